@@ -26,9 +26,17 @@ SET ULTIMATE_C=kalman_ultimate.c ^
                kalman_associative_smoother.c ^
                kalman_base.c ^
                kalman_explicit_representation.c ^
+               kalman_batch.c ^
+               kalman_windowed_smoother.c ^
+               kalman_async_smoother.c ^
+               kalman_trajectory.c ^
                matrix_ops.c ^
+               matrix_small.c ^
                flexible_arrays.c ^
                concurrent_set.c ^
+               concurrent_bag.c ^
+               instrument.c ^
+               parallel_budget.c ^
                cmdline_args.c ^
                gettimeofday.c
                
@@ -51,6 +59,7 @@ echo %ULTIMATE_O%
 
 cl /c %C_FLAGS% -I. %BLAS_LAPACK_FLAGS% %INT_TYPES% parallel_sequential.c
 cl /c %C_FLAGS% -I. %BLAS_LAPACK_FLAGS% %INT_TYPES% parallel_tbb.cpp 
+cl /c %C_FLAGS% -I. %BLAS_LAPACK_FLAGS% %INT_TYPES% /openmp parallel_openmp.c
 
 for %%C in (%CLIENTS%) do (
     cl /c %C_FLAGS% -I. %BLAS_LAPACK_FLAGS% %INT_TYPES% %%C.c
@@ -58,6 +67,13 @@ for %%C in (%CLIENTS%) do (
     cl %C_FLAGS% -Fe%%C.exe %ULTIMATE_O% parallel_sequential.obj %%C.obj %BLAS_LAPACK_LIBS% 
 	echo building %%C_par.exe
     cl %C_FLAGS% -Fe%%C_par.exe %ULTIMATE_O% parallel_tbb.obj        %%C.obj %BLAS_LAPACK_LIBS% 
+	echo building %%C_par_omp.exe
+    cl %C_FLAGS% /openmp -Fe%%C_par_omp.exe %ULTIMATE_O% parallel_openmp.obj %%C.obj %BLAS_LAPACK_LIBS% 
+)
+
+IF DEFINED JAVA_HOME (
+    echo building ultimatekalmanjni.dll
+    cl %C_FLAGS% /LD -I. -I"%JAVA_HOME%\include" -I"%JAVA_HOME%\include\win32" %BLAS_LAPACK_FLAGS% %INT_TYPES% -Feultimatekalmanjni.dll %ULTIMATE_O% parallel_tbb.obj ultimatekalmanjni.c %BLAS_LAPACK_LIBS% 
 )
 
 DEL *.obj
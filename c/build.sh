@@ -1,7 +1,22 @@
 #!/bin/bash
 
-# INT_TYPES="-DKALMAN_STEP_INDEX_TYPE_INT64 -DFARRAY_INDEX_TYPE_INT64 -DPARALLEL_INDEX_TYPE_INT64"
-INT_TYPES="-DKALMAN_STEP_INDEX_TYPE_INT32 -DFARRAY_INDEX_TYPE_INT32 -DPARALLEL_INDEX_TYPE_INT32"
+# 64-bit step indexes, as in build.bat and the MEX build; the 32-bit ones limit the filters to about 2^30 steps (bulk appends to 2^29)
+INT_TYPES="-DKALMAN_STEP_INDEX_TYPE_INT64 -DFARRAY_INDEX_TYPE_INT64 -DPARALLEL_INDEX_TYPE_INT64"
+# INT_TYPES="-DKALMAN_STEP_INDEX_TYPE_INT32 -DFARRAY_INDEX_TYPE_INT32 -DPARALLEL_INDEX_TYPE_INT32"
+
+# single-precision matrix elements (float, s-prefixed BLAS and LAPACK); the clients must match
+# PRECISION="-DBUILD_SINGLE_PRECISION"
+PRECISION=""
+
+# hot-path counters and Chrome traces (instrument.h); adds a little overhead
+# INSTRUMENT="-DBUILD_INSTRUMENT"
+INSTRUMENT=""
+
+# the associative smoother's scans on a GPU (KALMAN_GPU), through CUDA or HIP
+# GPU="-DBUILD_CUDA -I/usr/local/cuda/include";               GPULIBS="-L/usr/local/cuda/lib64 -lcublas -lcudart"
+# GPU="-DBUILD_HIP -D__HIP_PLATFORM_AMD__ -I/opt/rocm/include"; GPULIBS="-L/opt/rocm/lib -lhipblas -lamdhip64"
+GPU=""
+GPULIBS=""
 
 ARMPL_PATH="/opt/arm/armpl_24.10_gcc"
 AMDPL_PATH="/specific/amd-gcc/5.0.0/gcc"
@@ -14,9 +29,17 @@ kalman_oddeven_smoother.c \
 kalman_associative_smoother.c \
 kalman_base.c \
 kalman_explicit_representation.c \
+kalman_batch.c \
+kalman_windowed_smoother.c \
+kalman_async_smoother.c \
+kalman_trajectory.c \
 matrix_ops.c \
+matrix_small.c \
 flexible_arrays.c \
 concurrent_set.c \
+concurrent_bag.c \
+instrument.c \
+parallel_budget.c \
 cmdline_args.c"
 ULTIMATE_O="${ULTIMATE_C//.c/.o}"
 
@@ -38,6 +61,10 @@ case "$(uname)" in
         PARLIBS="-framework Accelerate -llapack -lblas -lm -L$(brew --prefix tbb)/lib -ltbb -ltbbmalloc -ltbbmalloc_proxy"
 
         PRNLIBS=$PARLIBS
+
+        # Apple's compiler needs the OpenMP runtime from Homebrew
+        OMPFLAGS="-Xpreprocessor -fopenmp -I$(brew --prefix libomp)/include"
+        OMPLIBS="-L$(brew --prefix libomp)/lib -lomp"
         ;;
     Linux)
 	case "$(uname -m)" in
@@ -55,7 +82,7 @@ case "$(uname)" in
 		if grep -q "EPYC" /proc/cpuinfo; then
 		   echo "Building for AMD EPYC"
 		   LIBDIR="-L${AMDPL_PATH}/lib_LP64"
-		   INCDIR="-DBUILD_BLAS_UNDERSCORE"
+		   INCDIR="-DBUILD_BLAS_UNDERSCORE -DBUILD_BLIS"
 		   # sequential libraries; not sure why -lpthread was used, but it was included
 		   SEQLIBS="                  -lflame -lblis-mt -laoclutils -lgomp -lpthread -lm -ldl"
 		   PARLIBS="-ltbbmalloc_proxy -lflame -lblis-mt -laoclutils -lgomp -lpthread -lm -ldl -ltbb"
@@ -85,21 +112,34 @@ case "$(uname)" in
         ;;
 esac
 
+SEQLIBS="$SEQLIBS $GPULIBS"
+PARLIBS="$PARLIBS $GPULIBS"
+
+# the OpenMP and pthreads variants link with the sequential BLAS, like the TBB one
+OMPFLAGS="${OMPFLAGS:--fopenmp}"
+OMPLIBS="${OMPLIBS:--fopenmp}"
+
 for C_SOURCE in $ULTIMATE_C; do
     echo compiling $C_SOURCE
-    gcc -c -O2 $INCDIR $INT_TYPES $C_SOURCE
+    gcc -c -O2 $INCDIR $INT_TYPES $PRECISION $INSTRUMENT $GPU $C_SOURCE
 done
 
 for C_SOURCE in $CLIENTS_C; do
     echo compiling $C_SOURCE
-    gcc -c -O2 $INT_TYPES $C_SOURCE
+    gcc -c -O2 $INT_TYPES $PRECISION $INSTRUMENT $C_SOURCE
 done
 
 echo compiling parallel_tbb.cpp
-g++ -c -O2 $INCDIR $INT_TYPES -std=c++14 parallel_tbb.cpp
+g++ -c -O2 $INCDIR $INT_TYPES $INSTRUMENT -std=c++14 parallel_tbb.cpp
 
 echo compiling parallel_sequential.c
-gcc -c -O2 $INCDIR $INT_TYPES            parallel_sequential.c
+gcc -c -O2 $INCDIR $INT_TYPES $INSTRUMENT            parallel_sequential.c
+
+echo compiling parallel_openmp.c
+gcc -c -O2 $INCDIR $INT_TYPES $INSTRUMENT $OMPFLAGS  parallel_openmp.c
+
+echo compiling parallel_pthreads.c
+gcc -c -O2 $INCDIR $INT_TYPES $INSTRUMENT -pthread   parallel_pthreads.c
 
 echo LINKING
 
@@ -113,6 +153,34 @@ for CLIENT in $CLIENTS; do
     g++ $ULTIMATE_O parallel_tbb.o ${CLIENT}.o -o ${CLIENT}_par $LIBDIR $PARLIBS
 done
 
+for CLIENT in $CLIENTS; do
+    echo linking ${CLIENT}_par_omp
+    gcc $ULTIMATE_O parallel_openmp.o ${CLIENT}.o -o ${CLIENT}_par_omp $LIBDIR $SEQLIBS $OMPLIBS
+done
+
+for CLIENT in $CLIENTS; do
+    echo linking ${CLIENT}_par_pthreads
+    gcc $ULTIMATE_O parallel_pthreads.o ${CLIENT}.o -o ${CLIENT}_par_pthreads $LIBDIR $SEQLIBS -pthread
+done
+
+# the JNI library for sivantoledo.kalman.UltimateKalmanNative, on the pthreads primitives
+if [ -n "$JAVA_HOME" ]; then
+    case "$(uname)" in
+        Darwin) JNI_LIB=libultimatekalmanjni.dylib; JNI_OS=darwin ;;
+        *)      JNI_LIB=libultimatekalmanjni.so;    JNI_OS=linux  ;;
+    esac
+    echo building $JNI_LIB
+    gcc -shared -fPIC -O2 $INCDIR $INT_TYPES -I"$JAVA_HOME/include" -I"$JAVA_HOME/include/$JNI_OS" \
+        $ULTIMATE_C parallel_pthreads.c ultimatekalmanjni.c -o $JNI_LIB $LIBDIR $SEQLIBS -pthread
+fi
+
+# performance with the distributed-memory odd-even smoother (algorithm=oddeven-mpi), run under mpirun
+if command -v mpicc >/dev/null; then
+    echo building performance_mpi
+    mpicc -O2 $INCDIR $INT_TYPES $PRECISION $INSTRUMENT $GPU -DBUILD_MPI \
+        $ULTIMATE_C parallel_pthreads.c performance.c -o performance_mpi $LIBDIR $SEQLIBS -pthread
+fi
+
 case "$(uname)" in 
     Darwin)
         ;;
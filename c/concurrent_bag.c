@@ -0,0 +1,125 @@
+/*
+ * A concurrent bag, to keep track of objects that are created during the
+ * parallel prefix sum operation so that we can release them at the end of
+ * the operation. Each thread appends to its own vector, so insertions take
+ * no locks and the memory overhead is proportional to the number of
+ * elements; the vectors are padded to a cache line to avoid false sharing.
+ *
+ * Threads that the parallel primitives do not know about (their index is
+ * out of range) share one more vector, protected by a spin lock.
+ *
+ * Copyright (c) Sivan Toledo and Shahaf Gargir 2024-2025
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#ifdef BUILD_MEX
+#include "mex.h"
+
+static char assert_msg[128];
+static void mex_assert(int c, int line) {
+    if (!c) {
+        sprintf(assert_msg,"Assert failed in %s line %d",__FILE__,line);
+        mexErrMsgIdAndTxt("MyToolbox:arrayProduct:assertion",assert_msg);
+    }
+}
+
+#define assert(c) mex_assert((c),__LINE__)
+#else
+#include <assert.h>
+#endif
+
+#include "parallel.h"
+#include "instrument.h"
+
+#define BAG_LINE 64
+
+typedef struct bag_vector_st {
+  void** elements;
+  size_t size;
+  size_t capacity;
+  char   padding[BAG_LINE - sizeof(void**) - 2*sizeof(size_t)];
+} bag_vector_t;
+
+typedef struct concurrent_bag_st {
+  int           threads;
+  bag_vector_t* vectors;  // one per thread and a shared one at the end
+  size_t*       offsets;  // of each vector in the concatenation, for foreach
+  spin_mutex_t* lock;     // of the shared vector
+  void          (*foreach)(void*);
+} concurrent_bag_t;
+
+static void bag_vector_append(bag_vector_t* v, void* element) {
+  if (v->size == v->capacity) {
+    v->capacity = (v->capacity == 0) ? 64 : 2*(v->capacity);
+    v->elements = (void**) realloc(v->elements, (v->capacity) * sizeof(void*));
+    assert(v->elements != NULL);
+  }
+  (v->elements)[ (v->size)++ ] = element;
+}
+
+/*
+ * The range is over the concatenation of the vectors, so that the elements
+ * are processed in parallel even if a single thread inserted all of them.
+ */
+static void concurrent_bag_parallel_foreach(void* bag_v, parallel_index_t length, parallel_index_t start, parallel_index_t end) {
+  (void) length;
+  concurrent_bag_t* bag = (concurrent_bag_t*) bag_v;
+  int t = 0;
+  while ((bag->offsets)[t+1] <= (size_t) start) t++;
+  for (parallel_index_t i = start; i < end; i++) {
+    while ((bag->offsets)[t+1] <= (size_t) i) t++;
+    (*(bag->foreach))(((bag->vectors)[t].elements)[ i - (bag->offsets)[t] ]);
+  }
+}
+
+concurrent_bag_t* concurrent_bag_create(void (*foreach)(void*)) {
+  concurrent_bag_t* bag = (concurrent_bag_t*) malloc(sizeof(concurrent_bag_t));
+  assert(bag != NULL);
+  bag->threads = parallel_max_threads();
+  bag->foreach = foreach;
+  bag->vectors = (bag_vector_t*) calloc(bag->threads + 1, sizeof(bag_vector_t));
+  bag->offsets = (size_t*)       malloc((bag->threads + 2) * sizeof(size_t));
+  bag->lock    = spin_mutex_create();
+  assert(bag->vectors != NULL);
+  assert(bag->offsets != NULL);
+  return bag;
+}
+
+void concurrent_bag_free(concurrent_bag_t* bag) {
+  for (int t = 0; t <= bag->threads; t++) free((bag->vectors)[t].elements);
+  spin_mutex_destroy(bag->lock);
+  free(bag->offsets);
+  free(bag->vectors);
+  free(bag);
+}
+
+void concurrent_bag_insert(concurrent_bag_t* bag, void* element) {
+  int t = parallel_thread_index();
+  INSTRUMENT_COUNT(INSTRUMENT_BAG_INSERTS, 1);
+  if (t >= 0 && t < bag->threads) {
+    bag_vector_append((bag->vectors) + t, element);
+  } else {
+    INSTRUMENT_COUNT(INSTRUMENT_BAG_SHARED, 1);
+    spin_mutex_lock(bag->lock);
+    bag_vector_append((bag->vectors) + bag->threads, element);
+    spin_mutex_unlock(bag->lock);
+  }
+}
+
+void concurrent_bag_foreach(concurrent_bag_t* bag) {
+  int t;
+  (bag->offsets)[0] = 0;
+  for (t = 0; t <= bag->threads; t++) (bag->offsets)[t+1] = (bag->offsets)[t] + (bag->vectors)[t].size;
+
+  parallel_index_t n = (parallel_index_t) (bag->offsets)[bag->threads + 1];
+  foreach_in_range(concurrent_bag_parallel_foreach, bag, n, n);
+
+  for (t = 0; t <= bag->threads; t++) (bag->vectors)[t].size = 0;
+}
+
+/******************************************************************************/
+/* END OF FILE                                                                */
+/******************************************************************************/
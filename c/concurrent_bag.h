@@ -0,0 +1,22 @@
+#ifndef CONCURRENT_BAG_H
+#define CONCURRENT_BAG_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+/*
+ * A bag of pointers that threads append to without locking; each thread
+ * appends to its own vector (indexed by parallel_thread_index), so the
+ * storage is proportional to the number of elements inserted. The bag is
+ * meant for elements that are released together at the end of an operation.
+ */
+
+struct concurrent_bag_st;
+typedef struct concurrent_bag_st concurrent_bag_t;
+
+concurrent_bag_t* concurrent_bag_create (void (*foreach)(void*));
+void              concurrent_bag_free   (concurrent_bag_t* bag);
+void              concurrent_bag_insert (concurrent_bag_t* bag, void* element);
+void              concurrent_bag_foreach(concurrent_bag_t* bag);
+
+#endif
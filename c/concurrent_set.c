@@ -4,9 +4,9 @@
  * are structures, not value types) so that we can release them at the end of
  * the operation.
  *
- * The current code may fail if the representation uses an array whose indexes
- * cannot be represented by 32-bit integers, because it will try to put all
- * the elements in the first 2 billion or so cells.
+ * Addresses are hashed to 64 bits and reduced modulo the size of the array,
+ * so every cell can be reached however large the array is; the size itself
+ * must fit in parallel_index_t.
  *
  * Copyright (c) Sivan Toledo and Shahaf Gargir 2024-2025
  */
@@ -15,7 +15,24 @@
 #include <stdlib.h>
 #include <stdio.h>
 
+#ifdef BUILD_MEX
+#include "mex.h"
+
+static char assert_msg[128];
+static void mex_assert(int c, int line) {
+    if (!c) {
+        sprintf(assert_msg,"Assert failed in %s line %d",__FILE__,line);
+        mexErrMsgIdAndTxt("MyToolbox:arrayProduct:assertion",assert_msg);
+    }
+}
+
+#define assert(c) mex_assert((c),__LINE__)
+#else
+#include <assert.h>
+#endif
+
 #include "parallel.h"
+#include "instrument.h"
 
 typedef struct concurrent_set_st {
   parallel_index_t size;
@@ -25,17 +42,17 @@ typedef struct concurrent_set_st {
 } concurrent_set_t;
 
 /*
- * FNV-1a hash of an address, to generate a random integer
+ * FNV-1a hash of an address, widened to 64 bits, to generate a random integer
  * 
  * Based on code suggested by Grok 3. 
  */
 
-static uint32_t hash_uint32(uint32_t value) {
-  const uint32_t FNV_PRIME = 16777619u;
-  const uint32_t FNV_OFFSET = 3141592653u; // Different offset for distinctness
+static uint64_t hash_uint64(uint64_t value) {
+  const uint64_t FNV_PRIME  = 1099511628211ull;
+  const uint64_t FNV_OFFSET = 14695981039346656037ull;
 
-  uint32_t hash = FNV_OFFSET;
-  for (size_t i = 0; i < sizeof(uint32_t); i++) {
+  uint64_t hash = FNV_OFFSET;
+  for (size_t i = 0; i < sizeof(uint64_t); i++) {
     hash ^= (value & 0xFF);
     hash *= FNV_PRIME;
     value >>= 8;
@@ -44,6 +61,7 @@ static uint32_t hash_uint32(uint32_t value) {
 }
 
 static void concurrent_set_parallel_init(void *set_v, parallel_index_t length, parallel_index_t start, parallel_index_t end) {
+  (void) length;
   concurrent_set_t *set = (concurrent_set_t*) set_v;
   for (parallel_index_t i = start; i < end; i++) {
     (set->pointers)[i] = NULL;
@@ -52,6 +70,7 @@ static void concurrent_set_parallel_init(void *set_v, parallel_index_t length, p
 }
 
 static void concurrent_set_parallel_destroy(void *set_v, parallel_index_t length, parallel_index_t start, parallel_index_t end) {
+  (void) length;
   concurrent_set_t *set = (concurrent_set_t*) set_v;
   for (parallel_index_t i = start; i < end; i++) {
     spin_mutex_destroy((set->locks)[i]);
@@ -59,6 +78,7 @@ static void concurrent_set_parallel_destroy(void *set_v, parallel_index_t length
 }
 
 static void concurrent_set_parallel_foreach(void *set_v, parallel_index_t length, parallel_index_t start, parallel_index_t end) {
+  (void) length;
   concurrent_set_t *set = (concurrent_set_t*) set_v;
   for (parallel_index_t i = start; i < end; i++) {
     if ((set->pointers)[i] != NULL) {
@@ -68,11 +88,15 @@ static void concurrent_set_parallel_foreach(void *set_v, parallel_index_t length
 }
 
 concurrent_set_t* concurrent_set_create(parallel_index_t capacity, void (*foreach)(void*)) {
+  assert(capacity >= 0 && (uint64_t) capacity <= ((uint64_t) PARALLEL_INDEX_MAX) / 10);
+
   concurrent_set_t *set = (concurrent_set_t*) malloc(sizeof(concurrent_set_t));
+  assert(set != NULL);
   set->size = capacity * 10; // expansion to reduce contention
   set->foreach = foreach;
-  set->pointers = (void**) malloc((set->size) * sizeof(void*));
-  set->locks = (spin_mutex_t**) malloc((set->size) * sizeof(spin_mutex_t*));
+  set->pointers = (void**) malloc(((size_t) set->size) * sizeof(void*));
+  set->locks = (spin_mutex_t**) malloc(((size_t) set->size) * sizeof(spin_mutex_t*));
+  assert(set->pointers != NULL && set->locks != NULL);
 
   //parallel_for_c(la, NULL, 0, k, BLOCKSIZE, parallelInit);
   foreach_in_range(concurrent_set_parallel_init, set, set->size, set->size);
@@ -89,12 +113,12 @@ void concurrent_set_free(concurrent_set_t *set) {
 }
 
 void concurrent_set_insert(concurrent_set_t *set, void *element) {
-  uint32_t inserted = 0;
-  uint32_t h = (uint32_t) (uintptr_t) element;
-  uint32_t i;
+  int inserted = 0;
+  uint64_t h = (uint64_t) (uintptr_t) element;
+  parallel_index_t i;
   do {
-    h = hash_uint32(h);
-    i = h % (set->size);
+    h = hash_uint64(h);
+    i = (parallel_index_t) (h % (uint64_t) (set->size));
 
     spin_mutex_lock((set->locks)[i]);
     if ((set->pointers)[i] == NULL) {
@@ -102,6 +126,7 @@ void concurrent_set_insert(concurrent_set_t *set, void *element) {
       inserted = 1;
     }
     spin_mutex_unlock((set->locks)[i]);
+    if (!inserted) INSTRUMENT_COUNT(INSTRUMENT_SET_RETRIES, 1);
   } while (!inserted);
 }
 
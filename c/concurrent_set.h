@@ -11,18 +11,22 @@
 
 #ifdef PARALLEL_INDEX_TYPE_INT32
 typedef int32_t parallel_index_t;
+#define PARALLEL_INDEX_MAX INT32_MAX
 #endif
 
 #ifdef PARALLEL_INDEX_TYPE_UINT32
 typedef uint32_t parallel_index_t;
+#define PARALLEL_INDEX_MAX UINT32_MAX
 #endif
 
 #ifdef PARALLEL_INDEX_TYPE_INT64
 typedef int64_t parallel_index_t;
+#define PARALLEL_INDEX_MAX INT64_MAX
 #endif
 
 #ifdef PARALLEL_INDEX_TYPE_UINT64
 typedef uint64_t parallel_index_t;
+#define PARALLEL_INDEX_MAX UINT64_MAX
 #endif
 
 struct concurrent_set_st;
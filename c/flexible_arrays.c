@@ -114,6 +114,7 @@ void farray_append(farray_t *a, void *v) {
       a->end = logical_size - 1;
       //if (debug) printf("farray shifted back, physical size %lld pointers, logical size %lld\n",a->array_size,logical_size);
     } else { // array is currently more than half full, realloc at a larger size
+      assert(a->array_size <= FARRAY_INDEX_MAX / 2); // otherwise farray_index_t is too narrow
       a->array_size *= 2;
       a->elements = realloc(a->elements, (a->array_size) * sizeof(void*));
       assert(a->elements != NULL);
@@ -127,6 +128,43 @@ void farray_append(farray_t *a, void *v) {
   (a->elements)[a->end] = v;
 }
 
+/*
+ * Makes room for count more elements with a single shift or reallocation,
+ * rather than doubling repeatedly, and returns the new (uninitialized) slots
+ * so that the caller can fill them in any order, e.g., in parallel.
+ */
+void** farray_extend(farray_t *a, farray_index_t count) {
+  farray_index_t i;
+  farray_index_t logical_size = farray_size(a);
+
+  assert(count >= 0 && count <= FARRAY_INDEX_MAX / 4 - logical_size); // the doubling below stays in range
+
+  if ((a->end) + count > (a->array_size) - 1) {
+    if (logical_size + count <= (a->array_size) / 2) {
+      for (i = 0; i < logical_size; i++) {
+        (a->elements)[i] = (a->elements)[(a->start) + i];
+      }
+      a->start = 0;
+      a->end = logical_size - 1;
+    } else {
+      while (logical_size + count > (a->array_size) / 2) a->array_size *= 2;
+      if (a->start > 0) {
+        for (i = 0; i < logical_size; i++) {
+          (a->elements)[i] = (a->elements)[(a->start) + i];
+        }
+        a->start = 0;
+        a->end = logical_size - 1;
+      }
+      a->elements = realloc(a->elements, (a->array_size) * sizeof(void*));
+      assert(a->elements != NULL);
+    }
+  }
+
+  void** slots = (a->elements) + (a->end) + 1;
+  (a->end) += count;
+  return slots;
+}
+
 void* farray_drop_first(farray_t *a) {
   void *r = (a->elements)[a->start];
   (a->first)++;
@@ -140,6 +178,11 @@ void* farray_drop_last(farray_t *a) {
   return r;
 }
 
+void farray_set_first(farray_t *a, farray_index_t first) {
+  assert(farray_size(a) == 0);
+  a->first = first;
+}
+
 /******************************************************************************/
 /* END OF FILE                                                                */
 /******************************************************************************/
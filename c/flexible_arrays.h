@@ -7,18 +7,22 @@
 
 #ifdef FARRAY_INDEX_TYPE_INT32
 typedef int32_t farray_index_t;
+#define FARRAY_INDEX_MAX INT32_MAX
 #endif
 
 #ifdef FARRAY_INDEX_TYPE_UINT32
 typedef uint32_t farray_index_t;
+#define FARRAY_INDEX_MAX UINT32_MAX
 #endif
 
 #ifdef FARRAY_INDEX_TYPE_INT64
 typedef int64_t farray_index_t;
+#define FARRAY_INDEX_MAX INT64_MAX
 #endif
 
 #ifdef FARRAY_INDEX_TYPE_UINT64
 typedef uint64_t farray_index_t;
+#define FARRAY_INDEX_MAX UINT64_MAX
 #endif
 
 /******************************************************************************/
@@ -42,8 +46,10 @@ void*     farray_get(farray_t* a, farray_index_t i);
 void*     farray_get_first(farray_t* a);
 void*     farray_get_last(farray_t* a);
 void      farray_append(farray_t* a, void* v);
+void**    farray_extend(farray_t* a, farray_index_t count); // appends count slots, returns the first
 void*     farray_drop_first(farray_t* a);
 void*     farray_drop_last(farray_t* a);
+void      farray_set_first(farray_t* a, farray_index_t first); // of an empty array: the index of the next append
 
 /******************************************************************************/
 /* END OF FILE                                                                */
@@ -0,0 +1,221 @@
+/*
+ * instrument.c
+ *
+ * Each thread accumulates its counters and trace events in a structure of
+ * its own, which it pushes onto a global list (without a lock, so that the
+ * spin locks can be instrumented) the first time it records something.
+ * Reports and traces walk the list.
+ *
+ * Copyright (C) Sivan Toledo 2022-2025
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <intrin.h>
+#else
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#endif
+
+#include "instrument.h"
+
+#if defined(_MSC_VER)
+#define THREAD_LOCAL __declspec(thread)
+#else
+#define THREAD_LOCAL __thread
+#endif
+
+/******************************************************************************/
+/* CLOCKS                                                                     */
+/******************************************************************************/
+
+double instrument_seconds() {
+#ifdef _WIN32
+  LARGE_INTEGER counter, frequency;
+  QueryPerformanceCounter(&counter);
+  QueryPerformanceFrequency(&frequency);
+  return (double) counter.QuadPart / (double) frequency.QuadPart;
+#else
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec * 1e-9;
+#endif
+}
+
+uint64_t instrument_ticks() {
+#if defined(_WIN32) || defined(__x86_64__) || defined(__i386__)
+  return (uint64_t) __rdtsc();
+#elif defined(__aarch64__)
+  uint64_t ticks;
+  __asm__ volatile("mrs %0, cntvct_el0" : "=r" (ticks));
+  return ticks;
+#else
+  return (uint64_t) (instrument_seconds() * 1e9);
+#endif
+}
+
+/******************************************************************************/
+/* PER-THREAD STATE                                                           */
+/******************************************************************************/
+
+typedef struct trace_event_st {
+  const char* name;  // a string literal
+  int32_t     level; // -1 if none
+  double      begin;
+  double      end;
+} trace_event_t;
+
+typedef struct thread_state_st {
+  uint64_t                counts[INSTRUMENT_COUNTERS];
+  uint64_t                ticks [INSTRUMENT_COUNTERS];
+  trace_event_t*          events;
+  size_t                  size;
+  size_t                  capacity;
+  int                     id;   // in the trace
+  struct thread_state_st* next;
+} thread_state_t;
+
+static thread_state_t*              threads = NULL;
+static int                          thread_count = 0;
+static THREAD_LOCAL thread_state_t* local = NULL;
+
+static double   origin_seconds = 0.0; // of the last reset
+static uint64_t origin_ticks   = 0;
+
+static int atomic_push(thread_state_t* t) {
+#ifdef _WIN32
+  do {
+    t->next = threads;
+  } while (InterlockedCompareExchangePointer((PVOID volatile*) &threads, t, t->next) != t->next);
+  return InterlockedIncrement((LONG volatile*) &thread_count) - 1;
+#else
+  t->next = __atomic_load_n(&threads, __ATOMIC_ACQUIRE);
+  while (!__atomic_compare_exchange_n(&threads, &(t->next), t, 0, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE)) ;
+  return __atomic_fetch_add(&thread_count, 1, __ATOMIC_RELAXED);
+#endif
+}
+
+static thread_state_t* thread_state() {
+  if (local == NULL) {
+    thread_state_t* t = (thread_state_t*) calloc(1, sizeof(thread_state_t));
+    if (t == NULL) return NULL;
+    t->id = atomic_push(t);
+    local = t;
+  }
+  return local;
+}
+
+/******************************************************************************/
+/* RECORDING                                                                  */
+/******************************************************************************/
+
+void instrument_add(instrument_counter_t counter, uint64_t count, uint64_t ticks) {
+  thread_state_t* t = thread_state();
+  if (t == NULL) return;
+  (t->counts)[counter] += count;
+  (t->ticks )[counter] += ticks;
+}
+
+void instrument_trace(const char* name, int32_t level, double begin, double end) {
+  thread_state_t* t = thread_state();
+  if (t == NULL) return;
+  if (t->size == t->capacity) {
+    size_t         capacity = (t->capacity == 0) ? 1024 : 2*(t->capacity);
+    trace_event_t* events   = (trace_event_t*) realloc(t->events, capacity * sizeof(trace_event_t));
+    if (events == NULL) return; // drop the event
+    t->events   = events;
+    t->capacity = capacity;
+  }
+  trace_event_t* e = (t->events) + (t->size)++;
+  e->name  = name;
+  e->level = level;
+  e->begin = begin;
+  e->end   = end;
+}
+
+/******************************************************************************/
+/* REPORTS                                                                    */
+/******************************************************************************/
+
+#ifdef BUILD_INSTRUMENT
+static const char* counter_names[INSTRUMENT_COUNTERS] = {
+  "qr", "apply_qt", "trisolve", "gemm", "chol",
+  "allocations", "allocated_bytes",
+  "slab_matrices", "slab_overflows", "slab_bytes", "bag_inserts", "bag_shared",
+  "set_retries", "spin_waits"
+};
+#endif
+
+void instrument_reset() {
+  for (thread_state_t* t = threads; t != NULL; t = t->next) {
+    memset(t->counts, 0, sizeof(t->counts));
+    memset(t->ticks,  0, sizeof(t->ticks));
+    t->size = 0;
+  }
+  origin_seconds = instrument_seconds();
+  origin_ticks   = instrument_ticks();
+}
+
+void instrument_report(FILE* f) {
+#ifndef BUILD_INSTRUMENT
+  fprintf(f,"instrumentation not compiled in (BUILD_INSTRUMENT)\n");
+#else
+  uint64_t counts[INSTRUMENT_COUNTERS] = { 0 };
+  uint64_t ticks [INSTRUMENT_COUNTERS] = { 0 };
+
+  for (thread_state_t* t = threads; t != NULL; t = t->next) {
+    for (int c = 0; c < INSTRUMENT_COUNTERS; c++) {
+      counts[c] += (t->counts)[c];
+      ticks [c] += (t->ticks )[c];
+    }
+  }
+
+  double elapsed = instrument_seconds() - origin_seconds;
+  double rate    = (origin_seconds > 0.0 && elapsed > 0.0) ? (instrument_ticks() - origin_ticks) / elapsed : 0.0;
+
+  fprintf(f,"instrumentation (%d threads, %.3e ticks per second)\n", thread_count, rate);
+  for (int c = 0; c < INSTRUMENT_COUNTERS; c++) {
+    if (ticks[c] > 0 && rate > 0.0)
+      fprintf(f,"  %-16s %12llu calls %.3e seconds\n", counter_names[c], (unsigned long long) counts[c], ticks[c] / rate);
+    else if (ticks[c] > 0)
+      fprintf(f,"  %-16s %12llu calls %llu ticks\n", counter_names[c], (unsigned long long) counts[c], (unsigned long long) ticks[c]);
+    else
+      fprintf(f,"  %-16s %12llu\n", counter_names[c], (unsigned long long) counts[c]);
+  }
+#endif
+}
+
+/*
+ * Complete ("X") events with microsecond timestamps relative to the last
+ * reset, one track per thread.
+ */
+int instrument_write_trace(const char* filename) {
+  FILE* f = fopen(filename, "w");
+  if (f == NULL) return -1;
+
+  int first = 1;
+  fprintf(f,"{\"traceEvents\": [\n");
+  for (thread_state_t* t = threads; t != NULL; t = t->next) {
+    for (size_t i = 0; i < t->size; i++) {
+      trace_event_t* e = (t->events) + i;
+      fprintf(f,"%s  {\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %d, \"ts\": %.3f, \"dur\": %.3f",
+              first ? "" : ",\n", e->name, t->id, (e->begin - origin_seconds)*1e6, (e->end - e->begin)*1e6);
+      if (e->level >= 0) fprintf(f,", \"args\": {\"level\": %d}", e->level);
+      fprintf(f,"}");
+      first = 0;
+    }
+  }
+  fprintf(f,"\n], \"displayTimeUnit\": \"ms\"}\n");
+
+  return fclose(f) == 0 ? 0 : -1;
+}
+
+/******************************************************************************/
+/* END OF FILE                                                                */
+/******************************************************************************/
@@ -0,0 +1,74 @@
+/*
+ * instrument.h
+ *
+ * Low-overhead instrumentation of the hot paths: per-thread counters and
+ * tick timers of the matrix kernels, matrix allocations, the matrices and
+ * bytes of the slabs, insertions into the concurrent bags (which keep the
+ * elements that the prefix sums create), retries in the concurrent set and
+ * waits for spin locks, and trace events of the parallel
+ * loops and the phases of the smoothers, which can be written in the Chrome
+ * trace format (chrome://tracing, ui.perfetto.dev).
+ *
+ * Everything is compiled in only with BUILD_INSTRUMENT; otherwise the macros
+ * expand to empty statements, the report and the trace are empty, and only
+ * instrument_seconds remains (the phase timings use it).
+ *
+ * Copyright (C) Sivan Toledo 2022-2025
+ */
+#ifndef INSTRUMENT_H
+#define INSTRUMENT_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+typedef enum {
+  INSTRUMENT_QR = 0,          // timed
+  INSTRUMENT_APPLY_QT,        // timed
+  INSTRUMENT_TRISOLVE,        // timed
+  INSTRUMENT_GEMM,            // timed
+  INSTRUMENT_CHOL,            // timed
+  INSTRUMENT_ALLOCATIONS,     // of matrices
+  INSTRUMENT_ALLOCATED_BYTES, // of matrix elements
+  INSTRUMENT_SLAB_MATRICES,   // matrices placed in a slab
+  INSTRUMENT_SLAB_OVERFLOWS,  // matrices too large for their slab, allocated instead
+  INSTRUMENT_SLAB_BYTES,      // of slab buffers
+  INSTRUMENT_BAG_INSERTS,     // by concurrent_bag_insert
+  INSTRUMENT_BAG_SHARED,      // of them into the shared vector, under its spin lock
+  INSTRUMENT_SET_RETRIES,     // occupied slots probed by concurrent_set_insert
+  INSTRUMENT_SPIN_WAITS,      // spin_mutex_lock calls that found the lock taken
+  INSTRUMENT_COUNTERS
+} instrument_counter_t;
+
+/*
+ * Reset clears the counters and the trace of all the threads, and report
+ * prints the totals over the threads (times in seconds, calibrated against
+ * the clock since the last reset). Neither may run concurrently with the
+ * parallel primitives.
+ */
+void   instrument_reset      (void);
+void   instrument_report     (FILE* f);
+int    instrument_write_trace(const char* filename); // 0 on success
+
+/*
+ * Used by the macros.
+ */
+double   instrument_seconds(void); // monotonic
+uint64_t instrument_ticks  (void); // cycle counter where available
+void     instrument_add    (instrument_counter_t counter, uint64_t count, uint64_t ticks);
+void     instrument_trace  (const char* name, int32_t level, double begin, double end);
+
+#ifdef BUILD_INSTRUMENT
+#define INSTRUMENT_COUNT(counter,count)  instrument_add((counter), (uint64_t) (count), 0)
+#define INSTRUMENT_TIMER_BEGIN(t)        uint64_t t = instrument_ticks()
+#define INSTRUMENT_TIMER_END(counter,t)  instrument_add((counter), 1, instrument_ticks() - (t))
+#define INSTRUMENT_TRACE_BEGIN(t)        double t = instrument_seconds()
+#define INSTRUMENT_TRACE_END(name,t)     instrument_trace((name), -1, (t), instrument_seconds())
+#else
+#define INSTRUMENT_COUNT(counter,count)  ((void)0)
+#define INSTRUMENT_TIMER_BEGIN(t)        ((void)0)
+#define INSTRUMENT_TIMER_END(counter,t)  ((void)0)
+#define INSTRUMENT_TRACE_BEGIN(t)        ((void)0)
+#define INSTRUMENT_TRACE_END(name,t)     ((void)0)
+#endif
+
+#endif /* ifndef INSTRUMENT_H */
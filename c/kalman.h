@@ -17,6 +17,10 @@
 #include "mex.h"
 #endif
 
+#ifdef BUILD_MPI
+#include <mpi.h>
+#endif
+
 extern double kalman_nan;
 #include "matrix_ops.h"
 #include "flexible_arrays.h"
@@ -41,8 +45,65 @@ typedef uint64_t kalman_step_index_t;
 /* COVARIANCE MATRICES                                                        */
 /******************************************************************************/
 
-kalman_matrix_t* kalman_covariance_matrix_weigh   (kalman_matrix_t *cov, char cov_type, kalman_matrix_t *A);
-kalman_matrix_t* kalman_covariance_matrix_explicit(kalman_matrix_t* cov, char type);
+/*
+ * The type of a covariance matrix says what cov holds: 'C' the covariance
+ * itself, 'W' a matrix W such that the covariance is inv(W'*W), 'w' a
+ * diagonal W stored as a column, 'U' or 'F' an upper or lower triangular
+ * factor L such that the covariance is L*L', and 'I' nothing at all: the
+ * covariance is the identity, and only the number of rows of cov (say, a
+ * column) is used.
+ *
+ * Weighing computes W*A (a triangular solve for 'U', 'F' and 'C', a row
+ * scaling for 'w' and a copy for 'I'); weigh_into writes it into WA, which
+ * can be a view (see matrix_view_sub) and, except for 'W', A itself.
+ * add_explicit adds the covariance to A; for 'w' and 'I' it touches only the
+ * diagonal and never forms the covariance.
+ */
+kalman_matrix_t* kalman_covariance_matrix_weigh       (kalman_matrix_t *cov, char cov_type, kalman_matrix_t *A);
+void             kalman_covariance_matrix_weigh_into  (kalman_matrix_t *cov, char cov_type, kalman_matrix_t *A, kalman_matrix_t *WA);
+kalman_matrix_t* kalman_covariance_matrix_explicit    (kalman_matrix_t* cov, char type);
+void             kalman_covariance_matrix_add_explicit(kalman_matrix_t *A, kalman_matrix_t *cov, char type);
+
+/******************************************************************************/
+/* TIME-INVARIANT MODELS                                                      */
+/******************************************************************************/
+
+/*
+ * A model registered once with kalman_set_model. It holds copies of the
+ * matrices, the weighed products V*H, V*F, V*c and W*G, the explicit
+ * covariances, and 'C' covariances factored once into 'F' form (the lower
+ * Cholesky factor), so that steps that use the model only weigh o.
+ *
+ * The weighing functions below take the model as an optional hint: when
+ * cov and A are the model's own matrices they return a copy of the cached
+ * product, otherwise they compute it. Either part of the model (H, F, c, K or
+ * G, C) may be NULL.
+ */
+typedef struct kalman_model_st {
+  kalman_matrix_t *H, *F, *c, *K;
+  char            K_type;
+  kalman_matrix_t *G, *C;
+  char            C_type;
+
+  kalman_matrix_t *VH, *VF, *Vc;      // weighed by K
+  kalman_matrix_t *WG;                // weighed by C
+  kalman_matrix_t *K_factor, *C_factor;
+  char            K_factor_type, C_factor_type;
+  kalman_matrix_t *K_explicit, *C_explicit;
+
+  struct kalman_model_st *previous;   // replaced models, still referenced by older steps
+} kalman_model_t;
+
+kalman_model_t*  kalman_model_create  (kalman_matrix_t *H, kalman_matrix_t *F, kalman_matrix_t *c, kalman_matrix_t *K, char K_type,
+                                       kalman_matrix_t *G,                                          kalman_matrix_t *C, char C_type);
+void             kalman_model_free    (kalman_model_t *model); // also frees the previous models
+int              kalman_model_contains(kalman_model_t *model, kalman_matrix_t *A);
+
+kalman_matrix_t* kalman_model_weigh       (kalman_model_t *model, kalman_matrix_t *cov, char cov_type, kalman_matrix_t *A);
+void             kalman_model_weigh_into  (kalman_model_t *model, kalman_matrix_t *cov, char cov_type, kalman_matrix_t *A,
+                                           kalman_matrix_t *WA);
+kalman_matrix_t* kalman_model_explicit    (kalman_model_t *model, kalman_matrix_t *cov, char cov_type);
+void             kalman_model_add_explicit(kalman_model_t *model, kalman_matrix_t *cov, char cov_type, kalman_matrix_t *A);
 
 /******************************************************************************/
 /* STEPS                                                                      */
@@ -72,19 +133,37 @@ typedef struct kalman_step_equations_st {
   kalman_matrix_t *state;
   kalman_matrix_t *covariance;
   char            covariance_type;
+  char            covariance_wanted; // if 0, the parallel smoothers may leave the covariance NULL
+
+  char            borrowed; // H, F, K, c, G, o, C belong to the caller and are not freed
+  kalman_model_t  *model;   // if not NULL, matrices of this model are not freed and their weighed forms are cached
 } kalman_step_equations_t;
 
 /******************************************************************************/
 /* KALMAN                                                                     */
 /******************************************************************************/
 
+/*
+ * With KALMAN_BORROW_MATRICES, filters that store their inputs (the
+ * conventional filter and the explicit representation behind the parallel
+ * smoothers) keep the caller's pointers. The caller must not modify or free
+ * the matrices passed to evolve and observe until the steps that use them are
+ * forgotten, rolled back, or freed with the filter. Time-invariant models can
+ * then pass the same H, F, K, G, C on every step and store them only once.
+ */
+
 typedef enum {
   KALMAN_NONE                      = 0,      // No flags
   KALMAN_ALGORITHM_ULTIMATE        = 1 << 0, // 0x01 (1)
   KALMAN_ALGORITHM_CONVENTIONAL    = 1 << 1, // 0x02 (2)
   KALMAN_ALGORITHM_ODDEVEN         = 1 << 2,
   KALMAN_ALGORITHM_ASSOCIATIVE     = 1 << 3,
-  KALMAN_NO_COVARIANCE             = 1 << 16
+  KALMAN_NO_COVARIANCE             = 1 << 16,
+  KALMAN_MATRIX_POOL               = 1 << 17, // recycle matrices through a per-filter pool
+  KALMAN_SMALL_KERNELS             = 1 << 18, // fixed-size kernels instead of BLAS/LAPACK when n <= 8
+  KALMAN_BORROW_MATRICES           = 1 << 19, // keep pointers to the caller's matrices instead of copies
+  KALMAN_LAZY_COVARIANCE           = 1 << 20, // smoothed covariances only on demand (see kalman_request_covariances)
+  KALMAN_GPU                       = 1 << 21  // the associative smoother's scans on a CUDA or HIP device (BUILD_CUDA, BUILD_HIP)
 } kalman_options_t;
 
 struct kalman_st;
@@ -93,6 +172,11 @@ typedef struct kalman_st {
     farray_t *steps;
     void *current; // really a pointer to step_t, but step_t varies among implementations
     kalman_options_t options;
+    kalman_matrix_pool_t *pool; // NULL unless KALMAN_MATRIX_POOL
+    kalman_model_t *model;      // NULL unless kalman_set_model was called
+    kalman_step_index_t lag;    // fixed-lag smoothing, -1 if off
+    struct kalman_async_st *async; // the background smoothing thread, NULL until kalman_smooth_async
+    struct kalman_checkpoint_st *checkpoints; // created for this filter; rollbacks empty those they invalidate
 
     // implementation-specific operations
     void (*evolve)(struct kalman_st *kalman, int32_t n_i, kalman_matrix_t *H_i, kalman_matrix_t *F_i,
@@ -100,6 +184,10 @@ typedef struct kalman_st {
     void (*observe)(struct kalman_st *kalman, kalman_matrix_t *G_i, kalman_matrix_t *o_i, kalman_matrix_t *C_i,
         char C_type);
     void (*smooth)(struct kalman_st *kalman);
+    void (*append_steps)(struct kalman_st *kalman, kalman_step_index_t count, int32_t n_i,
+        kalman_matrix_t **H, kalman_matrix_t **F, kalman_matrix_t **c, kalman_matrix_t **K, char K_type,
+        kalman_matrix_t **G, kalman_matrix_t **o, kalman_matrix_t **C, char C_type); // NULL if not supported
+    void (*covariance_materialize)(struct kalman_st *kalman, kalman_step_index_t si); // NULL if covariances are never lazy
 
     // functions on steps
     void* (*step_create)();         // returns a pointer to a step_t
@@ -111,6 +199,8 @@ typedef struct kalman_st {
     kalman_matrix_t* (*step_get_state)(void *step_v);
     kalman_matrix_t* (*step_get_covariance)(void *step_v);
     char (*step_get_covariance_type)(void *step_v);
+    void (*step_request_covariance)(void *step_v); // NULL if covariances need not be requested
+    void (*step_snapshot)(void *dst_v, void *src_v); // copies src into dst, reusing dst's matrices; NULL if not supported
 
 } kalman_t;
 
@@ -126,11 +216,104 @@ void kalman_evolve(kalman_t *kalman, int32_t n_i, kalman_matrix_t *H_i, kalman_m
 void kalman_observe(kalman_t *kalman, kalman_matrix_t *G_i, kalman_matrix_t *o_i, kalman_matrix_t *C_i, char C_type);
 void kalman_smooth(kalman_t *kalman);
 
+/*
+ * Appends count steps, as if by count calls to kalman_evolve and
+ * kalman_observe: step j evolves with H[j], F[j], c[j], K[j] (ignored on the
+ * first step of the filter) and is observed with G[j], o[j], C[j]; o[j] (or
+ * the entire o array) is NULL for steps without observations. The parallel
+ * smoothers store the steps in parallel; the other algorithms run the
+ * filter on one step after the other.
+ */
+void kalman_append_steps(kalman_t *kalman, kalman_step_index_t count, int32_t n_i,
+    kalman_matrix_t **H, kalman_matrix_t **F, kalman_matrix_t **c, kalman_matrix_t **K, char K_type,
+    kalman_matrix_t **G, kalman_matrix_t **o, kalman_matrix_t **C, char C_type);
+
+/*
+ * Time-invariant models: kalman_evolve_model and kalman_observe_model are
+ * kalman_evolve and kalman_observe with the registered model's matrices.
+ */
+void kalman_set_model    (kalman_t *kalman, kalman_matrix_t *H, kalman_matrix_t *F, kalman_matrix_t *c,
+                          kalman_matrix_t *K, char K_type,
+                          kalman_matrix_t *G, kalman_matrix_t *C, char C_type);
+void kalman_evolve_model (kalman_t *kalman);
+void kalman_observe_model(kalman_t *kalman, kalman_matrix_t *o_i);
+
+/*
+ * Fixed-lag smoothing, ultimate algorithm only. After step i is observed,
+ * kalman_estimate and kalman_covariance of step i-lag return the smoothed
+ * estimate given steps up to i, later steps return filtered estimates,
+ * and steps before i-lag are freed. Each step costs O(lag), so memory and
+ * time stay bounded on streams of any length. A negative lag turns the
+ * mode off. Rolling back into the window leaves stale smoothed estimates.
+ * Returns 0, and leaves the filter unchanged, if the algorithm is not
+ * ultimate and lag is not negative; it returns 1 otherwise.
+ */
+int kalman_set_fixed_lag(kalman_t *kalman, kalman_step_index_t lag);
+
 kalman_matrix_t* kalman_estimate(kalman_t *kalman, kalman_step_index_t si);
 kalman_matrix_t* kalman_covariance(kalman_t *kalman, kalman_step_index_t si);
+
+/*
+ * Lazy covariances (KALMAN_LAZY_COVARIANCE). The ultimate smoother computes
+ * the smoothed covariance of a step when kalman_covariance asks for it, at a
+ * cost proportional to the distance from the nearest later step whose
+ * covariance is known (the last step's always is). The parallel smoothers
+ * must know in advance: they compute the covariances of the steps in the
+ * ranges passed to kalman_request_covariances before kalman_smooth, and the
+ * covariances of the other steps are NaN. Requests are ignored elsewhere.
+ */
+void kalman_request_covariances(kalman_t *kalman, kalman_step_index_t first, kalman_step_index_t last);
+
+/*
+ * The covariance of step si as the factor that the filter stores, so that no
+ * explicit covariance is formed or inverted: on return, type is 'W' (the
+ * covariance is inv(W'*W)), 'w' (a diagonal W stored as a column), or 'F'
+ * (lower triangular, the covariance is F*F'); an explicit 'C' covariance
+ * is returned as its Cholesky factor of type 'F'.
+ *
+ * kalman_mahalanobis stores in distances (with one element per column of
+ * points) the squared Mahalanobis distance of each column of points from the
+ * estimate of step si; kalman_gate counts the points whose squared distance
+ * is at most threshold, and sets inside[j] for each of them (unless inside is
+ * NULL). Both work directly on the factor.
+ */
+kalman_matrix_t* kalman_covariance_factor(kalman_t *kalman, kalman_step_index_t si, char *type);
+void             kalman_mahalanobis      (kalman_t *kalman, kalman_step_index_t si, kalman_matrix_t *points,
+                                          kalman_matrix_t *distances);
+int32_t          kalman_gate             (kalman_t *kalman, kalman_step_index_t si, kalman_matrix_t *points,
+                                          double threshold, int32_t *inside);
 char kalman_covariance_type(kalman_t *kalman, kalman_step_index_t si);
 void kalman_forget(kalman_t *kalman, kalman_step_index_t si);
 void kalman_rollback(kalman_t *kalman, kalman_step_index_t si);
+
+/*
+ * Checkpoints, ultimate and conventional algorithms only. kalman_checkpoint
+ * copies the latest step, which must have been observed, into cp (its
+ * factor R, y and its estimate); kalman_restore drops the steps that were
+ * added later and copies the step back, so the filter is again in the state
+ * it was in when the checkpoint was taken, at a cost of O(n^2) for the step,
+ * rather than rolling back and re-observing it. The step is recreated even if
+ * it was forgotten, so a filter that forgets every step can still rewind.
+ * A checkpoint keeps its matrices between uses, so taking and restoring
+ * checkpoints of steps of the same dimension does not allocate.
+ * The restored step depends on the steps before it, so rolling back (or
+ * restoring another checkpoint) to a step before the checkpointed one
+ * empties the checkpoint, even if that step is observed again.
+ * Both return 0 if they fail (an empty checkpoint, an unsupported
+ * algorithm, or steps up to the checkpoint that were since rolled back).
+ * With KALMAN_BORROW_MATRICES, a checkpoint also keeps the caller's F.
+ */
+typedef struct kalman_checkpoint_st {
+  kalman_step_index_t step;          // logical step number, -1 if empty
+  void *snapshot;                    // a step_t of the filter's implementation
+  struct kalman_checkpoint_st *next; // in the filter's list of checkpoints
+} kalman_checkpoint_t;
+
+kalman_checkpoint_t* kalman_checkpoint_create(kalman_t *kalman);
+void                 kalman_checkpoint_free  (kalman_t *kalman, kalman_checkpoint_t *cp);
+int                  kalman_checkpoint       (kalman_t *kalman, kalman_checkpoint_t *cp);
+int                  kalman_restore          (kalman_t *kalman, kalman_checkpoint_t *cp);
+
 kalman_matrix_t* kalman_perftest(kalman_t *kalman,
                                  kalman_matrix_t *H,
                                  kalman_matrix_t *F,
@@ -141,13 +324,210 @@ kalman_matrix_t* kalman_perftest(kalman_t *kalman,
                                  kalman_matrix_t *C, char C_type,
                                  int32_t count, int32_t decimation);
 
+/******************************************************************************/
+/* BATCHED FILTERS                                                            */
+/******************************************************************************/
+
+/*
+ * A batch of count independent filters (ultimate algorithm, filtering only)
+ * that share the state dimension and the shapes of all their inputs.
+ *
+ * Inputs and outputs are stacked matrices: a matrix with one row per filter,
+ * in which row f holds the column-major elements of filter f's matrix; a
+ * stacked input with a single row is shared by all the filters. For example,
+ * the F argument is count-by-(n*n) (or 1-by-(n*n)) and estimates are
+ * count-by-n. Covariance types are 'W' and 'w' only.
+ */
+typedef struct kalman_batch_st {
+  int32_t count;
+  int32_t dimension;
+  kalman_step_index_t step; // logical step number, -1 before the first evolve
+  int32_t rows;             // rows of R, the same for all filters
+  int     observed;         // has the current step been observed?
+
+  kalman_matrix_t *R;       // count-by-(n*n), the upper-triangular (or flat) R of each filter
+  kalman_matrix_t *y;       // count-by-n
+  kalman_matrix_t *state;   // count-by-n, NaN while the state is undetermined
+} kalman_batch_t;
+
+kalman_batch_t*  kalman_batch_create    (int32_t count, int32_t dimension);
+void             kalman_batch_free      (kalman_batch_t *batch);
+
+void             kalman_batch_evolve    (kalman_batch_t *batch, kalman_matrix_t *H, kalman_matrix_t *F, kalman_matrix_t *c,
+                                         kalman_matrix_t *K, char K_type);
+void             kalman_batch_observe   (kalman_batch_t *batch, kalman_matrix_t *G, kalman_matrix_t *o,
+                                         kalman_matrix_t *C, char C_type);
+kalman_matrix_t* kalman_batch_estimate  (kalman_batch_t *batch);
+kalman_matrix_t* kalman_batch_covariance(kalman_batch_t *batch); // stacked, type 'W'
+
 /******************************************************************************/
 /* PARALLEL SMOOTHERS                                                         */
 /******************************************************************************/
 
 void kalman_smooth_oddeven    (kalman_options_t options, kalman_step_equations_t** equations, kalman_step_index_t length);
+
+/*
+ * With KALMAN_GPU, in a library built with BUILD_CUDA or BUILD_HIP, the
+ * associative smoother keeps its elements in device memory and runs both
+ * scans there, copying back only the smoothed estimates. It requires all the
+ * steps to have the same dimension, and falls back to the host otherwise, or
+ * if the device cannot be used.
+ */
 void kalman_smooth_associative(kalman_options_t options, kalman_step_equations_t** equations, kalman_step_index_t length);
 
+/*
+ * Smooths consecutive windows of the given size concurrently, each extended
+ * by overlap steps on both sides, with the odd-even smoother or, if options
+ * include KALMAN_ALGORITHM_ASSOCIATIVE, the associative one; the last window
+ * also gets the remaining steps. The windows are smoothed independently, so
+ * the estimates are exact only if window is 0 or at least length (a single
+ * window); otherwise they are approximate, with errors that decay with the
+ * overlap (exponentially for stable, observable models) but that depend on
+ * the model, so callers should check them against a full smooth. Several
+ * windows require an overlap between KALMAN_WINDOWED_MIN_OVERLAP and the
+ * window; for other settings, nothing is smoothed and the function returns
+ * 0. It returns 1 otherwise.
+ */
+#define KALMAN_WINDOWED_MIN_OVERLAP 32
+
+int  kalman_smooth_windowed   (kalman_options_t options, kalman_step_equations_t** equations, kalman_step_index_t length,
+                               kalman_step_index_t window, kalman_step_index_t overlap);
+
+#ifdef BUILD_MPI
+/*
+ * The odd-even smoother on a trajectory distributed over the ranks of comm:
+ * each rank passes the equations of a contiguous block of steps, rank 0 the
+ * first block, with the steps numbered from the start of the trajectory.
+ * The levels of the recursion in which every block starts on an even step
+ * are eliminated within the ranks; the reduced system of the remaining steps
+ * is smoothed on rank 0, and on the way back each level exchanges one state
+ * per block boundary. The estimates are the same as those of
+ * kalman_smooth_oddeven on the whole trajectory. Covariances are not
+ * computed (as with KALMAN_NO_COVARIANCE).
+ *
+ * kalman_oddeven_mpi_partition returns the block of the calling rank for
+ * which the most levels are local: lengths that are multiples of the
+ * largest power of two that leaves every rank a block, and the remainder on
+ * the last rank, so the reduced system has about one or two steps per rank.
+ */
+void kalman_smooth_oddeven_mpi   (kalman_options_t options, kalman_step_equations_t** equations, kalman_step_index_t length,
+                                  MPI_Comm comm);
+void kalman_oddeven_mpi_partition(kalman_step_index_t total, MPI_Comm comm,
+                                  kalman_step_index_t* first, kalman_step_index_t* length);
+#endif
+
+/*
+ * Phase timings, for benchmarks. When a callback is set, the parallel
+ * smoothers report the wall-clock duration of each level of the odd-even
+ * recursion ("oddeven-eliminate" on the way down, "oddeven-solve" on the way
+ * up, with level 0 being the full trajectory) and of the two scans of the
+ * associative smoother ("associative-filter" and "associative-smooth").
+ * kalman_smooth_windowed reports each window ("windowed-window", with the
+ * window index as the level), and kalman_smooth_async each segment
+ * ("async-segment", level -1, from the background thread). The callback is called by the thread that runs
+ * the smoother; the windows are smoothed concurrently, so under
+ * kalman_smooth_windowed it must be thread safe.
+ *
+ * kalman_phase_begin and kalman_phase_end are used by the smoothers; they do
+ * nothing when no callback is set, unless the library is built with
+ * BUILD_INSTRUMENT, in which case every phase is also a trace event (see
+ * instrument.h).
+ */
+typedef void (*kalman_phase_callback_t)(const char *phase, int32_t level, double seconds);
+
+void   kalman_set_phase_callback(kalman_phase_callback_t callback);
+double kalman_phase_begin       (void);
+void   kalman_phase_end         (const char *phase, int32_t level, double begin);
+
+/******************************************************************************/
+/* ASYNCHRONOUS SMOOTHING                                                     */
+/******************************************************************************/
+
+/*
+ * Smoothing completed segments in the background while the filter keeps
+ * ingesting steps (odd-even and associative algorithms only).
+ * kalman_smooth_async moves the steps from the earliest one to step last
+ * (or to the step before the latest, if last is negative or later; the
+ * latest step stays, as in kalman_forget) out of the filter into a segment,
+ * and returns at once; it returns NULL if there is nothing to move or the
+ * algorithm is not supported. The steps are smoothed by a background thread
+ * that smooths one segment at a time, in order, each one starting from the
+ * estimate and covariance of the last step of the previous segment, so its
+ * estimates are those of smoothing all the steps up to its last one (whose
+ * estimate is the filtered one). kalman_smooth on the steps that remain in
+ * the filter waits for the segments and starts from the last one, so it
+ * gives the estimates of smoothing the whole trajectory. A segment whose
+ * predecessor was not handed off (the first one, or after kalman_forget) is
+ * smoothed on its own. The smoother's parallel loops use the cores that the
+ * backend provides.
+ *
+ * When the estimates and covariances in the segment's equations are ready,
+ * the background thread calls the callback (if not NULL) and then marks the
+ * segment as done. The callback may read the segment but must not call
+ * functions on the filter or free the segment. kalman_segment_done tells
+ * whether a segment is done, and kalman_segment_wait waits for it.
+ * kalman_segment_free waits and frees the segment's steps; like the other
+ * functions on the filter, it must run on the thread that feeds the filter,
+ * and all the segments must be freed before the filter is.
+ */
+struct kalman_segment_st;
+
+typedef void (*kalman_segment_callback_t)(struct kalman_segment_st *segment, void *arg);
+
+typedef struct kalman_segment_st {
+  kalman_step_index_t       first;     // logical index of the first step
+  kalman_step_index_t       length;
+  kalman_step_equations_t** equations; // the steps, owned by the segment
+
+  // private
+  kalman_options_t          options;
+  kalman_segment_callback_t callback;
+  void                      *arg;
+  int                       done;
+  struct kalman_segment_st  *next;     // in the queue of the background thread
+  struct kalman_async_st    *async;
+} kalman_segment_t;
+
+kalman_segment_t* kalman_smooth_async (kalman_t *kalman, kalman_step_index_t last,
+                                       kalman_segment_callback_t callback, void *arg);
+int               kalman_segment_done (kalman_segment_t *segment);
+void              kalman_segment_wait (kalman_segment_t *segment);
+void              kalman_segment_free (kalman_t *kalman, kalman_segment_t *segment);
+
+/******************************************************************************/
+/* TRAJECTORY FILES                                                           */
+/******************************************************************************/
+
+/*
+ * A binary file format for the equations of a trajectory and/or its
+ * estimates. The writer stores a matrix that is equal to the one in the same
+ * place in the previous step only once. The reader maps the file into memory
+ * and returns equations whose matrices point into the mapping; they can be
+ * passed to the parallel smoothers, which replace the state and covariance,
+ * and to kalman_smooth_windowed, which smooths trajectories that are larger
+ * than memory in bounded space. kalman_trajectory_open returns NULL if the
+ * file cannot be mapped or is not a trajectory file written on a machine
+ * with the same byte order; of a truncated file, it returns the records
+ * that lie in the file with all their matrices.
+ */
+#define KALMAN_TRAJECTORY_EQUATIONS 1
+#define KALMAN_TRAJECTORY_ESTIMATES 2
+
+typedef struct kalman_trajectory_writer_st kalman_trajectory_writer_t;
+
+typedef struct kalman_trajectory_st {
+  kalman_step_index_t       length;
+  kalman_step_equations_t** equations;
+  struct kalman_trajectory_mapping_st* mapping;
+} kalman_trajectory_t;
+
+kalman_trajectory_writer_t* kalman_trajectory_writer_create(const char* filename, int contents);
+int                         kalman_trajectory_write       (kalman_trajectory_writer_t* writer, kalman_step_equations_t* equations);
+int                         kalman_trajectory_writer_close (kalman_trajectory_writer_t* writer);
+
+kalman_trajectory_t*        kalman_trajectory_open        (const char* filename);
+void                        kalman_trajectory_close       (kalman_trajectory_t* trajectory);
+
 /******************************************************************************/
 /* END OF FILE                                                                */
 /******************************************************************************/
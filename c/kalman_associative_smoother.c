@@ -47,9 +47,60 @@ static void mex_assert(int c, int line) {
 #define KALMAN_MATRIX_SHORT_TYPE
 #include "kalman.h"
 #include "parallel.h"
-#include "concurrent_set.h"
+#include "concurrent_bag.h"
 #include "memory.h"
 
+#if defined(BUILD_CUDA) || defined(BUILD_HIP)
+#define BUILD_GPU
+#include <stddef.h>
+#ifdef BUILD_HIP
+#include <hip/hip_runtime_api.h>
+#include <hipblas/hipblas.h>
+typedef hipblasHandle_t gpu_blas_t;
+#define GPU_SUCCESS              hipSuccess
+#define GPU_BLAS_SUCCESS         HIPBLAS_STATUS_SUCCESS
+#define GPU_OP_N                 HIPBLAS_OP_N
+#define GPU_OP_T                 HIPBLAS_OP_T
+#define GPU_HOST_TO_DEVICE       hipMemcpyHostToDevice
+#define GPU_DEVICE_TO_HOST       hipMemcpyDeviceToHost
+#define GPU_DEVICE_TO_DEVICE     hipMemcpyDeviceToDevice
+#define gpu_malloc               hipMalloc
+#define gpu_free                 hipFree
+#define gpu_memcpy               hipMemcpy
+#define gpu_memcpy_2d            hipMemcpy2D
+#define gpu_memset               hipMemset
+#define gpu_synchronize          hipDeviceSynchronize
+#define gpu_blas_create          hipblasCreate
+#define gpu_blas_destroy         hipblasDestroy
+#define gpu_gemm_strided_batched BLAS_PRECISION(hipblasDgemmStridedBatched,hipblasSgemmStridedBatched)
+#define gpu_getrf_batched        BLAS_PRECISION(hipblasDgetrfBatched,hipblasSgetrfBatched)
+#define gpu_getrs_batched        BLAS_PRECISION(hipblasDgetrsBatched,hipblasSgetrsBatched)
+#else
+#include <cuda_runtime_api.h>
+#include <cublas_v2.h>
+typedef cublasHandle_t gpu_blas_t;
+#define GPU_SUCCESS              cudaSuccess
+#define GPU_BLAS_SUCCESS         CUBLAS_STATUS_SUCCESS
+#define GPU_OP_N                 CUBLAS_OP_N
+#define GPU_OP_T                 CUBLAS_OP_T
+#define GPU_HOST_TO_DEVICE       cudaMemcpyHostToDevice
+#define GPU_DEVICE_TO_HOST       cudaMemcpyDeviceToHost
+#define GPU_DEVICE_TO_DEVICE     cudaMemcpyDeviceToDevice
+#define gpu_malloc               cudaMalloc
+#define gpu_free                 cudaFree
+#define gpu_memcpy               cudaMemcpy
+#define gpu_memcpy_2d            cudaMemcpy2D
+#define gpu_memset               cudaMemset
+#define gpu_synchronize          cudaDeviceSynchronize
+#define gpu_blas_create          cublasCreate
+#define gpu_blas_destroy         cublasDestroy
+#define gpu_gemm_strided_batched BLAS_PRECISION(cublasDgemmStridedBatched,cublasSgemmStridedBatched)
+#define gpu_getrf_batched        BLAS_PRECISION(cublasDgetrfBatched,cublasSgetrfBatched)
+#define gpu_getrs_batched(h,t,n,r,A,lda,p,B,ldb,info,count) \
+  BLAS_PRECISION(cublasDgetrsBatched,cublasSgetrsBatched)((h),(t),(n),(r),(const matrix_element_t* const*) (A),(lda),(p),(B),(ldb),(info),(count))
+#endif
+#endif
+
 /******************************************************************************/
 /* UTILITIES                                                                  */
 /******************************************************************************/
@@ -306,6 +357,44 @@ static void observe(kalman_t *kalman, matrix_t *G_i, matrix_t *o_i, matrix_t *C_
 /* Associative Smoother                                                       */
 /******************************************************************************/
 
+/*
+ * The estimate of step 0 from its observations alone, and its covariance;
+ * the filtering element of step 1 starts from it.
+ */
+static void first_step_estimate(kalman_step_equations_t* step_0, matrix_t** state, matrix_t** covariance) {
+  matrix_t* G_i    = step_0->G;
+  matrix_t* o_i    = step_0->o;
+  matrix_t* C_i    = step_0->C;
+  char      C_type = step_0->C_type;
+
+  matrix_t* W_i_G_i = kalman_model_weigh(step_0->model, C_i, C_type, G_i);
+  matrix_t* W_i_o_i = kalman_model_weigh(step_0->model, C_i, C_type, o_i);
+
+  matrix_t* R = matrix_create_copy(W_i_G_i);
+  matrix_t* Q = matrix_create_mutate_qr(R);
+
+  matrix_mutate_apply_qt(R, Q, W_i_o_i);
+
+  matrix_mutate_triu(R);
+  matrix_t* m0 = matrix_create_trisolve("U",R, W_i_o_i);
+
+  matrix_t* RT  = matrix_create_transpose(R);
+  matrix_t* RTR = matrix_create_multiply(RT, R);
+  matrix_t* P0  = matrix_create_inverse(RTR);
+
+  *state      = m0;
+  *covariance = P0;
+
+  matrix_free(Q);
+  matrix_free(R);
+
+  matrix_free(W_i_G_i);
+  matrix_free(W_i_o_i);
+
+  matrix_free(RT);
+  matrix_free(RTR);
+}
+
 static void build_filtering_element_new(kalman_step_equations_t* equations[], step_t* elements[], kalman_step_index_t i) {
   /*
    we denote by Z the matrix denoted by C in the article,
@@ -333,43 +422,12 @@ static void build_filtering_element_new(kalman_step_equations_t* equations[], st
   }
 
   if (i == 1) {
-    kalman_step_equations_t* step_0 = equations[0];
-    matrix_t* G_i    = step_0->G;
-    matrix_t* o_i    = step_0->o;
-    matrix_t* C_i    = step_0->C;
-    char      C_type = step_0->C_type;
-
-    matrix_t* W_i_G_i = kalman_covariance_matrix_weigh(C_i, C_type, G_i);
-    matrix_t* W_i_o_i = kalman_covariance_matrix_weigh(C_i, C_type, o_i);
-
-    matrix_t* R = matrix_create_copy(W_i_G_i);
-    matrix_t* Q = matrix_create_mutate_qr(R);
-
-    matrix_mutate_apply_qt(R, Q, W_i_o_i);
-
-    matrix_mutate_triu(R);
-    matrix_t* m0 = matrix_create_trisolve("U",R, W_i_o_i);
-
-    matrix_t* RT  = matrix_create_transpose(R);
-    matrix_t* RTR = matrix_create_multiply(RT, R);
-    matrix_t* P0  = matrix_create_inverse(RTR);
-
-    elements[0]->state = m0;
-    elements[0]->covariance = P0;
-
-    matrix_free(Q);
-    matrix_free(R);
-
-    matrix_free(W_i_G_i);
-    matrix_free(W_i_o_i);
-
-    matrix_free(RT);
-    matrix_free(RTR);
+    first_step_estimate(equations[0], &(elements[0]->state), &(elements[0]->covariance));
   }
 
   matrix_t *F_i = equation->F;
   matrix_t *c_i = equation->c;
-  matrix_t *K_i = kalman_covariance_matrix_explicit(equation->K, equation->K_type);
+  matrix_t *K_i = kalman_model_explicit(equation->model, equation->K, equation->K_type);
 
   if (i == 1) {
     //kalman_step_equations_t *step_0    = equations[0];
@@ -402,17 +460,13 @@ static void build_filtering_element_new(kalman_step_equations_t* equations[], st
   } else { // there are observations
     matrix_t* G_i = equation->G;
     matrix_t* o_i = equation->o;
-    matrix_t* C_i = kalman_covariance_matrix_explicit(equation->C, equation->C_type);
-
     matrix_t* G_iT = matrix_create_transpose(G_i);
     matrix_t* KGT  = matrix_create_multiply(K_i, G_iT);
-    matrix_t* GKGT = matrix_create_multiply(G_i, KGT);
-    matrix_t* S    = matrix_create_add(GKGT, C_i);
+    matrix_t* S    = matrix_create_multiply(G_i, KGT);
+    kalman_model_add_explicit(equation->model, equation->C, equation->C_type, S);
 
     matrix_free(G_iT);
     matrix_free(KGT);
-    matrix_free(GKGT);
-    matrix_free(C_i);
 
     matrix_t *ST = matrix_create_transpose(S);
 
@@ -707,13 +761,12 @@ static void build_smoothing_element_new(step_t* elements[], kalman_step_index_t
     matrix_t *P = kalman_covariance_matrix_explicit(step_i->covariance, 'C');
     step_t *step_ip1 = elements[ i+1 ];
     matrix_t *F = step_ip1->F;
-    matrix_t *Q = kalman_covariance_matrix_explicit(step_ip1->K, step_ip1->K_type);
     matrix_t *c = step_ip1->c;
 
     matrix_t *FT = matrix_create_transpose(F);
     matrix_t *PFT = matrix_create_multiply(P, FT);
-    matrix_t *FPFT = matrix_create_multiply(F, PFT);
-    matrix_t *FPFT_Q = matrix_create_add(FPFT, Q);
+    matrix_t *FPFT_Q = matrix_create_multiply(F, PFT);
+    kalman_covariance_matrix_add_explicit(FPFT_Q, step_ip1->K, step_ip1->K_type);
 
     matrix_t *PFT_T = matrix_create_transpose(PFT);
     matrix_t *FPFT_Q_T = matrix_create_transpose(FPFT_Q);
@@ -724,7 +777,6 @@ static void build_smoothing_element_new(step_t* elements[], kalman_step_index_t
 
     matrix_free(FT);
     matrix_free(PFT);
-    matrix_free(FPFT);
     matrix_free(FPFT_Q);
     matrix_free(PFT_T);
     matrix_free(FPFT_Q_T);
@@ -748,7 +800,6 @@ static void build_smoothing_element_new(step_t* elements[], kalman_step_index_t
     matrix_free(EFP);
 
     matrix_free(P);
-    matrix_free(Q);
   }
 }
 
@@ -832,6 +883,7 @@ static void build_smoothing_elements(void *kalman_v, kalman_step_index_t l, kalm
 #endif
 
 static void build_filtering_elements_new(void* equations_v, void* elements_v, kalman_step_index_t l, kalman_step_index_t start, kalman_step_index_t end) {
+  (void) l;
   kalman_step_equations_t** equations = (kalman_step_equations_t**) equations_v;
   step_t**                  elements  = (step_t**)                  elements_v;
   for (kalman_step_index_t j = start; j < end; j++) {
@@ -847,6 +899,7 @@ static void build_smoothing_elements_new(void* elements_v, kalman_step_index_t l
 }
 
 static void elements_init(void* elements_v, void* elements_array_v, kalman_step_index_t l, kalman_step_index_t start, kalman_step_index_t end) {
+  (void) l;
   step_t*  elements_array  = (step_t*)   elements_array_v;
   step_t** elements        = (step_t**)  elements_v;
   for (kalman_step_index_t j = start; j < end; j++) {
@@ -1052,6 +1105,7 @@ static void smoothed_to_state(void *kalman_v, void *smoothed_v, kalman_step_inde
 #endif
 
 static void filtered_to_state_new(void* elements_v, void* filtered_v, kalman_step_index_t l, kalman_step_index_t start, kalman_step_index_t end) {
+  (void) l;
   //kalman_t *kalman = (kalman_t*) kalman_v;
   //step_t **filtered = (step_t**) filtered_v;
   step_t** elements = (step_t**) elements_v;
@@ -1084,7 +1138,7 @@ static void smoothed_to_state_new(void* equations_v, void* smoothed_v, kalman_st
     matrix_free(equation->state);
     equation->state = matrix_create_copy(smoothed_i->g);
     matrix_free(equation->covariance);
-    equation->covariance = matrix_create_copy(smoothed_i->L);
+    equation->covariance = equation->covariance_wanted ? matrix_create_copy(smoothed_i->L) : NULL;
     equation->covariance_type = 'C';
     //step_free(smoothed_i);
   }
@@ -1159,14 +1213,14 @@ static void smooth(kalman_t *kalman) {
   foreach_in_range(build_filtering_elements, kalman, l, l);
 
   step_t **filtered = (step_t**) malloc((l - 1) * sizeof(step_t*));
-  concurrent_set_t *filtered_created_steps = concurrent_set_create(l, step_free);
+  concurrent_bag_t *filtered_created_steps = concurrent_bag_create(step_free);
 
   prefix_sums_pointers(filteringAssociativeOperation, &((kalman->steps->elements)[1]), (void**) filtered,
       filtered_created_steps, l - 1, 1);
   foreach_in_range_two(filtered_to_state, kalman, filtered, l, l - 1);
 
-  concurrent_set_foreach(filtered_created_steps);
-  concurrent_set_free(filtered_created_steps);
+  concurrent_bag_foreach(filtered_created_steps);
+  concurrent_bag_free(filtered_created_steps);
   free(filtered);
 
 //#ifdef PARALLEL
@@ -1177,7 +1231,7 @@ static void smooth(kalman_t *kalman) {
   foreach_in_range(build_smoothing_elements, kalman, l, l);
 
   step_t **smoothed = (step_t**) malloc(l * sizeof(step_t*));
-  concurrent_set_t *smoothed_created_steps = concurrent_set_create(l, step_free);
+  concurrent_bag_t *smoothed_created_steps = concurrent_bag_create(step_free);
 
   prefix_sums_pointers(smoothingAssociativeOperation, kalman->steps->elements, (void**) smoothed,
       smoothed_created_steps, l, -1);
@@ -1190,17 +1244,427 @@ static void smooth(kalman_t *kalman) {
 //	smoothed_to_state(kalman, (void**) smoothed, l, 0, l - 1);
 //#endif
 
-  concurrent_set_foreach(smoothed_created_steps);
-  concurrent_set_free(smoothed_created_steps);
+  concurrent_bag_foreach(smoothed_created_steps);
+  concurrent_bag_free(smoothed_created_steps);
   free(smoothed);
 }
 #endif
 
+/******************************************************************************/
+/* GPU (CUDA OR HIP)                                                          */
+/******************************************************************************/
+
+/*
+ * The elements live in device memory as fixed-stride batches, one array per
+ * field with a slot per step (n-by-n matrices, n-by-1 vectors, leading
+ * dimension n). The filtering elements are built on the host, because they
+ * depend on the observations, whose dimensions vary, and are uploaded; the
+ * smoothing elements are built on the device from the filtered estimates,
+ * in place of the filtering ones. Each scan is a work-efficient (Brent-Kung)
+ * inclusive scan, and all the combinations in a level of the scan form one
+ * batch: strided-batched gemm calls and batched LU factorizations and solves,
+ * with the slots of the left and right operands at a constant stride.
+ *
+ * The combination of the smoothing elements uses the transposes of E, which
+ * makes every transpose an op argument of gemm.
+ */
+#ifdef BUILD_GPU
+
+#define GPU_SLOT(field,size,slot) ((field) + ((size_t) (slot)) * (size))
+
+typedef struct gpu_st {
+  gpu_blas_t         blas;
+  int                failed;   // some call failed; the results are discarded
+  int32_t            n;
+  kalman_step_index_t l;
+
+  matrix_element_t*  identity; // n-by-n, used with stride 0
+  matrix_element_t*  A;        // the fields of the elements, l slots each
+  matrix_element_t*  b;        // b, then g
+  matrix_element_t*  Z;        // Z, then L
+  matrix_element_t*  e;
+  matrix_element_t*  J;
+  matrix_element_t*  Et;       // E transposed
+  matrix_element_t*  F;        // of the next step, l-1 slots; then F*P
+  matrix_element_t*  c;        // of the next step, l-1 slots; then F*x+c
+  matrix_element_t*  Q;        // explicit K of the next step, l-1 slots; then F*P*F'+Q
+
+  matrix_element_t*  N;        // scratch, one slot per combination in a level
+  matrix_element_t*  X;
+  matrix_element_t*  Y;
+  matrix_element_t*  T1;
+  matrix_element_t*  T2;
+  matrix_element_t*  t;
+
+  matrix_element_t** pointers; // device, for the batched LU, 2*l
+  matrix_element_t** host_pointers;
+  int*               pivots;   // device, n*l
+  int*               info;     // device, l
+
+  matrix_element_t*  staging;  // host, one field
+} gpu_t;
+
+static void* gpu_alloc(gpu_t* g, size_t bytes) {
+  void* p = NULL;
+  if (gpu_malloc(&p, bytes) != GPU_SUCCESS) {
+    g->failed = 1;
+    return NULL;
+  }
+  return p;
+}
+
+static void gpu_check(gpu_t* g, int ok) {
+  if (!ok) g->failed = 1;
+}
+
+/*
+ * C_k = alpha * op(A_k) * op(B_k) + beta * C_k for count batch entries,
+ * rows-by-cols, every operand with leading dimension n.
+ */
+static void gpu_gemm(gpu_t* g, char trans_A, char trans_B, int32_t rows, int32_t cols, int32_t inner,
+                     double alpha, const matrix_element_t* A, int64_t stride_A,
+                               const matrix_element_t* B, int64_t stride_B,
+                     double beta,  matrix_element_t* C,       int64_t stride_C, kalman_step_index_t count) {
+  if (g->failed || count == 0) return;
+  matrix_element_t a = (matrix_element_t) alpha;
+  matrix_element_t z = (matrix_element_t) beta;
+  gpu_check(g, gpu_gemm_strided_batched(g->blas, trans_A == 'T' ? GPU_OP_T : GPU_OP_N, trans_B == 'T' ? GPU_OP_T : GPU_OP_N,
+                                        rows, cols, inner, &a, A, g->n, stride_A, B, g->n, stride_B,
+                                        &z, C, g->n, stride_C, (int) count) == GPU_BLAS_SUCCESS);
+}
+
+static void gpu_copy(gpu_t* g, matrix_element_t* dst, size_t dst_stride, const matrix_element_t* src, size_t src_stride,
+                     size_t size, kalman_step_index_t count) {
+  if (g->failed || count == 0) return;
+  size_t e = sizeof(matrix_element_t);
+  gpu_check(g, gpu_memcpy_2d(dst, dst_stride * e, src, src_stride * e, size * e, count, GPU_DEVICE_TO_DEVICE) == GPU_SUCCESS);
+}
+
+static void gpu_set_pointers(gpu_t* g, matrix_element_t* M, size_t stride, matrix_element_t* B, size_t B_stride,
+                             kalman_step_index_t count) {
+  for (kalman_step_index_t k = 0; k < count; k++) {
+    (g->host_pointers)[k        ] = GPU_SLOT(M, stride,   k);
+    (g->host_pointers)[count + k] = GPU_SLOT(B, B_stride, k);
+  }
+  if (g->failed) return;
+  gpu_check(g, gpu_memcpy(g->pointers, g->host_pointers, 2 * count * sizeof(matrix_element_t*), GPU_HOST_TO_DEVICE) == GPU_SUCCESS);
+}
+
+/*
+ * With the pointer arrays set to M_k and B_k, factor LUs the count n-by-n
+ * matrices M_k in place and solve overwrites B_k (cols columns) with
+ * inv(op(M_k))*B_k, given the factors.
+ */
+static void gpu_factor(gpu_t* g, kalman_step_index_t count) {
+  if (g->failed || count == 0) return;
+  gpu_check(g, gpu_getrf_batched(g->blas, g->n, g->pointers, g->n, g->pivots, g->info, (int) count) == GPU_BLAS_SUCCESS);
+}
+
+static void gpu_solve(gpu_t* g, char trans, int32_t cols, kalman_step_index_t count) {
+  if (g->failed || count == 0) return;
+  int info = 0;
+  gpu_check(g, gpu_getrs_batched(g->blas, trans == 'T' ? GPU_OP_T : GPU_OP_N, g->n, cols,
+                                 g->pointers, g->n, g->pivots, g->pointers + count, g->n, &info, (int) count) == GPU_BLAS_SUCCESS);
+  gpu_check(g, info == 0);
+}
+
+/*
+ * The filtering combinations of the elements in slots left+k*stride (earlier)
+ * and right+k*stride, for k < count; the right elements are overwritten.
+ */
+static void gpu_filtering_combine(gpu_t* g, kalman_step_index_t left, kalman_step_index_t right, kalman_step_index_t stride,
+                                  kalman_step_index_t count) {
+  int32_t n  = g->n;
+  int64_t nn = ((int64_t) n) * n;
+  int64_t ms = stride * nn; // matrix and vector strides of the operands
+  int64_t vs = stride * n;
+
+  matrix_element_t* A_i = GPU_SLOT(g->A, nn, left ); matrix_element_t* A_j = GPU_SLOT(g->A, nn, right);
+  matrix_element_t* b_i = GPU_SLOT(g->b, n,  left ); matrix_element_t* b_j = GPU_SLOT(g->b, n,  right);
+  matrix_element_t* Z_i = GPU_SLOT(g->Z, nn, left ); matrix_element_t* Z_j = GPU_SLOT(g->Z, nn, right);
+  matrix_element_t* e_i = GPU_SLOT(g->e, n,  left ); matrix_element_t* e_j = GPU_SLOT(g->e, n,  right);
+  matrix_element_t* J_i = GPU_SLOT(g->J, nn, left ); matrix_element_t* J_j = GPU_SLOT(g->J, nn, right);
+
+  // N = I + J_j*Z_i, so X = A_j*inv(N') and Y = A_i'*inv(N), since Z and J are symmetric
+  gpu_gemm(g, 'N','N', n,n,n, 1.0, J_j, ms, Z_i, ms, 0.0, g->N, nn, count);
+  gpu_gemm(g, 'N','N', n,n,n, 1.0, g->identity, 0, g->identity, 0, 1.0, g->N, nn, count);
+
+  gpu_gemm(g, 'T','N', n,n,n, 1.0, A_j, ms, g->identity, 0, 0.0, g->X, nn, count); // X' = inv(N)*A_j'
+  gpu_copy(g, g->Y, nn, A_i, ms, nn, count);                                       // Y' = inv(N')*A_i
+
+  gpu_set_pointers(g, g->N, nn, g->X, nn, count);
+  gpu_factor(g, count);
+  gpu_solve(g, 'N', n, count);
+  gpu_set_pointers(g, g->N, nn, g->Y, nn, count);
+  gpu_solve(g, 'T', n, count);
+
+  // b_j = X*(Z_i*e_j + b_i) + b_j
+  gpu_copy(g, g->t, n, b_i, vs, n, count);
+  gpu_gemm(g, 'N','N', n,1,n, 1.0, Z_i, ms, e_j, vs, 1.0, g->t, n, count);
+  gpu_gemm(g, 'T','N', n,1,n, 1.0, g->X, nn, g->t, n, 1.0, b_j, vs, count);
+
+  // Z_j = X*Z_i*A_j' + Z_j
+  gpu_gemm(g, 'N','T', n,n,n, 1.0, Z_i, ms, A_j, ms, 0.0, g->T1, nn, count);
+  gpu_gemm(g, 'T','N', n,n,n, 1.0, g->X, nn, g->T1, nn, 1.0, Z_j, ms, count);
+
+  // e_j = Y*(e_j - J_j*b_i) + e_i
+  gpu_gemm(g, 'N','N', n,1,n, -1.0, J_j, ms, b_i, vs, 1.0, e_j, vs, count);
+  gpu_copy(g, g->t, n, e_i, vs, n, count);
+  gpu_gemm(g, 'T','N', n,1,n, 1.0, g->Y, nn, e_j, vs, 1.0, g->t, n, count);
+  gpu_copy(g, e_j, vs, g->t, n, n, count);
+
+  // J_j = Y*J_j*A_i + J_i
+  gpu_gemm(g, 'N','N', n,n,n, 1.0, J_j, ms, A_i, ms, 0.0, g->T2, nn, count);
+  gpu_copy(g, g->T1, nn, J_i, ms, nn, count);
+  gpu_gemm(g, 'T','N', n,n,n, 1.0, g->Y, nn, g->T2, nn, 1.0, g->T1, nn, count);
+  gpu_copy(g, J_j, ms, g->T1, nn, nn, count);
+
+  // A_j = X*A_i
+  gpu_gemm(g, 'T','N', n,n,n, 1.0, g->X, nn, A_i, ms, 0.0, g->T2, nn, count);
+  gpu_copy(g, A_j, ms, g->T2, nn, nn, count);
+}
+
+/*
+ * The smoothing combinations, as above, except that the left elements (later
+ * steps, which the scan combines first) are stride/2 slots after the right.
+ */
+static void gpu_smoothing_combine(gpu_t* g, kalman_step_index_t left, kalman_step_index_t right, kalman_step_index_t stride,
+                                  kalman_step_index_t count) {
+  int32_t n  = g->n;
+  int64_t nn = ((int64_t) n) * n;
+  int64_t ms = stride * nn;
+  int64_t vs = stride * n;
+
+  matrix_element_t* E_i = GPU_SLOT(g->Et, nn, left ); matrix_element_t* E_j = GPU_SLOT(g->Et, nn, right);
+  matrix_element_t* g_i = GPU_SLOT(g->b,  n,  left ); matrix_element_t* g_j = GPU_SLOT(g->b,  n,  right);
+  matrix_element_t* L_i = GPU_SLOT(g->Z,  nn, left ); matrix_element_t* L_j = GPU_SLOT(g->Z,  nn, right);
+
+  // g_j = E_j*g_i + g_j
+  gpu_gemm(g, 'T','N', n,1,n, 1.0, E_j, ms, g_i, vs, 1.0, g_j, vs, count);
+
+  // L_j = E_j*L_i*E_j' + L_j
+  gpu_gemm(g, 'N','N', n,n,n, 1.0, L_i, ms, E_j, ms, 0.0, g->T1, nn, count);
+  gpu_gemm(g, 'T','N', n,n,n, 1.0, E_j, ms, g->T1, nn, 1.0, L_j, ms, count);
+
+  // E_j = E_j*E_i, so E_j' = E_i'*E_j'
+  gpu_gemm(g, 'N','N', n,n,n, 1.0, E_i, ms, E_j, ms, 0.0, g->T1, nn, count);
+  gpu_copy(g, E_j, ms, g->T1, nn, nn, count);
+}
+
+/*
+ * The inclusive scan of length elements, the first in slot first; with
+ * direction -1 the scan runs from the last slot to the first.
+ */
+static void gpu_scan(gpu_t* g, void (*combine)(gpu_t*, kalman_step_index_t, kalman_step_index_t, kalman_step_index_t, kalman_step_index_t),
+                     kalman_step_index_t first, kalman_step_index_t length, int direction) {
+  kalman_step_index_t h, top = 0;
+
+  // the right operand of combination k is at position p0 + 2*h*k of the scan, the left at h positions before
+  for (h = 1; 2*h <= length; h *= 2) {
+    kalman_step_index_t count = length / (2*h);
+    kalman_step_index_t p0    = 2*h - 1;
+    kalman_step_index_t p     = direction > 0 ? p0 : p0 + (count-1)*2*h; // the position in the lowest slot
+    kalman_step_index_t right = direction > 0 ? first + p : first + length - 1 - p;
+    (*combine)(g, right - direction*h, right, 2*h, count);
+    top = h;
+  }
+
+  for (h = top; h >= 1; h /= 2) {
+    if (length < 3*h) continue;
+    kalman_step_index_t count = (length - 3*h) / (2*h) + 1;
+    kalman_step_index_t p0    = 3*h - 1;
+    kalman_step_index_t p     = direction > 0 ? p0 : p0 + (count-1)*2*h;
+    kalman_step_index_t right = direction > 0 ? first + p : first + length - 1 - p;
+    (*combine)(g, right - direction*h, right, 2*h, count);
+  }
+}
+
+/*
+ * Column-major, n-by-cols, from a matrix (zeros if it is NULL) in host memory.
+ */
+static void gpu_pack(matrix_element_t* dst, matrix_t* A, int32_t rows, int32_t cols) {
+  for (int32_t j = 0; j < cols; j++)
+    for (int32_t i = 0; i < rows; i++)
+      dst[i + j*rows] = (A == NULL) ? 0.0 : (A->elements)[i + j*(A->ld)];
+}
+
+static void gpu_upload(gpu_t* g, matrix_element_t* dst, step_t** elements, kalman_step_index_t first, kalman_step_index_t count,
+                       size_t field, int32_t cols) {
+  if (g->failed || count == 0) return;
+  size_t size = ((size_t) g->n) * cols;
+  for (kalman_step_index_t i = 0; i < count; i++) {
+    matrix_t* A = *((matrix_t**) (((char*) elements[first + i]) + field));
+    if (A != NULL && (matrix_rows(A) != g->n || matrix_cols(A) != cols)) g->failed = 1;
+    gpu_pack(GPU_SLOT(g->staging, size, i), g->failed ? NULL : A, g->n, cols);
+  }
+  gpu_check(g, gpu_memcpy(dst, g->staging, count * size * sizeof(matrix_element_t), GPU_HOST_TO_DEVICE) == GPU_SUCCESS);
+}
+
+static void gpu_free_all(gpu_t* g) {
+  matrix_element_t* fields[] = { g->identity, g->A, g->b, g->Z, g->e, g->J, g->Et, g->F, g->c, g->Q,
+                                 g->N, g->X, g->Y, g->T1, g->T2, g->t };
+  for (size_t f = 0; f < sizeof(fields) / sizeof(fields[0]); f++)
+    if (fields[f] != NULL) gpu_free(fields[f]);
+  if (g->pointers != NULL) gpu_free(g->pointers);
+  if (g->pivots   != NULL) gpu_free(g->pivots);
+  if (g->info     != NULL) gpu_free(g->info);
+  free(g->host_pointers);
+  free(g->staging);
+  gpu_blas_destroy(g->blas);
+}
+
+/*
+ * Smooths on the device, given the filtering elements built on the host, and
+ * returns 1; returns 0, without touching the equations, if it could not.
+ */
+static int gpu_smooth(kalman_step_equations_t** equations, step_t** elements, kalman_step_index_t l) {
+  gpu_t gpu = { 0 };
+  gpu_t* g = &gpu;
+
+  if (l < 2) return 0;
+  int32_t n = equations[0]->dimension;
+  for (kalman_step_index_t i = 0; i < l; i++)
+    if (equations[i]->dimension != n || elements[i]->dimension != n) return 0;
+
+  if (gpu_blas_create(&(g->blas)) != GPU_BLAS_SUCCESS) return 0;
+
+  size_t nn   = ((size_t) n) * n;
+  size_t e    = sizeof(matrix_element_t);
+  size_t half = l/2 + 1;
+  g->n = n;
+  g->l = l;
+
+  g->identity = gpu_alloc(g, nn * e);
+  g->A  = gpu_alloc(g, l * nn * e); g->b = gpu_alloc(g, l * n * e); g->Z = gpu_alloc(g, l * nn * e);
+  g->e  = gpu_alloc(g, l * n  * e); g->J = gpu_alloc(g, l * nn * e); g->Et = gpu_alloc(g, l * nn * e);
+  g->F  = gpu_alloc(g, l * nn * e); g->c = gpu_alloc(g, l * n * e); g->Q = gpu_alloc(g, l * nn * e);
+  g->N  = gpu_alloc(g, half * nn * e); g->X  = gpu_alloc(g, half * nn * e); g->Y = gpu_alloc(g, half * nn * e);
+  g->T1 = gpu_alloc(g, half * nn * e); g->T2 = gpu_alloc(g, half * nn * e); g->t = gpu_alloc(g, half * n  * e);
+  g->pointers = gpu_alloc(g, 2 * l * sizeof(matrix_element_t*));
+  g->pivots   = gpu_alloc(g, l * n * sizeof(int));
+  g->info     = gpu_alloc(g, l * sizeof(int));
+  g->host_pointers = (matrix_element_t**) malloc(2 * l * sizeof(matrix_element_t*));
+  g->staging       = (matrix_element_t*)  malloc(l * nn * e);
+  if (g->host_pointers == NULL || g->staging == NULL) g->failed = 1;
+
+  if (!g->failed) {
+    for (size_t i = 0; i < nn; i++) (g->staging)[i] = (i % (n+1) == 0) ? 1.0 : 0.0;
+    gpu_check(g, gpu_memcpy(g->identity, g->staging, nn * e, GPU_HOST_TO_DEVICE) == GPU_SUCCESS);
+  }
+
+  // the filtering elements in slots 1 to l-1; slot 0 holds the estimate of step 0 in b and Z
+  gpu_upload(g, g->A, elements, 0, l, offsetof(step_t, A), n);
+  gpu_upload(g, g->b, elements, 0, l, offsetof(step_t, b), 1);
+  gpu_upload(g, g->Z, elements, 0, l, offsetof(step_t, Z), n);
+  gpu_upload(g, g->e, elements, 0, l, offsetof(step_t, e), 1);
+  gpu_upload(g, g->J, elements, 0, l, offsetof(step_t, J), n);
+  gpu_upload(g, g->b, elements, 0, 1, offsetof(step_t, state),      1);
+  gpu_upload(g, g->Z, elements, 0, 1, offsetof(step_t, covariance), n);
+
+  double phase_begin = kalman_phase_begin();
+  gpu_scan(g, gpu_filtering_combine, 1, l-1, 1);
+  if (!g->failed) gpu_check(g, gpu_synchronize() == GPU_SUCCESS);
+  kalman_phase_end("associative-filter", 0, phase_begin);
+
+  // the smoothing elements of steps 0 to l-2, from the filtered estimates x (in b) and P (in Z)
+  matrix_t** Qs = (matrix_t**) calloc(l, sizeof(matrix_t*));
+  if (Qs == NULL) g->failed = 1;
+  for (kalman_step_index_t i = 1; !g->failed && i < l; i++) {
+    Qs[i] = kalman_covariance_matrix_explicit(elements[i]->K, elements[i]->K_type);
+    if (Qs[i] == NULL) g->failed = 1;
+  }
+  if (!g->failed) {
+    step_t** nexts = (step_t**) malloc(l * sizeof(step_t*)); // steps 1 to l-1, with an explicit K
+    step_t*  copies   = (step_t*)  malloc(l * sizeof(step_t));
+    if (nexts == NULL || copies == NULL) g->failed = 1;
+    for (kalman_step_index_t i = 1; !g->failed && i < l; i++) {
+      copies[i]   = *(elements[i]);
+      copies[i].K = Qs[i];
+      nexts[i-1] = copies + i;
+    }
+    gpu_upload(g, g->F, nexts, 0, l-1, offsetof(step_t, F), n);
+    gpu_upload(g, g->c, nexts, 0, l-1, offsetof(step_t, c), 1);
+    gpu_upload(g, g->Q, nexts, 0, l-1, offsetof(step_t, K), n);
+    free(nexts);
+    free(copies);
+  }
+  for (kalman_step_index_t i = 1; Qs != NULL && i < l; i++) matrix_free(Qs[i]);
+  free(Qs);
+
+  kalman_step_index_t count = l-1;
+  gpu_gemm(g, 'N','N', n,n,n, 1.0, g->F, nn, g->Z, nn, 0.0, g->Et, nn, count); // F*P
+  gpu_gemm(g, 'N','T', n,n,n, 1.0, g->Et, nn, g->F, nn, 1.0, g->Q, nn, count); // S = F*P*F' + Q
+  gpu_gemm(g, 'N','N', n,1,n, 1.0, g->F, nn, g->b, n, 1.0, g->c, n, count);    // F*x + c
+  gpu_copy(g, g->F, nn, g->Et, nn, nn, count);                                 // F*P
+  gpu_set_pointers(g, g->Q, nn, g->Et, nn, count);
+  gpu_factor(g, count);
+  gpu_solve(g, 'N', n, count);                                                 // E' = inv(S)*F*P, as S and P are symmetric
+  gpu_gemm(g, 'T','N', n,n,n, -1.0, g->Et, nn, g->F, nn, 1.0, g->Z, nn, count); // L = P - E*F*P
+  gpu_gemm(g, 'T','N', n,1,n, -1.0, g->Et, nn, g->c, n, 1.0, g->b, n, count);   // g = x - E*(F*x + c)
+  if (!g->failed) gpu_check(g, gpu_memset(GPU_SLOT(g->Et, nn, l-1), 0, nn * e) == GPU_SUCCESS); // the last: E=0, g=x, L=P
+
+  phase_begin = kalman_phase_begin();
+  gpu_scan(g, gpu_smoothing_combine, 0, l, -1);
+  if (!g->failed) gpu_check(g, gpu_synchronize() == GPU_SUCCESS);
+  kalman_phase_end("associative-smooth", 0, phase_begin);
+
+  int wanted = 0;
+  for (kalman_step_index_t i = 0; i < l; i++) wanted = wanted || equations[i]->covariance_wanted;
+
+  matrix_element_t* covariances = NULL;
+  if (!g->failed && wanted) {
+    covariances = (matrix_element_t*) malloc(l * nn * e);
+    if (covariances == NULL) g->failed = 1;
+    else gpu_check(g, gpu_memcpy(covariances, g->Z, l * nn * e, GPU_DEVICE_TO_HOST) == GPU_SUCCESS);
+  }
+  if (!g->failed) gpu_check(g, gpu_memcpy(g->staging, g->b, l * n * e, GPU_DEVICE_TO_HOST) == GPU_SUCCESS);
+
+  int ok = !g->failed;
+  for (kalman_step_index_t i = 0; ok && i < l; i++) {
+    kalman_step_equations_t* equation = equations[i];
+    matrix_free(equation->state);
+    equation->state = matrix_create(n, 1);
+    memcpy(equation->state->elements, GPU_SLOT(g->staging, n, i), n * e);
+    matrix_free(equation->covariance);
+    equation->covariance = NULL;
+    if (equation->covariance_wanted) {
+      equation->covariance = matrix_create(n, n);
+      for (int32_t j = 0; j < n; j++)
+        memcpy(equation->covariance->elements + j*(equation->covariance->ld), GPU_SLOT(covariances, nn, i) + j*n, n * e);
+    }
+    equation->covariance_type = 'C';
+  }
+
+  free(covariances);
+  gpu_free_all(g);
+  return ok;
+}
+
+#endif /* BUILD_GPU */
+
 void kalman_smooth_associative(kalman_options_t options, kalman_step_equations_t** equations, kalman_step_index_t l) {
+  (void) options;
   //kalman_step_index_t l = farray_size(kalman->steps);
 
   //foreach_in_range(build_filtering_elements, kalman, l, l);
 
+  // a single step has no evolution equation to scan over
+  if (l == 1) {
+    kalman_step_equations_t* equation = equations[0];
+    matrix_t* covariance;
+    matrix_free(equation->state);
+    matrix_free(equation->covariance);
+    first_step_estimate(equation, &(equation->state), &covariance);
+    if (equation->covariance_wanted) {
+      equation->covariance = covariance;
+    } else {
+      equation->covariance = NULL;
+      matrix_free(covariance);
+    }
+    equation->covariance_type = 'C';
+    return;
+  }
+
   step_t*  elements_array = (step_t*)  malloc( l * sizeof(step_t)  );
   step_t** elements       = (step_t**) malloc( l * sizeof(step_t*) );
 
@@ -1208,34 +1672,52 @@ void kalman_smooth_associative(kalman_options_t options, kalman_step_equations_t
 
   foreach_in_range_two(build_filtering_elements_new, equations, elements, l, l);
 
+#ifdef BUILD_GPU
+  if ((options & KALMAN_GPU) && gpu_smooth(equations, elements, l)) {
+    for (kalman_step_index_t i = 0; i < l; i++) {
+      step_t* s = elements[i];
+      matrix_free(s->F); matrix_free(s->c); matrix_free(s->K);
+      matrix_free(s->Z); matrix_free(s->A); matrix_free(s->b); matrix_free(s->e); matrix_free(s->J);
+      matrix_free(s->state); matrix_free(s->covariance);
+    }
+    free(elements);
+    free(elements_array);
+    return;
+  }
+#endif
+
   step_t **filtered = (step_t**) malloc( (l-1) * sizeof(step_t*) );
-  concurrent_set_t *filtered_created_steps = concurrent_set_create(l, step_free);
+  concurrent_bag_t *filtered_created_steps = concurrent_bag_create(step_free);
 
   //prefix_sums_pointers(filteringAssociativeOperation, &((kalman->steps->elements)[1]), (void**) filtered, filtered_created_steps, l - 1, 1);
+  double phase_begin = kalman_phase_begin();
   prefix_sums_pointers(filteringAssociativeOperation, (void**) &(elements[1]), (void**) filtered, filtered_created_steps, l - 1, 1);
+  kalman_phase_end("associative-filter", 0, phase_begin);
 
   foreach_in_range_two(filtered_to_state_new, elements, filtered, l, l - 1);
 
   // in the last step, the smoothed estimate is simply the filtered one, so copy now.
   equations[l-1]->state      = matrix_create_copy(filtered[l-2]->b);
-  equations[l-1]->covariance = matrix_create_copy(filtered[l-2]->L);
+  equations[l-1]->covariance = equations[l-1]->covariance_wanted ? matrix_create_copy(filtered[l-2]->Z) : NULL; // the filtered covariance
   equations[l-1]->covariance_type = 'C';
 
-  concurrent_set_foreach(filtered_created_steps);
-  concurrent_set_free(filtered_created_steps);
+  concurrent_bag_foreach(filtered_created_steps);
+  concurrent_bag_free(filtered_created_steps);
   free(filtered);
 
   foreach_in_range(build_smoothing_elements_new, elements, l, l);
 
   step_t **smoothed = (step_t**) malloc( l * sizeof(step_t*) );
-  concurrent_set_t *smoothed_created_steps = concurrent_set_create(l, step_free);
+  concurrent_bag_t *smoothed_created_steps = concurrent_bag_create(step_free);
 
+  phase_begin = kalman_phase_begin();
   prefix_sums_pointers(smoothingAssociativeOperation, (void**) elements, (void**) smoothed, smoothed_created_steps, l, -1);
+  kalman_phase_end("associative-smooth", 0, phase_begin);
 
   foreach_in_range_two(smoothed_to_state_new, equations, smoothed, l, l-1);
 
-  concurrent_set_foreach(smoothed_created_steps);
-  concurrent_set_free(smoothed_created_steps);
+  concurrent_bag_foreach(smoothed_created_steps);
+  concurrent_bag_free(smoothed_created_steps);
   free(smoothed);
 }
 
@@ -0,0 +1,383 @@
+/*
+ * kalman_async_smoother.c
+ *
+ * Asynchronous smoothing of completed segments of a filter that stores its
+ * equations for the parallel smoothers (KALMAN_ALGORITHM_ODDEVEN or
+ * KALMAN_ALGORITHM_ASSOCIATIVE). kalman_smooth_async moves the steps of a
+ * segment out of the filter's array (pointers only) and queues the segment
+ * for a background thread, so the thread that feeds the filter only pays for
+ * the move. The background thread smooths one segment at a time with the
+ * parallel smoother of the filter, whose loops run on the parallel backend
+ * (the TBB, OpenMP or pthreads pool), and then calls the segment's callback
+ * and wakes up the threads that wait for it.
+ *
+ * The segments are smoothed in order, and each one starts from the estimate
+ * and covariance of the last step of the previous one, which stand for all
+ * the steps before it: the evolution equation of its first step is kept and
+ * links it to an observation of the previous state with that covariance. The
+ * estimates of a segment are therefore those of smoothing all the steps up to
+ * its last one, and kalman_smooth on the steps that remain in the filter,
+ * which starts from the last segment, gives those of the whole trajectory.
+ *
+ * (C) Sivan Toledo, 2022-2025
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+
+#ifdef BUILD_MEX
+#include "mex.h"
+
+static char assert_msg[128];
+static void mex_assert(int c, int line) {
+    if (!c) {
+        sprintf(assert_msg,"Assert failed in %s line %d",__FILE__,line);
+        mexErrMsgIdAndTxt("MyToolbox:arrayProduct:assertion",assert_msg);
+    }
+}
+
+#define assert(c) mex_assert((c),__LINE__)
+#else
+#include <assert.h>
+#endif
+
+#define KALMAN_MATRIX_SHORT_TYPE
+#include "kalman.h"
+#include "parallel.h"
+
+/******************************************************************************/
+/* THREADS                                                                    */
+/******************************************************************************/
+
+#ifdef _WIN32
+typedef CRITICAL_SECTION   async_mutex_t;
+typedef CONDITION_VARIABLE async_condition_t;
+typedef HANDLE             async_thread_t;
+
+#define mutex_init(m)         InitializeCriticalSection(m)
+#define mutex_destroy(m)      DeleteCriticalSection(m)
+#define mutex_lock(m)         EnterCriticalSection(m)
+#define mutex_unlock(m)       LeaveCriticalSection(m)
+#define condition_init(c)     InitializeConditionVariable(c)
+#define condition_destroy(c)
+#define condition_wait(c,m)   SleepConditionVariableCS((c),(m),INFINITE)
+#define condition_signal(c)   WakeConditionVariable(c)
+#define condition_broadcast(c) WakeAllConditionVariable(c)
+#else
+typedef pthread_mutex_t    async_mutex_t;
+typedef pthread_cond_t     async_condition_t;
+typedef pthread_t          async_thread_t;
+
+#define mutex_init(m)         pthread_mutex_init((m),NULL)
+#define mutex_destroy(m)      pthread_mutex_destroy(m)
+#define mutex_lock(m)         pthread_mutex_lock(m)
+#define mutex_unlock(m)       pthread_mutex_unlock(m)
+#define condition_init(c)     pthread_cond_init((c),NULL)
+#define condition_destroy(c)  pthread_cond_destroy(c)
+#define condition_wait(c,m)   pthread_cond_wait((c),(m))
+#define condition_signal(c)   pthread_cond_signal(c)
+#define condition_broadcast(c) pthread_cond_broadcast(c)
+#endif
+
+/******************************************************************************/
+/* THE BACKGROUND THREAD                                                      */
+/******************************************************************************/
+
+/*
+ * One per filter, created by its first kalman_smooth_async. The queue, the
+ * done flags of the segments and the count of live segments are protected
+ * by the mutex.
+ */
+typedef struct kalman_async_st {
+	async_mutex_t     mutex;
+	async_condition_t queued;   // a segment was queued, or the thread must stop
+	async_condition_t finished; // a segment is done
+	async_thread_t    thread;
+
+	kalman_segment_t* head;     // the oldest queued segment
+	kalman_segment_t* tail;
+	int32_t           live;     // segments that have not been freed
+	int               busy;     // a segment is being smoothed
+	int               stopping;
+
+	// the estimate of the last step of the latest segment, created without a pool
+	kalman_step_index_t prior_step; // -1 if none
+	matrix_t*           prior_state;
+	matrix_t*           prior_covariance;
+	char                prior_covariance_type;
+} kalman_async_t;
+
+/*
+ * Smooths steps that follow the last segment, with an observation of its
+ * last state in front of them, or on their own if they do not follow it. The
+ * windowed driver, with a single window, smooths shallow copies renumbered
+ * from 0, splits the thread budget, and moves the estimates back.
+ */
+static void smooth_after_prior(kalman_async_t* async, kalman_options_t options,
+                               kalman_step_equations_t** equations, kalman_step_index_t length) {
+	kalman_step_index_t first = equations[0]->step;
+	if (async == NULL || async->prior_state == NULL || async->prior_step != first - 1) {
+		kalman_smooth_windowed(options, equations, length, length, 0);
+		return;
+	}
+
+	kalman_step_equations_t prior;
+	memset(&prior, 0, sizeof(kalman_step_equations_t));
+	prior.step      = first - 1;
+	prior.dimension = matrix_rows(async->prior_state);
+	prior.G         = matrix_create_identity(prior.dimension, prior.dimension);
+	prior.o         = async->prior_state;
+	prior.C         = async->prior_covariance;
+	prior.C_type    = async->prior_covariance_type;
+	prior.borrowed  = 1;
+
+	kalman_step_equations_t** chained = (kalman_step_equations_t**) malloc((length + 1) * sizeof(kalman_step_equations_t*));
+	assert(chained != NULL);
+	chained[0] = &prior;
+	for (kalman_step_index_t j = 0; j < length; j++) chained[j+1] = equations[j];
+
+	kalman_smooth_windowed(options, chained, length + 1, length + 1, 0);
+
+	matrix_free(prior.state);
+	matrix_free(prior.covariance);
+	matrix_free(prior.G);
+	free(chained);
+}
+
+/*
+ * The covariance of the last step is computed even if the filter does not
+ * keep covariances (and only that one, with KALMAN_NO_COVARIANCE), since the
+ * next segment needs it.
+ */
+static void smooth_segment(kalman_async_t* async, kalman_segment_t* segment) {
+	double begin = kalman_phase_begin();
+
+	kalman_options_t         options = segment->options;
+	kalman_step_equations_t* last    = (segment->equations)[segment->length - 1];
+	char                     wanted  = last->covariance_wanted;
+	if (options & KALMAN_NO_COVARIANCE) {
+		for (kalman_step_index_t j = 0; j < segment->length; j++) (segment->equations)[j]->covariance_wanted = 0;
+		options &= ~KALMAN_NO_COVARIANCE;
+		wanted   = 0;
+	}
+	last->covariance_wanted = 1;
+
+	smooth_after_prior(async, options, segment->equations, segment->length);
+
+	matrix_free(async->prior_state);
+	matrix_free(async->prior_covariance);
+	async->prior_step            = last->step;
+	async->prior_state           = matrix_create_copy(last->state);
+	async->prior_covariance      = matrix_create_copy(last->covariance);
+	async->prior_covariance_type = last->covariance_type;
+
+	last->covariance_wanted = wanted;
+	if (!wanted) {
+		matrix_free(last->covariance);
+		last->covariance = NULL;
+	}
+
+	kalman_phase_end("async-segment", -1, begin);
+}
+
+static void worker_loop(kalman_async_t* async) {
+	mutex_lock(&(async->mutex));
+	for (;;) {
+		while (async->head == NULL && !async->stopping) condition_wait(&(async->queued), &(async->mutex));
+		if (async->head == NULL) break; // stopping, and the queue is drained
+
+		kalman_segment_t* segment = async->head;
+		async->head = segment->next;
+		if (async->head == NULL) async->tail = NULL;
+		async->busy = 1;
+		mutex_unlock(&(async->mutex));
+
+		smooth_segment(async, segment);
+		if (segment->callback != NULL) (*(segment->callback))(segment, segment->arg);
+
+		mutex_lock(&(async->mutex));
+		segment->done = 1;
+		async->busy   = 0;
+		condition_broadcast(&(async->finished));
+	}
+	mutex_unlock(&(async->mutex));
+}
+
+#ifdef _WIN32
+static DWORD WINAPI worker(LPVOID async_v) {
+	worker_loop((kalman_async_t*) async_v);
+	return 0;
+}
+#else
+static void* worker(void* async_v) {
+	worker_loop((kalman_async_t*) async_v);
+	return NULL;
+}
+#endif
+
+static kalman_async_t* async_start() {
+	kalman_async_t* async = (kalman_async_t*) malloc(sizeof(kalman_async_t));
+	assert(async != NULL);
+
+	mutex_init(&(async->mutex));
+	condition_init(&(async->queued));
+	condition_init(&(async->finished));
+	async->head     = NULL;
+	async->tail     = NULL;
+	async->live     = 0;
+	async->busy     = 0;
+	async->stopping = 0;
+
+	async->prior_step       = -1;
+	async->prior_state      = NULL;
+	async->prior_covariance = NULL;
+
+#ifdef _WIN32
+	async->thread = CreateThread(NULL, 0, worker, async, 0, NULL);
+	assert(async->thread != NULL);
+#else
+	int rc = pthread_create(&(async->thread), NULL, worker, async);
+	assert(rc == 0);
+#endif
+	return async;
+}
+
+/*
+ * Called by kalman_free: the thread smooths the segments that are still
+ * queued and exits. The caller must have freed all the segments, since
+ * their steps may use the filter's model.
+ */
+void kalman_async_stop(kalman_t* kalman) {
+	kalman_async_t* async = kalman->async;
+	if (async == NULL) return;
+
+	mutex_lock(&(async->mutex));
+	async->stopping = 1;
+	condition_signal(&(async->queued));
+	mutex_unlock(&(async->mutex));
+
+#ifdef _WIN32
+	WaitForSingleObject(async->thread, INFINITE);
+	CloseHandle(async->thread);
+#else
+	pthread_join(async->thread, NULL);
+#endif
+
+	assert(async->live == 0);
+
+	matrix_free(async->prior_state);
+	matrix_free(async->prior_covariance);
+	condition_destroy(&(async->finished));
+	condition_destroy(&(async->queued));
+	mutex_destroy(&(async->mutex));
+	free(async);
+	kalman->async = NULL;
+}
+
+/*
+ * Called by kalman_smooth when the filter's first step is not step 0: waits
+ * for the queued segments and smooths the steps from the last one's estimate,
+ * without keeping the estimate of their last step (the next segment starts
+ * where the last one ended, not after these steps).
+ */
+void kalman_async_smooth(kalman_t* kalman, kalman_step_equations_t** equations, kalman_step_index_t length) {
+	kalman_async_t* async = kalman->async;
+	if (async != NULL) {
+		mutex_lock(&(async->mutex));
+		while (async->head != NULL || async->busy) condition_wait(&(async->finished), &(async->mutex));
+		mutex_unlock(&(async->mutex));
+	}
+	smooth_after_prior(async, kalman->options, equations, length);
+}
+
+/******************************************************************************/
+/* PUBLIC INTERFACE                                                           */
+/******************************************************************************/
+
+kalman_segment_t* kalman_smooth_async(kalman_t* kalman, kalman_step_index_t last,
+                                      kalman_segment_callback_t callback, void* arg) {
+	if ((kalman->options & (KALMAN_ALGORITHM_ODDEVEN | KALMAN_ALGORITHM_ASSOCIATIVE)) == 0) return NULL;
+	if (farray_size(kalman->steps) == 0) return NULL;
+
+	// the latest step stays in the filter, as in kalman_forget
+	kalman_step_index_t first = farray_first_index(kalman->steps);
+	if (last < 0 || last > farray_last_index(kalman->steps) - 1) last = farray_last_index(kalman->steps) - 1;
+	if (last < first) return NULL;
+
+	kalman_segment_t* segment = (kalman_segment_t*) malloc(sizeof(kalman_segment_t));
+	assert(segment != NULL);
+	segment->first     = first;
+	segment->length    = last - first + 1;
+	segment->equations = (kalman_step_equations_t**) malloc(segment->length * sizeof(kalman_step_equations_t*));
+	assert(segment->equations != NULL);
+	segment->options   = kalman->options;
+	segment->callback  = callback;
+	segment->arg       = arg;
+	segment->done      = 0;
+	segment->next      = NULL;
+
+	for (kalman_step_index_t j = 0; j < segment->length; j++)
+		(segment->equations)[j] = (kalman_step_equations_t*) farray_drop_first(kalman->steps);
+
+	if (kalman->async == NULL) kalman->async = async_start();
+	kalman_async_t* async = kalman->async;
+	segment->async = async;
+
+	mutex_lock(&(async->mutex));
+	if (async->tail == NULL) async->head = segment;
+	else                     async->tail->next = segment;
+	async->tail = segment;
+	(async->live)++;
+	condition_signal(&(async->queued));
+	mutex_unlock(&(async->mutex));
+
+	return segment;
+}
+
+int kalman_segment_done(kalman_segment_t* segment) {
+	kalman_async_t* async = segment->async;
+	mutex_lock(&(async->mutex));
+	int done = segment->done;
+	mutex_unlock(&(async->mutex));
+	return done;
+}
+
+void kalman_segment_wait(kalman_segment_t* segment) {
+	kalman_async_t* async = segment->async;
+	mutex_lock(&(async->mutex));
+	while (!segment->done) condition_wait(&(async->finished), &(async->mutex));
+	mutex_unlock(&(async->mutex));
+}
+
+/*
+ * The steps were created with the filter's pool (if any) current, so they
+ * are freed the same way, on the calling thread.
+ */
+void kalman_segment_free(kalman_t* kalman, kalman_segment_t* segment) {
+	if (segment == NULL) return;
+	kalman_segment_wait(segment);
+
+	matrix_pool_t* saved = matrix_pool_set_current(kalman->pool);
+	for (kalman_step_index_t j = 0; j < segment->length; j++) (*(kalman->step_free))((segment->equations)[j]);
+	matrix_pool_set_current(saved);
+
+	kalman_async_t* async = segment->async;
+	mutex_lock(&(async->mutex));
+	(async->live)--;
+	mutex_unlock(&(async->mutex));
+
+	free(segment->equations);
+	free(segment);
+}
+
+/******************************************************************************/
+/* END OF FILE                                                                */
+/******************************************************************************/
@@ -51,6 +51,7 @@ static void mex_assert(int c, int line) {
 #define KALMAN_MATRIX_SHORT_TYPE
 #include "kalman.h"
 #include "memory.h"
+#include "instrument.h"
 
 double kalman_nan = 0.0 / 0.0;
 
@@ -58,12 +59,12 @@ double kalman_nan = 0.0 / 0.0;
 /* COVARIANCE MATRICES                                                        */
 /******************************************************************************/
 
-matrix_t* kalman_covariance_matrix_weigh(matrix_t *cov, char cov_type, matrix_t *A) {
-  blas_int_t M, N, K, LDA, LDB, LDC, NRHS, INFO;
-  double ALPHA, BETA;
-
+void kalman_covariance_matrix_weigh_into(matrix_t *cov, char cov_type, matrix_t *A, matrix_t *WA) {
   assert(A != NULL);
+  assert(WA != NULL);
   assert(cov != NULL);
+  assert(matrix_rows(WA) == matrix_rows(A));
+  assert(matrix_cols(WA) == matrix_cols(A));
 
 #ifdef BUILD_DEBUG_PRINTOUTS
 	printf("cov(%c) ",cov_type);
@@ -72,83 +73,40 @@ matrix_t* kalman_covariance_matrix_weigh(matrix_t *cov, char cov_type, matrix_t
 	matrix_print(A,"%.3e");
 #endif
 
-  matrix_t *WA = NULL;
   matrix_t* L =  NULL;
 
-  int32_t i, j, rows, cols;
-
   switch (cov_type) {
     case 'W':
       //if (debug) printf("cov W %d %d %d %d\n",matrix_cols(cov),matrix_rows(cov),matrix_cols(A),matrix_rows(A));
 
       assert(matrix_cols(cov) == matrix_rows(A));
+      assert(WA != A);
 
-      WA = matrix_create_constant(matrix_rows(A), matrix_cols(A), 0.0);
-
-      M = matrix_rows(WA);
-      N = matrix_cols(WA);
-      K = matrix_cols(cov);
-      LDA = matrix_ld(cov);
-      LDB = matrix_ld(A);
-      LDC = matrix_ld(WA);
-      ALPHA = 1.0;
-      BETA = 0.0;
-#ifdef BUILD_BLAS_UNDERSCORE
-    dgemm_
-#else
-      dgemm
-#endif
-      ("n", "N", &M, &N, &K, &ALPHA, cov->elements, &LDA, A->elements, &LDB, &BETA, WA->elements, &LDC
-#ifdef BUILD_BLAS_STRLEN_END
-          ,1,1
-#endif
-          );
+      matrix_mutate_gemm(1.0, cov, A, 0.0, WA);
       break;
     case 'U': // cov and an upper triangular matrix that we need to solve with
     case 'F': // same representation; in Matlab, we started from explicit cov and factored
 
       //if (debug) printf("cov U %d %d %d %d\n",matrix_cols(cov),matrix_rows(cov),matrix_cols(A),matrix_rows(A));
 
-      // is this correct for 'F'?
-      WA = matrix_create_trisolve("L",cov, A);
-      /*
-       assert(matrix_cols(cov) == matrix_rows(A));
-
-       WA = matrix_create_copy(A);
-
-       N = matrix_cols(cov);
-       LDA = matrix_ld(cov);
-
-       NRHS = matrix_cols(WA);
-       LDB = matrix_ld(WA);
-
-       //if (debug) printf("dtrtrs N=%d NRHS=%d LDA=%d LDB=%d\n",N,NRHS,LDA,LDB);
-       //if (debug) printf("dtrtrs A %08x state %08x\n",step->Rdiag->elements, state->elements);
-
-       //if (debug) matrix_print(step->Rdiag,NULL);
-       //if (debug) matrix_print(kalman->current->state,NULL);
-
-       // upper triangular, no transpose, diagonal is general (not unit)
-       dtrtrs("U","N","N", &N, &NRHS, cov->elements, &LDA, WA->elements, &LDB, &INFO);
-       */
+      // 'F' is the lower Cholesky factor of an explicit covariance, as in Matlab
+      if (WA != A) matrix_mutate_copy(WA, A);
+      matrix_mutate_trisolve(cov_type == 'F' ? "L" : "U", cov, WA);
       break;
     case 'w':
       assert(matrix_rows(cov) == matrix_rows(A));
 
-      rows = matrix_rows(A);
-      cols = matrix_cols(A);
-
-      WA = matrix_create_constant(rows, cols, 0.0);
+      matrix_mutate_scale_rows(WA, cov, A);
+      break;
+    case 'I': // nothing to weigh
+      assert(matrix_rows(cov) == matrix_rows(A));
 
-      for (j = 0; j < cols; j++) {
-        for (i = 0; i < rows; i++) {
-          matrix_set(WA, i, j, matrix_get(cov, i, 0) * matrix_get(A, i, j));
-        }
-      }
+      if (WA != A) matrix_mutate_copy(WA, A);
       break;
     case 'C':
       L = matrix_create_chol(cov);
-      WA = matrix_create_trisolve("L",cov, A);
+      if (WA != A) matrix_mutate_copy(WA, A);
+      matrix_mutate_trisolve("L", L, WA);
       matrix_free(L);
       L = NULL;
 
@@ -156,28 +114,31 @@ matrix_t* kalman_covariance_matrix_weigh(matrix_t *cov, char cov_type, matrix_t
     default:
       printf("unknown covariance-matrix type %c\n", cov_type);
       assert(0);
-      WA = matrix_create_constant(matrix_rows(A), matrix_cols(A), kalman_nan);
+      matrix_mutate_scale(WA, kalman_nan);
       break;
   }
 
   //if (debug) printf("WA ");
   //if (debug) matrix_print(WA,"%.3e");
+}
+
+matrix_t* kalman_covariance_matrix_weigh(matrix_t *cov, char cov_type, matrix_t *A) {
+  assert(A != NULL);
 
+  matrix_t *WA = matrix_create(matrix_rows(A), matrix_cols(A));
+  kalman_covariance_matrix_weigh_into(cov, cov_type, A, WA);
   return WA;
 }
 
 // SUPPORT 'W','C' only
 matrix_t* kalman_covariance_matrix_explicit(matrix_t *cov, char type) {
   //fprintf(stderr,"cov type %c\n",type);
-  assert(type == 'w' || type == 'W' || type == 'C' || type == 'U' || type == 'F');
-  if (type == 'w') {
-    blas_int_t n = matrix_rows(cov);
+  assert(type == 'w' || type == 'I' || type == 'W' || type == 'C' || type == 'U' || type == 'F');
+  if (type == 'w' || type == 'I') {
+    int32_t n = matrix_rows(cov);
 
     matrix_t* C = matrix_create_constant(n, n, 0.0);
-
-    for (int j = 0; j < n; j++) {
-      matrix_set(C, j, j, pow(matrix_get(cov, j, 0),-2.0) );
-    }
+    kalman_covariance_matrix_add_explicit(C, cov, type);
     return C;
   }
   if (type == 'W') {
@@ -205,6 +166,179 @@ matrix_t* kalman_covariance_matrix_explicit(matrix_t *cov, char type) {
   return NULL;
 }
 
+static void add_to(matrix_t *A, matrix_t *B) {
+  int32_t i, j;
+
+  assert(matrix_rows(A) == matrix_rows(B));
+  assert(matrix_cols(A) == matrix_cols(B));
+
+  for (j = 0; j < matrix_cols(A); j++)
+    for (i = 0; i < matrix_rows(A); i++)
+      matrix_set(A, i, j, matrix_get(A, i, j) + matrix_get(B, i, j));
+}
+
+void kalman_covariance_matrix_add_explicit(matrix_t *A, matrix_t *cov, char type) {
+  int32_t n = matrix_rows(cov);
+  int32_t j;
+
+  assert(matrix_rows(A) == n);
+  assert(matrix_cols(A) == n);
+
+  if (type == 'w') {
+    for (j = 0; j < n; j++) {
+      double w = matrix_get(cov, j, 0);
+      matrix_set(A, j, j, matrix_get(A, j, j) + 1.0 / (w * w));
+    }
+    return;
+  }
+  if (type == 'I') {
+    for (j = 0; j < n; j++)
+      matrix_set(A, j, j, matrix_get(A, j, j) + 1.0);
+    return;
+  }
+
+  matrix_t *C = kalman_covariance_matrix_explicit(cov, type);
+  add_to(A, C);
+  matrix_free(C);
+}
+
+/******************************************************************************/
+/* TIME-INVARIANT MODELS                                                      */
+/******************************************************************************/
+
+static matrix_t* model_copy(matrix_t* A) {
+  return A == NULL ? NULL : matrix_create_copy(A);
+}
+
+/*
+ * Covariances of type 'C' are factored once; weighing with the factor (type
+ * 'F') is then a triangular solve, like the Matlab CovarianceMatrix class.
+ */
+static matrix_t* model_factor(matrix_t* cov, char cov_type, char* factor_type) {
+  if (cov == NULL) return NULL;
+  if (cov_type == 'C') {
+    matrix_t *L = matrix_create_chol(cov);
+    int32_t i, j;
+    for (j = 1; j < matrix_cols(L); j++)  // dpotrf leaves the upper triangle of cov in place
+      for (i = 0; i < j; i++)
+        matrix_set(L, i, j, 0.0);
+    *factor_type = 'F';
+    return L;
+  }
+  *factor_type = cov_type;
+  return matrix_create_copy(cov);
+}
+
+kalman_model_t* kalman_model_create(matrix_t *H, matrix_t *F, matrix_t *c, matrix_t *K, char K_type,
+                                    matrix_t *G,                           matrix_t *C, char C_type) {
+  kalman_model_t *model = malloc(sizeof(kalman_model_t));
+  assert(model != NULL);
+
+  model->H = model_copy(H);
+  model->F = model_copy(F);
+  model->c = model_copy(c);
+  model->K = model_copy(K);
+  model->K_type = K_type;
+  model->G = model_copy(G);
+  model->C = model_copy(C);
+  model->C_type = C_type;
+
+  model->K_factor = model_factor(K, K_type, &(model->K_factor_type));
+  model->C_factor = model_factor(C, C_type, &(model->C_factor_type));
+
+  model->VH = (K != NULL && H != NULL) ? kalman_covariance_matrix_weigh(model->K_factor, model->K_factor_type, H) : NULL;
+  model->VF = (K != NULL && F != NULL) ? kalman_covariance_matrix_weigh(model->K_factor, model->K_factor_type, F) : NULL;
+  model->Vc = (K != NULL && c != NULL) ? kalman_covariance_matrix_weigh(model->K_factor, model->K_factor_type, c) : NULL;
+  model->WG = (C != NULL && G != NULL) ? kalman_covariance_matrix_weigh(model->C_factor, model->C_factor_type, G) : NULL;
+
+  model->K_explicit = (K != NULL) ? kalman_covariance_matrix_explicit(K, K_type) : NULL;
+  model->C_explicit = (C != NULL) ? kalman_covariance_matrix_explicit(C, C_type) : NULL;
+
+  model->previous = NULL;
+
+  return model;
+}
+
+void kalman_model_free(kalman_model_t *model) {
+  while (model != NULL) {
+    kalman_model_t *previous = model->previous;
+
+    matrix_free(model->H);
+    matrix_free(model->F);
+    matrix_free(model->c);
+    matrix_free(model->K);
+    matrix_free(model->G);
+    matrix_free(model->C);
+    matrix_free(model->VH);
+    matrix_free(model->VF);
+    matrix_free(model->Vc);
+    matrix_free(model->WG);
+    matrix_free(model->K_factor);
+    matrix_free(model->C_factor);
+    matrix_free(model->K_explicit);
+    matrix_free(model->C_explicit);
+    free(model);
+
+    model = previous;
+  }
+}
+
+int kalman_model_contains(kalman_model_t *model, matrix_t *A) {
+  if (model == NULL || A == NULL) return 0;
+  return A == model->H || A == model->F || A == model->c || A == model->K
+      || A == model->G || A == model->C;
+}
+
+matrix_t* kalman_model_weigh(kalman_model_t *model, matrix_t *cov, char cov_type, matrix_t *A) {
+  if (model != NULL && cov != NULL) {
+    if (cov == model->K) {
+      if (A == model->H) return matrix_create_copy(model->VH);
+      if (A == model->F) return matrix_create_copy(model->VF);
+      if (A == model->c) return matrix_create_copy(model->Vc);
+      return kalman_covariance_matrix_weigh(model->K_factor, model->K_factor_type, A);
+    }
+    if (cov == model->C) {
+      if (A == model->G) return matrix_create_copy(model->WG);
+      return kalman_covariance_matrix_weigh(model->C_factor, model->C_factor_type, A);
+    }
+  }
+  return kalman_covariance_matrix_weigh(cov, cov_type, A);
+}
+
+void kalman_model_weigh_into(kalman_model_t *model, matrix_t *cov, char cov_type, matrix_t *A, matrix_t *WA) {
+  if (model != NULL && cov != NULL) {
+    if (cov == model->K) {
+      if      (A == model->H) matrix_mutate_copy(WA, model->VH);
+      else if (A == model->F) matrix_mutate_copy(WA, model->VF);
+      else if (A == model->c) matrix_mutate_copy(WA, model->Vc);
+      else kalman_covariance_matrix_weigh_into(model->K_factor, model->K_factor_type, A, WA);
+      return;
+    }
+    if (cov == model->C) {
+      if (A == model->G) matrix_mutate_copy(WA, model->WG);
+      else kalman_covariance_matrix_weigh_into(model->C_factor, model->C_factor_type, A, WA);
+      return;
+    }
+  }
+  kalman_covariance_matrix_weigh_into(cov, cov_type, A, WA);
+}
+
+void kalman_model_add_explicit(kalman_model_t *model, matrix_t *cov, char cov_type, matrix_t *A) {
+  if (model != NULL && cov != NULL && cov_type != 'w' && cov_type != 'I') {
+    if (cov == model->K) { add_to(A, model->K_explicit); return; }
+    if (cov == model->C) { add_to(A, model->C_explicit); return; }
+  }
+  kalman_covariance_matrix_add_explicit(A, cov, cov_type);
+}
+
+matrix_t* kalman_model_explicit(kalman_model_t *model, matrix_t *cov, char cov_type) {
+  if (model != NULL && cov != NULL) {
+    if (cov == model->K) return matrix_create_copy(model->K_explicit);
+    if (cov == model->C) return matrix_create_copy(model->C_explicit);
+  }
+  return kalman_covariance_matrix_explicit(cov, cov_type);
+}
+
 /******************************************************************************/
 /* KALMAN STEPS                                                               */
 /******************************************************************************/
@@ -219,6 +353,28 @@ void kalman_create_conventional(kalman_t*);
 void kalman_create_oddeven     (kalman_t*);
 void kalman_create_associative (kalman_t*);
 void kalman_create_explicit_representation(kalman_t*);
+void kalman_async_stop         (kalman_t*); // in kalman_async_smoother.c
+
+/*
+ * The per-thread matrix state (pool, small kernels) that a filter installs
+ * while one of its operations runs.
+ */
+typedef struct kalman_context_st {
+  matrix_pool_t *pool;
+  int small_kernels;
+} kalman_context_t;
+
+static kalman_context_t kalman_enter(kalman_t *kalman) {
+  kalman_context_t saved;
+  saved.pool          = matrix_pool_set_current(kalman->pool);
+  saved.small_kernels = matrix_small_kernels_set((kalman->options & KALMAN_SMALL_KERNELS) != 0);
+  return saved;
+}
+
+static void kalman_leave(kalman_context_t saved) {
+  matrix_pool_set_current(saved.pool);
+  matrix_small_kernels_set(saved.small_kernels);
+}
 
 kalman_t* kalman_create() {
   return kalman_create_options( KALMAN_ALGORITHM_ULTIMATE ); // default
@@ -249,6 +405,15 @@ kalman_t* kalman_create_options(kalman_options_t options) {
   kalman->steps = farray_create();
   kalman->current = NULL;
   kalman->options = options;
+  kalman->pool = (options & KALMAN_MATRIX_POOL) ? matrix_pool_create() : NULL;
+  kalman->model = NULL;
+  kalman->lag = -1;
+  kalman->async = NULL;
+  kalman->checkpoints = NULL;
+  kalman->append_steps = NULL;
+  kalman->covariance_materialize = NULL;
+  kalman->step_request_covariance = NULL;
+  kalman->step_snapshot = NULL;
 
   switch (options & (KALMAN_ALGORITHM_ULTIMATE | KALMAN_ALGORITHM_CONVENTIONAL | KALMAN_ALGORITHM_ODDEVEN | KALMAN_ALGORITHM_ASSOCIATIVE)) {
     case KALMAN_ALGORITHM_ULTIMATE:
@@ -277,11 +442,21 @@ kalman_t* kalman_create_options(kalman_options_t options) {
 void kalman_free(kalman_t *kalman) {
   //printf("waning: kalman_free not fully implemented yet (steps not processed)\n");
 
+  kalman_async_stop(kalman);
+
+  kalman_context_t context = kalman_enter(kalman);
+
   while (farray_size(kalman->steps) > 0) {
     void *i = farray_drop_last(kalman->steps);
     (*(kalman->step_free))(i);
   }
 
+  kalman_model_free(kalman->model);
+
+  kalman_leave(context);
+  // matrices returned by estimate/covariance may still be alive; the pool goes away with the last one
+  matrix_pool_release(kalman->pool);
+
   farray_free(kalman->steps);
   // step_free( kalman->current );
   free(kalman);
@@ -305,17 +480,96 @@ kalman_step_index_t kalman_latest(kalman_t *kalman) {
   return (*(kalman->step_get_index))(s);
 }
 
+/*
+ * Operations that create or free step storage make the filter's pool (if any)
+ * current while they run. Smoothing does not, because the parallel smoothers
+ * allocate from many threads and a pool is not thread safe. For the same
+ * reason, smoothing uses the small kernels only in the sequential smoothers;
+ * otherwise the calling thread would use them and the worker threads not.
+ */
+
 void kalman_evolve(kalman_t *kalman, int32_t n_i, matrix_t *H_i, matrix_t *F_i, matrix_t *c_i, matrix_t *K_i,
     char K_type) {
+  kalman_context_t context = kalman_enter(kalman);
   (*(kalman->evolve))(kalman, n_i, H_i, F_i, c_i, K_i, K_type);
+  kalman_leave(context);
 }
 
 void kalman_observe(kalman_t *kalman, matrix_t *G_i, matrix_t *o_i, matrix_t *C_i, char C_type) {
+  kalman_context_t context = kalman_enter(kalman);
   (*(kalman->observe))(kalman, G_i, o_i, C_i, C_type);
+  kalman_leave(context);
+}
+
+/*
+ * Like smoothing, parallel appends run without the filter's pool, which is
+ * not thread safe; the steps they create come from the heap.
+ */
+void kalman_append_steps(kalman_t *kalman, kalman_step_index_t count, int32_t n_i,
+    matrix_t **H, matrix_t **F, matrix_t **c, matrix_t **K, char K_type,
+    matrix_t **G, matrix_t **o, matrix_t **C, char C_type) {
+  if (kalman->append_steps != NULL) {
+    (*(kalman->append_steps))(kalman, count, n_i, H, F, c, K, K_type, G, o, C, C_type);
+    return;
+  }
+
+  for (kalman_step_index_t j = 0; j < count; j++) {
+    kalman_evolve(kalman, n_i, H ? H[j] : NULL, F ? F[j] : NULL, c ? c[j] : NULL, K ? K[j] : NULL, K_type);
+    if (o != NULL && o[j] != NULL) kalman_observe(kalman, G[j], o[j], C[j], C_type);
+    else                           kalman_observe(kalman, NULL, NULL, NULL, 'x');
+  }
+}
+
+/*
+ * A replaced model is kept (and freed with the filter) because the steps
+ * that used it may still refer to its matrices.
+ */
+void kalman_set_model(kalman_t *kalman, matrix_t *H, matrix_t *F, matrix_t *c, matrix_t *K, char K_type,
+    matrix_t *G, matrix_t *C, char C_type) {
+  kalman_context_t context = kalman_enter(kalman);
+  kalman_model_t *model = kalman_model_create(H, F, c, K, K_type, G, C, C_type);
+  model->previous = kalman->model;
+  kalman->model = model;
+  kalman_leave(context);
+}
+
+void kalman_evolve_model(kalman_t *kalman) {
+  kalman_model_t *model = kalman->model;
+  assert(model != NULL);
+  assert(model->H != NULL && model->F != NULL && model->c != NULL && model->K != NULL);
+  kalman_evolve(kalman, matrix_cols(model->H), model->H, model->F, model->c, model->K, model->K_type);
+}
+
+void kalman_observe_model(kalman_t *kalman, matrix_t *o_i) {
+  kalman_model_t *model = kalman->model;
+  assert(model != NULL);
+  if (o_i == NULL) {
+    kalman_observe(kalman, NULL, NULL, NULL, 'x');
+    return;
+  }
+  assert(model->G != NULL && model->C != NULL);
+  kalman_observe(kalman, model->G, o_i, model->C, model->C_type);
+}
+
+/*
+ * The parallel smoothers process the entire sequence at once, and the
+ * conventional smoother is not incremental either, so only the ultimate
+ * algorithm supports a fixed lag.
+ */
+int kalman_set_fixed_lag(kalman_t *kalman, kalman_step_index_t lag) {
+  if (lag >= 0 && !(kalman->options & KALMAN_ALGORITHM_ULTIMATE))
+    return 0;
+  kalman->lag = lag < 0 ? -1 : lag;
+  return 1;
 }
 
 void kalman_smooth(kalman_t *kalman) {
+  int sequential = (kalman->options & (KALMAN_ALGORITHM_ULTIMATE | KALMAN_ALGORITHM_CONVENTIONAL)) != 0;
+  int small_kernels = matrix_small_kernels_set(sequential && (kalman->options & KALMAN_SMALL_KERNELS));
+  INSTRUMENT_TRACE_BEGIN(trace);
   (*(kalman->smooth))(kalman);
+  INSTRUMENT_TRACE_END("kalman_smooth", trace);
+  matrix_small_kernels_set(small_kernels);
 }
 
 matrix_t* kalman_estimate(kalman_t *kalman, kalman_step_index_t si) {
@@ -331,12 +585,18 @@ matrix_t* kalman_estimate(kalman_t *kalman, kalman_step_index_t si) {
   void *step = farray_get(kalman->steps, si);
   matrix_t *state = (*(kalman->step_get_state))(step);
 
+  kalman_context_t context = kalman_enter(kalman);
+  matrix_t *estimate;
+
   if (state == NULL) {
     int32_t dim = (*(kalman->step_get_dimension))(step);
-    return matrix_create_constant(dim, 1, kalman_nan);
+    estimate = matrix_create_constant(dim, 1, kalman_nan);
+  } else {
+    estimate = matrix_create_copy(state);
   }
 
-  return matrix_create_copy(state);
+  kalman_leave(context);
+  return estimate;
 }
 
 void kalman_forget(kalman_t *kalman, kalman_step_index_t si) {
@@ -359,6 +619,7 @@ void kalman_forget(kalman_t *kalman, kalman_step_index_t si) {
   if (si < farray_first_index(kalman->steps))
     return; // nothing to delete
 
+  kalman_context_t context = kalman_enter(kalman);
   while (farray_first_index(kalman->steps) <= si) {
     void *step = farray_drop_first(kalman->steps);
     (*(kalman->step_free))(step);
@@ -366,11 +627,22 @@ void kalman_forget(kalman_t *kalman, kalman_step_index_t si) {
 		printf("forget new first %d\n",(int) farray_first_index(kalman->steps)
 #endif
   }
+  kalman_leave(context);
 #ifdef BUILD_DEBUG_PRINTOUTS
 	printf("forget %d done\n",(int) si);
 #endif
 }
 
+/*
+ * Checkpoints of steps after si depend on step si, which is about to change.
+ */
+static void empty_checkpoints_after(kalman_t *kalman, kalman_step_index_t si) {
+  kalman_checkpoint_t *cp;
+  for (cp = kalman->checkpoints; cp != NULL; cp = cp->next)
+    if (cp->step > si)
+      cp->step = -1;
+}
+
 void kalman_rollback(kalman_t *kalman, kalman_step_index_t si) {
   //printf("rollback %d\n",si);
   if (farray_size(kalman->steps) == 0)
@@ -384,6 +656,8 @@ void kalman_rollback(kalman_t *kalman, kalman_step_index_t si) {
   //step_t* step;
   void *step;
   kalman_step_index_t sj;
+  empty_checkpoints_after(kalman, si);
+  kalman_context_t context = kalman_enter(kalman);
   do {
     step = farray_drop_last(kalman->steps);
     sj = (*(kalman->step_get_index))(step);
@@ -408,11 +682,108 @@ void kalman_rollback(kalman_t *kalman, kalman_step_index_t si) {
       (*(kalman->step_free))(step);
     }
   } while (sj > si);
+  kalman_leave(context);
 
   //printf("rollback to %d new latest %d\n",si,kalman_latest(kalman));
 
 }
 
+kalman_checkpoint_t* kalman_checkpoint_create(kalman_t *kalman) {
+  kalman_checkpoint_t *cp = malloc(sizeof(kalman_checkpoint_t));
+  assert(cp != NULL);
+  cp->step = -1;
+  cp->snapshot = NULL;
+  cp->next = kalman->checkpoints;
+  kalman->checkpoints = cp;
+  if (kalman->step_snapshot != NULL) {
+    kalman_context_t context = kalman_enter(kalman);
+    cp->snapshot = (*(kalman->step_create))();
+    kalman_leave(context);
+  }
+  return cp;
+}
+
+void kalman_checkpoint_free(kalman_t *kalman, kalman_checkpoint_t *cp) {
+  if (cp == NULL)
+    return;
+  kalman_checkpoint_t **link = &(kalman->checkpoints);
+  while (*link != NULL && *link != cp)
+    link = &((*link)->next);
+  if (*link == cp)
+    *link = cp->next;
+  if (cp->snapshot != NULL) {
+    kalman_context_t context = kalman_enter(kalman);
+    (*(kalman->step_free))(cp->snapshot);
+    kalman_leave(context);
+  }
+  free(cp);
+}
+
+int kalman_checkpoint(kalman_t *kalman, kalman_checkpoint_t *cp) {
+  if (cp->snapshot == NULL || farray_size(kalman->steps) == 0)
+    return 0;
+
+  void *step = farray_get_last(kalman->steps);
+  if (kalman->current != NULL && kalman->current != step)
+    return 0; // the latest step has not been observed yet
+
+  kalman_context_t context = kalman_enter(kalman);
+  (*(kalman->step_snapshot))(cp->snapshot, step);
+  kalman_leave(context);
+
+  cp->step = (*(kalman->step_get_index))(step);
+  return 1;
+}
+
+int kalman_restore(kalman_t *kalman, kalman_checkpoint_t *cp) {
+  if (cp->snapshot == NULL || cp->step < 0)
+    return 0;
+
+  kalman_step_index_t si = cp->step;
+  farray_index_t size = farray_size(kalman->steps);
+  if (size > 0 && farray_last_index(kalman->steps) < si - 1)
+    return 0; // rolled back past the step
+
+  empty_checkpoints_after(kalman, si);
+
+  kalman_context_t context = kalman_enter(kalman);
+
+  // a step that was evolved but not observed is not in the array
+  if (kalman->current != NULL && (size == 0 || kalman->current != farray_get_last(kalman->steps)))
+    (*(kalman->step_free))(kalman->current);
+
+  while (farray_size(kalman->steps) > 0 && farray_last_index(kalman->steps) > si) {
+    void *step = farray_drop_last(kalman->steps);
+    (*(kalman->step_free))(step);
+  }
+
+  void *step;
+  if (farray_size(kalman->steps) > 0 && farray_last_index(kalman->steps) == si) {
+    step = farray_get_last(kalman->steps);
+  } else {
+    if (farray_size(kalman->steps) == 0)
+      farray_set_first(kalman->steps, si);
+    step = (*(kalman->step_create))();
+    farray_append(kalman->steps, step);
+  }
+  (*(kalman->step_snapshot))(step, cp->snapshot);
+  kalman->current = step;
+
+  kalman_leave(context);
+  return 1;
+}
+
+void kalman_request_covariances(kalman_t *kalman, kalman_step_index_t first, kalman_step_index_t last) {
+  if (kalman->step_request_covariance == NULL || farray_size(kalman->steps) == 0)
+    return;
+
+  if (first < farray_first_index(kalman->steps)) first = farray_first_index(kalman->steps);
+  if (last  < 0 || last > farray_last_index(kalman->steps)) last = farray_last_index(kalman->steps);
+
+  for (kalman_step_index_t si = first; si <= last; si++)
+    (*(kalman->step_request_covariance))(farray_get(kalman->steps, si));
+}
+
 char kalman_covariance_type(kalman_t *kalman, kalman_step_index_t si) {
   //return (*(kalman->step_get_covariance_type))(); // currently the same for all steps
 
@@ -440,6 +811,10 @@ matrix_t* kalman_covariance(kalman_t *kalman, kalman_step_index_t si) {
   void *step = farray_get(kalman->steps, si);
 
   matrix_t *cov = NULL;
+  kalman_context_t context = kalman_enter(kalman);
+
+  if ((*(kalman->step_get_covariance))(step) == NULL && kalman->covariance_materialize != NULL)
+    (*(kalman->covariance_materialize))(kalman, si);
 
   if ((*(kalman->step_get_covariance))(step) != NULL) {
     cov = matrix_create_copy((*(kalman->step_get_covariance))(step));
@@ -448,9 +823,154 @@ matrix_t* kalman_covariance(kalman_t *kalman, kalman_step_index_t si) {
     cov = matrix_create_constant(n_i, n_i, kalman_nan);
   }
 
+  kalman_leave(context);
   return cov;
 }
 
+/*
+ * The step whose covariance is read, with a lazy covariance computed first.
+ */
+static void* covariance_step(kalman_t *kalman, kalman_step_index_t si) {
+  if (si < 0)
+    si = farray_last_index(kalman->steps);
+  void *step = farray_get(kalman->steps, si);
+
+  if ((*(kalman->step_get_covariance))(step) == NULL && kalman->covariance_materialize != NULL)
+    (*(kalman->covariance_materialize))(kalman, si);
+
+  return step;
+}
+
+matrix_t* kalman_covariance_factor(kalman_t *kalman, kalman_step_index_t si, char *type) {
+  if (farray_size(kalman->steps) == 0)
+    return NULL;
+
+  kalman_context_t context = kalman_enter(kalman);
+  void *step = covariance_step(kalman, si);
+  matrix_t *cov = (*(kalman->step_get_covariance))(step);
+  matrix_t *factor = NULL;
+
+  *type = (*(kalman->step_get_covariance_type))(step);
+
+  if (cov == NULL) {
+    int32_t n_i = (*(kalman->step_get_dimension))(step);
+    factor = matrix_create_constant(n_i, n_i, kalman_nan);
+  } else if (*type == 'C') {
+    factor = matrix_create_chol(cov);
+    int32_t n_i = matrix_rows(factor);
+    for (int32_t j = 1; j < n_i; j++)
+      for (int32_t i = 0; i < j; i++)
+        matrix_set(factor, i, j, 0.0); // dpotrf leaves the upper triangle alone
+    *type = 'F';
+  } else {
+    factor = matrix_create_copy(cov);
+  }
+
+  kalman_leave(context);
+  return factor;
+}
+
+// element j of a row or column vector
+static void vector_set(matrix_t *v, int32_t j, double x) {
+  if (matrix_cols(v) == 1) matrix_set(v, j, 0, x);
+  else                     matrix_set(v, 0, j, x);
+}
+
+/*
+ * weigh(cov, x - estimate) is the whitened deviation of every point, so the
+ * squared norms of its columns are the squared Mahalanobis distances, with
+ * a single triangular multiply or solve for the whole batch.
+ */
+void kalman_mahalanobis(kalman_t *kalman, kalman_step_index_t si, matrix_t *points, matrix_t *distances) {
+  assert(farray_size(kalman->steps) > 0);
+
+  kalman_context_t context = kalman_enter(kalman);
+  void *step = covariance_step(kalman, si);
+  matrix_t *cov   = (*(kalman->step_get_covariance))(step);
+  matrix_t *state = (*(kalman->step_get_state))(step);
+  char      type  = (*(kalman->step_get_covariance_type))(step);
+
+  int32_t n = matrix_rows(points);
+  int32_t m = matrix_cols(points);
+  int32_t i, j;
+
+  assert(matrix_rows(distances) * matrix_cols(distances) == m);
+
+  if (cov == NULL || state == NULL) {
+    for (j = 0; j < m; j++) vector_set(distances, j, kalman_nan);
+    kalman_leave(context);
+    return;
+  }
+
+  assert(matrix_rows(state) == n);
+
+  matrix_t *D = matrix_create_copy(points);
+  for (j = 0; j < m; j++)
+    for (i = 0; i < n; i++)
+      matrix_set(D, i, j, matrix_get(D, i, j) - matrix_get(state, i, 0));
+
+  matrix_t *WD = kalman_covariance_matrix_weigh(cov, type, D);
+
+  for (j = 0; j < m; j++) {
+    double d = 0.0;
+    for (i = 0; i < matrix_rows(WD); i++) d += matrix_get(WD, i, j) * matrix_get(WD, i, j);
+    vector_set(distances, j, d);
+  }
+
+  matrix_free(WD);
+  matrix_free(D);
+  kalman_leave(context);
+}
+
+int32_t kalman_gate(kalman_t *kalman, kalman_step_index_t si, matrix_t *points, double threshold, int32_t *inside) {
+  int32_t m = matrix_cols(points);
+  int32_t count = 0;
+
+  matrix_t *distances = matrix_create(m, 1);
+  kalman_mahalanobis(kalman, si, points, distances);
+
+  for (int32_t j = 0; j < m; j++) {
+    int32_t in = matrix_get(distances, j, 0) <= threshold; // false for NaN
+    if (inside != NULL) inside[j] = in;
+    count += in;
+  }
+
+  matrix_free(distances);
+  return count;
+}
+
+/******************************************************************************/
+/* PHASE TIMINGS                                                              */
+/******************************************************************************/
+
+static kalman_phase_callback_t phase_callback = NULL;
+
+void kalman_set_phase_callback(kalman_phase_callback_t callback) {
+  phase_callback = callback;
+}
+
+double kalman_phase_begin() {
+#ifndef BUILD_INSTRUMENT
+  if (phase_callback == NULL) return 0.0;
+#endif
+  return instrument_seconds();
+}
+
+void kalman_phase_end(const char *phase, int32_t level, double begin) {
+#ifndef BUILD_INSTRUMENT
+  if (phase_callback == NULL) return;
+#endif
+  double now = instrument_seconds();
+#ifdef BUILD_INSTRUMENT
+  instrument_trace(phase, level, begin, now);
+#endif
+  if (phase_callback != NULL) (*phase_callback)(phase, level, now - begin);
+}
+
+/******************************************************************************/
+/* PERFORMANCE TESTING                                                        */
+/******************************************************************************/
+
 static struct timeval begin, end;
 
 matrix_t* kalman_perftest(kalman_t *kalman, matrix_t *H, matrix_t *F, matrix_t *c, matrix_t *K, char K_type,
@@ -0,0 +1,439 @@
+/*
+ * kalman_batch.c
+ *
+ * Batches of independent Kalman filters with the same dimensions, advanced
+ * together. Each step uses the QR-based algorithm of kalman_ultimate.c
+ * (filtering only, no smoothing), but the data is laid out as a structure of
+ * arrays: element e of all the filters is contiguous in memory, and every
+ * operation loops over filters in its innermost loop, so the compiler can
+ * vectorize across filters. Blocks of filters are processed in parallel using
+ * foreach_in_range.
+ *
+ * (C) Sivan Toledo, 2022-2025
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+
+#ifdef _WIN32
+// for "unused" attribute
+#define __attribute__(x)
+#include <float.h>
+// string.h for memcpy
+#else
+#include <unistd.h>
+#endif
+
+#ifdef BUILD_MEX
+#include "mex.h"
+
+static char assert_msg[128];
+static void mex_assert(int c, int line) {
+    if (!c) {
+        sprintf(assert_msg,"Assert failed in %s line %d",__FILE__,line);
+        mexErrMsgIdAndTxt("MyToolbox:arrayProduct:assertion",assert_msg);
+    }
+}
+
+#define assert(c) mex_assert((c),__LINE__)
+#else
+#include <assert.h>
+#endif
+
+#define KALMAN_MATRIX_SHORT_TYPE
+#include "kalman.h"
+#include "parallel.h"
+#include "memory.h"
+
+/******************************************************************************/
+/* UTILITIES                                                                  */
+/******************************************************************************/
+
+#define MIN(a,b) ((a)<(b) ? (a) : (b))
+
+// filters processed together in the vectorized loops
+#define BATCH_LANES 32
+
+/*
+ * Scratch matrices hold BATCH_LANES filters; element (i,j) of an mr-row
+ * scratch matrix starts at X + (j*mr + i)*BATCH_LANES.
+ */
+#define SCRATCH(X,mr,i,j) ((X) + ((j)*(mr) + (i))*BATCH_LANES)
+
+/*
+ * Pointer to element e of filter f in a stacked matrix, and the stride
+ * between consecutive filters (0 if the matrix is shared by all filters).
+ */
+static matrix_element_t* stacked(matrix_t* M, int32_t f, int32_t e, int32_t* stride) {
+	*stride = (matrix_rows(M) == 1 ? 0 : 1);
+	return M->elements + ((size_t) e)*matrix_ld(M) + (*stride)*f;
+}
+
+static void check_stacked(kalman_batch_t* batch, matrix_t* M, int32_t elements) {
+	assert(M != NULL);
+	assert(matrix_rows(M) == 1 || matrix_rows(M) == batch->count);
+	assert(matrix_cols(M) == elements);
+}
+
+/*
+ * Stores sign * W * A into the scratch matrix X, starting at (row0,col0),
+ * for the L filters starting at f0. A is rows-by-cols; W is rows-by-rows for
+ * type 'W' and a vector of length rows for type 'w'.
+ */
+static void weigh(matrix_element_t* X, int32_t mr, int32_t row0, int32_t col0,
+                  matrix_t* W, char W_type, matrix_t* A, int32_t rows, int32_t cols,
+                  matrix_element_t sign, int32_t f0, int32_t L) {
+	int32_t i, j, k, l;
+	int32_t ws, as;
+
+	for (j=0; j<cols; j++) {
+		for (i=0; i<rows; i++) {
+			matrix_element_t* x = SCRATCH(X,mr,row0+i,col0+j);
+			if (W_type == 'W') {
+				for (l=0; l<L; l++) x[l] = 0.0;
+				for (k=0; k<rows; k++) {
+					matrix_element_t* w = stacked(W, f0, k*rows + i, &ws);
+					matrix_element_t* a = stacked(A, f0, j*rows + k, &as);
+					for (l=0; l<L; l++) x[l] += sign * w[l*ws] * a[l*as];
+				}
+			} else { // 'w'
+				matrix_element_t* w = stacked(W, f0, i,          &ws);
+				matrix_element_t* a = stacked(A, f0, j*rows + i, &as);
+				for (l=0; l<L; l++) x[l] = sign * w[l*ws] * a[l*as];
+			}
+		}
+	}
+}
+
+/*
+ * Householder QR of the first k columns of the mr-by-nc scratch matrix X,
+ * applying the reflectors to the remaining columns, for L filters at once.
+ * The reflectors are computed as in LAPACK's dlarfg, so the signs of R agree
+ * with those that kalman_ultimate.c produces.
+ */
+static void householder(matrix_element_t* X, int32_t mr, int32_t nc, int32_t k, int32_t L) {
+	int32_t i, j, c, l;
+	matrix_element_t norm2[BATCH_LANES];
+	matrix_element_t tau  [BATCH_LANES];
+	matrix_element_t scale[BATCH_LANES];
+	matrix_element_t w    [BATCH_LANES];
+
+	for (j=0; j<k && j<mr; j++) {
+		matrix_element_t* diag = SCRATCH(X,mr,j,j);
+
+		for (l=0; l<L; l++) norm2[l] = 0.0;
+		for (i=j+1; i<mr; i++) {
+			matrix_element_t* x = SCRATCH(X,mr,i,j);
+			for (l=0; l<L; l++) norm2[l] += x[l]*x[l];
+		}
+
+		for (l=0; l<L; l++) {
+			matrix_element_t alpha = diag[l];
+			matrix_element_t beta  = -copysign(sqrt(alpha*alpha + norm2[l]), alpha);
+			int    zero  = (norm2[l] == 0.0); // H = I
+			tau  [l] = zero ? 0.0 : (beta - alpha) / beta;
+			scale[l] = zero ? 0.0 : 1.0 / (alpha - beta);
+			diag [l] = zero ? alpha : beta;
+		}
+
+		for (i=j+1; i<mr; i++) {
+			matrix_element_t* x = SCRATCH(X,mr,i,j);
+			for (l=0; l<L; l++) x[l] *= scale[l];
+		}
+
+		for (c=j+1; c<nc; c++) {
+			matrix_element_t* top = SCRATCH(X,mr,j,c);
+			for (l=0; l<L; l++) w[l] = top[l];
+			for (i=j+1; i<mr; i++) {
+				matrix_element_t* v = SCRATCH(X,mr,i,j);
+				matrix_element_t* x = SCRATCH(X,mr,i,c);
+				for (l=0; l<L; l++) w[l] += v[l]*x[l];
+			}
+			for (l=0; l<L; l++) {
+				w[l] *= tau[l];
+				top[l] -= w[l];
+			}
+			for (i=j+1; i<mr; i++) {
+				matrix_element_t* v = SCRATCH(X,mr,i,j);
+				matrix_element_t* x = SCRATCH(X,mr,i,c);
+				for (l=0; l<L; l++) x[l] -= w[l]*v[l];
+			}
+		}
+	}
+}
+
+/******************************************************************************/
+/* PARALLEL STEPS                                                             */
+/******************************************************************************/
+
+typedef struct batch_call_st {
+	kalman_batch_t* batch;
+	matrix_t*       H;
+	matrix_t*       F;
+	matrix_t*       c;
+	matrix_t*       G;
+	matrix_t*       o;
+	matrix_t*       W; // K or C
+	char            W_type;
+	int32_t         m; // number of observations
+} batch_call_t;
+
+/*
+ * [ R  0  y ]  QR on the first n columns  [ * * * ]
+ * [-VF VH Vc]  ------------------------>  [ 0 Rbar ybar ]
+ */
+static void evolve_chunks(void* call_v, parallel_index_t length, parallel_index_t start, parallel_index_t end) {
+	(void) length;
+	batch_call_t*   call  = (batch_call_t*) call_v;
+	kalman_batch_t* batch = call->batch;
+
+	int32_t n  = batch->dimension;
+	int32_t r  = batch->rows;
+	int32_t mr = r + n;
+	int32_t nc = 2*n + 1;
+	int32_t i, j, l;
+
+	matrix_element_t* X = malloc(((size_t) mr)*nc*BATCH_LANES*sizeof(matrix_element_t));
+	assert(X != NULL);
+
+	for (parallel_index_t chunk = start; chunk < end; chunk++) {
+		int32_t f0 = (int32_t) chunk * BATCH_LANES;
+		int32_t L  = MIN(BATCH_LANES, batch->count - f0);
+
+		for (j=0; j<n; j++) {
+			for (i=0; i<r; i++) {
+				matrix_element_t* x = SCRATCH(X,mr,i,j);
+				matrix_element_t* z = SCRATCH(X,mr,i,n+j);
+				matrix_element_t* R = batch->R->elements + ((size_t) j*n + i)*batch->count + f0;
+				for (l=0; l<L; l++) {
+					x[l] = R[l];
+					z[l] = 0.0;
+				}
+			}
+		}
+		for (i=0; i<r; i++) {
+			matrix_element_t* x = SCRATCH(X,mr,i,2*n);
+			matrix_element_t* y = batch->y->elements + ((size_t) i)*batch->count + f0;
+			for (l=0; l<L; l++) x[l] = y[l];
+		}
+
+		weigh(X, mr, r, 0,   call->W, call->W_type, call->F, n, n, -1.0, f0, L);
+		weigh(X, mr, r, n,   call->W, call->W_type, call->H, n, n,  1.0, f0, L);
+		weigh(X, mr, r, 2*n, call->W, call->W_type, call->c, n, 1,  1.0, f0, L);
+
+		householder(X, mr, nc, n, L);
+
+		for (j=0; j<n; j++) {
+			for (i=0; i<r; i++) {
+				matrix_element_t* x = SCRATCH(X,mr,n+i,n+j);
+				matrix_element_t* R = batch->R->elements + ((size_t) j*n + i)*batch->count + f0;
+				for (l=0; l<L; l++) R[l] = x[l];
+			}
+		}
+		for (i=0; i<r; i++) {
+			matrix_element_t* x = SCRATCH(X,mr,n+i,2*n);
+			matrix_element_t* y = batch->y->elements + ((size_t) i)*batch->count + f0;
+			for (l=0; l<L; l++) y[l] = x[l];
+		}
+	}
+
+	free(X);
+}
+
+/*
+ * [ Rbar ybar ]  QR (if tall enough)  [ R y ]
+ * [ WG   Wo   ]  ----------------->   [ 0 * ]
+ */
+static void observe_chunks(void* call_v, parallel_index_t length, parallel_index_t start, parallel_index_t end) {
+	(void) length;
+	batch_call_t*   call  = (batch_call_t*) call_v;
+	kalman_batch_t* batch = call->batch;
+
+	int32_t n  = batch->dimension;
+	int32_t r  = batch->rows;
+	int32_t m  = call->m;
+	int32_t mr = r + m;
+	int32_t nc = n + 1;
+	int32_t i, j, l;
+
+	matrix_element_t* X = malloc(((size_t) mr)*nc*BATCH_LANES*sizeof(matrix_element_t));
+	assert(X != NULL);
+
+	for (parallel_index_t chunk = start; chunk < end; chunk++) {
+		int32_t f0 = (int32_t) chunk * BATCH_LANES;
+		int32_t L  = MIN(BATCH_LANES, batch->count - f0);
+
+		for (j=0; j<n; j++) {
+			for (i=0; i<r; i++) {
+				matrix_element_t* x = SCRATCH(X,mr,i,j);
+				matrix_element_t* R = batch->R->elements + ((size_t) j*n + i)*batch->count + f0;
+				for (l=0; l<L; l++) x[l] = R[l];
+			}
+		}
+		for (i=0; i<r; i++) {
+			matrix_element_t* x = SCRATCH(X,mr,i,n);
+			matrix_element_t* y = batch->y->elements + ((size_t) i)*batch->count + f0;
+			for (l=0; l<L; l++) x[l] = y[l];
+		}
+
+		if (m > 0) {
+			weigh(X, mr, r, 0, call->W, call->W_type, call->G, m, n, 1.0, f0, L);
+			weigh(X, mr, r, n, call->W, call->W_type, call->o, m, 1, 1.0, f0, L);
+		}
+
+		if (mr >= n) householder(X, mr, nc, n, L);
+		int32_t rows = MIN(mr, n); // the rest of the rows are residuals
+
+		for (j=0; j<n; j++) {
+			for (i=0; i<rows; i++) {
+				matrix_element_t* x = SCRATCH(X,mr,i,j);
+				matrix_element_t* R = batch->R->elements + ((size_t) j*n + i)*batch->count + f0;
+				if (mr >= n && i > j) for (l=0; l<L; l++) R[l] = 0.0;
+				else                  for (l=0; l<L; l++) R[l] = x[l];
+			}
+		}
+		for (i=0; i<rows; i++) {
+			matrix_element_t* x = SCRATCH(X,mr,i,n);
+			matrix_element_t* y = batch->y->elements + ((size_t) i)*batch->count + f0;
+			for (l=0; l<L; l++) y[l] = x[l];
+		}
+
+		// solve for the estimates, by back substitution
+		for (i=n-1; i>=0; i--) {
+			matrix_element_t* s = batch->state->elements + ((size_t) i)*batch->count + f0;
+			if (rows < n) {
+				for (l=0; l<L; l++) s[l] = kalman_nan;
+				continue;
+			}
+			matrix_element_t* y = batch->y->elements + ((size_t) i)*batch->count + f0;
+			for (l=0; l<L; l++) s[l] = y[l];
+			for (j=i+1; j<n; j++) {
+				matrix_element_t* R  = batch->R->elements     + ((size_t) j*n + i)*batch->count + f0;
+				matrix_element_t* sj = batch->state->elements + ((size_t) j)*batch->count + f0;
+				for (l=0; l<L; l++) s[l] -= R[l]*sj[l];
+			}
+			matrix_element_t* d = batch->R->elements + ((size_t) i*n + i)*batch->count + f0;
+			for (l=0; l<L; l++) s[l] /= d[l];
+		}
+	}
+
+	free(X);
+}
+
+static void batch_run(void (*chunks)(void*, parallel_index_t, parallel_index_t, parallel_index_t), batch_call_t* call) {
+	parallel_index_t number_of_chunks = (call->batch->count + BATCH_LANES - 1) / BATCH_LANES;
+	foreach_in_range(chunks, call, call->batch->dimension, number_of_chunks);
+}
+
+/******************************************************************************/
+/* BATCHES                                                                    */
+/******************************************************************************/
+
+kalman_batch_t* kalman_batch_create(int32_t count, int32_t dimension) {
+	assert(count > 0);
+	assert(dimension > 0);
+
+	kalman_batch_t* batch = malloc(sizeof(kalman_batch_t));
+	assert(batch != NULL);
+
+	batch->count     = count;
+	batch->dimension = dimension;
+	batch->step      = -1;
+	batch->rows      = 0;
+	batch->observed  = 0;
+
+	batch->R     = matrix_create_constant(count, dimension*dimension, 0.0);
+	batch->y     = matrix_create_constant(count, dimension,           0.0);
+	batch->state = matrix_create_constant(count, dimension,           kalman_nan);
+
+	return batch;
+}
+
+void kalman_batch_free(kalman_batch_t* batch) {
+	if (batch == NULL) return;
+	matrix_free(batch->R);
+	matrix_free(batch->y);
+	matrix_free(batch->state);
+	free(batch);
+}
+
+void kalman_batch_evolve(kalman_batch_t* batch, matrix_t* H, matrix_t* F, matrix_t* c, matrix_t* K, char K_type) {
+	assert(batch != NULL);
+	assert(batch->step == -1 || batch->observed);
+
+	batch->step     = batch->step + 1;
+	batch->observed = 0;
+
+	if (batch->step == 0) return; // no evolution equation for the first step
+
+	int32_t n = batch->dimension;
+
+	assert(K_type == 'W' || K_type == 'w');
+	check_stacked(batch, H, n*n);
+	check_stacked(batch, F, n*n);
+	check_stacked(batch, c, n);
+	check_stacked(batch, K, K_type == 'W' ? n*n : n);
+
+	batch_call_t call;
+	call.batch  = batch;
+	call.H      = H;
+	call.F      = F;
+	call.c      = c;
+	call.G      = NULL;
+	call.o      = NULL;
+	call.W      = K;
+	call.W_type = K_type;
+	call.m      = 0;
+
+	batch_run(evolve_chunks, &call);
+	// the number of rows in Rbar is the number of rows in R
+}
+
+void kalman_batch_observe(kalman_batch_t* batch, matrix_t* G, matrix_t* o, matrix_t* C, char C_type) {
+	assert(batch != NULL);
+	assert(batch->step >= 0 && !(batch->observed));
+
+	int32_t n = batch->dimension;
+	int32_t m = (o == NULL ? 0 : matrix_cols(o));
+
+	if (m > 0) {
+		assert(C_type == 'W' || C_type == 'w');
+		check_stacked(batch, G, m*n);
+		check_stacked(batch, o, m);
+		check_stacked(batch, C, C_type == 'W' ? m*m : m);
+	}
+
+	batch_call_t call;
+	call.batch  = batch;
+	call.H      = NULL;
+	call.F      = NULL;
+	call.c      = NULL;
+	call.G      = G;
+	call.o      = o;
+	call.W      = C;
+	call.W_type = C_type;
+	call.m      = m;
+
+	batch_run(observe_chunks, &call);
+
+	batch->rows     = MIN(batch->rows + m, n);
+	batch->observed = 1;
+}
+
+kalman_matrix_t* kalman_batch_estimate(kalman_batch_t* batch) {
+	assert(batch != NULL);
+	return matrix_create_copy(batch->state);
+}
+
+kalman_matrix_t* kalman_batch_covariance(kalman_batch_t* batch) {
+	assert(batch != NULL);
+	if (batch->rows < batch->dimension || !(batch->observed))
+		return matrix_create_constant(batch->count, batch->dimension*batch->dimension, kalman_nan);
+	return matrix_create_copy(batch->R);
+}
+
+/******************************************************************************/
+/* END OF FILE                                                                */
+/******************************************************************************/
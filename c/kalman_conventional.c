@@ -51,6 +51,8 @@ typedef struct step_st {
   char C_type;
   char K_type;
 
+  char borrowed; // F belongs to the caller or to the filter's model
+
   //kalman_matrix_t* H;
   kalman_matrix_t *F;
 
@@ -69,13 +71,15 @@ typedef struct step_st {
 
 //static step_t* step_create() {
 static void* step_create() {
-  step_t *s = malloc(sizeof(step_t));
+  step_t *s = matrix_pool_malloc(sizeof(step_t));
   s->step = -1;
   s->dimension = -1;
 
   s->C_type = 0;
   s->K_type = 0;
 
+  s->borrowed = 0;
+
   //s->H = NULL;
   s->F = NULL;
 
@@ -97,7 +101,7 @@ static void step_free(void *v) {
   step_t *s = (step_t*) v;
 
   //matrix_free(s->H);
-  matrix_free(s->F);
+  if (!(s->borrowed)) matrix_free(s->F);
 
   matrix_free(s->predictedState);
   matrix_free(s->predictedCovariance);
@@ -108,7 +112,7 @@ static void step_free(void *v) {
 
   // state and covariance are aliases in this implementation
 
-  free(s);
+  matrix_pool_free(s);
 }
 
 static void step_rollback(void *v) {
@@ -117,11 +121,42 @@ static void step_rollback(void *v) {
   matrix_free(s->smoothedCovariance);
   matrix_free(s->assimilatedState);
   matrix_free(s->assimilatedCovariance);
+  // step_free and kalman_restore may free the step later
+  s->smoothedState = NULL;
+  s->smoothedCovariance = NULL;
+  s->assimilatedState = NULL;
+  s->assimilatedCovariance = NULL;
   // fix aliases
   s->state = s->predictedState;
   s->covariance = s->predictedCovariance;
 }
 
+static void step_snapshot(void *dst_v, void *src_v) {
+  step_t *dst = (step_t*) dst_v;
+  step_t *src = (step_t*) src_v;
+
+  dst->step = src->step;
+  dst->dimension = src->dimension;
+  dst->C_type = src->C_type;
+  dst->K_type = src->K_type;
+
+  if (dst->borrowed) dst->F = NULL;
+  dst->borrowed = src->borrowed;
+  dst->F = src->borrowed ? src->F : matrix_recopy(dst->F, src->F);
+
+  dst->predictedState = matrix_recopy(dst->predictedState, src->predictedState);
+  dst->predictedCovariance = matrix_recopy(dst->predictedCovariance, src->predictedCovariance);
+  dst->assimilatedState = matrix_recopy(dst->assimilatedState, src->assimilatedState);
+  dst->assimilatedCovariance = matrix_recopy(dst->assimilatedCovariance, src->assimilatedCovariance);
+  dst->smoothedState = matrix_recopy(dst->smoothedState, src->smoothedState);
+  dst->smoothedCovariance = matrix_recopy(dst->smoothedCovariance, src->smoothedCovariance);
+
+  // fix aliases
+  int smoothed = src->smoothedState != NULL && src->state == src->smoothedState;
+  dst->state = smoothed ? dst->smoothedState : dst->assimilatedState;
+  dst->covariance = smoothed ? dst->smoothedCovariance : dst->assimilatedCovariance;
+}
+
 static kalman_step_index_t step_get_index(void *v) {
   return ((step_t*) v)->step;
 }
@@ -139,6 +174,7 @@ static kalman_matrix_t* step_get_covariance(void *v) {
 }
 
 static char step_get_covariance_type(void *v) {
+  (void) v;
   return 'C';
 }
 
@@ -179,7 +215,9 @@ static void evolve(kalman_t *kalman, int32_t n_i, matrix_t *H_i, matrix_t *F_i,
 
   // we assume H_i is an identity, need to check in the final code
   //kalman->current->H	= matrix_create_copy(H_i);
-  kalman_current->F = matrix_create_copy(F_i);
+  kalman_current->borrowed = (kalman->options & KALMAN_BORROW_MATRICES) != 0
+                          || kalman_model_contains(kalman->model, F_i);
+  kalman_current->F = kalman_current->borrowed ? F_i : matrix_create_copy(F_i);
 
   //printf("imo->assimilatedState = ");
   //matrix_print(imo->assimilatedState,"%.3e");
@@ -216,16 +254,14 @@ static void evolve(kalman_t *kalman, int32_t n_i, matrix_t *H_i, matrix_t *F_i,
   kalman_current->predictedState = matrix_create_add(predictedState, c_i);
   matrix_free(predictedState);
 
-  matrix_t *K_i_explicit = kalman_covariance_matrix_explicit(K_i, K_type);
-
   matrix_t *t4 = matrix_create_multiply(F_i, imo->assimilatedCovariance);
   matrix_t *F_iTrans = matrix_create_transpose(F_i);
   matrix_t *t5 = matrix_create_multiply(t4, F_iTrans);
 
-  kalman_current->predictedCovariance = matrix_create_add(t5, K_i_explicit);
+  kalman_current->predictedCovariance = t5;
+  kalman_model_add_explicit(kalman->model, K_i, K_type, kalman_current->predictedCovariance);
 
   matrix_free(F_iTrans);
-  matrix_free(t5);
   matrix_free(t4);
 
   kalman_current->state = kalman_current->predictedState;
@@ -252,8 +288,8 @@ static void observe(kalman_t *kalman, matrix_t *G_i, matrix_t *o_i, matrix_t *C_
 
   if (kalman_current->step == 0) {
     //printf("filter_smoother step 0 observation cov-type %c\n",C_type);
-    matrix_t *W_i_G_i = kalman_covariance_matrix_weigh(C_i, C_type, G_i);
-    matrix_t *W_i_o_i = kalman_covariance_matrix_weigh(C_i, C_type, o_i);
+    matrix_t *W_i_G_i = kalman_model_weigh(kalman->model, C_i, C_type, G_i);
+    matrix_t *W_i_o_i = kalman_model_weigh(kalman->model, C_i, C_type, o_i);
 
     //matrix_print(W_i_G_i,"%.3e");
     //matrix_print(W_i_o_i,"%.3e");
@@ -309,8 +345,8 @@ static void observe(kalman_t *kalman, matrix_t *G_i, matrix_t *o_i, matrix_t *C_
     matrix_t *G_i_trans = matrix_create_transpose(G_i);
     matrix_t *t1 = matrix_create_multiply(G_i, kalman_current->predictedCovariance);
     matrix_t *t2 = matrix_create_multiply(t1, G_i_trans);
-    matrix_t *C_i_explicit = kalman_covariance_matrix_explicit(C_i, C_type);
-    matrix_t *S = matrix_create_add(t2, C_i_explicit);
+    matrix_t *S = t2;
+    kalman_model_add_explicit(kalman->model, C_i, C_type, S);
 
     matrix_t *t4 = matrix_create_multiply(kalman_current->predictedCovariance, G_i_trans);
     matrix_t *S_inv = matrix_create_inverse(S);
@@ -334,10 +370,8 @@ static void observe(kalman_t *kalman, matrix_t *G_i, matrix_t *o_i, matrix_t *C_
     matrix_free(S_inv);
     matrix_free(t5);
     matrix_free(t4);
-    matrix_free(S);
-    matrix_free(C_i_explicit);
+    matrix_free(S); // t2
     //matrix_free( t3 );
-    matrix_free(t2);
     matrix_free(t1);
     matrix_free(G_i_trans);
     matrix_free(predictedObservations);
@@ -432,6 +466,7 @@ void kalman_create_conventional(kalman_t *kalman) {
   kalman->step_create = step_create;
   kalman->step_free = step_free;
   kalman->step_rollback = step_rollback;
+  kalman->step_snapshot = step_snapshot;
   kalman->step_get_index = step_get_index;
   kalman->step_get_dimension = step_get_dimension;
   kalman->step_get_state = step_get_state;
@@ -50,6 +50,10 @@ static void mex_assert(int c, int line) {
 #include "concurrent_set.h"
 #include "memory.h"
 
+#define MAX(a,b) ((a)>(b) ? (a) : (b))
+
+void kalman_async_smooth(kalman_t*, kalman_step_equations_t**, kalman_step_index_t); // in kalman_async_smoother.c
+
 /******************************************************************************/
 /* UTILITIES                                                                  */
 /******************************************************************************/
@@ -84,7 +88,7 @@ typedef struct step_st {
 typedef kalman_step_equations_t step_t;
 
 static void* step_create() {
-  step_t *s = malloc(sizeof(step_t));
+  step_t *s = matrix_pool_malloc(sizeof(step_t));
   s->step = -1;
   s->dimension = -1;
 
@@ -103,35 +107,56 @@ static void* step_create() {
   s->state = NULL;
   s->covariance = NULL;
   s->covariance_type = 'C';
+  s->covariance_wanted = 1;
+
+  s->borrowed = 0;
+  s->model    = NULL;
 
   assert(s != NULL);
   return s;
 }
 
+/*
+ * Inputs are copied unless the caller lends them (KALMAN_BORROW_MATRICES) or
+ * they belong to the filter's model, which outlives the steps.
+ */
+static matrix_t* input_keep(step_t *s, matrix_t *A) {
+  if (s->borrowed || kalman_model_contains(s->model, A)) return A;
+  return matrix_create_copy(A);
+}
+
+static void input_free(step_t *s, matrix_t *A) {
+  if (s->borrowed || kalman_model_contains(s->model, A)) return;
+  matrix_free(A);
+}
+
 static void step_free(void *v) {
   step_t *s = (step_t*) v;
 
-  matrix_free(s->H);
-  matrix_free(s->F);
-  matrix_free(s->K);
-  matrix_free(s->c);
+  input_free(s, s->H);
+  input_free(s, s->F);
+  input_free(s, s->K);
+  input_free(s, s->c);
 
-  matrix_free(s->G);
-  matrix_free(s->o);
-  matrix_free(s->C);
+  input_free(s, s->G);
+  input_free(s, s->o);
+  input_free(s, s->C);
 
   matrix_free(s->state);
   matrix_free(s->covariance);
 
-  free(s);
+  matrix_pool_free(s);
 }
 
 static void step_rollback(void *v) {
   step_t *s = (step_t*) v;
 
-  matrix_free(s->G);
-  matrix_free(s->o);
-  matrix_free(s->C);
+  input_free(s, s->G);
+  input_free(s, s->o);
+  input_free(s, s->C);
+  s->G = NULL;
+  s->o = NULL;
+  s->C = NULL;
 
   matrix_free(s->state);
   matrix_free(s->covariance);
@@ -157,6 +182,10 @@ static char step_get_covariance_type(void *v) {
   return ((step_t*) v)->covariance_type;
 }
 
+static void step_request_covariance(void *v) {
+  ((step_t*) v)->covariance_wanted = 1;
+}
+
 /******************************************************************************/
 /* KALMAN                                                                     */
 /******************************************************************************/
@@ -165,6 +194,9 @@ static void evolve(kalman_t *kalman, int32_t n_i, matrix_t *H_i, matrix_t *F_i,
   step_t *kalman_current;
   kalman->current = kalman_current = step_create();
   kalman_current->dimension = n_i;
+  kalman_current->borrowed  = (kalman->options & KALMAN_BORROW_MATRICES) != 0;
+  kalman_current->model     = kalman->model;
+  kalman_current->covariance_wanted = (kalman->options & KALMAN_LAZY_COVARIANCE) == 0;
 
   if (farray_size(kalman->steps) == 0) {
     //if (debug) printf("kalman_evolve first step\n");
@@ -198,10 +230,10 @@ static void evolve(kalman_t *kalman, int32_t n_i, matrix_t *H_i, matrix_t *F_i,
 
   // matrix_mutate_scale(V_i_F_i,-1.0);
 
-  kalman_current->H = matrix_create_copy(H_i);
-  kalman_current->F = matrix_create_copy(F_i);
-  kalman_current->c = matrix_create_copy(c_i);
-  kalman_current->K = matrix_create_copy(K_i);
+  kalman_current->H = input_keep(kalman_current, H_i);
+  kalman_current->F = input_keep(kalman_current, F_i);
+  kalman_current->c = input_keep(kalman_current, c_i);
+  kalman_current->K = input_keep(kalman_current, K_i);
   kalman_current->K_type = K_type;
 }
 
@@ -229,9 +261,9 @@ static void observe(kalman_t *kalman, matrix_t *G_i, matrix_t *o_i, matrix_t *C_
 		printf("o_i ");
 		matrix_print(o_i,"%.3e");
 #endif
-    kalman_current->G = matrix_create_copy(G_i);
-    kalman_current->o = matrix_create_copy(o_i);
-    kalman_current->C = matrix_create_copy(C_i);
+    kalman_current->G = input_keep(kalman_current, G_i);
+    kalman_current->o = input_keep(kalman_current, o_i);
+    kalman_current->C = input_keep(kalman_current, C_i);
     kalman_current->C_type = C_type;
   }
 
@@ -243,17 +275,96 @@ static void observe(kalman_t *kalman, matrix_t *G_i, matrix_t *o_i, matrix_t *C_
 #endif
 }
 
+/*
+ * Bulk appends create and fill the steps in parallel, directly in the slots
+ * that farray_extend reserves for them.
+ */
+typedef struct append_call_st {
+  kalman_t*           kalman;
+  step_t**            slots;
+  kalman_step_index_t first; // logical index of the first new step
+  int32_t             n_i;
+  matrix_t            **H, **F, **c, **K;
+  matrix_t            **G, **o, **C;
+  char                K_type, C_type;
+} append_call_t;
+
+static void append_steps_range(void* call_v, parallel_index_t length, parallel_index_t start, parallel_index_t end) {
+  (void) length;
+  append_call_t* call = (append_call_t*) call_v;
+  for (parallel_index_t j = start; j < end; j++) {
+    step_t *s = step_create();
+    s->step      = call->first + j;
+    s->dimension = call->n_i;
+    s->borrowed  = (call->kalman->options & KALMAN_BORROW_MATRICES) != 0;
+    s->model     = call->kalman->model;
+    s->covariance_wanted = (call->kalman->options & KALMAN_LAZY_COVARIANCE) == 0;
+
+    if (s->step > 0) {
+      assert(call->H != NULL && call->H[j] != NULL);
+      assert(call->F != NULL && call->F[j] != NULL);
+      assert(call->c != NULL && call->c[j] != NULL);
+      s->H = input_keep(s, call->H[j]);
+      s->F = input_keep(s, call->F[j]);
+      s->c = input_keep(s, call->c[j]);
+      s->K = input_keep(s, call->K ? call->K[j] : NULL);
+      s->K_type = call->K_type;
+    }
+
+    if (call->o != NULL && call->o[j] != NULL) {
+      s->G = input_keep(s, call->G[j]);
+      s->o = input_keep(s, call->o[j]);
+      s->C = input_keep(s, call->C[j]);
+      s->C_type = call->C_type;
+    }
+
+    (call->slots)[j] = s;
+  }
+}
+
+static void append_steps(kalman_t *kalman, kalman_step_index_t count, int32_t n_i,
+                         matrix_t **H, matrix_t **F, matrix_t **c, matrix_t **K, char K_type,
+                         matrix_t **G, matrix_t **o, matrix_t **C, char C_type) {
+  assert(kalman->current == NULL); // the last step must have been observed
+  if (count <= 0) return;
+
+  append_call_t call;
+  call.kalman = kalman;
+  call.first  = (farray_size(kalman->steps) == 0) ? 0 : ((step_t*) farray_get_last(kalman->steps))->step + 1;
+  call.n_i    = n_i;
+  call.H = H; call.F = F; call.c = c; call.K = K; call.K_type = K_type;
+  call.G = G; call.o = o; call.C = C; call.C_type = C_type;
+  call.slots  = (step_t**) farray_extend(kalman->steps, count);
+
+  foreach_in_range(append_steps_range, &call, count, count);
+}
+
 static void smooth(kalman_t *kalman) {
   fprintf(stderr,"explicit rep smooth\n");
 
-  if (kalman->options & KALMAN_ALGORITHM_ODDEVEN)     kalman_smooth_oddeven    (kalman->options, (kalman_step_equations_t**) kalman->steps->elements, farray_size(kalman->steps));
-  if (kalman->options & KALMAN_ALGORITHM_ASSOCIATIVE) kalman_smooth_associative(kalman->options, (kalman_step_equations_t**) kalman->steps->elements, farray_size(kalman->steps));
+  kalman_step_equations_t** equations = ((kalman_step_equations_t**) kalman->steps->elements) + kalman->steps->start;
+  kalman_step_index_t       l         = farray_size(kalman->steps);
+  int32_t                   n         = 0;
+  for (kalman_step_index_t i = 0; i < l; i++) n = MAX(n, equations[i]->dimension);
+
+  // after kalman_forget or kalman_smooth_async the first step is not step 0; the async driver renumbers
+  // and, after kalman_smooth_async, starts from the estimate of the last segment
+  if (l > 0 && equations[0]->step > 0) {
+    kalman_async_smooth(kalman, equations, l);
+    return;
+  }
+
+  int previous = parallel_budget_begin(n, l);
+  if (kalman->options & KALMAN_ALGORITHM_ODDEVEN)     kalman_smooth_oddeven    (kalman->options, equations, l);
+  if (kalman->options & KALMAN_ALGORITHM_ASSOCIATIVE) kalman_smooth_associative(kalman->options, equations, l);
+  parallel_budget_end(previous);
 }
 
 void kalman_create_explicit_representation(kalman_t *kalman) {
   kalman->evolve = evolve;
   kalman->observe = observe;
   kalman->smooth = smooth;
+  kalman->append_steps = append_steps;
 
   kalman->step_create = step_create;
   kalman->step_free = step_free;
@@ -263,6 +374,7 @@ void kalman_create_explicit_representation(kalman_t *kalman) {
   kalman->step_get_state = step_get_state;
   kalman->step_get_covariance = step_get_covariance;
   kalman->step_get_covariance_type = step_get_covariance_type;
+  kalman->step_request_covariance = step_request_covariance;
 }
 
 /******************************************************************************/
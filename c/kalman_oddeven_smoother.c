@@ -45,6 +45,8 @@ static void mex_assert(int c, int line) {
 #include "parallel.h"
 #include "memory.h"
 
+#define MAX(a,b) ((a)>(b) ? (a) : (b))
+
 /******************************************************************************/
 /* KALMAN STEPS                                                               */
 /******************************************************************************/
@@ -74,6 +76,7 @@ typedef struct step_st {
 
 	kalman_matrix_t* state;
 	kalman_matrix_t* covariance;
+	char             wanted; // compute the covariance (see extract_recursion_steps)
 } step_t;
 
 static void* step_create() {
@@ -103,6 +106,7 @@ static void* step_create() {
 
 	s->state = NULL;
 	s->covariance = NULL;
+	s->wanted = 1;
 
 	assert( s != NULL );
 	return s;
@@ -288,18 +292,21 @@ static void observe(kalman_t* kalman, matrix_t* G_i, matrix_t* o_i, matrix_t* C_
 /* ADDITIONAL MATRIX OPERATIONS                                               */
 /******************************************************************************/
 
+/*
+ * The blocks keep their shapes, so the result is copied back into them; they
+ * may live in the level storage (see below).
+ */
 static void apply_Q_on_block_matrix (matrix_t* R, matrix_t* Q, matrix_t** upper, matrix_t** lower) {
+	int32_t i,j;
 	matrix_t* concat = matrix_create_vconcat(*upper, *lower);
 	matrix_mutate_apply_qt(R, Q, concat);
-	matrix_t *new_upper = matrix_create_sub(concat,0,matrix_rows(*upper), 0, matrix_cols(concat));
-	matrix_t *new_lower = matrix_create_sub(concat,matrix_rows(*upper),matrix_rows(*lower), 0, matrix_cols(concat));
 
-	matrix_free(*upper);
-	matrix_free(*lower);
-	matrix_free(concat);
+	for (j=0; j<matrix_cols(concat); j++) {
+		for (i=0; i<matrix_rows(*upper); i++) matrix_set(*upper,i,j,matrix_get(concat,i,j));
+		for (i=0; i<matrix_rows(*lower); i++) matrix_set(*lower,i,j,matrix_get(concat,matrix_rows(*upper)+i,j));
+	}
 
-	*upper = new_upper;
-	*lower = new_lower;
+	matrix_free(concat);
 }
 
 static void free_and_assign(matrix_t** original, matrix_t* new){
@@ -309,11 +316,107 @@ static void free_and_assign(matrix_t** original, matrix_t* new){
 	*original = new;
 }
 
+/******************************************************************************/
+/* LEVEL STORAGE                                                              */
+/******************************************************************************/
+
+/*
+ * The matrices that each level of the recursion computes for its steps live
+ * in one slab per role, indexed by the pair j_ that the parallel passes loop
+ * over, so each pass streams through the slabs of the roles it touches. The
+ * block capacity is set by the largest step of the level; a matrix that does
+ * not fit (or that a later pass replaces) is an ordinary heap matrix. Slab
+ * matrices are referenced by the steps until the very end, so all the levels
+ * are released together after the estimates are returned, one slab at a time.
+ */
+enum {
+	ROLE_R_TILDE, ROLE_R, ROLE_X, ROLE_Y, ROLE_Z, ROLE_F_TILDE, ROLE_X_TILDE, // of even steps
+	ROLE_H_TILDE, ROLE_G_TILDE, ROLE_F, ROLE_H, ROLE_C, ROLE_G, ROLE_O,       // of odd steps
+	ROLES
+};
+
+typedef struct level_st {
+	step_t**         steps;
+	int              first; // steps[0] is the first step of the trajectory (see eliminate)
+	int32_t          depth; // in the recursion, for phase timings
+	matrix_slab_t*   slabs[ROLES];
+	struct level_st* next;
+} level_t;
+
+static level_t* level_create(step_t** steps, kalman_step_index_t length) {
+	int32_t n = 1;
+	int32_t r = 1;
+	int     role;
+
+	for (kalman_step_index_t j = 0; j < length; j++) {
+		step_t* s = steps[j];
+		n = MAX(n, s->dimension);
+		if (s->G != NULL) r = MAX(r, matrix_rows(s->G));
+		if (s->H != NULL) r = MAX(r, matrix_rows(s->H));
+		if (s->F != NULL) r = MAX(r, matrix_rows(s->F));
+	}
+	r = MAX(r, n);
+
+	level_t* level = malloc(sizeof(level_t));
+	assert(level != NULL);
+	level->steps = steps;
+	level->first = 1;
+	level->depth = 0;
+	level->next  = NULL;
+	for (role = 0; role < ROLES; role++) {
+		int32_t capacity = (role == ROLE_C || role == ROLE_O) ? r : r*n;
+		level->slabs[role] = matrix_slab_create((length + 1)/2, capacity);
+	}
+	return level;
+}
+
+static void levels_free(level_t* level) {
+	int role;
+	while (level != NULL) {
+		level_t* next = level->next;
+		for (role = 0; role < ROLES; role++) matrix_slab_free(level->slabs[role]);
+		free(level);
+		level = next;
+	}
+}
+
+/*
+ * Like matrix_create_sub, matrix_create_copy and matrix_create_constant, but
+ * in block j_ of a role's slab.
+ */
+static matrix_t* level_sub(level_t* level, int role, kalman_step_index_t j_,
+                           matrix_t* A, int32_t first_row, int32_t rows, int32_t first_col, int32_t cols) {
+	int32_t i,j;
+	matrix_t* C = matrix_slab_matrix(level->slabs[role], j_, rows, cols);
+	for (j=0; j<cols; j++) {
+		for (i=0; i<rows; i++) {
+			matrix_set(C,i,j,matrix_get(A,first_row+i,first_col+j));
+		}
+	}
+	return C;
+}
+
+static matrix_t* level_copy(level_t* level, int role, kalman_step_index_t j_, matrix_t* A) {
+	return level_sub(level, role, j_, A, 0, matrix_rows(A), 0, matrix_cols(A));
+}
+
+static matrix_t* level_zeros(level_t* level, int role, kalman_step_index_t j_, int32_t rows, int32_t cols) {
+	int32_t i,j;
+	matrix_t* C = matrix_slab_matrix(level->slabs[role], j_, rows, cols);
+	for (j=0; j<cols; j++) {
+		for (i=0; i<rows; i++) {
+			matrix_set(C,i,j,0.0);
+		}
+	}
+	return C;
+}
+
 /******************************************************************************/
 /* FUNCIONS THAT CAN BE APPLIED IN PARALLEL TO AN ARRAY OF STEPS              */
 /******************************************************************************/
 
 static void create_steps_array(void* kalman_v, void* steps_v, kalman_step_index_t length, kalman_step_index_t start, kalman_step_index_t end) {
+    (void) length;
     kalman_t* kalman = (kalman_t*) kalman_v;
     step_t** steps = (step_t**) steps_v;
 
@@ -324,6 +427,7 @@ static void create_steps_array(void* kalman_v, void* steps_v, kalman_step_index_
 
 //void assign_steps(void* kalman_v, void* steps_v, int length, int** helper, kalman_step_index_t start, kalman_step_index_t end) {
 static void create_steps_array_new(void* kalman_v, void* steps_v, kalman_step_index_t length, kalman_step_index_t start, kalman_step_index_t end) {
+	(void) length;
 	kalman_t* kalman = (kalman_t*) kalman_v;
 	step_t** steps = (step_t**) steps_v;
 	
@@ -333,9 +437,10 @@ static void create_steps_array_new(void* kalman_v, void* steps_v, kalman_step_in
 }
 
 //void G_F_to_R_tilde(void* kalman_v, void* steps_v, kalman_step_index_t length, int** helper, kalman_step_index_t start, kalman_step_index_t end){
-static void G_F_to_R_tilde(void* steps_v, kalman_step_index_t length, kalman_step_index_t start, kalman_step_index_t end){
+static void G_F_to_R_tilde(void* level_v, kalman_step_index_t length, kalman_step_index_t start, kalman_step_index_t end){
 	//kalman_t* kalman = (kalman_t*) kalman_v;
-	step_t* *steps = (step_t**)steps_v;
+	level_t* level = (level_t*) level_v;
+	step_t* *steps = level->steps;
 
 	for (kalman_step_index_t j_ = start; j_ < end; ++j_) {
 		kalman_step_index_t j = j_ * 2;
@@ -346,7 +451,7 @@ static void G_F_to_R_tilde(void* steps_v, kalman_step_index_t length, kalman_ste
 		if (j == length - 1){
 			matrix_t* o_i = step_i->o;
 
-			matrix_t* R_tilde = matrix_create_copy(G_i);
+			matrix_t* R_tilde = level_copy(level, ROLE_R_TILDE, j_, G_i);
 
 			matrix_t* TAU = matrix_create_mutate_qr(R_tilde);
 			matrix_mutate_apply_qt(R_tilde,TAU,o_i);
@@ -371,11 +476,11 @@ static void G_F_to_R_tilde(void* steps_v, kalman_step_index_t length, kalman_ste
 			R_tilde = concat;
 			Q = matrix_create_mutate_qr(R_tilde);
 
-			step_i->R_tilde = matrix_create_sub(R_tilde,0,matrix_cols(R_tilde), 0, matrix_cols(R_tilde));
+			step_i->R_tilde = level_sub(level, ROLE_R_TILDE, j_, R_tilde,0,matrix_cols(R_tilde), 0, matrix_cols(R_tilde));
 			matrix_mutate_triu(step_i->R_tilde);
-			step_i->X = matrix_create_constant(matrix_rows(G_i), matrix_cols(H_ipo), 0);
+			step_i->X = level_zeros(level, ROLE_X, j_, matrix_rows(G_i), matrix_cols(H_ipo));
 
-			free_and_assign(&(step_ipo->H_tilde), matrix_create_copy(H_ipo));
+			free_and_assign(&(step_ipo->H_tilde), level_copy(level, ROLE_H_TILDE, j_, H_ipo));
 
 			apply_Q_on_block_matrix(R_tilde, Q, &(step_i->o), &(step_ipo->c));
 			apply_Q_on_block_matrix(R_tilde, Q, &(step_i->X), &(step_ipo->H_tilde));
@@ -386,16 +491,17 @@ static void G_F_to_R_tilde(void* steps_v, kalman_step_index_t length, kalman_ste
 }
 
 //void H_R_tilde_to_R(void* kalman_v, void* steps_v, int length, int** helper, kalman_step_index_t start, kalman_step_index_t end){
-static void H_R_tilde_to_R(void* steps_v, kalman_step_index_t length, kalman_step_index_t start, kalman_step_index_t end){
+static void H_R_tilde_to_R(void* level_v, kalman_step_index_t length, kalman_step_index_t start, kalman_step_index_t end){
 	//kalman_t* kalman = (kalman_t*) kalman_v;
-	step_t* *steps = (step_t**)steps_v;
+	level_t* level = (level_t*) level_v;
+	step_t* *steps = level->steps;
 
 	for (kalman_step_index_t j_ = start; j_ < end; j_++){
 		kalman_step_index_t j = j_ * 2;
 
 		step_t* step_i = steps[j];
-		if (j == 0){ //First index
-			step_i->R = matrix_create_copy(step_i->R_tilde);
+		if (j == 0 && level->first){ //First index
+			step_i->R = level_copy(level, ROLE_R, j_, step_i->R_tilde);
 			continue;
 		}
 
@@ -406,24 +512,24 @@ static void H_R_tilde_to_R(void* steps_v, kalman_step_index_t length, kalman_ste
 		matrix_t* concat = matrix_create_vconcat(H_i, R_tilde);
 		matrix_t* R_tall = concat;
 		matrix_t* Q = matrix_create_mutate_qr(R_tall);
-		matrix_t* R = matrix_create_sub(R_tall,0,matrix_cols(R_tall), 0, matrix_cols(R_tall));
+		matrix_t* R = level_sub(level, ROLE_R, j_, R_tall,0,matrix_cols(R_tall), 0, matrix_cols(R_tall));
 		
 		
 		matrix_mutate_triu(R);
 		step_i->R = R;
 
-		step_i->Z = matrix_create_constant(matrix_rows(R_tilde), matrix_cols(F_i), 0);
+		step_i->Z = level_zeros(level, ROLE_Z, j_, matrix_rows(R_tilde), matrix_cols(F_i));
 
-		step_i->F_tilde = matrix_create_copy(F_i);
+		step_i->F_tilde = level_copy(level, ROLE_F_TILDE, j_, F_i);
 		apply_Q_on_block_matrix(R_tall, Q, &(step_i->F_tilde), &(step_i->Z));
 		apply_Q_on_block_matrix(R_tall, Q, &(step_i->c), &(step_i->o));
 
 		if(j + 1 != length){
 			matrix_t *X = step_i->X;
 
-			step_i->Y = matrix_create_constant(matrix_rows(F_i), matrix_cols(X), 0);
+			step_i->Y = level_zeros(level, ROLE_Y, j_, matrix_rows(F_i), matrix_cols(X));
 
-			step_i->X_tilde = matrix_create_copy(X);
+			step_i->X_tilde = level_copy(level, ROLE_X_TILDE, j_, X);
 
 			apply_Q_on_block_matrix(R_tall, Q, &(step_i->Y), &(step_i->X_tilde));
 
@@ -435,15 +541,18 @@ static void H_R_tilde_to_R(void* steps_v, kalman_step_index_t length, kalman_ste
 }
 
 //void H_tilde_G_to_G_tilde(void* kalman_v, void* steps_v, int length, int** helper, kalman_step_index_t start, kalman_step_index_t end){
-static void H_tilde_G_to_G_tilde(void* steps_v, kalman_step_index_t length, kalman_step_index_t start, kalman_step_index_t end){
+static void H_tilde_G_to_G_tilde(void* level_v, kalman_step_index_t length, kalman_step_index_t start, kalman_step_index_t end){
 	//kalman_t* kalman = (kalman_t*) kalman_v;
-	step_t* *steps = (step_t**)steps_v;
+	level_t* level = (level_t*) level_v;
+	step_t* *steps = level->steps;
 
 	for (kalman_step_index_t j_ = start; j_ < end; j_++){
 		kalman_step_index_t j = j_ * 2;
 		// Sivan Feb 2025 wrong type and seens not to be used, commenting out
 		//int i = steps[j];
 
+		if (j + 1 == length) continue; // no odd step in this pair; see smooth_recursive
+
 		step_t* step_ipo = steps[j + 1];
 		matrix_t* H_tilde = step_ipo->H_tilde;
 		matrix_t* G_ipo = step_ipo->G;
@@ -451,7 +560,7 @@ static void H_tilde_G_to_G_tilde(void* steps_v, kalman_step_index_t length, kalm
 		matrix_t* concat = matrix_create_vconcat(H_tilde, G_ipo);
 		matrix_t* R_tall = concat;
 		matrix_t* Q = matrix_create_mutate_qr(R_tall);
-		matrix_t* R = matrix_create_sub(R_tall,0,matrix_cols(R_tall), 0, matrix_cols(R_tall));
+		matrix_t* R = level_sub(level, ROLE_G_TILDE, j_, R_tall,0,matrix_cols(R_tall), 0, matrix_cols(R_tall));
 
 		matrix_mutate_triu(R);
 
@@ -467,9 +576,11 @@ static void H_tilde_G_to_G_tilde(void* steps_v, kalman_step_index_t length, kalm
 }
 
 //void Variables_Renaming(void* kalman_v, void* steps_v, int length, int** helper, kalman_step_index_t start, kalman_step_index_t end){
-static void Variables_Renaming(void* steps_v, kalman_step_index_t length, kalman_step_index_t start, kalman_step_index_t end){
+static void Variables_Renaming(void* level_v, kalman_step_index_t length, kalman_step_index_t start, kalman_step_index_t end){
+	(void) length;
 	//kalman_t* kalman = (kalman_t*) kalman_v;
-	step_t* *steps = (step_t**)steps_v;
+	level_t* level = (level_t*) level_v;
+	step_t* *steps = level->steps;
 
 	for (kalman_step_index_t j_ = start; j_ < end; ++j_){
 		kalman_step_index_t j = j_ * 2;
@@ -479,18 +590,18 @@ static void Variables_Renaming(void* steps_v, kalman_step_index_t length, kalman
 		matrix_t* G_tilde = step_ipo->G_tilde;
 		matrix_t* o = step_ipo->c;
 
-		matrix_t * copy_G_tilde = matrix_create_copy(G_tilde);
-		matrix_t * copy_o = matrix_create_copy(o);
+		matrix_t * copy_G_tilde = level_copy(level, ROLE_G, j_, G_tilde);
+		matrix_t * copy_o = level_copy(level, ROLE_O, j_, o);
 
-		if (j != 0){
+		if (j != 0 || !level->first){
 			step_t* step_i = steps[j];
 			matrix_t* Z = step_i->Z;
 			matrix_t* X_tilde = step_i->X_tilde;
 			matrix_t* c = step_i->o;
 
-			matrix_t * copy_Z = matrix_create_copy(Z);
-			matrix_t * copy_X_tilde = matrix_create_copy(X_tilde);
-			matrix_t * copy_c = matrix_create_copy(c);
+			matrix_t * copy_Z = level_copy(level, ROLE_F, j_, Z);
+			matrix_t * copy_X_tilde = level_copy(level, ROLE_H, j_, X_tilde);
+			matrix_t * copy_c = level_copy(level, ROLE_C, j_, c);
 
 			free_and_assign(&(step_ipo->F), copy_Z); 
 
@@ -504,19 +615,27 @@ static void Variables_Renaming(void* steps_v, kalman_step_index_t length, kalman
 }
 
 //void Init_new_steps(void* new_steps_v, void* steps_v, int length, int** helper, kalman_step_index_t start, kalman_step_index_t end){
+/*
+ * SelInv computes the covariance of an even step from the covariances of its
+ * odd neighbors, which the recursion computes, so an odd step's covariance is
+ * wanted if its own or either neighbor's is.
+ */
 static void extract_recursion_steps(void* new_steps_v, void* steps_v, kalman_step_index_t length, kalman_step_index_t start, kalman_step_index_t end){
 	step_t** new_steps = (step_t**) new_steps_v;
 	step_t** steps     = (step_t**) steps_v;
 
     for (kalman_step_index_t i = start; i < end; ++i) {
-		new_steps[i] = steps[2*i + 1];
+		step_t* odd = steps[2*i + 1];
+		odd->wanted = odd->wanted || steps[2*i]->wanted || (2*i + 2 < length && steps[2*i + 2]->wanted);
+		new_steps[i] = odd;
 	}
 }
 
 //void Solve_Estimates(void* kalman_v, void* steps_v, int length, int** helper, kalman_step_index_t start, kalman_step_index_t end){
-static void Solve_Estimates(void* steps_v, kalman_step_index_t length, kalman_step_index_t start, kalman_step_index_t end){
+static void Solve_Estimates(void* level_v, kalman_step_index_t length, kalman_step_index_t start, kalman_step_index_t end){
 	//kalman_t* kalman = (kalman_t*) kalman_v;
-	step_t** steps = (step_t**) steps_v;
+	level_t* level = (level_t*) level_v;
+	step_t* *steps = level->steps;
 
 	for (kalman_step_index_t j_ = start; j_ < end; ++j_){
 		kalman_step_index_t j = j_ * 2;
@@ -524,7 +643,7 @@ static void Solve_Estimates(void* steps_v, kalman_step_index_t length, kalman_st
 		step_t* step_i = steps[j];
 		matrix_t* R = step_i->R;
 
-		if (j == 0){
+		if (j == 0 && level->first){
 
 			step_t* step_ipo = steps[j + 1];
 			matrix_t* x_ipo = step_ipo->state;
@@ -593,19 +712,22 @@ static void Solve_Estimates(void* steps_v, kalman_step_index_t length, kalman_st
 // ==========================================
 
 //void Convert_LDLT(void* kalman_v, void* steps_v, int length, int** helper, kalman_step_index_t start, kalman_step_index_t end){
-static void Convert_LDLT(void* steps_v, kalman_step_index_t length, kalman_step_index_t start, kalman_step_index_t end){
+static void Convert_LDLT(void* level_v, kalman_step_index_t length, kalman_step_index_t start, kalman_step_index_t end){
 	//kalman_t* kalman = (kalman_t*) kalman_v;
-	step_t** steps = (step_t**) steps_v;
+	level_t* level = (level_t*) level_v;
+	step_t* *steps = level->steps;
 
 	for (kalman_step_index_t j_ = start; j_ < end; ++j_){
 		kalman_step_index_t j = j_ * 2;
 
 		step_t* step = steps[j];
+		if (!step->wanted) continue;
+
 		matrix_t* R = step->R;
 		matrix_t* R_inv = matrix_create_inverse(R);
 		step->R = R_inv;
 		
-		if (j == 0){
+		if (j == 0 && level->first){
 			matrix_t* X = step->X;
 			matrix_t* X_inv = matrix_create_trisolve("U",R,X);
 			matrix_free(X);
@@ -644,6 +766,8 @@ static void SelInv(void* steps_v, void* converters_v, kalman_step_index_t length
 		kalman_step_index_t j = j_ * 2;
 
 		step_t* step = steps[j];
+		if (!step->wanted) continue;
+
 	// 	Ainv(inz,j) = -Ainv(inz,inz) * L(inz,j);
 	// 	Ainv(j,inz) = Ainv(inz,j)';
 	// 	Ainv(j,j) = 1/D(j,j) - Ainv(j,inz) * L(inz,j);
@@ -881,6 +1005,7 @@ static void SelInv(void* steps_v, void* converters_v, kalman_step_index_t length
 
 //void one_layer_converter (void* kalman_v, void* steps_v, int length, int** helper, kalman_step_index_t start, kalman_step_index_t end){
 static void one_layer_converter (void* array, kalman_step_index_t length, kalman_step_index_t start, kalman_step_index_t end){
+	(void) length;
 	//kalman_t* kalman = (kalman_t*) kalman_v;
 	//step_t* *steps = (step_t**)steps_v;
 	
@@ -956,48 +1081,30 @@ static kalman_step_index_t** virtual_physical(kalman_step_index_t n) {
 // End Cov Change 2
 // ==========================================
 
-//void smooth_recursive(kalman_t* kalman, step_t* *steps, int length) {
-static void smooth_recursive(kalman_options_t options, step_t** steps, kalman_step_index_t length) {
-	
-    if (length == 1) {
-
-		step_t* singleStep = steps[0];
-
-		matrix_t* G = matrix_create_copy(singleStep->G);
-		matrix_t* o = matrix_create_copy(singleStep->o);
-
-		matrix_t* TAU = matrix_create_mutate_qr(G);
-		matrix_mutate_apply_qt(G,TAU,o);
-
-		matrix_mutate_triu(G);
-
-		// ==========================================
-		// Cov Change 3
-		// ==========================================
-
-		matrix_t* RT = matrix_create_transpose(G);
+/*
+ * One level of the recursion is split into the elimination, which creates the
+ * level and stores its odd steps (the steps of the next level) in
+ * recursion_steps, and the solve, which runs once the states of the odd steps
+ * are known. steps[0] is the first step of the trajectory unless first is 0,
+ * in which case steps is a block of a distributed smoother that starts at an
+ * even step (see kalman_smooth_oddeven_mpi): its first pair is an interior
+ * pair and the solve reads the state of the preceding odd step from steps[-1].
+ */
+static level_t* eliminate(kalman_options_t options, step_t** steps, kalman_step_index_t length, int first,
+                          level_t** levels, step_t** recursion_steps) {
+	(void) options;
 
-		matrix_t* RT_R = matrix_create_constant(matrix_cols(G), matrix_cols(G), 0);
-		matrix_mutate_gemm(1, RT, G, 0, RT_R);
+	int32_t depth = 0; // of this level in the recursion, for phase timings
+	for (level_t* l = *levels; l != NULL; l = l->next) depth++;
 
-		singleStep->R = matrix_create_inverse(RT_R);
+	double phase_begin = kalman_phase_begin();
 
-		singleStep->covariance = matrix_create_copy(singleStep->R);
+	level_t* level = level_create(steps, length);
+	level->first = first;
+	level->depth = depth;
+	level->next  = *levels;
+	*levels      = level;
 
-		matrix_free(RT);
-		matrix_free(RT_R);
-		
-		// ==========================================
-		// End Cov Change 3
-		// ==========================================
-		singleStep->state = matrix_create_trisolve("U",G,o);
-		
-		matrix_free(TAU);
-		matrix_free(G);
-		matrix_free(o);
-		
-		return;
-    }
 	// First part of the algorithm
 	//#ifdef PARALLEL
 	//parallel_for_c(NULL, steps, length, NULL, (length + 1)/2,BLOCKSIZE,G_F_to_R_tilde);
@@ -1005,15 +1112,12 @@ static void smooth_recursive(kalman_options_t options, step_t** steps, kalman_st
 	//G_F_to_R_tilde(NULL, steps, length, NULL, 0, (length + 1)/2);
 	//#endif
 
-	foreach_in_range(G_F_to_R_tilde, steps, length, (length + 1)/2);
-
 	//Second part of the algorithm
 	//#ifdef PARALLEL
 	//parallel_for_c(NULL, steps, length, NULL, (length + 1)/2,BLOCKSIZE, H_R_tilde_to_R);
 	//#else
 	//H_R_tilde_to_R(NULL, steps, length, NULL, 0, (length + 1)/2);
 	//#endif
-	foreach_in_range(H_R_tilde_to_R, steps, length, (length + 1)/2);
 
 	//Third part of the algorithm
 	//#ifdef PARALLEL
@@ -1022,7 +1126,12 @@ static void smooth_recursive(kalman_options_t options, step_t** steps, kalman_st
 	//H_tilde_G_to_G_tilde(NULL, steps, length, NULL, 0, length/2);
 	//#endif
 	// Sivan March 2025 not sure why this goes to length/2, not as in previous two
-	foreach_in_range(H_tilde_G_to_G_tilde, steps, length, length/2);
+
+	// The three parts only touch steps j and j+1 of pair j_, so they run in a
+	// single parallel pass; the third part skips the unpaired last step.
+	void (*eliminate[])(void*, parallel_index_t, parallel_index_t, parallel_index_t)
+	  = { G_F_to_R_tilde, H_R_tilde_to_R, H_tilde_G_to_G_tilde };
+	foreach_in_range_phases(eliminate, 3, level, length, (length + 1)/2);
 	
 	//Fix the last index
 
@@ -1055,12 +1164,10 @@ static void smooth_recursive(kalman_options_t options, step_t** steps, kalman_st
 	//#else
 	//Variables_Renaming(NULL, steps, length, NULL, 0, length/2);
 	//#endif
-	foreach_in_range(Variables_Renaming, steps, length, length/2);
+	foreach_in_range(Variables_Renaming, level, length, length/2);
 	
 	// The Recursion
 
-	step_t** recursion_steps = (step_t**) malloc(length/2 * sizeof(step_t*));
-
 	//#ifdef PARALLEL
 	//parallel_for_c(new_steps, steps, length, NULL, length/2,BLOCKSIZE, Init_new_steps);
 	//#else
@@ -1069,32 +1176,40 @@ static void smooth_recursive(kalman_options_t options, step_t** steps, kalman_st
 	foreach_in_range_two(extract_recursion_steps, recursion_steps, steps, length, length/2);
 	
 	
-	//smooth_recursive(NULL, new_steps, length/2);
-	smooth_recursive(options, recursion_steps, length/2);
+	kalman_phase_end("oddeven-eliminate", depth, phase_begin);
 
-	free(recursion_steps);
+	return level;
+}
+
+static void solve(kalman_options_t options, level_t* level, kalman_step_index_t length) {
+
+	double phase_begin = kalman_phase_begin();
 
 	//#ifdef PARALLEL
 	//parallel_for_c(NULL, steps, length, NULL, (length + 1)/2, BLOCKSIZE, Solve_Estimates);
 	//#else
 	//Solve_Estimates(NULL, steps, length, NULL, 0, (length + 1)/2);
 	//#endif
-	foreach_in_range(Solve_Estimates, steps, length, (length + 1)/2);
 
 	// ==========================================
 	// Change 1
 	// ==========================================
 
-	if ((options & KALMAN_NO_COVARIANCE) == 0) {
 	// Since the selinv algorithm works with LDL^T matrices, we
-	// start with converting our RR^T to LDL^T
+	// start with converting our RR^T to LDL^T; the conversion of
+	// step j only uses what Solve_Estimates has just read for step j,
+	// so it runs in the same parallel pass.
 
 	//#ifdef PARALLEL
 	//parallel_for_c(NULL, steps, length, NULL, (length + 1)/2, BLOCKSIZE, Convert_LDLT);
 	//#else
 	//Convert_LDLT(NULL, steps, length, NULL, 0, (length + 1)/2);
 	//#endif
-	foreach_in_range(Convert_LDLT, steps, length, (length + 1)/2);
+	void (*solve[])(void*, parallel_index_t, parallel_index_t, parallel_index_t)
+	  = { Solve_Estimates, Convert_LDLT };
+	foreach_in_range_phases(solve, (options & KALMAN_NO_COVARIANCE) ? 1 : 2, level, length, (length + 1)/2);
+
+	if ((options & KALMAN_NO_COVARIANCE) == 0) {
 
 	// Now we can start the selinv algrithm for out case
 	
@@ -1105,7 +1220,7 @@ static void smooth_recursive(kalman_options_t options, step_t** steps, kalman_st
 	//#else
 	//SelInv(NULL, steps, length, result, 0, (length + 1)/2);
 	//#endif
-	foreach_in_range_two(SelInv, steps, result, length, (length + 1)/2);
+	foreach_in_range_two(SelInv, level->steps, result, length, (length + 1)/2);
 	
 	free(result[0]);
 	free(result[1]);
@@ -1116,9 +1231,65 @@ static void smooth_recursive(kalman_options_t options, step_t** steps, kalman_st
 	// % End Change 1
 	// % ==========================================
 	
+	kalman_phase_end("oddeven-solve", level->depth, phase_begin);
 
 }
 
+//void smooth_recursive(kalman_t* kalman, step_t* *steps, int length) {
+static void smooth_recursive(kalman_options_t options, step_t** steps, kalman_step_index_t length, level_t** levels) {
+	
+    if (length == 1) {
+
+		step_t* singleStep = steps[0];
+
+		matrix_t* G = matrix_create_copy(singleStep->G);
+		matrix_t* o = matrix_create_copy(singleStep->o);
+
+		matrix_t* TAU = matrix_create_mutate_qr(G);
+		matrix_mutate_apply_qt(G,TAU,o);
+
+		matrix_mutate_triu(G);
+
+		// ==========================================
+		// Cov Change 3
+		// ==========================================
+
+		matrix_t* RT = matrix_create_transpose(G);
+
+		matrix_t* RT_R = matrix_create_constant(matrix_cols(G), matrix_cols(G), 0);
+		matrix_mutate_gemm(1, RT, G, 0, RT_R);
+
+		singleStep->R = matrix_create_inverse(RT_R);
+
+		singleStep->covariance = matrix_create_copy(singleStep->R);
+
+		matrix_free(RT);
+		matrix_free(RT_R);
+		
+		// ==========================================
+		// End Cov Change 3
+		// ==========================================
+		singleStep->state = matrix_create_trisolve("U",G,o);
+		
+		matrix_free(TAU);
+		matrix_free(G);
+		matrix_free(o);
+		
+		return;
+    }
+
+	step_t** recursion_steps = (step_t**) malloc(length/2 * sizeof(step_t*));
+
+	level_t* level = eliminate(options, steps, length, 1, levels, recursion_steps);
+
+	//smooth_recursive(NULL, new_steps, length/2);
+	smooth_recursive(options, recursion_steps, length/2, levels);
+
+	free(recursion_steps);
+
+	solve(options, level, length);
+}
+
 #ifdef OBSOLETE
 static void smooth(kalman_t* kalman) {
 
@@ -1145,6 +1316,7 @@ static void smooth(kalman_t* kalman) {
 #endif
 
 static void steps_init(void* steps_v, void* steps_array_v, kalman_step_index_t l, kalman_step_index_t start, kalman_step_index_t end) {
+  (void) l;
   step_t*  steps_array  = (step_t*)   steps_array_v;
   step_t** steps        = (step_t**)  steps_v;
   for (kalman_step_index_t j = start; j < end; j++) {
@@ -1175,16 +1347,19 @@ static void steps_init(void* steps_v, void* steps_array_v, kalman_step_index_t l
 
     s->state = NULL;
     s->covariance = NULL;
+    s->wanted = 1;
   }
 }
 
 static void steps_weigh(void* equations_v, void* steps_v, kalman_step_index_t l, kalman_step_index_t start, kalman_step_index_t end) {
+  (void) l;
   kalman_step_equations_t** equations = (kalman_step_equations_t**) equations_v;
   step_t**                  steps     = (step_t**)                  steps_v;
   for (kalman_step_index_t i = start; i < end; i++) {
 
     steps[i]->step      = equations[i]->step;
     steps[i]->dimension = equations[i]->dimension;
+    steps[i]->wanted    = equations[i]->covariance_wanted;
 
     if (equations[i]->step > 0) {
       matrix_t* H_i = equations[i]->H;
@@ -1193,9 +1368,9 @@ static void steps_weigh(void* equations_v, void* steps_v, kalman_step_index_t l,
       matrix_t* K_i = equations[i]->K;
       char K_type   = equations[i]->K_type;
 
-      matrix_t* V_i_H_i = kalman_covariance_matrix_weigh(K_i,K_type,H_i);
-      matrix_t* V_i_F_i = kalman_covariance_matrix_weigh(K_i,K_type,F_i);
-      matrix_t* V_i_c_i = kalman_covariance_matrix_weigh(K_i,K_type,c_i);
+      matrix_t* V_i_H_i = kalman_model_weigh(equations[i]->model,K_i,K_type,H_i);
+      matrix_t* V_i_F_i = kalman_model_weigh(equations[i]->model,K_i,K_type,F_i);
+      matrix_t* V_i_c_i = kalman_model_weigh(equations[i]->model,K_i,K_type,c_i);
 
       matrix_mutate_scale(V_i_F_i,-1.0);
 
@@ -1210,8 +1385,8 @@ static void steps_weigh(void* equations_v, void* steps_v, kalman_step_index_t l,
     char C_type   = equations[i]->C_type;
 
     if (o_i != NULL) {
-      matrix_t* W_i_G_i = kalman_covariance_matrix_weigh(C_i,C_type,G_i);
-      matrix_t* W_i_o_i = kalman_covariance_matrix_weigh(C_i,C_type,o_i);
+      matrix_t* W_i_G_i = kalman_model_weigh(equations[i]->model,C_i,C_type,G_i);
+      matrix_t* W_i_o_i = kalman_model_weigh(equations[i]->model,C_i,C_type,o_i);
 
       steps[i]->G  = W_i_G_i;
       steps[i]->o  = W_i_o_i;
@@ -1220,6 +1395,7 @@ static void steps_weigh(void* equations_v, void* steps_v, kalman_step_index_t l,
 }
 
 static void steps_finalize(void* equations_v, void* steps_v, kalman_step_index_t l, kalman_step_index_t start, kalman_step_index_t end) {
+  (void) l;
   kalman_step_equations_t** equations = (kalman_step_equations_t**) equations_v;
   step_t**                  steps     = (step_t**)                  steps_v;
   for (kalman_step_index_t i = start; i < end; i++) {
@@ -1264,15 +1440,288 @@ void kalman_smooth_oddeven(kalman_options_t options, kalman_step_equations_t** e
   foreach_in_range_two(steps_init,  steps,     steps_array, l, l);
   foreach_in_range_two(steps_weigh, equations, steps,       l, l);
 
-  smooth_recursive(options, steps, l);
+  level_t* levels = NULL;
+  smooth_recursive(options, steps, l, &levels);
 
   foreach_in_range_two(steps_finalize, equations, steps,       l, l);
+  levels_free(levels);
 
   free(steps);
   free(steps_array);
 }
 
 
+#ifdef BUILD_MPI
+
+/******************************************************************************/
+/* DISTRIBUTED MEMORY (MPI)                                                   */
+/******************************************************************************/
+
+/*
+ * Matrices travel as arrays of doubles: the dimensions and the column-major
+ * elements, or -1 for NULL. A step travels as its index, dimension and
+ * covariance flag, followed by the matrices that the recursion reads.
+ */
+static size_t pack_matrix_size(matrix_t* A) {
+	return A == NULL ? 1 : 2 + ((size_t) matrix_rows(A)) * matrix_cols(A);
+}
+
+static double* pack_matrix(double* p, matrix_t* A) {
+	int32_t i,j;
+	if (A == NULL) {
+		*(p++) = -1.0;
+		return p;
+	}
+	*(p++) = matrix_rows(A);
+	*(p++) = matrix_cols(A);
+	for (j=0; j<matrix_cols(A); j++)
+		for (i=0; i<matrix_rows(A); i++)
+			*(p++) = matrix_get(A,i,j);
+	return p;
+}
+
+static double* unpack_matrix(double* p, matrix_t** A) {
+	int32_t i,j;
+	if (p[0] < 0) {
+		*A = NULL;
+		return p + 1;
+	}
+	int32_t rows = (int32_t) p[0];
+	int32_t cols = (int32_t) p[1];
+	p += 2;
+	*A = matrix_create(rows, cols);
+	for (j=0; j<cols; j++)
+		for (i=0; i<rows; i++)
+			matrix_set(*A,i,j,*(p++));
+	return p;
+}
+
+static size_t pack_step_size(step_t* s) {
+	return 3 + pack_matrix_size(s->H) + pack_matrix_size(s->F) + pack_matrix_size(s->c)
+	         + pack_matrix_size(s->G) + pack_matrix_size(s->o);
+}
+
+static double* pack_step(double* p, step_t* s) {
+	*(p++) = (double) s->step;
+	*(p++) = s->dimension;
+	*(p++) = s->wanted;
+	p = pack_matrix(p, s->H);
+	p = pack_matrix(p, s->F);
+	p = pack_matrix(p, s->c);
+	p = pack_matrix(p, s->G);
+	p = pack_matrix(p, s->o);
+	return p;
+}
+
+static double* unpack_step(double* p, step_t* s) {
+	s->step      = (kalman_step_index_t) p[0];
+	s->dimension = (int32_t) p[1];
+	s->wanted    = (char) p[2];
+	p += 3;
+	p = unpack_matrix(p, &(s->H));
+	p = unpack_matrix(p, &(s->F));
+	p = unpack_matrix(p, &(s->c));
+	p = unpack_matrix(p, &(s->G));
+	p = unpack_matrix(p, &(s->o));
+	return p;
+}
+
+void kalman_oddeven_mpi_partition(kalman_step_index_t total, MPI_Comm comm,
+                                  kalman_step_index_t* first, kalman_step_index_t* length) {
+	int rank, size;
+	MPI_Comm_rank(comm, &rank);
+	MPI_Comm_size(comm, &size);
+
+	kalman_step_index_t unit = 1;
+	while (2*unit <= total/size) unit *= 2;
+
+	kalman_step_index_t units = total / unit;
+	kalman_step_index_t q     = units / size;
+	kalman_step_index_t r     = units % size;
+
+	*first  = unit * (rank*q + (rank < r ? rank : r));
+	*length = unit * (q + (rank < r ? 1 : 0));
+	if (rank == size - 1) *length = total - *first; // and the steps that do not fill a unit
+}
+
+/*
+ * The ranks eliminate the levels in which every block boundary falls on an
+ * even step locally, the remaining steps are smoothed on rank 0, and the
+ * solve passes go back up the local levels; before each one, a rank sends
+ * the state of its last (odd) step to the next rank, which reads it as
+ * steps[-1] (see eliminate).
+ */
+void kalman_smooth_oddeven_mpi(kalman_options_t options, kalman_step_equations_t** equations, kalman_step_index_t l,
+                               MPI_Comm comm) {
+	int rank, size, r;
+	MPI_Comm_rank(comm, &rank);
+	MPI_Comm_size(comm, &size);
+
+	options |= KALMAN_NO_COVARIANCE; // the selected inversion needs cross covariances from all the levels
+
+	long long  local   = l;
+	long long* lengths = (long long*) malloc(size * sizeof(long long));
+	MPI_Allgather(&local, 1, MPI_LONG_LONG, lengths, 1, MPI_LONG_LONG, comm);
+
+	int32_t depth = 0; // number of local levels
+	for (;;) {
+		long long unit = 1LL << (depth + 1);
+		int local_level = 1;
+		for (r = 0; r < size; r++) {
+			if (lengths[r] < unit || (r < size - 1 && lengths[r] % unit != 0)) local_level = 0;
+		}
+		if (!local_level) break;
+		depth++;
+	}
+
+	// the blocks of the local levels, each with room for steps[-1]
+	step_t*** blocks = (step_t***) malloc((depth + 1) * sizeof(step_t**));
+	kalman_step_index_t* length = (kalman_step_index_t*) malloc((depth + 1) * sizeof(kalman_step_index_t));
+	level_t** level_of = (level_t**) malloc((depth + 1) * sizeof(level_t*));
+
+	step_t  ghost_step; // steps[-1] of every level, holding only a state
+	step_t* ghost;
+	steps_init(&ghost, &ghost_step, 1, 0, 1);
+
+	step_t* steps_array = (step_t*)  malloc( l * sizeof(step_t) );
+	blocks[0] = ((step_t**) malloc( (l + 1) * sizeof(step_t*) )) + 1;
+	length[0] = l;
+
+	foreach_in_range_two(steps_init,  blocks[0], steps_array, l, l);
+	foreach_in_range_two(steps_weigh, equations, blocks[0],   l, l);
+
+	level_t* levels = NULL;
+	int32_t d;
+	blocks[0][-1] = ghost;
+	for (d = 0; d < depth; d++) {
+		length[d+1]       = length[d]/2;
+		blocks[d+1]       = ((step_t**) malloc( (length[d+1] + 1) * sizeof(step_t*) )) + 1;
+		blocks[d+1][-1]   = ghost;
+		level_of[d]       = eliminate(options, blocks[d], length[d], rank == 0, &levels, blocks[d+1]);
+	}
+
+	// the reduced system, on rank 0
+
+	double phase_begin = kalman_phase_begin();
+
+	step_t** reduced = blocks[depth];
+	kalman_step_index_t reduced_length = length[depth];
+
+	int* counts  = (int*) malloc(size * sizeof(int));
+	int* offsets = (int*) malloc(size * sizeof(int));
+
+	size_t packed = 0;
+	for (kalman_step_index_t i = 0; i < reduced_length; i++) packed += pack_step_size(reduced[i]);
+	double* buffer = (double*) malloc((packed > 0 ? packed : 1) * sizeof(double));
+	double* p = buffer;
+	for (kalman_step_index_t i = 0; i < reduced_length; i++) p = pack_step(p, reduced[i]);
+
+	int count = (int) packed;
+	assert((size_t) count == packed);
+	MPI_Gather(&count, 1, MPI_INT, counts, 1, MPI_INT, 0, comm);
+
+	double* all = NULL;
+	if (rank == 0) {
+		size_t total = 0;
+		for (r = 0; r < size; r++) {
+			offsets[r] = (int) total;
+			total += counts[r];
+		}
+		assert(total <= (size_t) 0x7fffffff);
+		all = (double*) malloc((total > 0 ? total : 1) * sizeof(double));
+	}
+	MPI_Gatherv(buffer, count, MPI_DOUBLE, all, counts, offsets, MPI_DOUBLE, 0, comm);
+	free(buffer);
+
+	double* states = NULL;
+	if (rank == 0) {
+		kalman_step_index_t total_length = 0;
+		for (r = 0; r < size; r++) total_length += (kalman_step_index_t) (lengths[r] >> depth);
+
+		step_t** steps = (step_t**) malloc( total_length * sizeof(step_t*) );
+		p = all;
+		for (kalman_step_index_t i = 0; i < total_length; i++) {
+			steps[i] = step_create();
+			p = unpack_step(p, steps[i]);
+		}
+		free(all);
+
+		if (total_length > 0) smooth_recursive(options, steps, total_length, &levels);
+
+		// the states go back to the ranks of the steps
+		size_t total = 0;
+		kalman_step_index_t i = 0;
+		for (r = 0; r < size; r++) {
+			offsets[r] = (int) total;
+			size_t rank_total = 0;
+			for (kalman_step_index_t j = 0; j < (kalman_step_index_t) (lengths[r] >> depth); j++)
+				rank_total += pack_matrix_size(steps[i + j]->state);
+			counts[r] = (int) rank_total;
+			total += rank_total;
+			i += (kalman_step_index_t) (lengths[r] >> depth);
+		}
+		states = (double*) malloc((total > 0 ? total : 1) * sizeof(double));
+		p = states;
+		for (i = 0; i < total_length; i++) {
+			p = pack_matrix(p, steps[i]->state);
+			step_free(steps[i]);
+		}
+		free(steps);
+	}
+
+	MPI_Scatter(counts, 1, MPI_INT, &count, 1, MPI_INT, 0, comm);
+	buffer = (double*) malloc((count > 0 ? count : 1) * sizeof(double));
+	MPI_Scatterv(states, counts, offsets, MPI_DOUBLE, buffer, count, MPI_DOUBLE, 0, comm);
+	free(states);
+
+	p = buffer;
+	for (kalman_step_index_t i = 0; i < reduced_length; i++) p = unpack_matrix(p, &(reduced[i]->state));
+	free(buffer);
+
+	kalman_phase_end("oddeven-mpi-reduced", depth, phase_begin);
+
+	// back up the local levels
+
+	int next     = rank < size - 1 ? rank + 1 : MPI_PROC_NULL;
+	int previous = rank > 0        ? rank - 1 : MPI_PROC_NULL;
+
+	for (d = depth - 1; d >= 0; d--) {
+		matrix_t* last = (next != MPI_PROC_NULL) ? blocks[d][length[d] - 1]->state : NULL;
+		int send_count = (int) pack_matrix_size(last);
+		int recv_count = 0;
+		MPI_Sendrecv(&send_count, 1, MPI_INT, next,     0,
+		             &recv_count, 1, MPI_INT, previous, 0, comm, MPI_STATUS_IGNORE);
+
+		double* send = (double*) malloc(send_count * sizeof(double));
+		double* recv = (double*) malloc((recv_count > 0 ? recv_count : 1) * sizeof(double));
+		pack_matrix(send, last);
+		MPI_Sendrecv(send, send_count, MPI_DOUBLE, next,     1,
+		             recv, recv_count, MPI_DOUBLE, previous, 1, comm, MPI_STATUS_IGNORE);
+		matrix_free(ghost->state);
+		ghost->state = NULL;
+		if (previous != MPI_PROC_NULL) unpack_matrix(recv, &(ghost->state));
+		free(send);
+		free(recv);
+
+		solve(options, level_of[d], length[d]);
+	}
+
+	foreach_in_range_two(steps_finalize, equations, blocks[0], l, l);
+	levels_free(levels);
+	matrix_free(ghost->state);
+
+	for (d = 0; d <= depth; d++) free(blocks[d] - 1);
+	free(blocks);
+	free(length);
+	free(level_of);
+	free(counts);
+	free(offsets);
+	free(lengths);
+	free(steps_array);
+}
+
+#endif /* BUILD_MPI */
+
 #ifdef OBSOLETE
 void kalman_create_oddeven(kalman_t* kalman) {
 	kalman->evolve  = evolve;	
@@ -0,0 +1,394 @@
+/*
+ * kalman_trajectory.c
+ *
+ * Binary trajectory files: the equations of a sequence of steps and/or their
+ * smoothed estimates, in a compact format that can be memory mapped.
+ *
+ * A file consists of a header followed by one record per step. A record
+ * holds the step number, the dimension, the covariance types, and the offset
+ * and shape of each of its matrices (H, F, c, K, G, o, C, state, covariance;
+ * offset 0 means NULL), followed by the column-major elements of the
+ * matrices that are new in this record. A matrix that is equal to the one in
+ * the same slot of the previous record is not stored again, so time-invariant
+ * models take constant space per step. Offsets are absolute and aligned to 8
+ * bytes, and all numbers are in the byte order and element type of the
+ * writer, which the reader checks.
+ *
+ * The reader maps the file (copy on write) and creates each step's equations
+ * with matrices that are views into the mapping, so opening a file costs
+ * step headers only and the page cache reads the elements as the smoothers
+ * touch them.
+ *
+ * (C) Sivan Toledo, 2022-2025
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#ifdef BUILD_MEX
+#include "mex.h"
+
+static char assert_msg[128];
+static void mex_assert(int c, int line) {
+    if (!c) {
+        sprintf(assert_msg,"Assert failed in %s line %d",__FILE__,line);
+        mexErrMsgIdAndTxt("MyToolbox:arrayProduct:assertion",assert_msg);
+    }
+}
+
+#define assert(c) mex_assert((c),__LINE__)
+#else
+#include <assert.h>
+#endif
+
+#define KALMAN_MATRIX_SHORT_TYPE
+#include "kalman.h"
+
+/******************************************************************************/
+/* FILE FORMAT                                                                */
+/******************************************************************************/
+
+#define TRAJECTORY_MAGIC      "UKTRAJ\0\0"
+#define TRAJECTORY_VERSION    1
+#define TRAJECTORY_BYTE_ORDER 0x01020304u
+
+#define ALIGNED(bytes) ((((bytes) + 7) / 8) * 8)
+
+enum { SLOT_H, SLOT_F, SLOT_c, SLOT_K, SLOT_G, SLOT_o, SLOT_C, SLOT_STATE, SLOT_COVARIANCE, SLOTS };
+
+typedef struct file_header_st {
+  char     magic[8];
+  uint32_t version;
+  uint32_t byte_order;
+  uint32_t element_size; // in bytes, 8 or 4 (BUILD_SINGLE_PRECISION)
+  uint32_t padding;
+  int64_t  count;        // of records
+  int64_t  first_record; // offset
+} file_header_t;
+
+typedef struct file_matrix_st {
+  int64_t offset; // 0 if NULL
+  int32_t rows;
+  int32_t cols;
+} file_matrix_t;
+
+typedef struct file_record_st {
+  int64_t       step;
+  int64_t       next;     // offset of the next record
+  int32_t       dimension;
+  char          K_type;
+  char          C_type;
+  char          covariance_type;
+  char          padding;
+  file_matrix_t matrices[SLOTS];
+} file_record_t;
+
+static kalman_matrix_t** slot(kalman_step_equations_t* e, int s) {
+  switch (s) {
+    case SLOT_H:          return &(e->H);
+    case SLOT_F:          return &(e->F);
+    case SLOT_c:          return &(e->c);
+    case SLOT_K:          return &(e->K);
+    case SLOT_G:          return &(e->G);
+    case SLOT_o:          return &(e->o);
+    case SLOT_C:          return &(e->C);
+    case SLOT_STATE:      return &(e->state);
+    case SLOT_COVARIANCE: return &(e->covariance);
+  }
+  assert(0);
+  return NULL;
+}
+
+/******************************************************************************/
+/* WRITER                                                                     */
+/******************************************************************************/
+
+struct kalman_trajectory_writer_st {
+  FILE*         file;
+  int           contents;
+  int64_t       count;
+  int64_t       position;
+  file_matrix_t written[SLOTS];  // where the previous record's matrices are
+  matrix_t*     previous[SLOTS]; // and copies of them, to detect repetitions
+};
+
+kalman_trajectory_writer_t* kalman_trajectory_writer_create(const char* filename, int contents) {
+  FILE* file = fopen(filename, "wb");
+  if (file == NULL) return NULL;
+
+  kalman_trajectory_writer_t* w = (kalman_trajectory_writer_t*) calloc(1, sizeof(kalman_trajectory_writer_t));
+  assert(w != NULL);
+  w->file     = file;
+  w->contents = contents;
+
+  file_header_t header;
+  memset(&header, 0, sizeof(header));
+  fwrite(&header, sizeof(header), 1, file); // rewritten when the count is known
+  w->position = sizeof(header);
+
+  return w;
+}
+
+static int same_matrix(matrix_t* A, matrix_t* B) {
+  if (A == NULL || B == NULL) return 0;
+  if (matrix_rows(A) != matrix_rows(B) || matrix_cols(A) != matrix_cols(B)) return 0;
+  for (int32_t j = 0; j < matrix_cols(A); j++)
+    for (int32_t i = 0; i < matrix_rows(A); i++)
+      if (matrix_get(A, i, j) != matrix_get(B, i, j)) return 0;
+  return 1;
+}
+
+int kalman_trajectory_write(kalman_trajectory_writer_t* w, kalman_step_equations_t* e) {
+  file_record_t record;
+  matrix_t*     matrices[SLOTS];
+  int           fresh[SLOTS];
+  int           s;
+
+  memset(&record, 0, sizeof(record));
+  record.step            = e->step;
+  record.dimension       = e->dimension;
+  record.K_type          = e->K_type;
+  record.C_type          = e->C_type;
+  record.covariance_type = e->covariance_type;
+
+  int64_t data = w->position + sizeof(record);
+  for (s = 0; s < SLOTS; s++) {
+    int wanted = (s < SLOT_STATE) ? (w->contents & KALMAN_TRAJECTORY_EQUATIONS) : (w->contents & KALMAN_TRAJECTORY_ESTIMATES);
+    matrices[s] = wanted ? *slot(e, s) : NULL;
+    fresh[s]    = 0;
+    if (matrices[s] == NULL) continue;
+
+    if (same_matrix(matrices[s], w->previous[s])) {
+      record.matrices[s] = w->written[s];
+    } else {
+      record.matrices[s].offset = data;
+      record.matrices[s].rows   = matrix_rows(matrices[s]);
+      record.matrices[s].cols   = matrix_cols(matrices[s]);
+      data += ALIGNED(((int64_t) matrix_rows(matrices[s])) * matrix_cols(matrices[s]) * sizeof(matrix_element_t));
+      fresh[s] = 1;
+    }
+  }
+  record.next = data;
+
+  if (fwrite(&record, sizeof(record), 1, w->file) != 1) return -1;
+  for (s = 0; s < SLOTS; s++) {
+    if (!fresh[s]) continue;
+    matrix_t* A = matrices[s];
+    for (int32_t j = 0; j < matrix_cols(A); j++) { // columns are contiguous in the file even if ld > rows
+      if (fwrite(A->elements + ((size_t) j) * matrix_ld(A), sizeof(matrix_element_t), matrix_rows(A), w->file) != (size_t) matrix_rows(A)) return -1;
+    }
+    int64_t bytes = ((int64_t) matrix_rows(A)) * matrix_cols(A) * sizeof(matrix_element_t);
+    if (ALIGNED(bytes) > bytes) { // only floats leave a gap
+      static const char zeros[8] = { 0 };
+      if (fwrite(zeros, 1, (size_t) (ALIGNED(bytes) - bytes), w->file) != (size_t) (ALIGNED(bytes) - bytes)) return -1;
+    }
+    matrix_free(w->previous[s]);
+    w->previous[s] = matrix_create_copy(A);
+    w->written[s]  = record.matrices[s];
+  }
+  for (s = 0; s < SLOTS; s++) {
+    if (matrices[s] == NULL) { // a gap breaks the chain of repetitions
+      matrix_free(w->previous[s]);
+      w->previous[s] = NULL;
+    }
+  }
+
+  w->position = data;
+  (w->count)++;
+  return 0;
+}
+
+int kalman_trajectory_writer_close(kalman_trajectory_writer_t* w) {
+  file_header_t header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, TRAJECTORY_MAGIC, sizeof(header.magic));
+  header.version      = TRAJECTORY_VERSION;
+  header.byte_order   = TRAJECTORY_BYTE_ORDER;
+  header.element_size = sizeof(matrix_element_t);
+  header.count        = w->count;
+  header.first_record = sizeof(header);
+
+  int rc = 0;
+  if (fseek(w->file, 0, SEEK_SET) != 0 || fwrite(&header, sizeof(header), 1, w->file) != 1) rc = -1;
+  if (fclose(w->file) != 0) rc = -1;
+
+  for (int s = 0; s < SLOTS; s++) matrix_free(w->previous[s]);
+  free(w);
+  return rc;
+}
+
+/******************************************************************************/
+/* READER                                                                     */
+/******************************************************************************/
+
+struct kalman_trajectory_mapping_st {
+  void*    address;
+  size_t   size;
+  matrix_t* headers; // SLOTS per step
+  kalman_step_equations_t* steps;
+#ifdef _WIN32
+  HANDLE   file;
+  HANDLE   mapping;
+#endif
+};
+
+static void unmap(struct kalman_trajectory_mapping_st* m) {
+  if (m->address == NULL) return;
+#ifdef _WIN32
+  UnmapViewOfFile(m->address);
+  CloseHandle(m->mapping);
+  CloseHandle(m->file);
+#else
+  munmap(m->address, m->size);
+#endif
+}
+
+static int map(struct kalman_trajectory_mapping_st* m, const char* filename) {
+#ifdef _WIN32
+  LARGE_INTEGER size;
+  m->file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+  if (m->file == INVALID_HANDLE_VALUE) return -1;
+  if (!GetFileSizeEx(m->file, &size) || size.QuadPart == 0) { CloseHandle(m->file); return -1; }
+  m->mapping = CreateFileMappingA(m->file, NULL, PAGE_WRITECOPY, 0, 0, NULL);
+  if (m->mapping == NULL) { CloseHandle(m->file); return -1; }
+  m->address = MapViewOfFile(m->mapping, FILE_MAP_COPY, 0, 0, 0);
+  if (m->address == NULL) { CloseHandle(m->mapping); CloseHandle(m->file); return -1; }
+  m->size = (size_t) size.QuadPart;
+#else
+  struct stat st;
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0) return -1;
+  if (fstat(fd, &st) != 0 || st.st_size == 0) { close(fd); return -1; }
+  // private and writable, so that code that scribbles on its inputs does not fault
+  void* address = mmap(NULL, (size_t) st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (address == MAP_FAILED) return -1;
+  m->address = address;
+  m->size    = (size_t) st.st_size;
+#endif
+  return 0;
+}
+
+/*
+ * The number of leading records of the file that lie in the mapping, with all
+ * their matrices, at most the count in the header; the rest were truncated.
+ * Records and matrices must be aligned, and records must follow one another,
+ * so a corrupt header or chain cannot make the reader allocate for records
+ * that are not there or create views outside the mapping. Returns -1 if the
+ * header itself is invalid.
+ */
+static int64_t complete_records(struct kalman_trajectory_mapping_st* m, file_header_t* header) {
+  char*   base     = (char*) m->address;
+  int64_t size     = (int64_t) m->size;
+  int64_t position = header->first_record;
+  int64_t i;
+
+  if (header->count < 0 || position < (int64_t) sizeof(file_header_t)) return -1;
+
+  for (i = 0; i < header->count; i++) {
+    if (position % 8 != 0 || position > size - (int64_t) sizeof(file_record_t)) return i;
+    file_record_t* record = (file_record_t*) (base + position);
+
+    for (int s = 0; s < SLOTS; s++) {
+      file_matrix_t* fm = (record->matrices) + s;
+      if (fm->offset == 0) continue;
+      if (fm->offset % 8 != 0 || fm->offset < (int64_t) sizeof(file_header_t) || fm->offset > size
+          || fm->rows < 0 || fm->cols < 0
+          || ((int64_t) fm->rows) * fm->cols > (size - fm->offset) / (int64_t) sizeof(matrix_element_t)) return i;
+    }
+
+    if (record->next < position + (int64_t) sizeof(file_record_t)) return i + 1; // the chain ends here
+    position = record->next;
+  }
+  return i;
+}
+
+kalman_trajectory_t* kalman_trajectory_open(const char* filename) {
+  struct kalman_trajectory_mapping_st* m = (struct kalman_trajectory_mapping_st*) calloc(1, sizeof(*m));
+  assert(m != NULL);
+  if (map(m, filename) != 0) { free(m); return NULL; }
+
+  char*          base   = (char*) m->address;
+  file_header_t* header = (file_header_t*) base;
+  int64_t        count  = -1;
+  if (m->size >= sizeof(file_header_t)
+      && memcmp(header->magic, TRAJECTORY_MAGIC, sizeof(header->magic)) == 0
+      && header->version    == TRAJECTORY_VERSION
+      && header->byte_order == TRAJECTORY_BYTE_ORDER
+      && header->element_size == sizeof(matrix_element_t))
+    count = complete_records(m, header);
+  if (count < 0) {
+    unmap(m);
+    free(m);
+    return NULL;
+  }
+
+  m->steps   = (kalman_step_equations_t*) malloc(((size_t) count) * sizeof(kalman_step_equations_t));
+  m->headers = (matrix_t*) malloc(((size_t) count) * SLOTS * sizeof(matrix_t));
+
+  kalman_trajectory_t* t = (kalman_trajectory_t*) malloc(sizeof(kalman_trajectory_t));
+  t->length    = (kalman_step_index_t) count;
+  t->equations = (kalman_step_equations_t**) malloc(((size_t) count) * sizeof(kalman_step_equations_t*));
+  t->mapping   = m;
+  assert(t->equations != NULL && m->steps != NULL && m->headers != NULL);
+
+  int64_t position = header->first_record;
+  for (int64_t i = 0; i < count; i++) { // complete_records checked the records and their matrices
+    file_record_t*           record = (file_record_t*) (base + position);
+    kalman_step_equations_t* e      = (m->steps) + i;
+
+    memset(e, 0, sizeof(*e));
+    e->step              = (kalman_step_index_t) record->step;
+    e->dimension         = record->dimension;
+    e->K_type            = record->K_type;
+    e->C_type            = record->C_type;
+    e->covariance_type   = record->covariance_type ? record->covariance_type : 'C';
+    e->covariance_wanted = 1;
+    e->borrowed          = 1; // the matrices belong to the mapping
+    e->model             = NULL;
+
+    for (int s = 0; s < SLOTS; s++) {
+      file_matrix_t* fm = (record->matrices) + s;
+      if (fm->offset == 0) continue;
+      *slot(e, s) = matrix_view((m->headers) + i*SLOTS + s, (matrix_element_t*) (base + fm->offset), fm->rows, fm->cols);
+    }
+
+    (t->equations)[i] = e;
+    position = record->next;
+  }
+
+  return t;
+}
+
+/*
+ * The smoothers replace the state and covariance of the steps with matrices
+ * of their own; views do not need to be freed.
+ */
+void kalman_trajectory_close(kalman_trajectory_t* t) {
+  if (t == NULL) return;
+  struct kalman_trajectory_mapping_st* m = t->mapping;
+  for (kalman_step_index_t i = 0; i < t->length; i++) {
+    matrix_free((t->equations)[i]->state);
+    matrix_free((t->equations)[i]->covariance);
+  }
+  unmap(m);
+  free(m->headers);
+  free(m->steps);
+  free(m);
+  free(t->equations);
+  free(t);
+}
+
+/******************************************************************************/
+/* END OF FILE                                                                */
+/******************************************************************************/
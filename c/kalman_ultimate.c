@@ -72,7 +72,7 @@ typedef struct step_st {
 } step_t;
 
 static void* step_create() {
-  step_t *s = malloc(sizeof(step_t));
+  step_t *s = matrix_pool_malloc(sizeof(step_t));
   s->step = -1;
   s->dimension = -1;
 
@@ -100,7 +100,7 @@ static void step_free(void *v) {
   matrix_free(s->y);
   matrix_free(s->Rbar);
   matrix_free(s->ybar);
-  free(s);
+  matrix_pool_free(s);
 }
 
 static void step_rollback(void *v) {
@@ -111,6 +111,30 @@ static void step_rollback(void *v) {
   matrix_free(s->Rdiag);
   matrix_free(s->Rsupdiag);
   matrix_free(s->y);
+  // step_free and kalman_restore may free the step later
+  s->covariance = NULL;
+  s->state = NULL;
+  s->Rdiag = NULL;
+  s->Rsupdiag = NULL;
+  s->y = NULL;
+}
+
+static void step_snapshot(void *dst_v, void *src_v) {
+  step_t *dst = (step_t*) dst_v;
+  step_t *src = (step_t*) src_v;
+
+  dst->step = src->step;
+  dst->dimension = src->dimension;
+
+  dst->Rdiag = matrix_recopy(dst->Rdiag, src->Rdiag);
+  dst->Rsupdiag = matrix_recopy(dst->Rsupdiag, src->Rsupdiag);
+  dst->y = matrix_recopy(dst->y, src->y);
+
+  dst->Rbar = matrix_recopy(dst->Rbar, src->Rbar);
+  dst->ybar = matrix_recopy(dst->ybar, src->ybar);
+
+  dst->state = matrix_recopy(dst->state, src->state);
+  dst->covariance = matrix_recopy(dst->covariance, src->covariance);
 }
 
 static kalman_step_index_t step_get_index(void *v) {
@@ -130,6 +154,7 @@ static kalman_matrix_t* step_get_covariance(void *v) {
 }
 
 static char step_get_covariance_type(void *v) {
+  (void) v;
   return 'W';
 }
 
@@ -172,44 +197,31 @@ static void evolve(kalman_t *kalman, int32_t n_i, matrix_t *H_i, matrix_t *F_i,
   //if (debug) printf("kalman_evolve F_i = %08x %d %d\n",F_i,F_i->row_dim,F_i->col_dim);
   //if (debug) matrix_print(F_i,NULL);
 
-#if 1
-  matrix_t *V_i_H_i = kalman_covariance_matrix_weigh(K_i, K_type, H_i);
-  matrix_t *V_i_F_i = kalman_covariance_matrix_weigh(K_i, K_type, F_i);
-  matrix_t *V_i_c_i = kalman_covariance_matrix_weigh(K_i, K_type, c_i);
-#else
-	matrix_t* V_i_H_i = matrix_create_copy(H_i);
-	matrix_t* V_i_F_i = matrix_create_copy(F_i);
-	matrix_t* V_i_c_i = matrix_create_copy(c_i);
-#endif
-
-  matrix_mutate_scale(V_i_F_i, -1.0);
+  /*
+   * The blocks [ Rdiag(i-1) 0 ; -V_i*F_i V_i*H_i ] and [ y(i-1) ; V_i*c_i ] to
+   * factor, with the weighed matrices written straight into their blocks.
+   */
+  int32_t z_i = (imo->Rdiag != NULL) ? matrix_rows(imo->Rdiag) : 0;
+  int32_t l_i = matrix_rows(F_i);
 
-#ifdef BUILD_DEBUG_PRINTOUTS
-	printf("evolve!\n");
-	printf("V_i_H_i ");
-	matrix_print(V_i_H_i,"%.3e");
-	printf("V_i_F_i ");
-	matrix_print(V_i_F_i,"%.3e");
-	printf("V_i_c_i ");
-	matrix_print(V_i_c_i,"%.3e");
-#endif
+  matrix_t *A = matrix_create(z_i + l_i, matrix_cols(F_i));
+  matrix_t *B = matrix_create_constant(z_i + l_i, n_i, 0.0);
+  matrix_t *y = matrix_create(z_i + l_i, 1);
 
-  matrix_t *A;
-  matrix_t *B;
-  matrix_t *y;
+  matrix_t view; // of blocks of A, B and y
 
-  if (imo->Rdiag != NULL) {
-    int32_t z_i = matrix_rows(imo->Rdiag);
-    A = matrix_create_vconcat(imo->Rdiag, V_i_F_i);
-    B = matrix_create_vconcat(matrix_create_constant(z_i, n_i, 0.0), V_i_H_i);
-    y = matrix_create_vconcat(imo->y, V_i_c_i);
-  } else {
-    A = matrix_create_copy(V_i_F_i);
-    B = matrix_create_copy(V_i_H_i);
-    y = matrix_create_copy(V_i_c_i);
+  if (z_i > 0) {
+    matrix_mutate_copy(matrix_view_sub(&view, A, 0, z_i, 0, matrix_cols(A)), imo->Rdiag);
+    matrix_mutate_copy(matrix_view_sub(&view, y, 0, z_i, 0, 1), imo->y);
   }
 
+  kalman_model_weigh_into(kalman->model, K_i, K_type, F_i, matrix_view_sub(&view, A, z_i, l_i, 0, matrix_cols(A)));
+  matrix_mutate_scale(&view, -1.0);
+  kalman_model_weigh_into(kalman->model, K_i, K_type, H_i, matrix_view_sub(&view, B, z_i, l_i, 0, n_i));
+  kalman_model_weigh_into(kalman->model, K_i, K_type, c_i, matrix_view_sub(&view, y, z_i, l_i, 0, 1));
+
 #ifdef BUILD_DEBUG_PRINTOUTS
+	printf("evolve!\n");
 	printf("A ");
 	matrix_print(A,"%.3e");
 	printf("B ");
@@ -325,23 +337,101 @@ static void evolve(kalman_t *kalman, int32_t n_i, matrix_t *H_i, matrix_t *F_i,
   if (imo->y != NULL)
     matrix_free(imo->y);
 
-  matrix_mutate_chop(A, MIN(matrix_rows(A), n_imo), matrix_cols(A)); // we only need the upper triangular part, and that's what we'll use; with the too-long LDA.
-  matrix_mutate_chop(B, MIN(matrix_rows(B), n_imo), matrix_cols(B));
-  matrix_mutate_chop(y, MIN(matrix_rows(y), n_imo), matrix_cols(y));
+  /*
+   * We keep only the top rows, without the slack below them: the upper
+   * triangle of A, packed when it is square, and the top of B and y.
+   */
+  int32_t r = MIN(matrix_rows(A), n_imo);
+  if (r == matrix_cols(A)) {
+    imo->Rdiag = matrix_create_packed(A);
+  } else {
+    imo->Rdiag = matrix_create_copy(matrix_view_sub(&view, A, 0, r, 0, matrix_cols(A)));
+    matrix_mutate_triu(imo->Rdiag);
+  }
+  imo->Rsupdiag = matrix_create_copy(matrix_view_sub(&view, B, 0, r, 0, matrix_cols(B)));
+  imo->y        = matrix_create_copy(matrix_view_sub(&view, y, 0, r, 0, matrix_cols(y)));
+
+  matrix_free(y);
+  matrix_free(A);
+  matrix_free(B);
+}
+
+/*
+ * The factor of the smoothed covariance of step i, given the factor R of the
+ * smoothed covariance of step i+1 (both of type 'W').
+ */
+static matrix_t* covariance_back(step_t *i, matrix_t *R) {
+  int32_t n_i = matrix_rows(i->Rdiag);
+  int32_t n_ipo = matrix_rows(R);
+  matrix_t view;
+  matrix_t *A = matrix_create_vconcat(i->Rsupdiag, R);
+  matrix_t *S = matrix_create_constant(n_i + n_ipo, matrix_cols(i->Rdiag), 0.0);
+  matrix_mutate_copy(matrix_view_sub(&view, S, 0, n_i, 0, matrix_cols(i->Rdiag)), i->Rdiag);
+  matrix_t *TAU = matrix_create_mutate_qr(A);
+  matrix_mutate_apply_qt(A, TAU, S);
+  matrix_free(TAU);
+  matrix_free(A);
+
+  matrix_t *R_i = matrix_create_sub(S, n_ipo, n_i, 0, n_i);
+  matrix_free(S);
+  return R_i;
+}
+
+/*
+ * Fixed-lag smoothing (kalman_set_fixed_lag). When step i has been observed,
+ * the estimate of step i-L is replaced by its smoothed estimate given steps up
+ * to i, and the steps before i-L are freed. The back substitution (and the
+ * covariance recursion) run over the L+1 steps of the window only and use
+ * temporaries, so steps i-L+1 to i keep their filtered estimates.
+ */
+static void smooth_fixed_lag(kalman_t *kalman) {
+  kalman_step_index_t last = farray_last_index(kalman->steps);
+  kalman_step_index_t lagged = last - kalman->lag;
+  kalman_step_index_t si;
+  step_t *i;
+
+  if (lagged < farray_first_index(kalman->steps))
+    return; // the window is not full yet
 
-  imo->Rdiag = A;
-  imo->Rsupdiag = B;
-  imo->y = y;
+  while (farray_first_index(kalman->steps) < lagged) {
+    void *step = farray_drop_first(kalman->steps);
+    step_free(step);
+  }
+
+  for (si = lagged; si <= last; si++) {
+    i = farray_get(kalman->steps, si);
+    if (i->Rdiag == NULL || matrix_rows(i->Rdiag) != matrix_cols(i->Rdiag))
+      return; // the window does not determine the states yet
+  }
 
-  matrix_mutate_triu(imo->Rdiag);
+  matrix_t *next = NULL; // estimate of step si+1
+  for (si = last; si >= lagged; si--) {
+    i = farray_get(kalman->steps, si);
+    matrix_t *state = matrix_create_copy(i->y);
+    if (next != NULL)
+      matrix_mutate_gemm(-1.0, i->Rsupdiag, next, 1.0, state);
+    matrix_mutate_trisolve("U", i->Rdiag, state);
+    matrix_free(next);
+    next = state;
+  }
 
-  //matrix_free(y);
-  //matrix_free(A);
-  //matrix_free(B);
+  i = farray_get(kalman->steps, lagged);
+  matrix_free(i->state);
+  i->state = next;
 
-  matrix_free(V_i_c_i);
-  matrix_free(V_i_F_i);
-  matrix_free(V_i_H_i);
+  if ((kalman->options & KALMAN_NO_COVARIANCE) == 0) {
+    i = farray_get(kalman->steps, last);
+    matrix_t *R = matrix_create_unpacked(i->Rdiag);
+    for (si = last - 1; si >= lagged; si--) {
+      i = farray_get(kalman->steps, si);
+      matrix_t *R_i = covariance_back(i, R);
+      matrix_free(R);
+      R = R_i;
+    }
+    i = farray_get(kalman->steps, lagged);
+    matrix_free(i->covariance);
+    i->covariance = R;
+  }
 }
 
 static void observe(kalman_t *kalman, matrix_t *G_i, matrix_t *o_i, matrix_t *C_i, char C_type) {
@@ -359,40 +449,44 @@ static void observe(kalman_t *kalman, matrix_t *G_i, matrix_t *o_i, matrix_t *C_
 	printf("observe %d\n",(int) kalman_current->step);
 #endif
 
-  matrix_t *W_i_G_i = NULL;
-  matrix_t *W_i_o_i = NULL;
-
-  if (o_i != NULL) { // no observations
 #ifdef BUILD_DEBUG_PRINTOUTS
+  if (o_i != NULL) {
 		printf("C_i(%c) ",C_type);
 		matrix_print(C_i,"%.3e");
 		printf("G_i ");
 		matrix_print(G_i,"%.3e");
 		printf("o_i ");
 		matrix_print(o_i,"%.3e");
+  }
 #endif
 
-#if 1
-    W_i_G_i = kalman_covariance_matrix_weigh(C_i, C_type, G_i);
-    W_i_o_i = kalman_covariance_matrix_weigh(C_i, C_type, o_i);
-#else
-		W_i_G_i = matrix_create_copy(G_i);
-		W_i_o_i = matrix_create_copy(o_i);
-#endif
+  //if (debug) printf("kalman_observe %08x %d %08x %d\n",G_i,G_i?matrix_rows(G_i):0, kalman->current->Rbar, kalman->current->Rbar?matrix_rows(kalman->current->Rbar):0);
 
-#ifdef BUILD_DEBUG_PRINTOUTS
-		printf("W_i_G_i ");
-		matrix_print(W_i_G_i,"%.3e");
-		printf("W_i_o_i ");
-		matrix_print(W_i_o_i,"%.3e");
-#endif
-  }
+  /*
+   * The blocks [ Rbar_i ; W_i*G_i ] and [ ybar_i ; W_i*o_i ], weighed in
+   * place as in evolve; none if there are no rows in either.
+   */
+  int32_t z_i = (kalman_current->Rbar != NULL) ? matrix_rows(kalman_current->Rbar) : 0;
+  int32_t m_i = (o_i != NULL) ? matrix_rows(o_i) : 0;
 
-  //if (debug) printf("kalman_observe %08x %d %08x %d\n",G_i,G_i?matrix_rows(G_i):0, kalman->current->Rbar, kalman->current->Rbar?matrix_rows(kalman->current->Rbar):0);
-  //if (debug) printf("current ybar %08x Rbar %08x Woi %08x\n",kalman->current->Rbar, kalman->current->ybar, W_i_o_i);
+  matrix_t *A = NULL;
+  matrix_t *y = NULL;
 
-  matrix_t *A = matrix_create_vconcat(kalman_current->Rbar, W_i_G_i);
-  matrix_t *y = matrix_create_vconcat(kalman_current->ybar, W_i_o_i);
+  if (z_i + m_i > 0) {
+    matrix_t view; // of blocks of A and y
+
+    A = matrix_create(z_i + m_i, n_i);
+    y = matrix_create(z_i + m_i, 1);
+
+    if (z_i > 0) {
+      matrix_mutate_copy(matrix_view_sub(&view, A, 0, z_i, 0, n_i), kalman_current->Rbar);
+      matrix_mutate_copy(matrix_view_sub(&view, y, 0, z_i, 0, 1), kalman_current->ybar);
+    }
+    if (m_i > 0) {
+      kalman_model_weigh_into(kalman->model, C_i, C_type, G_i, matrix_view_sub(&view, A, z_i, m_i, 0, n_i));
+      kalman_model_weigh_into(kalman->model, C_i, C_type, o_i, matrix_view_sub(&view, y, z_i, m_i, 0, 1));
+    }
+  }
 
   if (A != NULL) { // we got some rows from at least one of the two blocks
 #ifdef BUILD_DEBUG_PRINTOUTS
@@ -484,20 +578,24 @@ static void observe(kalman_t *kalman, matrix_t *G_i, matrix_t *o_i, matrix_t *C_
 		matrix_print(y,"%.3e");
 #endif
 
-      matrix_mutate_chop(A, MIN(matrix_rows(A), n_i), matrix_cols(A));
-      matrix_mutate_chop(y, MIN(matrix_rows(y), n_i), matrix_cols(y));
-
-      //if (debug) printf("**** %d %d %d %d\n",matrix_rows(A),matrix_ld(A),matrix_rows(y),matrix_ld(y));
+      // as in evolve, we keep the triangle (packed if square) and the top of y
+      matrix_t view;
+      int32_t r = MIN(matrix_rows(A), n_i);
+      if (r == matrix_cols(A)) {
+        kalman_current->Rdiag = matrix_create_packed(A);
+      } else {
+        kalman_current->Rdiag = matrix_create_copy(matrix_view_sub(&view, A, 0, r, 0, matrix_cols(A)));
+        matrix_mutate_triu(kalman_current->Rdiag);
+      }
+      kalman_current->y = matrix_create_copy(matrix_view_sub(&view, y, 0, r, 0, matrix_cols(y)));
 
 #ifdef BUILD_DEBUG_PRINTOUTS
-		printf("A ");
-		matrix_print(A,"%.3e");
+		printf("Rdiag ");
+		matrix_print(kalman_current->Rdiag,"%.3e");
 #endif
 
-      kalman_current->Rdiag = A;
-      kalman_current->y = y;
-
-      matrix_mutate_triu(kalman_current->Rdiag);
+      matrix_free(A);
+      matrix_free(y);
 
     } else { // A is flat, no need to factor
       //printf("obs step %d no need to factor, flat\n",kalman->current->step);
@@ -511,7 +609,7 @@ static void observe(kalman_t *kalman, matrix_t *G_i, matrix_t *o_i, matrix_t *C_
 
     if (matrix_rows(kalman_current->Rdiag) == n_i) {
 
-      state = matrix_create_trisolve("U",kalman_current->Rdiag, y);
+      state = matrix_create_trisolve("U",kalman_current->Rdiag, kalman_current->y);
 
       /*
 
@@ -542,13 +640,12 @@ static void observe(kalman_t *kalman, matrix_t *G_i, matrix_t *o_i, matrix_t *C_
     }
 
     kalman_current->state = state;
-    kalman_current->covariance = matrix_create_copy(kalman_current->Rdiag);
+    kalman_current->covariance = matrix_create_unpacked(kalman_current->Rdiag);
   }
 
-  matrix_free(W_i_G_i);
-  matrix_free(W_i_o_i);
-
   farray_append(kalman->steps, kalman->current);
+
+  if (kalman->lag >= 0) smooth_fixed_lag(kalman);
   //kalman->current = NULL; // had no effect, commented out Aug 2024 to avoid bugs in testing
 
 #ifdef BUILD_DEBUG_PRINTOUTS
@@ -590,43 +687,60 @@ static void smooth(kalman_t *kalman) {
 
   //printf("smooth2 %d to %d\n",last,first);
 
-  if ((kalman->options & KALMAN_NO_COVARIANCE) == 0) {
+  if (kalman->options & KALMAN_LAZY_COVARIANCE) {
+    // the filtered covariances are stale; covariance_materialize computes the smoothed ones
+    for (si = last - 1; si >= first; si--) {
+      i = farray_get(kalman->steps, si);
+      matrix_free(i->covariance);
+      i->covariance = NULL;
+    }
+  } else if ((kalman->options & KALMAN_NO_COVARIANCE) == 0) {
     matrix_t *R;
-    int32_t n_i, n_ipo;
     for (si = last; si >= first; si--) {
       i = farray_get(kalman->steps, si);
       if (si == last) {
         R = i->Rdiag;
-        n_ipo = matrix_rows(i->Rdiag);
       } else {
         matrix_free(i->covariance);
-
-        n_i = matrix_rows(i->Rdiag);
-        matrix_t *A = matrix_create_vconcat(i->Rsupdiag, R);
-        matrix_t *S = matrix_create_vconcat(i->Rdiag,
-            matrix_create_constant(matrix_rows(R), matrix_cols(i->Rdiag), 0.0));
-        matrix_t *TAU = matrix_create_mutate_qr(A);
-        matrix_mutate_apply_qt(A, TAU, S);
-        matrix_free(TAU);
-        matrix_free(A);
-
-        R = i->covariance = matrix_create_sub(S, n_ipo, n_i, 0, n_i);
-        matrix_free(S);
-
-        n_ipo = n_i;
+        R = i->covariance = covariance_back(i, R);
       }
     }
   } /* end of if not NO_COVARIANCE */
 }
 
+/*
+ * Lazy covariances: the recursion of smooth, from the nearest later step whose
+ * covariance is known down to step si, keeping the covariances of the steps
+ * in between, so that queries of nearby steps are cheap.
+ */
+static void covariance_materialize(kalman_t *kalman, kalman_step_index_t si) {
+  kalman_step_index_t last = farray_last_index(kalman->steps);
+  kalman_step_index_t sj;
+  step_t *i;
+
+  for (sj = si; sj <= last; sj++) {
+    i = farray_get(kalman->steps, sj);
+    if (i->covariance != NULL) break;
+  }
+  if (sj > last) return; // not even the last step is determined
+
+  matrix_t *R = i->covariance;
+  for (sj = sj - 1; sj >= si; sj--) {
+    i = farray_get(kalman->steps, sj);
+    R = i->covariance = covariance_back(i, R);
+  }
+}
+
 void kalman_create_ultimate(kalman_t *kalman) {
   kalman->evolve = evolve;
   kalman->observe = observe;
   kalman->smooth = smooth;
+  kalman->covariance_materialize = covariance_materialize;
 
   kalman->step_create = step_create;
   kalman->step_free = step_free;
   kalman->step_rollback = step_rollback;
+  kalman->step_snapshot = step_snapshot;
   kalman->step_get_index = step_get_index;
   kalman->step_get_dimension = step_get_dimension;
   kalman->step_get_state = step_get_state;
@@ -0,0 +1,162 @@
+/*
+ * kalman_windowed_smoother.c
+ *
+ * A driver that smooths a long trajectory in windows, using the odd-even or
+ * the associative parallel smoother on each window. The trajectory is split
+ * into consecutive core windows; each window is extended by overlap steps on
+ * both sides, smoothed on its own, and only the estimates of its core steps
+ * are kept. Windows are processed in parallel using foreach_in_range, so the
+ * smoothers' working storage is proportional to the window size times the
+ * number of windows in flight, not to the length of the trajectory.
+ *
+ * The windows are not coupled: the first step of an extended window (unless
+ * it is step 0) loses its evolution equation, and the steps beyond the ends
+ * of the extended window are ignored. The result is therefore exact only when
+ * there is a single window, and an approximation otherwise, whose error near
+ * a core boundary decays with the distance to the end of the extended window,
+ * exponentially for stable, observable models. Without overlap the error at
+ * the boundaries is of the order of the estimates themselves, so several
+ * windows require an overlap of at least KALMAN_WINDOWED_MIN_OVERLAP steps,
+ * and no more than the window itself; other settings are rejected. The
+ * remainder of the trajectory is added to the last window, so that no window
+ * is shorter than the others.
+ *
+ * (C) Sivan Toledo, 2022-2025
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+
+#ifdef BUILD_MEX
+#include "mex.h"
+
+static char assert_msg[128];
+static void mex_assert(int c, int line) {
+    if (!c) {
+        sprintf(assert_msg,"Assert failed in %s line %d",__FILE__,line);
+        mexErrMsgIdAndTxt("MyToolbox:arrayProduct:assertion",assert_msg);
+    }
+}
+
+#define assert(c) mex_assert((c),__LINE__)
+#else
+#include <assert.h>
+#endif
+
+#define KALMAN_MATRIX_SHORT_TYPE
+#include "kalman.h"
+#include "parallel.h"
+
+#define MIN(a,b) ((a)<(b) ? (a) : (b))
+#define MAX(a,b) ((a)>(b) ? (a) : (b))
+
+/******************************************************************************/
+/* WINDOWS                                                                    */
+/******************************************************************************/
+
+typedef struct window_call_st {
+	kalman_options_t          options;
+	kalman_step_equations_t** equations;
+	kalman_step_index_t       length;
+	kalman_step_index_t       window;
+	kalman_step_index_t       overlap;
+	kalman_step_index_t       number_of_windows;
+} window_call_t;
+
+/*
+ * The smoothers read the equations but write the state and covariance of
+ * every step, so each window works on shallow copies of its equations: the
+ * copies share the matrices of the trajectory, and only the estimates of the
+ * core steps are moved back. The first copy is renumbered as step 0 and loses
+ * its evolution equation, whose predecessor is outside the window.
+ */
+static void smooth_window(window_call_t* call, kalman_step_index_t w) {
+	kalman_step_index_t core_start = w * call->window;
+	kalman_step_index_t core_end   = (w == call->number_of_windows - 1) ? call->length : core_start + call->window;
+	kalman_step_index_t start      = MAX(core_start - call->overlap, 0);
+	kalman_step_index_t end        = MIN(core_end   + call->overlap, call->length);
+	kalman_step_index_t l          = end - start;
+	kalman_step_index_t j;
+
+	kalman_step_equations_t*  copies = (kalman_step_equations_t*)  malloc(l * sizeof(kalman_step_equations_t));
+	kalman_step_equations_t** window = (kalman_step_equations_t**) malloc(l * sizeof(kalman_step_equations_t*));
+	assert(copies != NULL);
+	assert(window != NULL);
+
+	for (j = 0; j < l; j++) {
+		copies[j] = *(call->equations[start + j]);
+		copies[j].step       = j;
+		copies[j].state      = NULL;
+		copies[j].covariance = NULL;
+		window[j] = &(copies[j]);
+	}
+	copies[0].H = NULL;
+	copies[0].F = NULL;
+	copies[0].c = NULL;
+	copies[0].K = NULL;
+
+	if (call->options & KALMAN_ALGORITHM_ASSOCIATIVE) kalman_smooth_associative(call->options, window, l);
+	else                                              kalman_smooth_oddeven    (call->options, window, l);
+
+	for (j = 0; j < l; j++) {
+		if (start + j >= core_start && start + j < core_end) {
+			kalman_step_equations_t* equation = call->equations[start + j];
+			matrix_free(equation->state);
+			matrix_free(equation->covariance);
+			equation->state           = copies[j].state;
+			equation->covariance      = copies[j].covariance;
+			equation->covariance_type = copies[j].covariance_type;
+		} else {
+			matrix_free(copies[j].state);
+			matrix_free(copies[j].covariance);
+		}
+	}
+
+	free(window);
+	free(copies);
+}
+
+static void smooth_windows(void* call_v, parallel_index_t length, parallel_index_t start, parallel_index_t end) {
+	(void) length;
+	window_call_t* call = (window_call_t*) call_v;
+	for (parallel_index_t w = start; w < end; w++) {
+		double begin = kalman_phase_begin();
+		smooth_window(call, (kalman_step_index_t) w);
+		kalman_phase_end("windowed-window", (int32_t) w, begin);
+	}
+}
+
+/******************************************************************************/
+/* PUBLIC INTERFACE                                                           */
+/******************************************************************************/
+
+int kalman_smooth_windowed(kalman_options_t options, kalman_step_equations_t** equations, kalman_step_index_t length,
+                           kalman_step_index_t window, kalman_step_index_t overlap) {
+	if (length == 0) return 1;
+
+	if (overlap < 0) return 0;
+	if (window <= 0 || window >= length) window = length;
+	if (window < length && (overlap < KALMAN_WINDOWED_MIN_OVERLAP || overlap > window)) return 0;
+
+	window_call_t call;
+	call.options   = options;
+	call.equations = equations;
+	call.length    = length;
+	call.window    = window;
+	call.overlap   = overlap;
+	call.number_of_windows = length / window; // the remainder goes to the last window
+
+	int32_t n = 0;
+	for (kalman_step_index_t i = 0; i < length; i++) n = MAX(n, equations[i]->dimension);
+
+	int previous = parallel_budget_begin(n, length);
+	foreach_in_range(smooth_windows, &call, length, call.number_of_windows);
+	parallel_budget_end(previous);
+	return 1;
+}
+
+/******************************************************************************/
+/* END OF FILE                                                                */
+/******************************************************************************/
@@ -41,7 +41,9 @@ static void mex_assert(int c, int line) {
 
 #define KALMAN_MATRIX_SHORT_TYPE
 #include "matrix_ops.h"
+#include "matrix_small.h"
 #include "memory.h"
+#include "instrument.h"
 
 /******************************************************************************/
 /* UTILITIES                                                                  */
@@ -64,6 +66,7 @@ void matrix_set(matrix_t* A, int32_t i, int32_t j, double v) {
 	assert(j >= 0);
 	assert(i < A->row_dim);
 	assert(j < A->col_dim);
+	assert(A->ld != MATRIX_PACKED_LD);
 	(A->elements)[ j*(A->ld) + i ] = v;
 }
 
@@ -72,10 +75,17 @@ double matrix_get(matrix_t* A, int32_t i, int32_t j) {
 	assert(j >= 0);
 	assert(i < A->row_dim);
 	assert(j < A->col_dim);
+	assert(A->ld != MATRIX_PACKED_LD);
 	return (A->elements)[ j*(A->ld) + i ];
 }
 #endif
 
+// like matrix_get, but also reads packed matrices
+static double element(matrix_t* A, int32_t i, int32_t j) {
+	if (A->ld != MATRIX_PACKED_LD) return matrix_get(A,i,j);
+	return (i <= j) ? (A->elements)[ i + (j*(j+1))/2 ] : 0.0;
+}
+
 // this replaces the matrix by its top-left block
 void matrix_mutate_chop(matrix_t* A, int32_t rows, int32_t cols) {
 	assert(rows >= 0);
@@ -98,24 +108,292 @@ void matrix_mutate_triu(matrix_t* A) {
 	}
 }
 
+/******************************************************************************/
+/* MATRIX POOLS                                                               */
+/******************************************************************************/
+
+#if defined(_MSC_VER)
+#define THREAD_LOCAL __declspec(thread)
+#else
+#define THREAD_LOCAL __thread
+#endif
+
+// size class c holds chunks of 64*2^c bytes; larger requests go to the heap
+#define POOL_CLASSES      20
+#define POOL_CHUNK_MIN    64
+// untyped blocks carry a prefix recording their pool and size class
+#define POOL_BLOCK_PREFIX 16
+
+struct matrix_pool_st {
+	void*     chunks[POOL_CLASSES]; // free chunks, linked through their first word
+	matrix_t* headers;              // free headers, linked through elements
+	int64_t   outstanding;          // matrices and blocks currently in use
+	int       released;             // owner is gone, destroy when outstanding is 0
+};
+
+typedef struct pool_block_st {
+	matrix_pool_t* pool;
+	int32_t        size_class;
+} pool_block_t;
+
+static THREAD_LOCAL matrix_pool_t* current_pool = NULL;
+
+static int32_t pool_size_class(size_t bytes) {
+	int32_t c = 0;
+	size_t  s = POOL_CHUNK_MIN;
+	while (s < bytes && c < POOL_CLASSES) {
+		s <<= 1;
+		c++;
+	}
+	return (c < POOL_CLASSES ? c : -1);
+}
+
+static void* pool_chunk_get(matrix_pool_t* pool, int32_t c) {
+	void* p = (pool->chunks)[c];
+	if (p != NULL) {
+		(pool->chunks)[c] = *((void**) p);
+	} else {
+		p = malloc(((size_t) POOL_CHUNK_MIN) << c);
+		assert(p != NULL);
+	}
+	(pool->outstanding)++;
+	return p;
+}
+
+static void pool_destroy(matrix_pool_t* pool) {
+	int32_t c;
+	for (c=0; c<POOL_CLASSES; c++) {
+		while ((pool->chunks)[c] != NULL) {
+			void* p = (pool->chunks)[c];
+			(pool->chunks)[c] = *((void**) p);
+			free(p);
+		}
+	}
+	while (pool->headers != NULL) {
+		matrix_t* A = pool->headers;
+		pool->headers = (matrix_t*) (A->elements);
+		free(A);
+	}
+	if (pool->outstanding == 0) free(pool);
+}
+
+static void pool_chunk_put(matrix_pool_t* pool, int32_t c, void* p) {
+	assert(pool->outstanding > 0);
+	(pool->outstanding)--;
+	if (pool->released) {
+		free(p);
+		if (pool->outstanding == 0) free(pool);
+		return;
+	}
+	*((void**) p) = (pool->chunks)[c];
+	(pool->chunks)[c] = p;
+}
+
+matrix_pool_t* matrix_pool_create() {
+	int32_t c;
+	matrix_pool_t* pool = malloc(sizeof(matrix_pool_t));
+	assert(pool != NULL);
+	for (c=0; c<POOL_CLASSES; c++) (pool->chunks)[c] = NULL;
+	pool->headers     = NULL;
+	pool->outstanding = 0;
+	pool->released    = 0;
+	return pool;
+}
+
+void matrix_pool_release(matrix_pool_t* pool) {
+	if (pool == NULL) return;
+	if (current_pool == pool) current_pool = NULL;
+	pool->released = 1;
+	pool_destroy(pool); // frees the pool itself only if nothing is outstanding
+}
+
+matrix_pool_t* matrix_pool_set_current(matrix_pool_t* pool) {
+	matrix_pool_t* previous = current_pool;
+	current_pool = pool;
+	return previous;
+}
+
+matrix_pool_t* matrix_pool_get_current() {
+	return current_pool;
+}
+
+void* matrix_pool_malloc(size_t size) {
+	matrix_pool_t* pool = current_pool;
+	int32_t        c    = (pool == NULL ? -1 : pool_size_class(size + POOL_BLOCK_PREFIX));
+	pool_block_t*  b;
+
+	if (c >= 0) {
+		b = pool_chunk_get(pool, c);
+	} else {
+		b = malloc(size + POOL_BLOCK_PREFIX);
+		assert(b != NULL);
+		pool = NULL;
+	}
+	b->pool       = pool;
+	b->size_class = c;
+	return ((char*) b) + POOL_BLOCK_PREFIX;
+}
+
+void matrix_pool_free(void* block) {
+	if (block == NULL) return;
+	pool_block_t* b = (pool_block_t*) (((char*) block) - POOL_BLOCK_PREFIX);
+	if (b->pool == NULL) free(b);
+	else                 pool_chunk_put(b->pool, b->size_class, b);
+}
+
+/******************************************************************************/
+/* MATRIX SLABS                                                               */
+/******************************************************************************/
+
+// size class of matrices whose elements are in a slab, or not ours (views)
+#define SLAB_SIZE_CLASS -2
+// elements per cache line; block strides are multiples of it
+#define SLAB_LINE       ((int32_t) (64 / sizeof(matrix_element_t)))
+
+struct matrix_slab_st {
+	int64_t   count;
+	int32_t   capacity;
+	int32_t   stride;   // in elements
+	void*     buffer;   // as returned by malloc
+	matrix_element_t* elements; // aligned to a cache line
+	matrix_t* headers;
+};
+
+matrix_slab_t* matrix_slab_create(int64_t count, int32_t capacity) {
+	assert(count >= 0);
+	assert(capacity >= 0);
+
+	matrix_slab_t* slab = malloc(sizeof(matrix_slab_t));
+	assert(slab != NULL);
+
+	slab->count    = count;
+	slab->capacity = capacity;
+	slab->stride   = ((capacity + SLAB_LINE - 1) / SLAB_LINE) * SLAB_LINE;
+	slab->buffer   = malloc(((size_t) count) * ((size_t) slab->stride) * sizeof(matrix_element_t) + SLAB_LINE*sizeof(matrix_element_t));
+	slab->headers  = malloc(((size_t) count) * sizeof(matrix_t) + 1);
+	assert(slab->buffer  != NULL);
+	assert(slab->headers != NULL);
+	INSTRUMENT_COUNT(INSTRUMENT_SLAB_BYTES, ((size_t) count) * ((size_t) slab->stride) * sizeof(matrix_element_t));
+
+	uintptr_t line   = SLAB_LINE*sizeof(matrix_element_t);
+	slab->elements   = (matrix_element_t*) ((((uintptr_t) slab->buffer) + line - 1) & ~(line - 1));
+
+	return slab;
+}
+
+matrix_t* matrix_slab_matrix(matrix_slab_t* slab, int64_t i, int32_t rows, int32_t cols) {
+	assert(i >= 0 && i < slab->count);
+
+	if (((int64_t) rows) * ((int64_t) cols) > slab->capacity) {
+		INSTRUMENT_COUNT(INSTRUMENT_SLAB_OVERFLOWS, 1);
+		return matrix_create(rows,cols);
+	}
+
+	INSTRUMENT_COUNT(INSTRUMENT_SLAB_MATRICES, 1);
+	matrix_t* A = (slab->headers) + i;
+	A->row_dim    = rows;
+	A->col_dim    = cols;
+	A->ld         = rows;
+	A->size_class = SLAB_SIZE_CLASS;
+	A->elements   = (slab->elements) + i*(slab->stride);
+	A->pool       = NULL;
+	return A;
+}
+
+void matrix_slab_free(matrix_slab_t* slab) {
+	if (slab == NULL) return;
+	free(slab->headers);
+	free(slab->buffer);
+	free(slab);
+}
+
+matrix_t* matrix_view(matrix_t* header, matrix_element_t* elements, int32_t rows, int32_t cols) {
+	header->row_dim    = rows;
+	header->col_dim    = cols;
+	header->ld         = rows;
+	header->size_class = SLAB_SIZE_CLASS;
+	header->elements   = elements;
+	header->pool       = NULL;
+	return header;
+}
+
+matrix_t* matrix_view_sub(matrix_t* header, matrix_t* A, int32_t first_row, int32_t rows, int32_t first_col, int32_t cols) {
+	assert(A->ld != MATRIX_PACKED_LD);
+	assert(first_row >= 0);
+	assert(first_col >= 0);
+	assert(first_row+rows <= A->row_dim);
+	assert(first_col+cols <= A->col_dim);
+
+	header->row_dim    = rows;
+	header->col_dim    = cols;
+	header->ld         = A->ld;
+	header->size_class = SLAB_SIZE_CLASS;
+	header->elements   = (A->elements) + ((size_t) first_col)*(A->ld) + first_row;
+	header->pool       = NULL;
+	return header;
+}
+
+/*
+ * Creates a rows-by-cols matrix with count undefined elements
+ */
+static matrix_t* create(int32_t rows, int32_t cols, size_t count) {
+	matrix_t*      A;
+	matrix_pool_t* pool  = current_pool;
+	size_t         bytes = count * sizeof(matrix_element_t);
+	int32_t        c     = (pool == NULL ? -1 : pool_size_class(bytes));
+
+	INSTRUMENT_COUNT(INSTRUMENT_ALLOCATIONS,     1);
+	INSTRUMENT_COUNT(INSTRUMENT_ALLOCATED_BYTES, bytes);
+
+	if (c >= 0) {
+		if (pool->headers != NULL) {
+			A = pool->headers;
+			pool->headers = (matrix_t*) (A->elements);
+		} else {
+			A = malloc(sizeof(matrix_t));
+			assert( A!= NULL );
+		}
+		A->elements = pool_chunk_get(pool, c);
+	} else {
+		A = malloc(sizeof(matrix_t));
+		assert( A!= NULL );
+		A->elements = malloc(bytes);
+		pool = NULL;
+	}
+	assert( A->elements != NULL );
+	A->row_dim    = rows;
+	A->col_dim    = cols;
+	A->ld         = rows;
+	A->size_class = c;
+	A->pool       = pool;
+	return A;
+}
+
 /*
  * Creates a matrix with undefined elements
  */
 matrix_t* matrix_create(int32_t rows, int32_t cols) {
-	matrix_t* A = malloc(sizeof(matrix_t));
-	assert( A!= NULL );
-	A->row_dim = rows;
-	A->col_dim = cols;
-	A->ld      = rows;
-	A->elements = malloc(rows*cols*sizeof(double));
-	assert( A->elements != NULL );
-	return A;
+	return create(rows, cols, ((size_t) rows) * ((size_t) cols));
 }
 
 void matrix_free(matrix_t* A) {
 	if (A==NULL) return;
-	free( A->elements );
-	free( A );
+	if (A->size_class == SLAB_SIZE_CLASS) return; // freed with its slab
+	matrix_pool_t* pool = A->pool;
+	if (pool == NULL) {
+		free( A->elements );
+		free( A );
+		return;
+	}
+	matrix_element_t* elements = A->elements;
+	int32_t size_class = A->size_class;
+	if (pool->released) {
+		free( A );
+	} else {
+		A->elements = (matrix_element_t*) (pool->headers);
+		pool->headers = A;
+	}
+	pool_chunk_put(pool, size_class, elements);
 }
 
 int32_t matrix_rows(matrix_t* A) { return A->row_dim; }
@@ -183,7 +461,7 @@ void matrix_print(matrix_t* A, char* format) {
 
 	for (i=0; i<A->row_dim; i++) {
 		for (j=0; j<A->col_dim; j++) {
-			printf(format,matrix_get(A,i,j));
+			printf(format,element(A,i,j));
 			printf(" ");
 		}
 		printf("\n");
@@ -202,15 +480,25 @@ void matrix_mutate_copy(matrix_t* C, matrix_t* A) {
 	int32_t rows  = (A->row_dim);
 	int32_t cols  = (A->col_dim);
 
+	if (C->ld == MATRIX_PACKED_LD) {
+		for (j=0; j<cols; j++) {
+			for (i=0; i<=j; i++) {
+				(C->elements)[ i + (j*(j+1))/2 ] = element(A,i,j);
+			}
+		}
+		return;
+	}
+
 	for (i=0; i<rows; i++) {
 		for (j=0; j<cols; j++) {
-			matrix_set(C,i,j,matrix_get(A,i,j));
+			matrix_set(C,i,j,element(A,i,j));
 		}
 	}
 }
 
 matrix_t* matrix_create_copy(matrix_t* A) {
 	if (A==NULL) return NULL;
+	if (A->ld == MATRIX_PACKED_LD) return matrix_create_packed(A);
 
 	int32_t rows  = (A->row_dim);
 	int32_t cols  = (A->col_dim);
@@ -230,6 +518,51 @@ matrix_t* matrix_create_copy(matrix_t* A) {
 	return C;
 }
 
+matrix_t* matrix_recopy(matrix_t* C, matrix_t* A) {
+	if (A != NULL && C != NULL && matrix_rows(A) == matrix_rows(C) && matrix_cols(A) == matrix_cols(C)
+	    && matrix_is_packed(A) == matrix_is_packed(C)) {
+		matrix_mutate_copy(C, A);
+		return C;
+	}
+	matrix_free(C);
+	return matrix_create_copy(A);
+}
+
+/******************************************************************************/
+/* PACKED TRIANGULAR MATRICES                                                 */
+/******************************************************************************/
+
+int matrix_is_packed(matrix_t* A) {
+	return A->ld == MATRIX_PACKED_LD;
+}
+
+matrix_t* matrix_create_packed(matrix_t* A) {
+	assert(A != NULL);
+	assert(matrix_rows(A) >= matrix_cols(A));
+
+	int32_t n = matrix_cols(A);
+
+	int32_t i,j;
+
+	matrix_t* C = create(n, n, (((size_t) n) * ((size_t) (n+1))) / 2);
+	C->ld = MATRIX_PACKED_LD;
+
+	for (j=0; j<n; j++) {
+		for (i=0; i<=j; i++) {
+			(C->elements)[ i + (j*(j+1))/2 ] = element(A,i,j);
+		}
+	}
+	return C;
+}
+
+matrix_t* matrix_create_unpacked(matrix_t* A) {
+	if (A==NULL) return NULL;
+
+	matrix_t* C = matrix_create(matrix_rows(A),matrix_cols(A));
+	matrix_mutate_copy(C,A);
+	return C;
+}
+
 
 matrix_t* matrix_create_sub(matrix_t* A, int32_t first_row, int32_t rows, int32_t first_col, int32_t cols) {
 	int i,j;
@@ -291,13 +624,13 @@ matrix_t* matrix_create_vconcat(matrix_t* A, matrix_t* B) {
 
 	for (i=0; i<Arows; i++) {
 		for (j=0; j<cols; j++) {
-			matrix_set(C,i,j,matrix_get(A,i,j));
+			matrix_set(C,i,j,element(A,i,j));
 		}
 	}
 
 	for (   ; i<rows; i++) {
 		for (j=0; j<cols; j++) {
-			matrix_set(C,i,j,matrix_get(B,i-Arows,j));
+			matrix_set(C,i,j,element(B,i-Arows,j));
 		}
 	}
 
@@ -319,6 +652,38 @@ void matrix_mutate_scale(matrix_t* A, double s) {
 	}
 }
 
+/*
+ * On raw columns, so that the inner loop is a unit-stride multiply that the
+ * compiler vectorizes; the in-place case is separate so that it has no
+ * possible aliasing between the input and the output.
+ */
+void matrix_mutate_scale_rows(matrix_t* C, matrix_t* d, matrix_t* A) {
+	assert(C != NULL);
+	assert(d != NULL);
+	assert(A != NULL);
+	assert(matrix_rows(d) == matrix_rows(A));
+	assert(matrix_rows(C) == matrix_rows(A));
+	assert(matrix_cols(C) == matrix_cols(A));
+	assert(A->ld != MATRIX_PACKED_LD && C->ld != MATRIX_PACKED_LD);
+
+	int32_t i,j;
+
+	int32_t rows = matrix_rows(A);
+	int32_t cols = matrix_cols(A);
+
+	const matrix_element_t* w = d->elements;
+
+	for (j=0; j<cols; j++) {
+		matrix_element_t* c = (C->elements) + ((size_t) j)*(C->ld);
+		if (C == A) {
+			for (i=0; i<rows; i++) c[i] *= w[i];
+		} else {
+			const matrix_element_t* a = (A->elements) + ((size_t) j)*(A->ld);
+			for (i=0; i<rows; i++) c[i] = w[i] * a[i];
+		}
+	}
+}
+
 /* function from ultimatekalman_oddeven.c; name is wrong, there is no mutation */
 /*
 matrix_t* matrix_mutate_subtract(matrix_t* A, matrix_t* B) {
@@ -342,6 +707,75 @@ matrix_t* matrix_mutate_subtract(matrix_t* A, matrix_t* B) {
 */
 
 
+/******************************************************************************/
+/* SMALL-MATRIX KERNELS                                                       */
+/******************************************************************************/
+
+static THREAD_LOCAL int small_kernels = 0;
+
+int matrix_small_kernels_set(int enabled) {
+	int previous = small_kernels;
+	small_kernels = enabled;
+	return previous;
+}
+
+/******************************************************************************/
+/* LAPACK WORKSPACE                                                           */
+/******************************************************************************/
+
+/*
+ * Each thread caches the optimal LWORK of the shapes it factors and keeps a
+ * grow-only WORK buffer, so a fixed-model filter queries LAPACK for each shape
+ * once. Everything is thread-local, so the parallel smoothers can call the QR
+ * routines concurrently.
+ */
+
+#define WORKSPACE_CACHE_SIZE 64
+
+typedef struct workspace_entry_st {
+	char       routine; // 'q' for dgeqrf, 'o' for dormqr, 0 if empty
+	blas_int_t M, N, K;
+	blas_int_t LWORK;   // -1 if not queried yet
+} workspace_entry_t;
+
+static THREAD_LOCAL workspace_entry_t workspace_cache[WORKSPACE_CACHE_SIZE];
+static THREAD_LOCAL matrix_element_t* workspace      = NULL;
+static THREAD_LOCAL blas_int_t        workspace_size = 0;
+
+// direct mapped; a collision just evicts the older shape
+static workspace_entry_t* workspace_lookup(char routine, blas_int_t M, blas_int_t N, blas_int_t K) {
+	uint32_t h = (uint32_t) routine;
+	h = h*31u + (uint32_t) M;
+	h = h*31u + (uint32_t) N;
+	h = h*31u + (uint32_t) K;
+
+	workspace_entry_t* e = &(workspace_cache[ h % WORKSPACE_CACHE_SIZE ]);
+	if (e->routine == routine && e->M == M && e->N == N && e->K == K) return e;
+
+	e->routine = routine;
+	e->M       = M;
+	e->N       = N;
+	e->K       = K;
+	e->LWORK   = -1;
+	return e;
+}
+
+static matrix_element_t* workspace_get(blas_int_t LWORK) {
+	if (LWORK > workspace_size) {
+		free(workspace);
+		workspace = malloc(((size_t) LWORK) * sizeof(matrix_element_t));
+		assert(workspace != NULL);
+		workspace_size = LWORK;
+	}
+	return workspace;
+}
+
+void matrix_workspace_free() {
+	free(workspace);
+	workspace      = NULL;
+	workspace_size = 0;
+}
+
 // returns TAU
 // nor for flat matrices
 matrix_t* matrix_create_mutate_qr(matrix_t* A) {
@@ -354,7 +788,7 @@ matrix_t* matrix_create_mutate_qr(matrix_t* A) {
 	assert(rows >= cols);
 
 	blas_int_t M,N,LDA,LWORK,INFO;
-	double     WORK_SCALAR;
+	matrix_element_t WORK_SCALAR;
 
 	M   = matrix_rows(A);
 	N   = matrix_cols(A);
@@ -362,31 +796,44 @@ matrix_t* matrix_create_mutate_qr(matrix_t* A) {
 
 	matrix_t* TAU = matrix_create(N,1);
 
-	LWORK = -1; // tell lapack to compute the size of the work area required
-	//if (debug) printf("dgeqrf: M=%d N=%d LDA=%d LWORK=%d\n",M,N,LDA,LWORK);
+	INSTRUMENT_TIMER_BEGIN(timer);
+
+	if (small_kernels && N <= MATRIX_SMALL_MAX) {
+		matrix_small_qr(M, N, A->elements, LDA, TAU->elements);
+		INSTRUMENT_TIMER_END(INSTRUMENT_QR, timer);
+		return TAU;
+	}
+
+	workspace_entry_t* cached = workspace_lookup('q', M, N, 0);
+	if (cached->LWORK < 0) {
+		LWORK = -1; // tell lapack to compute the size of the work area required
+		//if (debug) printf("dgeqrf: M=%d N=%d LDA=%d LWORK=%d\n",M,N,LDA,LWORK);
 
 #ifdef BUILD_BLAS_UNDERSCORE
-  dgeqrf_
+  BLAS_PRECISION(dgeqrf_,sgeqrf_)
 #else
-  dgeqrf
+  BLAS_PRECISION(dgeqrf,sgeqrf)
 #endif
-	      (&M, &N, A->elements, &LDA, TAU->elements, &WORK_SCALAR, &LWORK, &INFO);
-	if (INFO != 0) printf("dgeqrf INFO=%d\n",INFO);
-	assert(INFO==0);
+		      (&M, &N, A->elements, &LDA, TAU->elements, &WORK_SCALAR, &LWORK, &INFO);
+		if (INFO != 0) printf("dgeqrf INFO=%d\n",INFO);
+		assert(INFO==0);
+
+		cached->LWORK = (blas_int_t) WORK_SCALAR;
+	}
 
-	LWORK = (blas_int_t) WORK_SCALAR;
-	matrix_t* WORK = matrix_create(LWORK,1);
+	LWORK = cached->LWORK;
+	matrix_element_t* WORK = workspace_get(LWORK);
 	//printf("dgeqrf requires %f (%d) words in WORK\n",WORK_SCALAR,LWORK);
 #ifdef BUILD_BLAS_UNDERSCORE
-  dgeqrf_
+  BLAS_PRECISION(dgeqrf_,sgeqrf_)
 #else
-  dgeqrf
+  BLAS_PRECISION(dgeqrf,sgeqrf)
 #endif
-	      (&M, &N, A->elements, &LDA, TAU->elements, WORK->elements, &LWORK, &INFO);
+	      (&M, &N, A->elements, &LDA, TAU->elements, WORK, &LWORK, &INFO);
 	if (INFO != 0) printf("dgeqrf INFO=%d\n",INFO);
 	assert(INFO==0);
-	matrix_free(WORK);
 
+	INSTRUMENT_TIMER_END(INSTRUMENT_QR, timer);
 	return TAU;
 }
 
@@ -395,13 +842,11 @@ void matrix_mutate_apply_qt(matrix_t* QR, matrix_t* TAU, matrix_t* C) {
 	assert(QR != NULL);
 
 	blas_int_t M,N,K,LDA,LDC,LWORK,INFO;
-	double     WORK_SCALAR;
+	matrix_element_t WORK_SCALAR;
 
 	//int32_t rows = matrix_rows(A);
 	//int32_t cols = matrix_cols(A);
 
-	LWORK = -1; // tell lapack to compute the size of the work area required
-
 	M = matrix_rows(C);
 	N = matrix_cols(C);
 	K = matrix_cols(QR); // number of reflectors
@@ -409,31 +854,46 @@ void matrix_mutate_apply_qt(matrix_t* QR, matrix_t* TAU, matrix_t* C) {
 	LDC = matrix_ld(C);
 	//printf("dormqr M=%d N=%d K=%d LDA=%d LDC=%d\n",M,N,K,LDA,LDC);
 
+	INSTRUMENT_TIMER_BEGIN(timer);
+
+	if (small_kernels && K <= MATRIX_SMALL_MAX) {
+		matrix_small_apply_qt(M, N, K, QR->elements, LDA, TAU->elements, C->elements, LDC);
+		INSTRUMENT_TIMER_END(INSTRUMENT_APPLY_QT, timer);
+		return;
+	}
+
+	workspace_entry_t* cached = workspace_lookup('o', M, N, K);
+	if (cached->LWORK < 0) {
+		LWORK = -1; // tell lapack to compute the size of the work area required
+
 #ifdef BUILD_BLAS_UNDERSCORE
-  dormqr_
+  BLAS_PRECISION(dormqr_,sormqr_)
 #else
-  dormqr
+  BLAS_PRECISION(dormqr,sormqr)
 #endif
-        ("L", "T", &M, &N, &K, QR->elements, &LDA, TAU->elements, C->elements, &LDC, &WORK_SCALAR, &LWORK, &INFO
+	        ("L", "T", &M, &N, &K, QR->elements, &LDA, TAU->elements, C->elements, &LDC, &WORK_SCALAR, &LWORK, &INFO
 #ifdef BUILD_BLAS_STRLEN_END
-         ,1,1
+	         ,1,1
 #endif
-			  );
-	if (INFO != 0) printf("dormqr INFO=%d\n",INFO);
-	assert(INFO==0);
+				  );
+		if (INFO != 0) printf("dormqr INFO=%d\n",INFO);
+		assert(INFO==0);
+
+		cached->LWORK = (blas_int_t) WORK_SCALAR;
+	}
 
-	LWORK = (blas_int_t) WORK_SCALAR;
-	matrix_t* WORK = matrix_create(LWORK,1);
+	LWORK = cached->LWORK;
+	matrix_element_t* WORK = workspace_get(LWORK);
 
 	//if (debug) printf("dormqr requires %f (%d) words in WORK\n",WORK_SCALAR,LWORK);
 
 	// left (pre) multiplication by Q^T
 #ifdef BUILD_BLAS_UNDERSCORE
-  dormqr_
+  BLAS_PRECISION(dormqr_,sormqr_)
 #else
-  dormqr
+  BLAS_PRECISION(dormqr,sormqr)
 #endif
-	      ("L", "T", &M, &N, &K, QR->elements, &LDA, TAU->elements, C->elements, &LDC, WORK->elements, &LWORK, &INFO
+	      ("L", "T", &M, &N, &K, QR->elements, &LDA, TAU->elements, C->elements, &LDC, WORK, &LWORK, &INFO
 #ifdef BUILD_BLAS_STRLEN_END
          ,1,1
 #endif
@@ -441,7 +901,7 @@ void matrix_mutate_apply_qt(matrix_t* QR, matrix_t* TAU, matrix_t* C) {
 	if (INFO != 0) printf("dormqr INFO=%d\n",INFO);
 	assert(INFO==0);
 
-	matrix_free(WORK);
+	INSTRUMENT_TIMER_END(INSTRUMENT_APPLY_QT, timer);
 }
 
 // mutates b
@@ -465,14 +925,44 @@ void matrix_mutate_trisolve(char* triangle, matrix_t* U, matrix_t* b) {
 	printf("dtrtrs N=%d NRHS=%d LDA=%d LDB=%d\n",N,NRHS,LDA,LDB);
 #endif
 
+	INSTRUMENT_TIMER_BEGIN(timer);
+
+	if (LDA == MATRIX_PACKED_LD) {
+		assert(triangle[0] == 'U' || triangle[0] == 'u');
+		if (small_kernels && N <= MATRIX_SMALL_MAX) {
+			INFO = matrix_small_trisolve_packed(N, NRHS, U->elements, b->elements, LDB);
+		} else {
+#ifdef BUILD_BLAS_UNDERSCORE
+     BLAS_PRECISION(dtptrs_,stptrs_)
+#else
+     BLAS_PRECISION(dtptrs,stptrs)
+#endif
+           ("U","N","N", &N, &NRHS, U->elements, b->elements, &LDB, &INFO
+#ifdef BUILD_BLAS_STRLEN_END
+    ,1,1,1
+#endif
+);
+		}
+		assert(INFO==0);
+		INSTRUMENT_TIMER_END(INSTRUMENT_TRISOLVE, timer);
+		return;
+	}
+
+	if (small_kernels && N <= MATRIX_SMALL_MAX) {
+		INFO = matrix_small_trisolve(triangle[0], N, NRHS, U->elements, LDA, b->elements, LDB);
+		assert(INFO==0);
+		INSTRUMENT_TIMER_END(INSTRUMENT_TRISOLVE, timer);
+		return;
+	}
+
 	//if (debug) matrix_print(kalman->current->Rdiag,NULL);
 	//if (debug) matrix_print(state,NULL);
 
 	// upper triangular, no transpose, diagonal is general (not unit)
 #ifdef BUILD_BLAS_UNDERSCORE
-     dtrtrs_
+     BLAS_PRECISION(dtrtrs_,strtrs_)
 #else
-     dtrtrs
+     BLAS_PRECISION(dtrtrs,strtrs)
 #endif
            (triangle,"N","N", &N, &NRHS, U->elements, &LDA, b->elements, &LDB, &INFO
 #ifdef BUILD_BLAS_STRLEN_END
@@ -485,6 +975,7 @@ void matrix_mutate_trisolve(char* triangle, matrix_t* U, matrix_t* b) {
 #endif
 	}
 	assert(INFO==0);
+	INSTRUMENT_TIMER_END(INSTRUMENT_TRISOLVE, timer);
 #ifdef BUILD_DEBUG_PRINTOUTS
 	printf("dtrtr done\n");
 #endif
@@ -492,7 +983,7 @@ void matrix_mutate_trisolve(char* triangle, matrix_t* U, matrix_t* b) {
 
 matrix_t* matrix_create_trisolve(char* triangle, matrix_t* U, matrix_t* b) {
     matrix_t* x = matrix_create_copy(b);
-    matrix_mutate_trisolve("U",U,x);
+    matrix_mutate_trisolve(triangle,U,x);
     return x;
 }
 
@@ -507,10 +998,12 @@ void matrix_mutate_chol(matrix_t* L) {
     N   = matrix_cols(L);
     LDA = matrix_ld(L);
 
+    INSTRUMENT_TIMER_BEGIN(timer);
+
 #ifdef BUILD_BLAS_UNDERSCORE
-     dpotrf_
+     BLAS_PRECISION(dpotrf_,spotrf_)
 #else
-     dpotrf
+     BLAS_PRECISION(dpotrf,spotrf)
 #endif
            ("L",&N, L->elements, &LDA, &INFO
 #ifdef BUILD_BLAS_STRLEN_END
@@ -523,6 +1016,7 @@ void matrix_mutate_chol(matrix_t* L) {
 #endif
     }
     assert(INFO==0);
+    INSTRUMENT_TIMER_END(INSTRUMENT_CHOL, timer);
 #ifdef BUILD_DEBUG_PRINTOUTS
     printf("dpotrf done\n");
 #endif
@@ -544,6 +1038,8 @@ void matrix_mutate_gemm(double ALPHA, matrix_t* A, matrix_t* B, double BETA, mat
 	assert(matrix_cols(C) == matrix_cols(B));
 
 	blas_int_t N,M,K,LDA,LDB,LDC;
+	matrix_element_t alpha = (matrix_element_t) ALPHA;
+	matrix_element_t beta  = (matrix_element_t) BETA;
 
 	//if (debug) printf("**** %d %d %d %d\n",matrix_rows(A),matrix_ld(A),matrix_rows(kalman->current->state),matrix_ld(kalman->current->state));
 
@@ -556,17 +1052,26 @@ void matrix_mutate_gemm(double ALPHA, matrix_t* A, matrix_t* B, double BETA, mat
 
 	//if (debug) printf("dtrtrs N=%d NRHS=%d LDA=%d LDB=%d\n",N,NRHS,LDA,LDB);
 
+	INSTRUMENT_TIMER_BEGIN(timer);
+
+	if (small_kernels && M <= MATRIX_SMALL_MAX && N <= MATRIX_SMALL_MAX && K <= MATRIX_SMALL_MAX) {
+		matrix_small_gemm(M, N, K, ALPHA, A->elements, LDA, B->elements, LDB, BETA, C->elements, LDC);
+		INSTRUMENT_TIMER_END(INSTRUMENT_GEMM, timer);
+		return;
+	}
+
 	// no transpose
 #ifdef BUILD_BLAS_UNDERSCORE
-  dgemm_
+  BLAS_PRECISION(dgemm_,sgemm_)
 #else
-  dgemm
+  BLAS_PRECISION(dgemm,sgemm)
 #endif
-	     ("N","N", &M, &N, &K, &ALPHA, A->elements, &LDA, B->elements, &LDB, &BETA, C->elements, &LDC
+	     ("N","N", &M, &N, &K, &alpha, A->elements, &LDA, B->elements, &LDB, &beta, C->elements, &LDC
 #ifdef BUILD_BLAS_STRLEN_END
         ,1,1
 #endif
 			 );
+	INSTRUMENT_TIMER_END(INSTRUMENT_GEMM, timer);
 	//if (debug) printf("dtrtr done\n");
 }
 
@@ -677,7 +1182,12 @@ matrix_t* matrix_create_from_mxarray(const mxArray* mx) {
 
 	matrix_t* A = matrix_create(rows,cols);
 
+#ifdef BUILD_SINGLE_PRECISION
+	double* in = mxGetPr(mx);
+	for (int32_t i=0; i<rows*cols; i++) (A->elements)[i] = (matrix_element_t) in[i];
+#else
 	memcpy( A->elements, mxGetPr(mx), rows*cols*sizeof(double));
+#endif
 
 	return A;
 }
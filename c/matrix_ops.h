@@ -9,6 +9,24 @@
 #include "mex.h"
 #endif
 
+/******************************************************************************/
+/* ELEMENT TYPE                                                               */
+/******************************************************************************/
+
+/*
+ * Matrix elements are doubles, or floats if the library and its clients are
+ * built with BUILD_SINGLE_PRECISION; the matrix routines then call the
+ * s-prefixed BLAS and LAPACK routines. Scalar arguments and return values
+ * (matrix_get, matrix_set, and so on) are doubles in both cases.
+ */
+#ifdef BUILD_SINGLE_PRECISION
+typedef float  matrix_element_t;
+#define BLAS_PRECISION(d,s) s
+#else
+typedef double matrix_element_t;
+#define BLAS_PRECISION(d,s) d
+#endif
+
 /******************************************************************************/
 /* BLAS AND LAPACK DECLARATIONS                                               */
 /******************************************************************************/
@@ -59,17 +77,17 @@
 //#warning "LAPACK subroutines defined in ultimatekalman.c, no header file"
 void
 #ifdef BUILD_BLAS_UNDERSCORE
-     dormqr_
+     BLAS_PRECISION(dormqr_,sormqr_)
 #else
-     dormqr
+     BLAS_PRECISION(dormqr,sormqr)
 #endif
 		(
     char const* side, char const* trans,
 		blas_int_t const* m, blas_int_t const* n, blas_int_t const* k,
-    double const* A, blas_int_t const* lda,
-    double const* tau,
-    double* C, blas_int_t const* ldc,
-    double* work, blas_int_t const* lwork,
+    matrix_element_t const* A, blas_int_t const* lda,
+    matrix_element_t const* tau,
+    matrix_element_t* C, blas_int_t const* ldc,
+    matrix_element_t* work, blas_int_t const* lwork,
 		blas_int_t* info
 #ifdef BUILD_BLAS_STRLEN_END
     , size_t, size_t
@@ -78,34 +96,67 @@ void
 
 void
 #ifdef BUILD_BLAS_UNDERSCORE
-     dgeqrf_
+     BLAS_PRECISION(dgeqrf_,sgeqrf_)
 #else
-     dgeqrf
+     BLAS_PRECISION(dgeqrf,sgeqrf)
 #endif
 		(
 		blas_int_t const* m, blas_int_t const* n,
-    double* A, blas_int_t const* lda,
-    double* tau,
-    double* work, blas_int_t const* lwork,
+    matrix_element_t* A, blas_int_t const* lda,
+    matrix_element_t* tau,
+    matrix_element_t* work, blas_int_t const* lwork,
 		blas_int_t* info );
 
 void
 #ifdef BUILD_BLAS_UNDERSCORE
-     dtrtrs_
+     BLAS_PRECISION(dtrtrs_,strtrs_)
+#else
+     BLAS_PRECISION(dtrtrs,strtrs)
+#endif
+    (
+    char const* uplo, char const* trans, char const* diag,
+		blas_int_t const* n, blas_int_t const* nrhs,
+    matrix_element_t const* A, blas_int_t const* lda,
+    matrix_element_t* B, blas_int_t const* ldb,
+		blas_int_t* info
+#ifdef BUILD_BLAS_STRLEN_END
+    , size_t, size_t, size_t
+#endif
+);
+
+void
+#ifdef BUILD_BLAS_UNDERSCORE
+     BLAS_PRECISION(dtptrs_,stptrs_)
 #else
-     dtrtrs
+     BLAS_PRECISION(dtptrs,stptrs)
 #endif
     (
     char const* uplo, char const* trans, char const* diag,
 		blas_int_t const* n, blas_int_t const* nrhs,
-    double const* A, blas_int_t const* lda,
-    double* B, blas_int_t const* ldb,
+    matrix_element_t const* AP,
+    matrix_element_t* B, blas_int_t const* ldb,
 		blas_int_t* info
 #ifdef BUILD_BLAS_STRLEN_END
     , size_t, size_t, size_t
 #endif
 );
 
+void
+#ifdef BUILD_BLAS_UNDERSCORE
+     BLAS_PRECISION(dpotrf_,spotrf_)
+#else
+     BLAS_PRECISION(dpotrf,spotrf)
+#endif
+    (
+    char const* uplo,
+		blas_int_t const* n,
+    matrix_element_t* A, blas_int_t const* lda,
+		blas_int_t* info
+#ifdef BUILD_BLAS_STRLEN_END
+    , size_t
+#endif
+);
+
 #endif
 
 #ifndef HAS_BLAS_H
@@ -113,17 +164,17 @@ void
 //#warning "BLAS subroutines defined in ultimatekalman.c, no header file"
 void
 #ifdef BUILD_BLAS_UNDERSCORE
-     dgemm_
+     BLAS_PRECISION(dgemm_,sgemm_)
 #else
-     dgemm
+     BLAS_PRECISION(dgemm,sgemm)
 #endif
           (char const* transa, char const* transb,
            blas_int_t const* m, blas_int_t const* n, blas_int_t const* k,
-					 double* ALPHA,
-					 double* A, blas_int_t const* LDA,
-					 double* B, blas_int_t const* LDB,
-					 double* BETA,
-					 double* C, blas_int_t const* LDC
+					 matrix_element_t* ALPHA,
+					 matrix_element_t* A, blas_int_t const* LDA,
+					 matrix_element_t* B, blas_int_t const* LDB,
+					 matrix_element_t* BETA,
+					 matrix_element_t* C, blas_int_t const* LDC
 #ifdef BUILD_BLAS_STRLEN_END
            , size_t, size_t
 #endif
@@ -134,11 +185,15 @@ void
 /* MATRICES                                                                   */
 /******************************************************************************/
 
+struct matrix_pool_st;
+
 typedef struct matrix_st {
 	int32_t row_dim;
 	int32_t col_dim;
 	int32_t ld;      // leading dimension
-	double* elements;
+	int32_t size_class; // of the elements buffer, if it came from a pool or a slab
+	matrix_element_t* elements;
+	struct matrix_pool_st* pool; // NULL if allocated on the heap
 }
 kalman_matrix_t
 #ifdef KALMAN_MATRIX_SHORT_TYPE
@@ -164,6 +219,12 @@ kalman_matrix_t* matrix_create_sub(kalman_matrix_t* A, int32_t first_row, int32_
 void             matrix_mutate_copy_sub(kalman_matrix_t* C, int32_t first_row, int32_t first_col, kalman_matrix_t* A);
 void             matrix_free(kalman_matrix_t* A);
 
+/*
+ * Copies A into C if they have the same dimensions and returns C; otherwise
+ * frees C and returns a copy of A (NULL if A is NULL).
+ */
+kalman_matrix_t* matrix_recopy(kalman_matrix_t* C, kalman_matrix_t* A);
+
 int32_t matrix_rows(kalman_matrix_t* A);
 int32_t matrix_cols(kalman_matrix_t* A);
 int32_t matrix_ld  (kalman_matrix_t* A);
@@ -192,12 +253,114 @@ mxArray*  matrix_copy_to_mxarray    (kalman_matrix_t* A);
 
 void matrix_print(kalman_matrix_t* A, char* format);
 
+/******************************************************************************/
+/* MATRIX POOLS                                                               */
+/******************************************************************************/
+
+/*
+ * A pool recycles matrix headers and element buffers using power-of-two
+ * size classes. While a pool is current in a thread, matrix_create and its
+ * relatives take storage from it; matrix_free always returns a matrix to the
+ * pool it came from (or to the heap). A pool is not thread safe; it is meant
+ * to be owned by a single filter, used only by the thread running it.
+ *
+ * matrix_pool_release can be called while matrices from the pool are still
+ * alive; the pool is destroyed when the last one is freed.
+ */
+typedef struct matrix_pool_st
+kalman_matrix_pool_t
+#ifdef KALMAN_MATRIX_SHORT_TYPE
+,matrix_pool_t
+#endif
+;
+
+kalman_matrix_pool_t* matrix_pool_create     ();
+void                  matrix_pool_release    (kalman_matrix_pool_t* pool);
+kalman_matrix_pool_t* matrix_pool_set_current(kalman_matrix_pool_t* pool); // returns the previous one
+kalman_matrix_pool_t* matrix_pool_get_current();
+
+/*
+ * Untyped blocks (e.g., step structures) from the current pool, or from the
+ * heap if no pool is current. Blocks must be freed with matrix_pool_free.
+ */
+void* matrix_pool_malloc(size_t size);
+void  matrix_pool_free  (void* block);
+
+/******************************************************************************/
+/* MATRIX SLABS                                                               */
+/******************************************************************************/
+
+/*
+ * A slab holds count matrices of at most capacity elements each, in a single
+ * cache-line-aligned buffer with a fixed stride, so that block i of a slab
+ * follows block i-1 and a loop over i streams through memory.
+ * matrix_slab_matrix returns block i shaped as a rows-by-cols matrix with
+ * undefined elements, or a matrix from matrix_create if it does not fit.
+ * Matrices in a slab are freed only by matrix_slab_free; matrix_free does
+ * nothing on them. Distinct blocks can be used by different threads.
+ */
+typedef struct matrix_slab_st
+kalman_matrix_slab_t
+#ifdef KALMAN_MATRIX_SHORT_TYPE
+,matrix_slab_t
+#endif
+;
+
+kalman_matrix_slab_t* matrix_slab_create(int64_t count, int32_t capacity);
+kalman_matrix_t*      matrix_slab_matrix(kalman_matrix_slab_t* slab, int64_t i, int32_t rows, int32_t cols);
+void                  matrix_slab_free  (kalman_matrix_slab_t* slab);
+
+/*
+ * Makes header (storage that the caller owns) a rows-by-cols column-major
+ * view of elements, which the caller also owns; as with slabs, matrix_free
+ * does nothing on the view.
+ */
+kalman_matrix_t*      matrix_view       (kalman_matrix_t* header, matrix_element_t* elements, int32_t rows, int32_t cols);
+
+/*
+ * Makes header a view of the rows-by-cols block of A that starts at element
+ * (first_row,first_col): it points into the elements of A and has the
+ * leading dimension of A, so writing the view writes A. A must outlive it.
+ */
+kalman_matrix_t*      matrix_view_sub   (kalman_matrix_t* header, kalman_matrix_t* A,
+                                         int32_t first_row, int32_t rows, int32_t first_col, int32_t cols);
+
+/******************************************************************************/
+/* PACKED TRIANGULAR MATRICES                                                 */
+/******************************************************************************/
+
+/*
+ * A packed matrix is a square upper triangular matrix that stores only its
+ * upper triangle, column by column (LAPACK's packed format): element (i,j),
+ * i <= j, is elements[i + j*(j+1)/2], so an n-by-n matrix takes n*(n+1)/2
+ * elements. Its ld is MATRIX_PACKED_LD.
+ *
+ * matrix_mutate_copy, matrix_create_copy, matrix_recopy, matrix_create_vconcat,
+ * matrix_mutate_trisolve and matrix_print accept packed matrices (elements
+ * below the diagonal read as zeros); matrix_get, matrix_set and the other
+ * functions do not.
+ */
+#define MATRIX_PACKED_LD (-1)
+
+int              matrix_is_packed      (kalman_matrix_t* A);
+
+/*
+ * The upper triangle of the leading cols-by-cols block of A, packed.
+ */
+kalman_matrix_t* matrix_create_packed  (kalman_matrix_t* A);
+
+/*
+ * A conventional (column-major) copy of A, packed or not.
+ */
+kalman_matrix_t* matrix_create_unpacked(kalman_matrix_t* A);
+
 /*
  * Intended mostly for testing that the BLAS library is working and linked correctly
  */
 void matrix_mutate_gemm                 (double ALPHA, kalman_matrix_t* A, kalman_matrix_t* B, double BETA, kalman_matrix_t* C);
 
 void matrix_mutate_scale                (kalman_matrix_t* A, double s);
+void matrix_mutate_scale_rows           (kalman_matrix_t* C, kalman_matrix_t* d, kalman_matrix_t* A); // C = diag(d)*A, C can be A
 void matrix_mutate_triu                 (kalman_matrix_t* A);
 void matrix_mutate_chop                 (kalman_matrix_t* A, int32_t rows, int32_t cols);
 void matrix_mutate_copy                 (kalman_matrix_t* C, kalman_matrix_t* A);
@@ -210,6 +373,20 @@ kalman_matrix_t* matrix_create_chol     (kalman_matrix_t* L);
 kalman_matrix_t* matrix_create_vconcat  (kalman_matrix_t* A, kalman_matrix_t* B);
 
 kalman_matrix_t* matrix_create_mutate_qr(kalman_matrix_t* A);
+
+/*
+ * Enables or disables, in the calling thread, the fixed-size kernels of
+ * matrix_small.c, which replace BLAS/LAPACK in QR, Q^T application,
+ * triangular solves and multiplication when the dimensions are small enough.
+ * Returns the previous setting.
+ */
+int  matrix_small_kernels_set(int enabled);
+
+/*
+ * The QR routines keep a per-thread LAPACK workspace that grows as needed.
+ * This releases the calling thread's workspace (it is recreated on demand).
+ */
+void matrix_workspace_free();
 kalman_matrix_t* matrix_create_inverse  (kalman_matrix_t* A);
 kalman_matrix_t* matrix_create_transpose(kalman_matrix_t* A);
 kalman_matrix_t* matrix_create_copy     (kalman_matrix_t* A);
@@ -0,0 +1,330 @@
+/*
+ * matrix_small.c
+ *
+ * Fixed-size kernels for small matrices (at most MATRIX_SMALL_MAX columns).
+ *
+ * Each kernel is written once as an always-inlined function whose size
+ * parameter is a compile-time constant in every instance generated by the
+ * SMALL_INSTANCES macro, so the compiler fully unrolls the loops over that
+ * dimension and vectorizes the remaining ones. A table indexed by the
+ * dimension selects the instance at run time, replacing the BLAS/LAPACK call
+ * (and its argument checking and dispatch) that dominates at these sizes.
+ *
+ * (C) Sivan Toledo, 2022-2025
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <math.h>
+
+#ifdef BUILD_MEX
+#include "mex.h"
+
+static char assert_msg[128];
+static void mex_assert(int c, int line) {
+    if (!c) {
+        sprintf(assert_msg,"Assert failed in %s line %d",__FILE__,line);
+        mexErrMsgIdAndTxt("MyToolbox:arrayProduct:assertion",assert_msg);
+    }
+}
+
+#define assert(c) mex_assert((c),__LINE__)
+#else
+#include <assert.h>
+#endif
+
+#include "matrix_small.h"
+
+#if defined(_MSC_VER)
+#define SMALL_INLINE static __forceinline
+#else
+#define SMALL_INLINE static inline __attribute__((always_inline))
+#endif
+
+#define SMALL_INSTANCES(X) X(1) X(2) X(3) X(4) X(5) X(6) X(7) X(8)
+
+/******************************************************************************/
+/* QR FACTORIZATION                                                           */
+/******************************************************************************/
+
+/*
+ * Unblocked Householder QR (dgeqr2). The reflectors are generated as in
+ * dlarfg: beta = -sign(alpha) norm(x), tau = (beta-alpha)/beta, and
+ * v = x/(alpha-beta) with an implicit leading one. Unlike dlarfg we do not
+ * rescale tiny or huge columns, which is harmless at Kalman-filter scales.
+ */
+SMALL_INLINE void qr_kernel(const int32_t n, int32_t m, matrix_element_t* A, int32_t lda, matrix_element_t* tau) {
+	int32_t i, j, k;
+
+	for (j=0; j<n; j++) {
+		matrix_element_t* x   = A + j*lda + j;
+		int32_t len = m - j;
+
+		matrix_element_t xnorm2 = 0.0;
+		for (i=1; i<len; i++) xnorm2 += x[i]*x[i];
+
+		if (xnorm2 == 0.0) {
+			tau[j] = 0.0; // H = I
+			continue;
+		}
+
+		matrix_element_t alpha = x[0];
+		matrix_element_t beta  = -copysign(sqrt(alpha*alpha + xnorm2), alpha);
+		matrix_element_t scale = 1.0 / (alpha - beta);
+
+		tau[j] = (beta - alpha) / beta;
+		for (i=1; i<len; i++) x[i] *= scale;
+		x[0] = beta;
+
+		for (k=j+1; k<n; k++) {
+			matrix_element_t* c = A + k*lda + j;
+			matrix_element_t  w = c[0];
+			for (i=1; i<len; i++) w += x[i]*c[i];
+			w *= tau[j];
+			c[0] -= w;
+			for (i=1; i<len; i++) c[i] -= w*x[i];
+		}
+	}
+}
+
+#define SMALL_QR(N) \
+static void qr_##N(int32_t m, matrix_element_t* A, int32_t lda, matrix_element_t* tau) { qr_kernel(N, m, A, lda, tau); }
+#define SMALL_QR_NAME(N) qr_##N,
+
+SMALL_INSTANCES(SMALL_QR)
+
+static void (* const qr_table[MATRIX_SMALL_MAX+1])(int32_t, matrix_element_t*, int32_t, matrix_element_t*) = {
+	NULL, SMALL_INSTANCES(SMALL_QR_NAME)
+};
+
+void matrix_small_qr(int32_t m, int32_t n, matrix_element_t* A, int32_t lda, matrix_element_t* tau) {
+	assert(n <= MATRIX_SMALL_MAX);
+	assert(m >= n);
+	if (n == 0) return;
+	(*(qr_table[n]))(m, A, lda, tau);
+}
+
+/******************************************************************************/
+/* APPLYING Q^T                                                               */
+/******************************************************************************/
+
+SMALL_INLINE void apply_qt_kernel(const int32_t k, int32_t m, int32_t n,
+                                  const matrix_element_t* QR, int32_t lda, const matrix_element_t* tau,
+                                  matrix_element_t* C, int32_t ldc) {
+	int32_t i, j, col;
+
+	// Q^T = H_k ... H_1, so H_1 is applied first
+	for (j=0; j<k; j++) {
+		const matrix_element_t* v   = QR + j*lda + j;
+		int32_t       len = m - j;
+		matrix_element_t        t   = tau[j];
+
+		if (t == 0.0) continue;
+
+		for (col=0; col<n; col++) {
+			matrix_element_t* c = C + col*ldc + j;
+			matrix_element_t  w = c[0];
+			for (i=1; i<len; i++) w += v[i]*c[i];
+			w *= t;
+			c[0] -= w;
+			for (i=1; i<len; i++) c[i] -= w*v[i];
+		}
+	}
+}
+
+#define SMALL_APPLY_QT(K) \
+static void apply_qt_##K(int32_t m, int32_t n, const matrix_element_t* QR, int32_t lda, const matrix_element_t* tau, matrix_element_t* C, int32_t ldc) \
+{ apply_qt_kernel(K, m, n, QR, lda, tau, C, ldc); }
+#define SMALL_APPLY_QT_NAME(K) apply_qt_##K,
+
+SMALL_INSTANCES(SMALL_APPLY_QT)
+
+static void (* const apply_qt_table[MATRIX_SMALL_MAX+1])(int32_t, int32_t, const matrix_element_t*, int32_t, const matrix_element_t*, matrix_element_t*, int32_t) = {
+	NULL, SMALL_INSTANCES(SMALL_APPLY_QT_NAME)
+};
+
+void matrix_small_apply_qt(int32_t m, int32_t n, int32_t k,
+                           const matrix_element_t* QR, int32_t lda, const matrix_element_t* tau,
+                           matrix_element_t* C, int32_t ldc) {
+	assert(k <= MATRIX_SMALL_MAX);
+	assert(k <= m);
+	if (k == 0) return;
+	(*(apply_qt_table[k]))(m, n, QR, lda, tau, C, ldc);
+}
+
+/******************************************************************************/
+/* TRIANGULAR SOLVES                                                          */
+/******************************************************************************/
+
+SMALL_INLINE void trisolve_upper_kernel(const int32_t n, int32_t nrhs, const matrix_element_t* T, int32_t ldt, matrix_element_t* B, int32_t ldb) {
+	int32_t i, l, col;
+
+	for (col=0; col<nrhs; col++) {
+		matrix_element_t* b = B + col*ldb;
+		for (i=n-1; i>=0; i--) {
+			matrix_element_t s = b[i];
+			for (l=i+1; l<n; l++) s -= T[l*ldt + i] * b[l];
+			b[i] = s / T[i*ldt + i];
+		}
+	}
+}
+
+SMALL_INLINE void trisolve_lower_kernel(const int32_t n, int32_t nrhs, const matrix_element_t* T, int32_t ldt, matrix_element_t* B, int32_t ldb) {
+	int32_t i, l, col;
+
+	for (col=0; col<nrhs; col++) {
+		matrix_element_t* b = B + col*ldb;
+		for (i=0; i<n; i++) {
+			matrix_element_t s = b[i];
+			for (l=0; l<i; l++) s -= T[l*ldt + i] * b[l];
+			b[i] = s / T[i*ldt + i];
+		}
+	}
+}
+
+#define SMALL_TRISOLVE(N) \
+static void trisolve_upper_##N(int32_t nrhs, const matrix_element_t* T, int32_t ldt, matrix_element_t* B, int32_t ldb) \
+{ trisolve_upper_kernel(N, nrhs, T, ldt, B, ldb); } \
+static void trisolve_lower_##N(int32_t nrhs, const matrix_element_t* T, int32_t ldt, matrix_element_t* B, int32_t ldb) \
+{ trisolve_lower_kernel(N, nrhs, T, ldt, B, ldb); }
+#define SMALL_TRISOLVE_UPPER_NAME(N) trisolve_upper_##N,
+#define SMALL_TRISOLVE_LOWER_NAME(N) trisolve_lower_##N,
+
+SMALL_INSTANCES(SMALL_TRISOLVE)
+
+static void (* const trisolve_upper_table[MATRIX_SMALL_MAX+1])(int32_t, const matrix_element_t*, int32_t, matrix_element_t*, int32_t) = {
+	NULL, SMALL_INSTANCES(SMALL_TRISOLVE_UPPER_NAME)
+};
+
+static void (* const trisolve_lower_table[MATRIX_SMALL_MAX+1])(int32_t, const matrix_element_t*, int32_t, matrix_element_t*, int32_t) = {
+	NULL, SMALL_INSTANCES(SMALL_TRISOLVE_LOWER_NAME)
+};
+
+/*
+ * Upper triangular, packed by columns: T(i,l), i <= l, is T[i + l*(l+1)/2].
+ */
+SMALL_INLINE void trisolve_packed_kernel(const int32_t n, int32_t nrhs, const matrix_element_t* T, matrix_element_t* B, int32_t ldb) {
+	int32_t i, l, col;
+
+	for (col=0; col<nrhs; col++) {
+		matrix_element_t* b = B + col*ldb;
+		for (i=n-1; i>=0; i--) {
+			matrix_element_t s = b[i];
+			for (l=i+1; l<n; l++) s -= T[i + (l*(l+1))/2] * b[l];
+			b[i] = s / T[i + (i*(i+1))/2];
+		}
+	}
+}
+
+#define SMALL_TRISOLVE_PACKED(N) \
+static void trisolve_packed_##N(int32_t nrhs, const matrix_element_t* T, matrix_element_t* B, int32_t ldb) \
+{ trisolve_packed_kernel(N, nrhs, T, B, ldb); }
+#define SMALL_TRISOLVE_PACKED_NAME(N) trisolve_packed_##N,
+
+SMALL_INSTANCES(SMALL_TRISOLVE_PACKED)
+
+static void (* const trisolve_packed_table[MATRIX_SMALL_MAX+1])(int32_t, const matrix_element_t*, matrix_element_t*, int32_t) = {
+	NULL, SMALL_INSTANCES(SMALL_TRISOLVE_PACKED_NAME)
+};
+
+int32_t matrix_small_trisolve(char uplo, int32_t n, int32_t nrhs,
+                              const matrix_element_t* T, int32_t ldt,
+                              matrix_element_t* B, int32_t ldb) {
+	int32_t i;
+
+	assert(n <= MATRIX_SMALL_MAX);
+	assert(uplo == 'U' || uplo == 'u' || uplo == 'L' || uplo == 'l');
+
+	// like dtrtrs, check for singularity before solving
+	for (i=0; i<n; i++) {
+		if (T[i*ldt + i] == 0.0) return i+1;
+	}
+
+	if (n == 0) return 0;
+
+	if (uplo == 'U' || uplo == 'u') (*(trisolve_upper_table[n]))(nrhs, T, ldt, B, ldb);
+	else                            (*(trisolve_lower_table[n]))(nrhs, T, ldt, B, ldb);
+
+	return 0;
+}
+
+int32_t matrix_small_trisolve_packed(int32_t n, int32_t nrhs, const matrix_element_t* T,
+                                     matrix_element_t* B, int32_t ldb) {
+	int32_t i;
+
+	assert(n <= MATRIX_SMALL_MAX);
+
+	for (i=0; i<n; i++) {
+		if (T[i + (i*(i+1))/2] == 0.0) return i+1;
+	}
+
+	if (n == 0) return 0;
+
+	(*(trisolve_packed_table[n]))(nrhs, T, B, ldb);
+
+	return 0;
+}
+
+/******************************************************************************/
+/* MATRIX MULTIPLICATION                                                      */
+/******************************************************************************/
+
+/*
+ * Specialized on the inner dimension k; each column of C is a linear
+ * combination of the k columns of A.
+ */
+SMALL_INLINE void gemm_kernel(const int32_t k, int32_t m, int32_t n,
+                              matrix_element_t alpha, const matrix_element_t* A, int32_t lda,
+                                            const matrix_element_t* B, int32_t ldb,
+                              matrix_element_t beta,        matrix_element_t* C, int32_t ldc) {
+	int32_t i, j, l;
+
+	for (j=0; j<n; j++) {
+		matrix_element_t acc[MATRIX_SMALL_MAX];
+		for (i=0; i<m; i++) acc[i] = 0.0;
+		for (l=0; l<k; l++) {
+			matrix_element_t b = B[j*ldb + l];
+			for (i=0; i<m; i++) acc[i] += A[l*lda + i] * b;
+		}
+		matrix_element_t* c = C + j*ldc;
+		if (beta == 0.0) for (i=0; i<m; i++) c[i] = alpha*acc[i];
+		else             for (i=0; i<m; i++) c[i] = alpha*acc[i] + beta*c[i];
+	}
+}
+
+#define SMALL_GEMM(K) \
+static void gemm_##K(int32_t m, int32_t n, matrix_element_t alpha, const matrix_element_t* A, int32_t lda, \
+                     const matrix_element_t* B, int32_t ldb, matrix_element_t beta, matrix_element_t* C, int32_t ldc) \
+{ gemm_kernel(K, m, n, alpha, A, lda, B, ldb, beta, C, ldc); }
+#define SMALL_GEMM_NAME(K) gemm_##K,
+
+SMALL_INSTANCES(SMALL_GEMM)
+
+static void (* const gemm_table[MATRIX_SMALL_MAX+1])(int32_t, int32_t, matrix_element_t, const matrix_element_t*, int32_t,
+                                                     const matrix_element_t*, int32_t, matrix_element_t, matrix_element_t*, int32_t) = {
+	NULL, SMALL_INSTANCES(SMALL_GEMM_NAME)
+};
+
+void matrix_small_gemm(int32_t m, int32_t n, int32_t k,
+                       matrix_element_t alpha, const matrix_element_t* A, int32_t lda,
+                                     const matrix_element_t* B, int32_t ldb,
+                       matrix_element_t beta,        matrix_element_t* C, int32_t ldc) {
+	int32_t i, j;
+
+	assert(m <= MATRIX_SMALL_MAX);
+	assert(n <= MATRIX_SMALL_MAX);
+	assert(k <= MATRIX_SMALL_MAX);
+
+	if (k == 0) { // C = beta*C, as in dgemm
+		for (j=0; j<n; j++)
+			for (i=0; i<m; i++)
+				C[j*ldc + i] = (beta == 0.0 ? 0.0 : beta*C[j*ldc + i]);
+		return;
+	}
+
+	(*(gemm_table[k]))(m, n, alpha, A, lda, B, ldb, beta, C, ldc);
+}
+
+/******************************************************************************/
+/* END OF FILE                                                                */
+/******************************************************************************/
@@ -0,0 +1,57 @@
+/*
+ * matrix_small.h
+ *
+ * Fixed-size kernels for matrices with at most MATRIX_SMALL_MAX columns
+ * (or reflectors), used by matrix_ops.c in place of BLAS and LAPACK calls
+ * when small kernels are enabled. All matrices are column major.
+ *
+ * Copyright (C) Sivan Toledo 2022-2025
+ */
+#ifndef MATRIX_SMALL_H
+#define MATRIX_SMALL_H
+
+#include <stdint.h>
+
+#include "matrix_ops.h" // for matrix_element_t
+
+#define MATRIX_SMALL_MAX 8
+
+/*
+ * Householder QR of an m-by-n matrix, m >= n, n <= MATRIX_SMALL_MAX, in the
+ * same compact representation (R and reflectors in A, scalars in tau) that
+ * dgeqrf produces, so the result can also be used with dormqr.
+ */
+void    matrix_small_qr      (int32_t m, int32_t n, matrix_element_t* A, int32_t lda, matrix_element_t* tau);
+
+/*
+ * C = Q^T C where Q is represented by k <= MATRIX_SMALL_MAX reflectors,
+ * like dormqr("L","T",...).
+ */
+void    matrix_small_apply_qt(int32_t m, int32_t n, int32_t k,
+                              const matrix_element_t* QR, int32_t lda, const matrix_element_t* tau,
+                              matrix_element_t* C, int32_t ldc);
+
+/*
+ * Solves T X = B for an n-by-n triangular T, n <= MATRIX_SMALL_MAX; uplo is
+ * 'U' or 'L'. Returns INFO like dtrtrs: 0, or i if T(i,i) is zero (1-based).
+ */
+int32_t matrix_small_trisolve(char uplo, int32_t n, int32_t nrhs,
+                              const matrix_element_t* T, int32_t ldt,
+                              matrix_element_t* B, int32_t ldb);
+
+/*
+ * The same for an upper triangular T packed by columns (like dtptrs).
+ */
+int32_t matrix_small_trisolve_packed(int32_t n, int32_t nrhs, const matrix_element_t* T,
+                                     matrix_element_t* B, int32_t ldb);
+
+/*
+ * C = alpha*A*B + beta*C with all dimensions at most MATRIX_SMALL_MAX, like
+ * dgemm("N","N",...); C is not read when beta is zero.
+ */
+void    matrix_small_gemm    (int32_t m, int32_t n, int32_t k,
+                              matrix_element_t alpha, const matrix_element_t* A, int32_t lda,
+                                            const matrix_element_t* B, int32_t ldb,
+                              matrix_element_t beta,        matrix_element_t* C, int32_t ldc);
+
+#endif /* ifndef MATRIX_SMALL_H */
@@ -10,31 +10,95 @@
 #ifndef PARALLEL_H
 #define PARALLEL_H
 
-#ifdef PARALLEL_TYPE_INT32
+#ifdef PARALLEL_INDEX_TYPE_INT32
 typedef int32_t parallel_index_t;
+#define PARALLEL_INDEX_MAX INT32_MAX
 #endif
 
 #ifdef PARALLEL_INDEX_TYPE_UINT32
 typedef uint32_t parallel_index_t;
+#define PARALLEL_INDEX_MAX UINT32_MAX
 #endif
 
 #ifdef PARALLEL_INDEX_TYPE_INT64
 typedef int64_t parallel_index_t;
+#define PARALLEL_INDEX_MAX INT64_MAX
 #endif
 
 #ifdef PARALLEL_INDEX_TYPE_UINT64
 typedef uint64_t parallel_index_t;
+#define PARALLEL_INDEX_MAX UINT64_MAX
 #endif
 
 #include "concurrent_set.h"
+#include "concurrent_bag.h"
 
 void parallel_set_thread_limit(int number_of_threads);
 void parallel_set_blocksize   (int blocksize_in);
 
+/*
+ * Limits the threads that run the primitives called by the calling thread
+ * (0 means no limit below the thread limit) and returns the previous limit.
+ * The limit belongs to the calling thread and changes no shared state, so
+ * unlike the thread limit it may be set while other threads are using the
+ * primitives.
+ */
+int  parallel_set_region_threads(int number_of_threads);
+
+/*
+ * The NUMA mode (affinity nonzero; off by default). Every loop splits a range
+ * of a given length the same way, into one contiguous share per thread, and
+ * each thread runs only its own share, without load balancing. The threads
+ * are pinned to cores spread evenly over the cores the process may use, in
+ * order, so consecutive shares go to consecutive cores, and hence to the same
+ * NUMA node. The arrays of the smoothers are first touched by loops over their
+ * steps, so every phase that loops over the same steps then finds its blocks
+ * in the memory of its own node. The pinning is Linux-only; the thread that
+ * calls a primitive runs the first share and is not pinned. With OpenMP, the
+ * threads are bound through proc_bind(spread), which requires OMP_PLACES
+ * (e.g., OMP_PLACES=cores). Must not be called while other threads are using
+ * the primitives.
+ */
+void parallel_set_affinity    (int affinity);
+
+/*
+ * A budget of cores that the parallel smoothers split between the parallel
+ * primitives and the BLAS, depending on the state dimension and the number
+ * of steps (0 means no budget; the thread limit and the BLAS are left alone).
+ * The BLAS thread count is set by set_blas_threads; the default depends on
+ * the build flags, and NULL leaves the BLAS single threaded within a region.
+ * Begin and end bracket a parallel region; they are called by the library,
+ * outside of any parallel primitive. Begin limits the region of the calling
+ * thread and returns the previous limit, which end restores.
+ */
+void parallel_set_thread_budget      (int cores);
+void parallel_set_blas_thread_control(void (*set_blas_threads)(int));
+void parallel_budget_split           (int dimension, parallel_index_t steps, int* step_threads, int* blas_threads);
+int  parallel_budget_begin           (int dimension, parallel_index_t steps);
+void parallel_budget_end             (int previous);
+
+/*
+ * The index of the calling thread among the threads that can run the
+ * parallel primitives, between 0 and parallel_max_threads()-1, or -1 if the
+ * thread is not one of them.
+ */
+int  parallel_thread_index();
+int  parallel_max_threads ();
+
 void foreach_in_range    (void (*func)(void*,        parallel_index_t, parallel_index_t, parallel_index_t), void* array ,               parallel_index_t length, parallel_index_t n);
+/*
+ * Applies the phases, in order, to each block of the range in a single
+ * parallel pass, instead of one pass (and one barrier) per phase. Valid only
+ * when phase p at index i depends on nothing but phases 0..p-1 at index i.
+ */
+void foreach_in_range_phases(void (**funcs)(void*, parallel_index_t, parallel_index_t, parallel_index_t), int phases, void* array, parallel_index_t length, parallel_index_t n);
 void foreach_in_range_two(void (*func)(void*, void*, parallel_index_t, parallel_index_t, parallel_index_t), void* array1, void* array2, parallel_index_t length, parallel_index_t n);
 
-void prefix_sums_pointers(void* (*f)(void*, void*), void** input, void** sums, concurrent_set_t* create_array , parallel_index_t length, int stride);
+/*
+ * Elements that f creates (as opposed to returning one of its arguments) are
+ * inserted into created_elements, so that the caller can release them.
+ */
+void prefix_sums_pointers(void* (*f)(void*, void*), void** input, void** sums, concurrent_bag_t* created_elements, parallel_index_t length, int stride);
 
 // Opaque pointer for clients
 struct spin_mutex_st;
@@ -0,0 +1,101 @@
+/*
+ * parallel_budget.c
+ *
+ * A thread budget that is shared between the parallel primitives (step-level
+ * parallelism) and a multithreaded BLAS (parallelism within each dgemm or
+ * dgeqrf). When the two are not coordinated, every worker of a parallel
+ * smoother may call a BLAS that spawns its own threads, which oversubscribes
+ * the cores.
+ *
+ * The split depends on the state dimension and on the number of steps: a
+ * BLAS call only benefits from threads on large matrices, and the parallel
+ * loops only have work for a limited number of threads on short trajectories.
+ * The split is applied by parallel_budget_begin, before a parallel smoother
+ * runs, as a region limit of the calling thread, so that smoothers that run
+ * concurrently on different threads (e.g., a background segment and the
+ * filter) do not change each other's limits. parallel_budget_end restores
+ * the previous region limit and gives the whole budget back to the BLAS,
+ * which then runs alone (e.g., in the filters).
+ *
+ * The BLAS thread count is set by a function that depends on the BLAS; the
+ * default one is chosen by the build flags (BUILD_MKL, BUILD_OPENBLAS, or
+ * BUILD_BLIS), and clients can install their own.
+ *
+ * Copyright (c) 2024-2025 Sivan Toledo and Shahaf Gargir
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "parallel.h"
+#include "matrix_ops.h" // includes mkl.h under BUILD_MKL
+
+#define MIN(a,b) ((a)<(b) ? (a) : (b))
+#define MAX(a,b) ((a)>(b) ? (a) : (b))
+
+/*
+ * BLAS calls on matrices of this dimension or larger get one more thread,
+ * and a parallel loop needs at least this many steps per thread.
+ */
+#define BUDGET_BLAS_DIMENSION    32
+#define BUDGET_STEPS_PER_THREAD  64
+
+#if defined(BUILD_OPENBLAS)
+void openblas_set_num_threads(int number_of_threads);
+static void default_blas_threads(int number_of_threads) { openblas_set_num_threads(number_of_threads); }
+#elif defined(BUILD_BLIS)
+void bli_thread_set_num_threads(int64_t number_of_threads);
+static void default_blas_threads(int number_of_threads) { bli_thread_set_num_threads((int64_t) number_of_threads); }
+#elif defined(BUILD_MKL)
+static void default_blas_threads(int number_of_threads) { mkl_set_num_threads(number_of_threads); }
+#else
+#define default_blas_threads NULL
+#endif
+
+static int  budget = 0; // 0 means no budget
+static void (*blas_threads)(int) = default_blas_threads;
+
+void parallel_set_blas_thread_control(void (*set_blas_threads)(int)) {
+  blas_threads = set_blas_threads;
+}
+
+void parallel_set_thread_budget(int cores) {
+  budget = MAX(cores, 0);
+  if (budget > 0 && blas_threads != NULL) (*blas_threads)(budget);
+}
+
+void parallel_budget_split(int dimension, parallel_index_t steps, int* step_threads, int* blas_threads_out) {
+  int cores = (budget > 0 ? budget : parallel_max_threads());
+
+  int blas = MIN(MAX(dimension / BUDGET_BLAS_DIMENSION, 1), cores);
+  int most = (int) MIN((int64_t) steps / BUDGET_STEPS_PER_THREAD, (int64_t) cores);
+  int par  = MIN(MAX(cores / blas, 1), MAX(most, 1));
+
+  // when the steps cannot use all the cores, the rest go to the BLAS
+  if (blas_threads != NULL) blas = MAX(cores / par, 1);
+  else                      blas = 1;
+
+  *step_threads     = par;
+  *blas_threads_out = blas;
+}
+
+int parallel_budget_begin(int dimension, parallel_index_t steps) {
+  if (budget == 0) return -1; // nothing to restore
+
+  int par, blas;
+  parallel_budget_split(dimension, steps, &par, &blas);
+
+  if (blas_threads != NULL) (*blas_threads)(blas);
+  return parallel_set_region_threads(par);
+}
+
+void parallel_budget_end(int previous) {
+  if (previous < 0) return;
+  parallel_set_region_threads(previous);
+  if (blas_threads != NULL) (*blas_threads)(budget);
+}
+
+/******************************************************************************/
+/* END OF FILE                                                                */
+/******************************************************************************/
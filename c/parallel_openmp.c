@@ -0,0 +1,225 @@
+/*
+ * parallel_openmp.c
+ *
+ * An OpenMP-based implementation of the parallel primitives, for platforms
+ * without TBB or with an OpenMP-threaded BLAS.
+ *
+ * Loops are split into blocks of blocksize iterations that are scheduled
+ * dynamically, or, in the NUMA mode (parallel_set_affinity), statically, in
+ * one contiguous share of blocks per thread, with the threads spread over the
+ * places (OMP_PLACES). The prefix sums use the blocked algorithm: every block but
+ * the last is reduced in parallel, the block totals are scanned sequentially,
+ * and then every block is scanned in parallel starting from the total of the
+ * blocks before it.
+ *
+ * Copyright (c) 2024-2025 Sivan Toledo and Shahaf Gargir
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <omp.h>
+
+#include "parallel.h"
+#include "instrument.h"
+
+#define MIN(a,b) ((a)<(b) ? (a) : (b))
+
+#if defined(_MSC_VER)
+#define THREAD_LOCAL __declspec(thread)
+#else
+#define THREAD_LOCAL __thread
+#endif
+
+struct spin_mutex_st {
+  omp_lock_t lock;
+};
+
+static int nthreads = 0;
+static int blocksize = 16;
+static int affinity = 0;
+
+static THREAD_LOCAL int region_threads = 0; // of the calling thread; 0 means no region limit
+
+static int number_of_threads() {
+  return (nthreads > 0 ? nthreads : omp_get_max_threads());
+}
+
+/*
+ * The number of threads of a loop that the calling thread starts.
+ */
+static int loop_threads() {
+  int threads = number_of_threads();
+  return (region_threads > 0 ? MIN(region_threads, threads) : threads);
+}
+
+void parallel_set_thread_limit(int number_of_threads) {
+  if (number_of_threads > 0) {
+    nthreads = number_of_threads;
+  }
+}
+
+int parallel_set_region_threads(int number_of_threads) {
+  int previous = region_threads;
+  region_threads = (number_of_threads > 0 ? number_of_threads : 0);
+  return previous;
+}
+
+void parallel_set_blocksize(int blocksize_in) {
+  if (blocksize_in > 0) {
+    blocksize = blocksize_in;
+  }
+}
+
+void parallel_set_affinity(int affinity_in) {
+  affinity = (affinity_in != 0);
+}
+
+int parallel_thread_index() { return omp_get_thread_num(); }
+int parallel_max_threads () { return number_of_threads(); }
+
+void foreach_in_range(void (*func)(void*, parallel_index_t, parallel_index_t, parallel_index_t),
+                      void* array, parallel_index_t length, parallel_index_t n) {
+  int64_t blocks = ((int64_t) n + blocksize - 1) / blocksize;
+  INSTRUMENT_TRACE_BEGIN(trace);
+
+  if (affinity) {
+    #pragma omp parallel for schedule(static) num_threads(loop_threads()) proc_bind(spread) if(blocks > 1)
+    for (int64_t b = 0; b < blocks; b++) {
+      int64_t start = b * blocksize;
+      int64_t end   = MIN(start + blocksize, (int64_t) n);
+      func(array, length, (parallel_index_t) start, (parallel_index_t) end);
+    }
+  } else {
+    #pragma omp parallel for schedule(dynamic,1) num_threads(loop_threads()) if(blocks > 1)
+    for (int64_t b = 0; b < blocks; b++) {
+      int64_t start = b * blocksize;
+      int64_t end   = MIN(start + blocksize, (int64_t) n);
+      func(array, length, (parallel_index_t) start, (parallel_index_t) end);
+    }
+  }
+  INSTRUMENT_TRACE_END("foreach_in_range", trace);
+}
+
+void foreach_in_range_phases(void (**funcs)(void*, parallel_index_t, parallel_index_t, parallel_index_t), int phases,
+                             void* array, parallel_index_t length, parallel_index_t n) {
+  int64_t blocks = ((int64_t) n + blocksize - 1) / blocksize;
+  INSTRUMENT_TRACE_BEGIN(trace);
+
+  if (affinity) {
+    #pragma omp parallel for schedule(static) num_threads(loop_threads()) proc_bind(spread) if(blocks > 1)
+    for (int64_t b = 0; b < blocks; b++) {
+      int64_t start = b * blocksize;
+      int64_t end   = MIN(start + blocksize, (int64_t) n);
+      for (int p = 0; p < phases; p++) funcs[p](array, length, (parallel_index_t) start, (parallel_index_t) end);
+    }
+  } else {
+    #pragma omp parallel for schedule(dynamic,1) num_threads(loop_threads()) if(blocks > 1)
+    for (int64_t b = 0; b < blocks; b++) {
+      int64_t start = b * blocksize;
+      int64_t end   = MIN(start + blocksize, (int64_t) n);
+      for (int p = 0; p < phases; p++) funcs[p](array, length, (parallel_index_t) start, (parallel_index_t) end);
+    }
+  }
+  INSTRUMENT_TRACE_END("foreach_in_range_phases", trace);
+}
+
+void foreach_in_range_two(void (*func)(void*, void*, parallel_index_t, parallel_index_t, parallel_index_t),
+                          void* array1, void* array2, parallel_index_t length, parallel_index_t n) {
+  int64_t blocks = ((int64_t) n + blocksize - 1) / blocksize;
+  INSTRUMENT_TRACE_BEGIN(trace);
+
+  if (affinity) {
+    #pragma omp parallel for schedule(static) num_threads(loop_threads()) proc_bind(spread) if(blocks > 1)
+    for (int64_t b = 0; b < blocks; b++) {
+      int64_t start = b * blocksize;
+      int64_t end   = MIN(start + blocksize, (int64_t) n);
+      func(array1, array2, length, (parallel_index_t) start, (parallel_index_t) end);
+    }
+  } else {
+    #pragma omp parallel for schedule(dynamic,1) num_threads(loop_threads()) if(blocks > 1)
+    for (int64_t b = 0; b < blocks; b++) {
+      int64_t start = b * blocksize;
+      int64_t end   = MIN(start + blocksize, (int64_t) n);
+      func(array1, array2, length, (parallel_index_t) start, (parallel_index_t) end);
+    }
+  }
+  INSTRUMENT_TRACE_END("foreach_in_range_two", trace);
+}
+
+/*
+ * Scans positions start..end-1 starting from sum, storing the prefix sums if
+ * sums is not NULL, and returns the last one.
+ */
+static void* scan_block(void* (*f)(void*, void*), void** input, void** sums, concurrent_bag_t* created_elements,
+                        parallel_index_t length, int stride, int64_t start, int64_t end, void* sum) {
+  for (int64_t i = start; i < end; i++) {
+    int64_t j = (stride == 1 ? i : (int64_t) length - 1 - i);
+    int is_created = (sum != NULL) && (input[j] != NULL); // otherwise one of them is returned
+    sum = f(sum, input[j]);
+    if (sums != NULL) sums[i] = sum;
+    if (is_created) concurrent_bag_insert(created_elements, sum);
+  }
+  return sum;
+}
+
+void prefix_sums_pointers(void* (*f)(void*, void*), void** input, void** sums, concurrent_bag_t* created_elements,
+                          parallel_index_t length, int stride) {
+  if (length == 0) return;
+
+  int64_t blocks = MIN((int64_t) loop_threads(), (int64_t) length);
+  void**  totals = (void**) malloc(blocks * sizeof(void*)); // of the blocks before each block
+  INSTRUMENT_TRACE_BEGIN(trace);
+
+  totals[0] = NULL;
+  #pragma omp parallel for schedule(static,1) num_threads((int) blocks)
+  for (int64_t b = 0; b < blocks - 1; b++) {
+    totals[b+1] = scan_block(f, input, NULL, created_elements, length, stride,
+                             (length*b)/blocks, (length*(b+1))/blocks, NULL);
+  }
+
+  for (int64_t b = 1; b < blocks; b++) {
+    int is_created = (totals[b-1] != NULL) && (totals[b] != NULL);
+    totals[b] = f(totals[b-1], totals[b]);
+    if (is_created) concurrent_bag_insert(created_elements, totals[b]);
+  }
+
+  #pragma omp parallel for schedule(static,1) num_threads((int) blocks)
+  for (int64_t b = 0; b < blocks; b++) {
+    scan_block(f, input, sums, created_elements, length, stride,
+               (length*b)/blocks, (length*(b+1))/blocks, totals[b]);
+  }
+
+  free(totals);
+  INSTRUMENT_TRACE_END("prefix_sums_pointers", trace);
+}
+
+spin_mutex_t* spin_mutex_create() {
+  spin_mutex_t* wrapper = (spin_mutex_t*) malloc(sizeof(spin_mutex_t));
+  if (wrapper) omp_init_lock(&(wrapper->lock));
+  return wrapper;
+}
+
+void spin_mutex_lock(spin_mutex_t* mutex) {
+  if (mutex == NULL) return;
+#ifdef BUILD_INSTRUMENT
+  if (omp_test_lock(&(mutex->lock))) return;
+  INSTRUMENT_COUNT(INSTRUMENT_SPIN_WAITS, 1);
+#endif
+  omp_set_lock(&(mutex->lock));
+}
+
+void spin_mutex_unlock(spin_mutex_t* mutex) {
+  if (mutex) omp_unset_lock(&(mutex->lock));
+}
+
+void spin_mutex_destroy(spin_mutex_t* mutex) {
+  if (mutex) {
+    omp_destroy_lock(&(mutex->lock));
+    free(mutex);
+  }
+}
+
+/******************************************************************************/
+/* END OF FILE                                                                */
+/******************************************************************************/
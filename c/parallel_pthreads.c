@@ -0,0 +1,395 @@
+/*
+ * parallel_pthreads.c
+ *
+ * An implementation of the parallel primitives on a pool of POSIX threads,
+ * with no dependencies beyond pthreads and C11 atomics.
+ *
+ * A parallel loop splits its range into one contiguous share per thread.
+ * Each thread claims blocks from the front of its own share and, once it is
+ * exhausted, steals blocks from the shares of the other threads, so the load
+ * is balanced while each thread mostly walks through its own part of the
+ * arrays. In the NUMA mode (parallel_set_affinity) there is no stealing, so
+ * the thread that runs a block of a range of a given length is always the
+ * same, and the workers are pinned to cores. A region limit
+ * (parallel_set_region_threads) splits the loops that the calling thread
+ * starts into fewer shares, and the workers without a share sit them out,
+ * so the pool is not restarted. The pool is started by the first
+ * loop and runs one loop at a time;
+ * a loop started inside a loop, or while another thread is running one, is
+ * executed sequentially by the calling thread.
+ *
+ * The prefix sums use the blocked algorithm: every block but the last is
+ * reduced in parallel, the block totals are scanned sequentially, and then
+ * every block is scanned in parallel starting from the total of the blocks
+ * before it.
+ *
+ * Copyright (c) 2024-2025 Sivan Toledo and Shahaf Gargir
+ */
+
+#ifdef __linux__
+#define _GNU_SOURCE // for pthread_setaffinity_np
+#include <sched.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "parallel.h"
+#include "instrument.h"
+
+#define MIN(a,b) ((a)<(b) ? (a) : (b))
+
+struct spin_mutex_st {
+  atomic_flag flag;
+};
+
+/******************************************************************************/
+/* THE POOL                                                                   */
+/******************************************************************************/
+
+typedef struct share_st {
+  atomic_int_fast64_t next; // first unclaimed index
+  int64_t             end;
+  char                padding[64 - sizeof(atomic_int_fast64_t) - sizeof(int64_t)];
+} share_t;
+
+typedef void (*body_t)(void* context, int64_t start, int64_t end);
+
+typedef struct job_st {
+  body_t   body;
+  void*    context;
+  int64_t  grain;
+  int      threads;
+  int      steal;   // from the shares of the other threads
+  share_t* shares;
+} job_t;
+
+static int nthreads  = 0; // 0 means the number of processors
+static int blocksize = 16;
+static int affinity  = 0;
+
+static pthread_mutex_t owner = PTHREAD_MUTEX_INITIALIZER; // held while running a loop
+
+static pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  started    = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t  finished   = PTHREAD_COND_INITIALIZER;
+static pthread_t*      workers    = NULL;
+static int             pool_size  = 0; // including the thread that runs the loop
+static job_t*          job        = NULL;
+static uint64_t        generation = 0;
+static uint64_t        first_job  = 0; // generation when the pool was started
+static int             running    = 0; // workers that have not finished the job
+static int             stopping   = 0;
+
+static __thread int thread_index   = -1;
+static __thread int in_loop        = 0;
+static __thread int region_threads = 0; // 0 means no region limit
+
+static int number_of_threads() {
+  if (nthreads > 0) return nthreads;
+  long processors = sysconf(_SC_NPROCESSORS_ONLN);
+  return (processors > 0 ? (int) processors : 1);
+}
+
+static void job_work(job_t* j, int me) {
+  int shares = (j->steal ? j->threads : 1);
+  for (int k = 0; k < shares; k++) {
+    share_t* share = (j->shares) + (me + k) % (j->threads); // our own share first
+    for (;;) {
+      int64_t start = atomic_fetch_add(&(share->next), j->grain);
+      if (start >= share->end) break;
+      (*(j->body))(j->context, start, MIN(start + j->grain, share->end));
+    }
+  }
+}
+
+/*
+ * Pins the calling thread to core t*count/p among the count cores that it may
+ * use.
+ */
+static void pin(int t, int p) {
+#ifdef __linux__
+  cpu_set_t allowed;
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) return;
+  int target = (int) (((int64_t) t * CPU_COUNT(&allowed)) / p);
+  for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+    if (!CPU_ISSET(cpu, &allowed) || target-- > 0) continue;
+    cpu_set_t one;
+    CPU_ZERO(&one);
+    CPU_SET(cpu, &one);
+    pthread_setaffinity_np(pthread_self(), sizeof(one), &one);
+    return;
+  }
+#endif
+}
+
+static void* worker(void* index_v) {
+  uint64_t seen = first_job; // not generation, which the first job may have already advanced
+
+  thread_index = (int) (intptr_t) index_v;
+  in_loop      = 1;           // loops started by the body run sequentially
+  if (affinity) pin(thread_index, pool_size);
+
+  pthread_mutex_lock(&pool_mutex);
+  for (;;) {
+    while (generation == seen && !stopping) pthread_cond_wait(&started, &pool_mutex);
+    if (stopping) break;
+    seen = generation;
+    job_t* j = job;
+    pthread_mutex_unlock(&pool_mutex);
+
+    if (thread_index < j->threads) job_work(j, thread_index); // the others sit out a limited region
+
+    pthread_mutex_lock(&pool_mutex);
+    if (--running == 0) pthread_cond_signal(&finished);
+  }
+  pthread_mutex_unlock(&pool_mutex);
+  return NULL;
+}
+
+/*
+ * Both must be called by the owner.
+ */
+static void pool_start() {
+  if (workers != NULL) return;
+  pool_size = number_of_threads();
+  first_job = generation;
+  workers   = (pthread_t*) malloc(pool_size * sizeof(pthread_t));
+  for (int t = 1; t < pool_size; t++) {
+    pthread_create(workers + t, NULL, worker, (void*) (intptr_t) t);
+  }
+}
+
+static void pool_stop() {
+  if (workers == NULL) return;
+  pthread_mutex_lock(&pool_mutex);
+  stopping = 1;
+  pthread_cond_broadcast(&started);
+  pthread_mutex_unlock(&pool_mutex);
+  for (int t = 1; t < pool_size; t++) pthread_join(workers[t], NULL);
+  stopping = 0;
+  free(workers);
+  workers = NULL;
+}
+
+static void run(body_t body, void* context, int64_t n, int64_t grain) {
+  if (n <= 0) return;
+
+  if (in_loop || n <= grain || pthread_mutex_trylock(&owner) != 0) {
+    (*body)(context, 0, n);
+    return;
+  }
+
+  pool_start();
+  int p = (region_threads > 0 ? MIN(region_threads, pool_size) : pool_size);
+
+  share_t* shares = (share_t*) malloc(p * sizeof(share_t));
+  for (int t = 0; t < p; t++) {
+    atomic_init(&(shares[t].next), (n * t) / p);
+    shares[t].end = (n * (t+1)) / p;
+  }
+  job_t j = { body, context, grain, p, !affinity, shares };
+
+  pthread_mutex_lock(&pool_mutex);
+  job     = &j;
+  running = pool_size - 1;
+  generation++;
+  pthread_cond_broadcast(&started);
+  pthread_mutex_unlock(&pool_mutex);
+
+  int saved_index = thread_index;
+  thread_index = 0;
+  in_loop      = 1;
+  job_work(&j, 0);
+  in_loop      = 0;
+  thread_index = saved_index;
+
+  pthread_mutex_lock(&pool_mutex);
+  while (running > 0) pthread_cond_wait(&finished, &pool_mutex);
+  job = NULL;
+  pthread_mutex_unlock(&pool_mutex);
+
+  free(shares);
+  pthread_mutex_unlock(&owner);
+}
+
+/******************************************************************************/
+/* THE PRIMITIVES                                                             */
+/******************************************************************************/
+
+void parallel_set_thread_limit(int number_of_threads) {
+  if (number_of_threads > 0 && number_of_threads != nthreads) {
+    pthread_mutex_lock(&owner);
+    pool_stop(); // the next loop starts a pool of the new size
+    nthreads = number_of_threads;
+    pthread_mutex_unlock(&owner);
+  }
+}
+
+int parallel_set_region_threads(int number_of_threads) {
+  int previous = region_threads;
+  region_threads = (number_of_threads > 0 ? number_of_threads : 0);
+  return previous;
+}
+
+void parallel_set_blocksize(int blocksize_in) {
+  if (blocksize_in > 0) {
+    blocksize = blocksize_in;
+  }
+}
+
+void parallel_set_affinity(int affinity_in) {
+  pthread_mutex_lock(&owner);
+  if ((affinity_in != 0) != affinity) {
+    pool_stop(); // the next loop starts a pool of pinned or unpinned workers
+    affinity = (affinity_in != 0);
+  }
+  pthread_mutex_unlock(&owner);
+}
+
+int parallel_thread_index() { return thread_index; }
+int parallel_max_threads () { return (workers != NULL ? pool_size : number_of_threads()); }
+
+typedef struct loop_st {
+  void (*func    )(void*,        parallel_index_t, parallel_index_t, parallel_index_t);
+  void (*func_two)(void*, void*, parallel_index_t, parallel_index_t, parallel_index_t);
+  void (**funcs  )(void*,        parallel_index_t, parallel_index_t, parallel_index_t);
+  int              phases;
+  void*            array1;
+  void*            array2;
+  parallel_index_t length;
+} loop_t;
+
+static void loop_body(void* loop_v, int64_t start, int64_t end) {
+  loop_t* loop = (loop_t*) loop_v;
+  (*(loop->func))(loop->array1, loop->length, (parallel_index_t) start, (parallel_index_t) end);
+}
+
+static void loop_body_phases(void* loop_v, int64_t start, int64_t end) {
+  loop_t* loop = (loop_t*) loop_v;
+  for (int p = 0; p < loop->phases; p++) {
+    (*((loop->funcs)[p]))(loop->array1, loop->length, (parallel_index_t) start, (parallel_index_t) end);
+  }
+}
+
+static void loop_body_two(void* loop_v, int64_t start, int64_t end) {
+  loop_t* loop = (loop_t*) loop_v;
+  (*(loop->func_two))(loop->array1, loop->array2, loop->length, (parallel_index_t) start, (parallel_index_t) end);
+}
+
+void foreach_in_range(void (*func)(void*, parallel_index_t, parallel_index_t, parallel_index_t),
+                      void* array, parallel_index_t length, parallel_index_t n) {
+  loop_t loop = { func, NULL, NULL, 0, array, NULL, length };
+  INSTRUMENT_TRACE_BEGIN(trace);
+  run(loop_body, &loop, (int64_t) n, blocksize);
+  INSTRUMENT_TRACE_END("foreach_in_range", trace);
+}
+
+void foreach_in_range_phases(void (**funcs)(void*, parallel_index_t, parallel_index_t, parallel_index_t), int phases,
+                             void* array, parallel_index_t length, parallel_index_t n) {
+  loop_t loop = { NULL, NULL, funcs, phases, array, NULL, length };
+  INSTRUMENT_TRACE_BEGIN(trace);
+  run(loop_body_phases, &loop, (int64_t) n, blocksize);
+  INSTRUMENT_TRACE_END("foreach_in_range_phases", trace);
+}
+
+void foreach_in_range_two(void (*func)(void*, void*, parallel_index_t, parallel_index_t, parallel_index_t),
+                          void* array1, void* array2, parallel_index_t length, parallel_index_t n) {
+  loop_t loop = { NULL, func, NULL, 0, array1, array2, length };
+  INSTRUMENT_TRACE_BEGIN(trace);
+  run(loop_body_two, &loop, (int64_t) n, blocksize);
+  INSTRUMENT_TRACE_END("foreach_in_range_two", trace);
+}
+
+typedef struct scan_st {
+  void*             (*f)(void*, void*);
+  void**            input;
+  void**            sums;
+  concurrent_bag_t* created_elements;
+  parallel_index_t  length;
+  int               stride;
+  int64_t           blocks;
+  void**            totals; // of the blocks before each block
+} scan_t;
+
+/*
+ * Scans positions start..end-1 starting from sum, storing the prefix sums if
+ * sums is not NULL, and returns the last one.
+ */
+static void* scan_block(scan_t* scan, void** sums, int64_t start, int64_t end, void* sum) {
+  for (int64_t i = start; i < end; i++) {
+    int64_t j = (scan->stride == 1 ? i : (int64_t) (scan->length) - 1 - i);
+    int is_created = (sum != NULL) && ((scan->input)[j] != NULL); // otherwise one of them is returned
+    sum = (*(scan->f))(sum, (scan->input)[j]);
+    if (sums != NULL) sums[i] = sum;
+    if (is_created) concurrent_bag_insert(scan->created_elements, sum);
+  }
+  return sum;
+}
+
+static void scan_reduce(void* scan_v, int64_t start, int64_t end) {
+  scan_t* scan = (scan_t*) scan_v;
+  for (int64_t b = start; b < end; b++) {
+    (scan->totals)[b+1] = scan_block(scan, NULL, (scan->length*b)/scan->blocks, (scan->length*(b+1))/scan->blocks, NULL);
+  }
+}
+
+static void scan_final(void* scan_v, int64_t start, int64_t end) {
+  scan_t* scan = (scan_t*) scan_v;
+  for (int64_t b = start; b < end; b++) {
+    scan_block(scan, scan->sums, (scan->length*b)/scan->blocks, (scan->length*(b+1))/scan->blocks, (scan->totals)[b]);
+  }
+}
+
+void prefix_sums_pointers(void* (*f)(void*, void*), void** input, void** sums, concurrent_bag_t* created_elements,
+                          parallel_index_t length, int stride) {
+  if (length == 0) return;
+
+  scan_t scan = { f, input, sums, created_elements, length, stride, 0, NULL };
+  scan.blocks = MIN((int64_t) parallel_max_threads(), (int64_t) length);
+  scan.totals = (void**) malloc(scan.blocks * sizeof(void*));
+  INSTRUMENT_TRACE_BEGIN(trace);
+
+  (scan.totals)[0] = NULL;
+  run(scan_reduce, &scan, scan.blocks - 1, 1);
+
+  for (int64_t b = 1; b < scan.blocks; b++) {
+    int is_created = ((scan.totals)[b-1] != NULL) && ((scan.totals)[b] != NULL);
+    (scan.totals)[b] = f((scan.totals)[b-1], (scan.totals)[b]);
+    if (is_created) concurrent_bag_insert(created_elements, (scan.totals)[b]);
+  }
+
+  run(scan_final, &scan, scan.blocks, 1);
+
+  free(scan.totals);
+  INSTRUMENT_TRACE_END("prefix_sums_pointers", trace);
+}
+
+spin_mutex_t* spin_mutex_create() {
+  spin_mutex_t* mutex = (spin_mutex_t*) malloc(sizeof(spin_mutex_t));
+  if (mutex) atomic_flag_clear(&(mutex->flag));
+  return mutex;
+}
+
+void spin_mutex_lock(spin_mutex_t* mutex) {
+  if (mutex == NULL) return;
+  if (!atomic_flag_test_and_set_explicit(&(mutex->flag), memory_order_acquire)) return;
+  INSTRUMENT_COUNT(INSTRUMENT_SPIN_WAITS, 1);
+  while (atomic_flag_test_and_set_explicit(&(mutex->flag), memory_order_acquire)) ;
+}
+
+void spin_mutex_unlock(spin_mutex_t* mutex) {
+  if (mutex) atomic_flag_clear_explicit(&(mutex->flag), memory_order_release);
+}
+
+void spin_mutex_destroy(spin_mutex_t* mutex) {
+  free(mutex);
+}
+
+/******************************************************************************/
+/* END OF FILE                                                                */
+/******************************************************************************/
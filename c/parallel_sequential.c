@@ -11,28 +11,53 @@
 #include <stdint.h>
 
 #include "parallel.h"
+#include "instrument.h"
 
 void parallel_set_thread_limit(int number_of_threads) {
+  (void) number_of_threads;
+}
+int parallel_set_region_threads(int number_of_threads) {
+  (void) number_of_threads;
+  return 0;
 }
 void parallel_set_blocksize(int blocksize_in) {
+  (void) blocksize_in;
+}
+void parallel_set_affinity(int affinity) {
+  (void) affinity;
 }
 
+int parallel_thread_index() { return 0; }
+int parallel_max_threads () { return 1; }
+
 void foreach_in_range(void (*f)(void*, parallel_index_t, parallel_index_t, parallel_index_t),
                       void *array, parallel_index_t length, parallel_index_t n) {
+  INSTRUMENT_TRACE_BEGIN(trace);
   (*f)(array, length, 0, n);
+  INSTRUMENT_TRACE_END("foreach_in_range", trace);
+}
+
+void foreach_in_range_phases(void (**f)(void*, parallel_index_t, parallel_index_t, parallel_index_t), int phases,
+                             void *array, parallel_index_t length, parallel_index_t n) {
+  INSTRUMENT_TRACE_BEGIN(trace);
+  for (int p = 0; p < phases; p++) (*(f[p]))(array, length, 0, n);
+  INSTRUMENT_TRACE_END("foreach_in_range_phases", trace);
 }
 
 void foreach_in_range_two(void (*f)(void*, void*, parallel_index_t, parallel_index_t, parallel_index_t),
                           void *array1, void *array2, parallel_index_t length, parallel_index_t n) {
+  INSTRUMENT_TRACE_BEGIN(trace);
   (*f)(array1, array2, length, 0, n);
+  INSTRUMENT_TRACE_END("foreach_in_range_two", trace);
 }
 
 void prefix_sums_pointers(void* (*f)(void*, void*),
                           void **input, void **sums,
-                          concurrent_set_t *created_elements,
+                          concurrent_bag_t *created_elements,
                           parallel_index_t length, int stride) {
   parallel_index_t i, j;
   void *sum = NULL; // neutral element when operating on pointers
+  INSTRUMENT_TRACE_BEGIN(trace);
 
   for (i = 0; i < length; i++) {
     if (stride == 1) {
@@ -43,16 +68,17 @@ void prefix_sums_pointers(void* (*f)(void*, void*),
     //fprintf(stderr,">>> %d %d\n",i,j);
     void *temp = f(sum, input[j]);
     if ((sum != NULL) && (input[j] != NULL))
-      concurrent_set_insert(created_elements, temp); // the first element is combined with NULL so f returns it, not a new element
+      concurrent_bag_insert(created_elements, temp); // the first element is combined with NULL so f returns it, not a new element
     sums[i] = temp;
     sum = temp;
   }
+  INSTRUMENT_TRACE_END("prefix_sums_pointers", trace);
 }
 
 spin_mutex_t* spin_mutex_create()            { return NULL; }
-void spin_mutex_lock(spin_mutex_t *mutex)    {}
-void spin_mutex_unlock(spin_mutex_t *mutex)  {}
-void spin_mutex_destroy(spin_mutex_t *mutex) {}
+void spin_mutex_lock(spin_mutex_t *mutex)    { (void) mutex; }
+void spin_mutex_unlock(spin_mutex_t *mutex)  { (void) mutex; }
+void spin_mutex_destroy(spin_mutex_t *mutex) { (void) mutex; }
 
 /******************************************************************************/
 /* END OF FILE                                                                */
@@ -7,6 +7,24 @@
  * is normally 32-bit on 32-bit systems and 64 bit on 64-bit systems, so
  * there should be no issue or but if it is different from parallel_index_t.
  *
+ * All the primitives run in a task arena that the library owns; it is
+ * created by parallel_set_thread_limit (together with the global_control
+ * that allows that many threads) and reused by every call, so the thread
+ * limit costs nothing per call. Without a limit, the primitives run
+ * in TBB's implicit arena.
+ *
+ * A region limit (parallel_set_region_threads) belongs to the thread that
+ * sets it: the primitives that this thread calls run in a smaller arena of
+ * its own, which is cached, and the shared arena and global_control are left
+ * alone, so threads may run regions with different limits concurrently.
+ * Primitives that are called from within a primitive run in the arena that
+ * the calling task is already in.
+ *
+ * In the NUMA mode (parallel_set_affinity), the loops use a static_partitioner,
+ * which gives the same subranges to the same threads in every loop over a
+ * range of a given length, and an observer pins every worker that enters an
+ * arena to a core, by its index in the arena.
+ *
  * Copyright (c) 2024-2025 Sivan Toledo and Shahaf Gargir
  */
 
@@ -14,14 +32,106 @@
 #include <cstdint>
 #include <tbb/parallel_for.h>
 #include <tbb/blocked_range.h>
-#include <tbb/global_control.h>
 #include <tbb/parallel_scan.h>
 #include <tbb/spin_mutex.h>
+#include <tbb/task_arena.h>
+#include <tbb/global_control.h>
+#include <tbb/task_scheduler_observer.h>
+#include <memory>
+
+#ifdef __linux__
+#include <sched.h>
+#include <pthread.h>
+#endif
+
+static std::unique_ptr<tbb::global_control> control; // lets the arena have more threads than cores
+static std::unique_ptr<tbb::task_arena>     arena;
+
+static thread_local int                              region_threads = 0; // 0 means no region limit
+static thread_local std::unique_ptr<tbb::task_arena> region_arena;
+static thread_local int                              nesting = 0;        // inside a primitive's body
+
+/*
+ * Marks the bodies of the primitives, so that nested primitives stay in
+ * the arena of the task that calls them.
+ */
+struct nested {
+  nested()  { nesting++; }
+  ~nested() { nesting--; }
+};
+
+static int max_threads() {
+  if (arena) return arena->max_concurrency();
+  return tbb::this_task_arena::max_concurrency();
+}
+
+template<typename F>
+static void in_arena(const F& body) {
+  if (nesting > 0) {
+    body();
+    return;
+  }
+  if (region_threads > 0 && region_threads < max_threads()) {
+    if (!region_arena || region_arena->max_concurrency() != region_threads) {
+      region_arena = std::make_unique<tbb::task_arena>(region_threads);
+    }
+    region_arena->execute(body);
+    return;
+  }
+  if (arena) arena->execute(body);
+  else       body();
+}
+
+static int affinity = 0;
+
+/*
+ * Pins worker t of an arena of p threads to core t*count/p among the count
+ * cores that it may use.
+ */
+class pinning_observer : public tbb::task_scheduler_observer {
+public:
+  pinning_observer() { observe(true); }
+  ~pinning_observer() { observe(false); }
+
+  void on_scheduler_entry(bool is_worker) override {
+#ifdef __linux__
+    int t = tbb::this_task_arena::current_thread_index();
+    int p = tbb::this_task_arena::max_concurrency();
+    cpu_set_t allowed;
+    if (!is_worker || t < 0 || p <= 0 || sched_getaffinity(0, sizeof(allowed), &allowed) != 0) return;
+    int target = (int) (((int64_t) t * CPU_COUNT(&allowed)) / p);
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+      if (!CPU_ISSET(cpu, &allowed) || target-- > 0) continue;
+      cpu_set_t one;
+      CPU_ZERO(&one);
+      CPU_SET(cpu, &one);
+      pthread_setaffinity_np(pthread_self(), sizeof(one), &one);
+      return;
+    }
+#endif
+  }
+};
+
+static std::unique_ptr<pinning_observer> pinning;
+
+template<typename Body>
+static void for_blocks(size_t n, size_t blocksize, const Body& body) {
+  auto marked = [&body](const tbb::blocked_range<size_t>& subrange) {
+    nested mark;
+    body(subrange);
+  };
+  in_arena([&]() {
+    if (affinity) tbb::parallel_for(tbb::blocked_range<size_t>(0, n, blocksize), marked, tbb::static_partitioner());
+    else          tbb::parallel_for(tbb::blocked_range<size_t>(0, n, blocksize), marked);
+  });
+}
 
 extern "C" {
 
 #include "parallel.h"
 #include "concurrent_set.h"
+#include "concurrent_bag.h"
+#include "instrument.h"
 
 struct spin_mutex_st {
   tbb::spin_mutex mutex;
@@ -30,66 +140,94 @@ struct spin_mutex_st {
 static int nthreads = 0;
 static int blocksize = 16;
 
+/*
+ * Must not be called while other threads are using the primitives; use
+ * parallel_set_region_threads to limit a single region.
+ */
 void parallel_set_thread_limit(int number_of_threads) {
-  if (number_of_threads > 0) {
+  if (number_of_threads > 0 && number_of_threads != nthreads) {
     nthreads = number_of_threads;
+    arena.reset();
+    control = std::make_unique<tbb::global_control>(tbb::global_control::max_allowed_parallelism, nthreads);
+    arena   = std::make_unique<tbb::task_arena>(nthreads);
   }
 }
 
+int parallel_set_region_threads(int number_of_threads) {
+  int previous = region_threads;
+  region_threads = (number_of_threads > 0 ? number_of_threads : 0);
+  return previous;
+}
+
 void parallel_set_blocksize(int blocksize_in) {
   if (blocksize_in > 0) {
     blocksize = blocksize_in;
   }
 }
 
-void foreach_in_range(void (*func)(void*, parallel_index_t, parallel_index_t, parallel_index_t), void* array, parallel_index_t length, parallel_index_t n) {
-  //tbb::global_control control(tbb::global_control::max_allowed_parallelism, nthreads);
+/*
+ * Must not be called while other threads are using the primitives; workers
+ * that were pinned stay pinned.
+ */
+void parallel_set_affinity(int affinity_in) {
+  affinity = (affinity_in != 0);
+  if (affinity && !pinning) pinning = std::make_unique<pinning_observer>();
+  if (!affinity)            pinning.reset();
+}
 
-  std::unique_ptr<tbb::global_control> control;
-  if (nthreads > 0) {
-    control = std::make_unique<tbb::global_control>(tbb::global_control::max_allowed_parallelism, nthreads);
-  }
+int parallel_thread_index() {
+  int index = tbb::this_task_arena::current_thread_index();
+  return (index >= 0 ? index : -1);
+}
 
+int parallel_max_threads() {
+  return max_threads();
+}
+
+void foreach_in_range(void (*func)(void*, parallel_index_t, parallel_index_t, parallel_index_t), void* array, parallel_index_t length, parallel_index_t n) {
   //printf("blocksize = %d\n",blocksize>0 ? blocksize : block_size);
-    tbb::parallel_for(tbb::blocked_range<size_t>(0, n, blocksize),
-        [array, length, func](const tbb::blocked_range<size_t>& subrange) {
-          func(array, length, subrange.begin(), subrange.end());
-        }
-    );
+  INSTRUMENT_TRACE_BEGIN(trace);
+  for_blocks(n, blocksize,
+      [array, length, func](const tbb::blocked_range<size_t>& subrange) {
+        func(array, length, subrange.begin(), subrange.end());
+      }
+  );
+  INSTRUMENT_TRACE_END("foreach_in_range", trace);
   }
 
-  void foreach_in_range_two(void (*func)(void*, void*, parallel_index_t, parallel_index_t, parallel_index_t), void* array1, void* array2, parallel_index_t length, parallel_index_t n) {
-    //tbb::global_control control(tbb::global_control::max_allowed_parallelism, nthreads);
-
-    std::unique_ptr<tbb::global_control> control;
-    if (nthreads > 0) {
-      control = std::make_unique<tbb::global_control>(tbb::global_control::max_allowed_parallelism, nthreads);
-    }
+  void foreach_in_range_phases(void (**funcs)(void*, parallel_index_t, parallel_index_t, parallel_index_t), int phases, void* array, parallel_index_t length, parallel_index_t n) {
+  INSTRUMENT_TRACE_BEGIN(trace);
+  for_blocks(n, blocksize,
+      [funcs, phases, array, length](const tbb::blocked_range<size_t>& subrange) {
+        for (int p = 0; p < phases; p++) funcs[p](array, length, subrange.begin(), subrange.end());
+      }
+  );
+  INSTRUMENT_TRACE_END("foreach_in_range_phases", trace);
+  }
 
+  void foreach_in_range_two(void (*func)(void*, void*, parallel_index_t, parallel_index_t, parallel_index_t), void* array1, void* array2, parallel_index_t length, parallel_index_t n) {
     //printf("blocksize = %d\n",blocksize>0 ? blocksize : block_size);
-    tbb::parallel_for(tbb::blocked_range<size_t>(0, n, blocksize),
+    INSTRUMENT_TRACE_BEGIN(trace);
+    for_blocks(n, blocksize,
         [array1, array2, length, func](const tbb::blocked_range<size_t>& subrange) {
           func(array1, array2, length, subrange.begin(), subrange.end());
         }
     );
+    INSTRUMENT_TRACE_END("foreach_in_range_two", trace);
   }
 
   //void parallel_scan_c(void** input, void** sums, void* created_elements , void* (*f)(void*, void*, void*, int), int length, int stride){
-  void prefix_sums_pointers(void* (*f)(void*, void*), void** input, void** sums, concurrent_set_t* created_elements , parallel_index_t length, int stride) {
-    //tbb::global_control control(tbb::global_control::max_allowed_parallelism, nthreads);
-
-    std::unique_ptr<tbb::global_control> control;
-    if (nthreads > 0) {
-      control = std::make_unique<tbb::global_control>(tbb::global_control::max_allowed_parallelism, nthreads);
-    }
-
+  void prefix_sums_pointers(void* (*f)(void*, void*), void** input, void** sums, concurrent_bag_t* created_elements , parallel_index_t length, int stride) {
+    INSTRUMENT_TRACE_BEGIN(trace);
+    in_arena([=]() {
     tbb::parallel_scan(
         tbb::blocked_range<size_t>(0, length, blocksize),
         (void*) NULL, /* starting value (identity elements) */
         // now define the scan operation
         [input, sums, created_elements, f, length, stride](const tbb::blocked_range<size_t>& r, void* sum, bool is_final_scan) {
+          nested mark;
           void* temp = sum;
-          for (parallel_index_t i = r.begin(); i != r.end(); ++i) {
+          for (parallel_index_t i = (parallel_index_t) r.begin(); i != (parallel_index_t) r.end(); ++i) {
             //int j = i + 1;
             parallel_index_t j = i;
             if (stride == -1) {
@@ -103,7 +241,7 @@ void foreach_in_range(void (*func)(void*, parallel_index_t, parallel_index_t, pa
             if (is_final_scan) {
               sums[i] = temp;
             } //else {
-            if (is_created) concurrent_set_insert( created_elements, temp );
+            if (is_created) concurrent_bag_insert( created_elements, temp );
             //}
           }
           return temp;
@@ -111,13 +249,16 @@ void foreach_in_range(void (*func)(void*, parallel_index_t, parallel_index_t, pa
         // and now the combining operation
         //[f, created_elements](void* left, void* right) { return f(left, right, created_elements, 0); }
         [f, created_elements](void* left, void* right) {
+          nested mark;
           int is_created = (left != NULL) && (right != NULL); // otherwise one of them is returned
           void* temp = f(left, right);
-          if (is_created) concurrent_set_insert( created_elements, temp );
+          if (is_created) concurrent_bag_insert( created_elements, temp );
           return temp;
         }
         // there is also a version with an explicit is_final flag
     );
+    });
+    INSTRUMENT_TRACE_END("prefix_sums_pointers", trace);
   }
 
   spin_mutex_t* spin_mutex_create() {
@@ -131,6 +272,10 @@ void foreach_in_range(void (*func)(void*, parallel_index_t, parallel_index_t, pa
 
   void spin_mutex_lock(spin_mutex_t* mutex) {
     if (mutex) {
+#ifdef BUILD_INSTRUMENT
+      if (mutex->mutex.try_lock()) return;
+      INSTRUMENT_COUNT(INSTRUMENT_SPIN_WAITS, 1);
+#endif
       mutex->mutex.lock();
     }
   }
@@ -24,15 +24,21 @@
 
 #ifdef _WIN32
 #include <windows.h>
+#include <psapi.h>
+#include <io.h> // dup, dup2
 int gettimeofday(struct timeval * tp, struct timezone * tzp);
 #else
 #include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
 #endif
 
 #include <math.h>
+#include <float.h>
 
 #include "kalman.h"
 #include "parallel.h"
+#include "instrument.h"
 
 #include "cmdline_args.h"
 
@@ -208,35 +214,159 @@ kalman_matrix_t* generateRandomOrthonormal(int rows, int cols) {
 
 double times[16];
 
+/*
+ * The peak resident memory of the process so far, in bytes (0 if unknown).
+ * It only grows, so the benchmarks measure each record in a process of its
+ * own.
+ */
+static double peak_memory() {
+#ifdef _WIN32
+	PROCESS_MEMORY_COUNTERS counters;
+	if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) return 0.0;
+	return (double) counters.PeakWorkingSetSize;
+#else
+	struct rusage usage;
+	if (getrusage(RUSAGE_SELF, &usage) != 0) return 0.0;
+#ifdef __APPLE__
+	return (double) usage.ru_maxrss;          // in bytes
+#else
+	return (double) usage.ru_maxrss * 1024.0; // in kilobytes
+#endif
+#endif
+}
+
+/*
+ * The sum and the largest magnitude of the elements of the smoothed
+ * estimates, when an accuracy report is requested; comparing them between
+ * a double and a BUILD_SINGLE_PRECISION build shows the loss of accuracy.
+ */
+double estimates_sum;
+double estimates_max;
+
+static void accumulate_estimate(kalman_matrix_t* e) {
+	int32_t j;
+	for (j=0; j<matrix_rows(e); j++) {
+		estimates_sum += matrix_get(e,j,0);
+		estimates_max  = fmax(estimates_max, fabs(matrix_get(e,j,0)));
+	}
+}
+
+/*
+ * The tests that have an independent reference (e.g., windowed smoothing
+ * against kalman_smooth) also compare their estimates with it when an
+ * accuracy report is requested. The test fails if the largest difference
+ * exceeds the square root of the machine epsilon, relative to the largest
+ * element of the reference (or absolute, if that is smaller than 1).
+ */
+const char* reference_name = NULL;
+double      reference_difference;
+double      reference_max;
+
+static void compare_estimate(kalman_matrix_t* e, kalman_matrix_t* reference) {
+	int32_t j;
+	for (j=0; j<matrix_rows(reference); j++) {
+		double d = fabs(matrix_get(e,j,0) - matrix_get(reference,j,0));
+		if (!(d <= reference_difference)) reference_difference = d; // NaN counts as a failure
+		reference_max = fmax(reference_max, fabs(matrix_get(reference,j,0)));
+	}
+}
+
+static int reference_passed() {
+	double epsilon = sizeof(matrix_element_t) == sizeof(float) ? (double) FLT_EPSILON : DBL_EPSILON;
+	return reference_difference <= sqrt(epsilon) * fmax(reference_max, 1.0);
+}
+
+/*
+ * The number of steps of perftest_smooth at which a fixed-lag estimate is
+ * compared with a full kalman_smooth; each reference costs a filter.
+ */
+#define LAG_CHECKS 16
+
+/*
+ * Filters and smooths count steps (times[0] and times[1]), reads the
+ * estimates (times[2]) and frees the filter (times[3]). With a fixed lag and
+ * accuracy=1, right after step i is observed at LAG_CHECKS steps i, the
+ * estimate of step i-lag is compared with that of kalman_smooth on steps 0
+ * to i, computed before the timing starts.
+ */
 double perftest_smooth(
         kalman_options_t options,
 		kalman_matrix_t* H, kalman_matrix_t* F, kalman_matrix_t* c, kalman_matrix_t* K, char K_type,
 		kalman_matrix_t* G,                     kalman_matrix_t* o, kalman_matrix_t* C, char C_type,
-		int32_t count) {
+		int32_t count, int model, int32_t lag, int bulk, int accuracy) {
 
 	struct timeval begin, end;
 	long seconds, microseconds;
 
 	int32_t i,j,n;
 
+	int32_t           lag_checks = 0; // not timed
+	int32_t           lag_steps    [ LAG_CHECKS ];
+	kalman_matrix_t*  lag_reference[ LAG_CHECKS ];
+	if (accuracy && lag >= 0 && !bulk && count > lag) {
+		lag_checks = count - lag < LAG_CHECKS ? count - lag : LAG_CHECKS;
+		for (j=0; j<lag_checks; j++) {
+			lag_steps[j] = lag + (lag_checks == 1 ? 0 : (int32_t) (((int64_t) j * (count - 1 - lag)) / (lag_checks - 1)));
+			kalman_t* kalman = kalman_create_options(options & ~KALMAN_NO_COVARIANCE);
+			for (i=0; i<=lag_steps[j]; i++) {
+				kalman_evolve(kalman,matrix_cols(G),H,F,c,K,K_type);
+				kalman_observe(kalman,G,o,C,C_type);
+			}
+			kalman_smooth(kalman);
+			lag_reference[j] = kalman_estimate(kalman,lag_steps[j] - lag);
+			kalman_free(kalman);
+		}
+		reference_name = "kalman_smooth of steps 0 to i";
+	}
+
 	//printf("perftest count %d decimation %d rows %d\n",count,decimation,matrix_rows(t));
 
 	//struct timeval begin, end;
 	gettimeofday(&begin, 0);
 
 	kalman_t* kalman = kalman_create_options(options);
+	if (model) kalman_set_model(kalman,H,F,c,K,K_type,G,C,C_type);
+	if (!kalman_set_fixed_lag(kalman,lag)) printf("performance testing: lag %d rejected\n", lag);
 
 	j = 0;
 	n = matrix_cols(G);
 
-	for (i=0; i<count; i++) {
+	if (bulk) { // all the steps at once, without reading filtered estimates
+		size_t            m  = (size_t) count;
+		kalman_matrix_t** Hs = (kalman_matrix_t**) malloc(7 * m * sizeof(kalman_matrix_t*));
+		kalman_matrix_t** Fs = Hs +   m;
+		kalman_matrix_t** cs = Hs + 2*m;
+		kalman_matrix_t** Ks = Hs + 3*m;
+		kalman_matrix_t** Gs = Hs + 4*m;
+		kalman_matrix_t** os = Hs + 5*m;
+		kalman_matrix_t** Cs = Hs + 6*m;
+		for (i=0; i<count; i++) {
+			Hs[i] = H; Fs[i] = F; cs[i] = c; Ks[i] = K;
+			Gs[i] = G; os[i] = o; Cs[i] = C;
+		}
+		kalman_append_steps(kalman,count,n,Hs,Fs,cs,Ks,K_type,Gs,os,Cs,C_type);
+		free(Hs);
+	}
+
+	for (i=0; !bulk && i<count; i++) {
 		//printf("perftest iter %d (j=%d)\n",i,j);
 		//if (debug) printf("perftest iter %d (j=%d)\n",i,j);
-		kalman_evolve(kalman,n,H,F,c,K,K_type);
-		kalman_observe(kalman,G,o,C,C_type);
+		if (model) {
+			kalman_evolve_model(kalman);
+			kalman_observe_model(kalman,o);
+		} else {
+			kalman_evolve(kalman,n,H,F,c,K,K_type);
+			kalman_observe(kalman,G,o,C,C_type);
+		}
 		kalman_matrix_t* e = kalman_estimate(kalman,-1);
 		matrix_free(e);
 		//kalman_forget(kalman,-1);
+
+		if (j < lag_checks && i == lag_steps[j]) {
+			e = kalman_estimate(kalman,i - lag);
+			compare_estimate(e, lag_reference[j++]);
+			matrix_free(e);
+		}
 	}
 
 	gettimeofday(&end, 0);
@@ -253,9 +383,10 @@ double perftest_smooth(
 
 	// read the estimates, for a believable simulation
 
-	for (i=0; i<count; i++) {
+	for (i=kalman_earliest(kalman); i<count; i++) { // with a fixed lag, only the window is left
 		kalman_matrix_t* e = kalman_estimate(kalman,i);
 		// matrix_print(e, "%.4f");
+		if (accuracy) accumulate_estimate(e);
 		matrix_free(e);
 	}
 
@@ -271,6 +402,8 @@ double perftest_smooth(
 	microseconds = end.tv_usec - begin.tv_usec;
 	times[3]          = seconds + microseconds*1e-6;
 
+	for (j=0; j<lag_checks; j++) matrix_free(lag_reference[j]);
+
 	matrix_free(H);
 	matrix_free(F);
 	matrix_free(c);
@@ -282,81 +415,1438 @@ double perftest_smooth(
 	return times[3];
 }
 
-static int streq(char* constant, char* value) {
-  size_t l = strlen(constant);
-  if (strncmp(constant,value,l)==0 && strlen(value)==l) {
-    printf("streq %s == %s => %d\n",constant,value,1);
-    return 1;
-  }
-  printf("streq %s == %s => %d\n",constant,value,0);
-  return 0;
+/*
+ * The equations of steps first to first+length-1 of the trajectory of
+ * perftest_smooth, in one array; they borrow the matrices, so only the
+ * estimates need to be freed.
+ */
+static kalman_step_equations_t** trajectory_equations(
+		kalman_matrix_t* H, kalman_matrix_t* F, kalman_matrix_t* c, kalman_matrix_t* K, char K_type,
+		kalman_matrix_t* G,                     kalman_matrix_t* o, kalman_matrix_t* C, char C_type,
+		kalman_step_index_t first, kalman_step_index_t length) {
+	kalman_step_index_t i;
+	kalman_step_equations_t*  array     = (kalman_step_equations_t*)  calloc(length, sizeof(kalman_step_equations_t));
+	kalman_step_equations_t** equations = (kalman_step_equations_t**) malloc(length * sizeof(kalman_step_equations_t*));
+	for (i=0; i<length; i++) {
+		kalman_step_equations_t* e = equations[i] = array + i;
+		e->step      = first + i;
+		e->dimension = matrix_cols(G);
+		if (e->step > 0) { e->H = H; e->F = F; e->c = c; e->K = K; e->K_type = K_type; }
+		e->G = G; e->o = o; e->C = C; e->C_type = C_type;
+		e->covariance_wanted = 1;
+		e->borrowed  = 1;
+	}
+	return equations;
 }
 
-int main(int argc, char* argv[]) {
+static void trajectory_free(kalman_step_equations_t** equations, kalman_step_index_t length) {
+	kalman_step_index_t i;
+	for (i=0; i<length; i++) {
+		matrix_free(equations[i]->state);
+		matrix_free(equations[i]->covariance);
+	}
+	free(equations[0]);
+	free(equations);
+}
 
-  int n, k;
-  int nocov;
-  int nthreads, blocksize;
-  char *algorithm;
-  int present;
+/*
+ * The trajectory of perftest_smooth, smoothed by kalman_smooth_windowed
+ * (with the odd-even or the associative smoother). times[0] is the time to
+ * set up the equations, times[1] includes the smoothing, times[2] reading the
+ * estimates and times[3] releasing them. With accuracy=1, the estimates are
+ * compared with those of kalman_smooth on the same steps; the windows are
+ * not coupled, so the difference shows the error that the overlap leaves.
+ */
+double perftest_windowed(
+        kalman_options_t options,
+		kalman_matrix_t* H, kalman_matrix_t* F, kalman_matrix_t* c, kalman_matrix_t* K, char K_type,
+		kalman_matrix_t* G,                     kalman_matrix_t* o, kalman_matrix_t* C, char C_type,
+		int32_t count, int32_t window, int32_t overlap, int accuracy) {
 
-  parse_args(argc, argv);
-  present = get_int_param    ("n",         &n, 6);
-  present = get_int_param    ("k",         &k, 100000);
-  present = get_string_param ("algorithm", &algorithm, "ultimate");
-  present = get_int_param    ("nthreads",  &nthreads,  -1);
-  present = get_int_param    ("blocksize", &blocksize, -1);
-  present = get_boolean_param("nocov",     &nocov,      0);
-  check_unused_args();
+	struct timeval begin, end;
+	long seconds, microseconds;
+	int32_t i;
 
-  printf("performance n=%d k=%d nocov=%d algorithm=%s nthreads=%d blocksize=%d (-1 means do not set)\n",n,k,nocov,algorithm,nthreads,blocksize);
+	kalman_matrix_t** reference = NULL; // not timed
+	if (accuracy) {
+		reference = (kalman_matrix_t**) malloc(count * sizeof(kalman_matrix_t*));
+		kalman_t* kalman = kalman_create_options(options & ~KALMAN_NO_COVARIANCE);
+		for (i=0; i<count; i++) {
+			kalman_evolve(kalman,matrix_cols(G),H,F,c,K,K_type);
+			kalman_observe(kalman,G,o,C,C_type);
+		}
+		kalman_smooth(kalman);
+		for (i=0; i<count; i++) reference[i] = kalman_estimate(kalman,i);
+		kalman_free(kalman);
+		reference_name = "kalman_smooth";
+	}
 
-  kalman_options_t options = KALMAN_ALGORITHM_ULTIMATE;
-  if (streq("ultimate",    algorithm)) options  = KALMAN_ALGORITHM_ULTIMATE;
-  if (streq("conventional",algorithm)) options  = KALMAN_ALGORITHM_CONVENTIONAL;
-  if (streq("oddeven",     algorithm)) options  = KALMAN_ALGORITHM_ODDEVEN;
-  if (streq("associative", algorithm)) options  = KALMAN_ALGORITHM_ASSOCIATIVE;
-  if (nocov)                           options |= KALMAN_NO_COVARIANCE;
+	gettimeofday(&begin, 0);
 
-  if (nthreads != -1)  parallel_set_thread_limit(nthreads);
-  if (blocksize != -1) parallel_set_blocksize(blocksize);
+	kalman_step_equations_t** equations = trajectory_equations(H, F, c, K, K_type, G, o, C, C_type, 0, count);
 
-	printf("performance testing smoothing\n");
+	gettimeofday(&end, 0);
+	seconds      = end.tv_sec  - begin.tv_sec;
+	microseconds = end.tv_usec - begin.tv_usec;
+	times[0]     = seconds + microseconds*1e-6;
 
-	double t = 0.0;
+	int smoothed = kalman_smooth_windowed(options, equations, count, window, overlap);
+	if (!smoothed) printf("performance testing windowed: window %d and overlap %d rejected\n", window, overlap);
 
-	switch (n) {
-	case 6:
-		t = perftest_smooth(options,
-		                    matrix_create_identity(6,6), matrix_create_from_rowwise(F6, 6, 6), matrix_create_constant(6,1,0.0),      matrix_create_identity(6,6), 'W',
-			  	                                         matrix_create_from_rowwise(G6, 6, 6), matrix_create_from_rowwise(o6, 6, 1), matrix_create_identity(6,6), 'W',
-					        k);
-		break;
-	case 48:
-		t = perftest_smooth(options,
-		                    matrix_create_identity(48,48), matrix_create_from_rowwise(F48, 48, 48), matrix_create_constant(48,1,0.0),      matrix_create_identity(48,48), 'W',
-			  	                                           matrix_create_from_rowwise(G48, 48, 48), matrix_create_from_rowwise(o48, 48, 1), matrix_create_identity(48,48), 'W',
-					        k);
-		break;
-	default:
-		t = perftest_smooth(options,
-		                    matrix_create_identity(n,n), generateRandomOrthonormal(n, n), matrix_create_constant(n,1,0.0), matrix_create_identity(n,n), 'W',
-				                                         generateRandomOrthonormal(n, n), generateRandomOrthonormal(n, 1), matrix_create_identity(n,n), 'W',
-					        k);
-		break;
-		//printf("dimension must be 6 or 48, exiting\n");
-		//return 1;
+	gettimeofday(&end, 0);
+	seconds      = end.tv_sec  - begin.tv_sec;
+	microseconds = end.tv_usec - begin.tv_usec;
+	times[1]     = seconds + microseconds*1e-6;
+
+	for (i=0; smoothed && i<count; i++) {
+		kalman_matrix_t* e = matrix_create_copy(equations[i]->state);
+		if (accuracy) {
+			accumulate_estimate(e);
+			compare_estimate(e, reference[i]);
+		}
+		matrix_free(e);
 	}
-	
-	printf("performance testing took %.2e seconds\n",t);
-	printf("performance testing breakdown %.2e %.2e %.2e %.2e (filter, smooth, read estimates, free)\n",
-			times[0],
-			times[1]-times[0],
-			times[2]-times[1],
-			times[3]-times[2]);
 
-	printf("performance testing done\n");
-	return 0;
+	gettimeofday(&end, 0);
+	seconds      = end.tv_sec  - begin.tv_sec;
+	microseconds = end.tv_usec - begin.tv_usec;
+	times[2]     = seconds + microseconds*1e-6;
+
+	trajectory_free(equations, count);
+
+	gettimeofday(&end, 0);
+	seconds      = end.tv_sec  - begin.tv_sec;
+	microseconds = end.tv_usec - begin.tv_usec;
+	times[3]     = seconds + microseconds*1e-6;
+
+	for (i=0; accuracy && i<count; i++) matrix_free(reference[i]);
+	free(reference);
+
+	matrix_free(H);
+	matrix_free(F);
+	matrix_free(c);
+	matrix_free(K);
+	matrix_free(G);
+	matrix_free(o);
+	matrix_free(C);
+
+	return smoothed ? times[3] : -1.0;
+}
+
+/*
+ * The trajectory of perftest_smooth, written to a trajectory file (times[0]),
+ * mapped back and smoothed by kalman_smooth_windowed (times[1]); reading the
+ * estimates is times[2] and closing the file times[3]. With accuracy=1, the
+ * estimates are compared with those of the same smoother on the equations in
+ * memory, so any difference comes from the round trip through the file.
+ */
+double perftest_trajectory(
+        kalman_options_t options,
+		kalman_matrix_t* H, kalman_matrix_t* F, kalman_matrix_t* c, kalman_matrix_t* K, char K_type,
+		kalman_matrix_t* G,                     kalman_matrix_t* o, kalman_matrix_t* C, char C_type,
+		int32_t count, int32_t window, int32_t overlap, char* filename, int accuracy) {
+
+	struct timeval begin, end;
+	long seconds, microseconds;
+	int32_t i;
+	int failed = 0;
+
+	kalman_step_equations_t** equations = trajectory_equations(H, F, c, K, K_type, G, o, C, C_type, 0, count);
+
+	kalman_step_equations_t** reference = NULL; // not timed
+	if (accuracy) {
+		reference = trajectory_equations(H, F, c, K, K_type, G, o, C, C_type, 0, count);
+		kalman_smooth_windowed(options, reference, count, window, overlap);
+		reference_name = "the equations in memory";
+	}
+
+	gettimeofday(&begin, 0);
+
+	kalman_trajectory_writer_t* writer = kalman_trajectory_writer_create(filename, KALMAN_TRAJECTORY_EQUATIONS);
+	for (i=0; writer != NULL && i<count; i++) {
+		if (kalman_trajectory_write(writer, equations[i]) != 0) failed = 1;
+	}
+	if (writer == NULL || kalman_trajectory_writer_close(writer) != 0) failed = 1;
+	trajectory_free(equations, count);
+
+	gettimeofday(&end, 0);
+	seconds      = end.tv_sec  - begin.tv_sec;
+	microseconds = end.tv_usec - begin.tv_usec;
+	times[0]     = seconds + microseconds*1e-6;
+
+	kalman_trajectory_t* trajectory = failed ? NULL : kalman_trajectory_open(filename);
+	if (trajectory == NULL || trajectory->length != count) {
+		printf("performance testing trajectory: could not write and map %s\n", filename);
+		failed = 1;
+	} else if (!kalman_smooth_windowed(options, trajectory->equations, count, window, overlap)) {
+		printf("performance testing trajectory: window %d and overlap %d rejected\n", window, overlap);
+		failed = 1;
+	}
+
+	gettimeofday(&end, 0);
+	seconds      = end.tv_sec  - begin.tv_sec;
+	microseconds = end.tv_usec - begin.tv_usec;
+	times[1]     = seconds + microseconds*1e-6;
+
+	for (i=0; !failed && i<count; i++) {
+		kalman_matrix_t* e = matrix_create_copy(trajectory->equations[i]->state);
+		if (accuracy) {
+			accumulate_estimate(e);
+			compare_estimate(e, reference[i]->state);
+		}
+		matrix_free(e);
+	}
+
+	gettimeofday(&end, 0);
+	seconds      = end.tv_sec  - begin.tv_sec;
+	microseconds = end.tv_usec - begin.tv_usec;
+	times[2]     = seconds + microseconds*1e-6;
+
+	kalman_trajectory_close(trajectory);
+
+	gettimeofday(&end, 0);
+	seconds      = end.tv_sec  - begin.tv_sec;
+	microseconds = end.tv_usec - begin.tv_usec;
+	times[3]     = seconds + microseconds*1e-6;
+
+	if (accuracy) trajectory_free(reference, count);
+
+	matrix_free(H);
+	matrix_free(F);
+	matrix_free(c);
+	matrix_free(K);
+	matrix_free(G);
+	matrix_free(o);
+	matrix_free(C);
+
+	return failed ? -1.0 : times[3];
+}
+
+/*
+ * The steps of perftest_smooth, each followed by a speculative step with a
+ * different observation that is undone by restoring a checkpoint of the real
+ * one. times[0] is the time of the loop, times[1] of the smoothing, times[2]
+ * of reading the estimates and times[3] of freeing the filter. With
+ * accuracy=1, the filtered estimate after each restore is compared with an
+ * ultimate filter without speculation, and the checkpoint of the last step is
+ * restored after rolling back its observation (which must succeed) and after
+ * rolling back the step before it (which must fail).
+ */
+double perftest_checkpoint(
+        kalman_options_t options,
+		kalman_matrix_t* H, kalman_matrix_t* F, kalman_matrix_t* c, kalman_matrix_t* K, char K_type,
+		kalman_matrix_t* G,                     kalman_matrix_t* o, kalman_matrix_t* C, char C_type,
+		int32_t count, int accuracy) {
+
+	struct timeval begin, end;
+	long seconds, microseconds;
+	int32_t i, j;
+	int32_t n = matrix_cols(G);
+	int failed = 0;
+
+	kalman_matrix_t* speculative = matrix_create_copy(o);
+	for (j=0; j<matrix_rows(o); j++) matrix_set(speculative,j,0,matrix_get(o,j,0) + 1.0);
+
+	kalman_matrix_t** filtered = NULL; // the references, not timed
+	if (accuracy) {
+		filtered = (kalman_matrix_t**) malloc(count * sizeof(kalman_matrix_t*));
+		kalman_t* reference = kalman_create_options(KALMAN_ALGORITHM_ULTIMATE);
+		for (i=0; i<count; i++) {
+			kalman_evolve(reference,n,H,F,c,K,K_type);
+			kalman_observe(reference,G,o,C,C_type);
+			filtered[i] = kalman_estimate(reference,-1);
+		}
+		kalman_free(reference);
+		reference_name = "an ultimate filter";
+	}
+
+	gettimeofday(&begin, 0);
+
+	kalman_t* kalman = kalman_create_options(options);
+	kalman_checkpoint_t* cp = kalman_checkpoint_create(kalman);
+
+	for (i=0; !failed && i<count; i++) {
+		kalman_evolve(kalman,n,H,F,c,K,K_type);
+		kalman_observe(kalman,G,o,C,C_type);
+		if (!kalman_checkpoint(kalman,cp)) {
+			printf("performance testing checkpoint: algorithm does not support checkpoints\n");
+			failed = 1;
+			break;
+		}
+
+		kalman_evolve(kalman,n,H,F,c,K,K_type);
+		kalman_observe(kalman,G,speculative,C,C_type);
+		if (!kalman_restore(kalman,cp)) {
+			printf("performance testing checkpoint: could not restore step %d\n", i);
+			failed = 1;
+		}
+
+		if (accuracy) {
+			kalman_matrix_t* e = kalman_estimate(kalman,-1);
+			compare_estimate(e, filtered[i]);
+			matrix_free(e);
+		}
+	}
+
+	if (accuracy && !failed && count >= 2) { // not timed
+		kalman_rollback(kalman,count - 1);
+		if (!kalman_restore(kalman,cp)) {
+			printf("performance testing checkpoint: could not restore after rolling back the step itself\n");
+			failed = 1;
+		} else {
+			kalman_matrix_t* e = kalman_estimate(kalman,-1);
+			compare_estimate(e, filtered[count - 1]);
+			matrix_free(e);
+		}
+
+		kalman_rollback(kalman,count - 2);
+		if (kalman_restore(kalman,cp)) {
+			printf("performance testing checkpoint: restored after rolling back the step before it\n");
+			failed = 1;
+		}
+		kalman_observe(kalman,G,o,C,C_type); // the trajectory is complete again
+		if (kalman_restore(kalman,cp)) {
+			printf("performance testing checkpoint: restored after observing the step before it again\n");
+			failed = 1;
+		}
+		kalman_evolve(kalman,n,H,F,c,K,K_type);
+		kalman_observe(kalman,G,o,C,C_type);
+	}
+
+	gettimeofday(&end, 0);
+	seconds      = end.tv_sec  - begin.tv_sec;
+	microseconds = end.tv_usec - begin.tv_usec;
+	times[0]     = seconds + microseconds*1e-6;
+
+	kalman_smooth(kalman);
+
+	gettimeofday(&end, 0);
+	seconds      = end.tv_sec  - begin.tv_sec;
+	microseconds = end.tv_usec - begin.tv_usec;
+	times[1]     = seconds + microseconds*1e-6;
+
+	for (i=kalman_earliest(kalman); !failed && i<=kalman_latest(kalman); i++) {
+		kalman_matrix_t* e = kalman_estimate(kalman,i);
+		if (accuracy) accumulate_estimate(e);
+		matrix_free(e);
+	}
+
+	gettimeofday(&end, 0);
+	seconds      = end.tv_sec  - begin.tv_sec;
+	microseconds = end.tv_usec - begin.tv_usec;
+	times[2]     = seconds + microseconds*1e-6;
+
+	kalman_checkpoint_free(kalman,cp);
+	kalman_free(kalman);
+
+	gettimeofday(&end, 0);
+	seconds      = end.tv_sec  - begin.tv_sec;
+	microseconds = end.tv_usec - begin.tv_usec;
+	times[3]     = seconds + microseconds*1e-6;
+
+	for (i=0; accuracy && i<count; i++) matrix_free(filtered[i]);
+	free(filtered);
+
+	matrix_free(speculative);
+	matrix_free(H);
+	matrix_free(F);
+	matrix_free(c);
+	matrix_free(K);
+	matrix_free(G);
+	matrix_free(o);
+	matrix_free(C);
+
+	return failed ? -1.0 : times[3];
+}
+
+static double seconds_since(struct timeval* begin) {
+	struct timeval now;
+	gettimeofday(&now, 0);
+	return (now.tv_sec - begin->tv_sec) + (now.tv_usec - begin->tv_usec)*1e-6;
 }
 
-     
+/*
+ * The steps of perftest_smooth, but every segment steps the completed ones
+ * are handed off to kalman_smooth_async, so smoothing overlaps the filtering.
+ * times[0] is the time to feed all the steps, times[1] includes the wait for
+ * the last segment, times[2] reading the estimates from the segments, and
+ * times[3] freeing them. The latency of each step (evolve, observe, and the
+ * hand-off when there is one) is measured; with the smoothing in the
+ * background, the worst one should stay close to the mean.
+ *
+ * With accuracy=1, the estimates are compared with an ultimate filter on the
+ * same steps: the last step of every segment with its filtered estimate (a
+ * segment is smoothed as if it ended the trajectory), and the steps that
+ * were not handed off with its smoothed estimates.
+ */
+double perftest_async(
+        kalman_options_t options,
+		kalman_matrix_t* H, kalman_matrix_t* F, kalman_matrix_t* c, kalman_matrix_t* K, char K_type,
+		kalman_matrix_t* G,                     kalman_matrix_t* o, kalman_matrix_t* C, char C_type,
+		int32_t count, int32_t segment, int accuracy) {
+
+	struct timeval begin;
+	int32_t i, j, s;
+	int32_t n = matrix_cols(G);
+	int32_t number_of_segments = 0;
+	double  worst = 0.0;
+
+	kalman_segment_t** segments = (kalman_segment_t**) malloc((count / segment + 1) * sizeof(kalman_segment_t*));
+
+	kalman_matrix_t** filtered = NULL; // the references, not timed
+	kalman_matrix_t** smoothed = NULL;
+	if (accuracy) {
+		filtered = (kalman_matrix_t**) malloc(count * sizeof(kalman_matrix_t*));
+		smoothed = (kalman_matrix_t**) malloc(count * sizeof(kalman_matrix_t*));
+		kalman_t* reference = kalman_create_options(KALMAN_ALGORITHM_ULTIMATE);
+		for (i=0; i<count; i++) {
+			kalman_evolve(reference,n,H,F,c,K,K_type);
+			kalman_observe(reference,G,o,C,C_type);
+			filtered[i] = kalman_estimate(reference,-1);
+		}
+		kalman_smooth(reference);
+		for (i=0; i<count; i++) smoothed[i] = kalman_estimate(reference,i);
+		kalman_free(reference);
+		reference_name = "an ultimate filter";
+	}
+
+	gettimeofday(&begin, 0);
+
+	kalman_t* kalman = kalman_create_options(options);
+
+	for (i=0; i<count; i++) {
+		double start = seconds_since(&begin);
+		kalman_evolve(kalman,n,H,F,c,K,K_type);
+		kalman_observe(kalman,G,o,C,C_type);
+		if ((i+1) % segment == 0) {
+			kalman_segment_t* done = kalman_smooth_async(kalman,-1,NULL,NULL);
+			if (done != NULL) segments[ number_of_segments++ ] = done;
+		}
+		double latency = seconds_since(&begin) - start;
+		if (latency > worst) worst = latency;
+	}
+
+	times[0] = seconds_since(&begin);
+
+	kalman_smooth(kalman); // the steps that were not handed off
+	for (s=0; s<number_of_segments; s++) kalman_segment_wait(segments[s]);
+
+	times[1] = seconds_since(&begin);
+
+	for (s=0; s<number_of_segments; s++) {
+		for (j=0; j<segments[s]->length; j++) {
+			kalman_matrix_t* e = matrix_create_copy(segments[s]->equations[j]->state);
+			if (accuracy) accumulate_estimate(e);
+			if (accuracy && j == segments[s]->length - 1) compare_estimate(e, filtered[ segments[s]->first + j ]);
+			matrix_free(e);
+		}
+	}
+	for (i=kalman_earliest(kalman); i<count; i++) {
+		kalman_matrix_t* e = kalman_estimate(kalman,i);
+		if (accuracy) {
+			accumulate_estimate(e);
+			compare_estimate(e, smoothed[i]);
+		}
+		matrix_free(e);
+	}
+
+	times[2] = seconds_since(&begin);
+
+	for (s=0; s<number_of_segments; s++) kalman_segment_free(kalman,segments[s]);
+	kalman_free(kalman);
+	free(segments);
+
+	times[3] = seconds_since(&begin);
+
+	printf("performance testing async: %d segments, step latency mean %.2e worst %.2e seconds\n",
+	       number_of_segments, times[0]/count, worst);
+
+	for (i=0; accuracy && i<count; i++) {
+		matrix_free(filtered[i]);
+		matrix_free(smoothed[i]);
+	}
+	free(filtered);
+	free(smoothed);
+
+	matrix_free(H);
+	matrix_free(F);
+	matrix_free(c);
+	matrix_free(K);
+	matrix_free(G);
+	matrix_free(o);
+	matrix_free(C);
+
+	return times[3];
+}
+
+/*
+ * A 1-row stacked matrix, shared by all the filters in a batch.
+ */
+static kalman_matrix_t* stacked_shared(kalman_matrix_t* A) {
+	int32_t i,j;
+	int32_t rows = matrix_rows(A);
+	kalman_matrix_t* S = matrix_create(1, rows*matrix_cols(A));
+	for (j=0; j<matrix_cols(A); j++)
+		for (i=0; i<rows; i++)
+			matrix_set(S, 0, j*rows + i, matrix_get(A,i,j));
+	return S;
+}
+
+/*
+ * Checks a batch against independent ultimate filters, after the timing:
+ * filter f observes o plus 0.01*f in every element, so that every row of the
+ * stacked observations differs, and the batch's estimates are compared with
+ * those of the filters after every step. Each filter forgets all but its
+ * last step, so the check needs no more memory than the batch.
+ */
+static void check_batch(
+        int32_t batch_size,
+		kalman_matrix_t* sH, kalman_matrix_t* sF, kalman_matrix_t* sc, kalman_matrix_t* sK, char K_type,
+		kalman_matrix_t* sG,                                           kalman_matrix_t* sC, char C_type,
+		kalman_matrix_t* H, kalman_matrix_t* F, kalman_matrix_t* c, kalman_matrix_t* K,
+		kalman_matrix_t* G, kalman_matrix_t* o, kalman_matrix_t* C,
+		int32_t count) {
+	int32_t i,j,f;
+	int32_t n    = matrix_cols(G);
+	int32_t rows = matrix_rows(o);
+
+	kalman_matrix_t*  so        = matrix_create(batch_size, rows);
+	kalman_matrix_t** observed  = (kalman_matrix_t**) malloc(batch_size * sizeof(kalman_matrix_t*));
+	kalman_t**        filters   = (kalman_t**)        malloc(batch_size * sizeof(kalman_t*));
+	for (f=0; f<batch_size; f++) {
+		observed[f] = matrix_create(rows, 1);
+		for (j=0; j<rows; j++) {
+			matrix_set(observed[f], j, 0, matrix_get(o,j,0) + 0.01*f);
+			matrix_set(so,          f, j, matrix_get(o,j,0) + 0.01*f);
+		}
+		filters[f] = kalman_create_options(KALMAN_ALGORITHM_ULTIMATE);
+	}
+
+	kalman_batch_t*  batch = kalman_batch_create(batch_size, n);
+	kalman_matrix_t* row   = matrix_create(n, 1);
+	for (i=0; i<count; i++) {
+		kalman_batch_evolve(batch,sH,sF,sc,sK,K_type);
+		kalman_batch_observe(batch,sG,so,sC,C_type);
+		kalman_matrix_t* e = kalman_batch_estimate(batch);
+		for (f=0; f<batch_size; f++) {
+			kalman_evolve(filters[f],n,H,F,c,K,K_type);
+			kalman_observe(filters[f],G,observed[f],C,C_type);
+			kalman_matrix_t* reference = kalman_estimate(filters[f],-1);
+			for (j=0; j<n; j++) matrix_set(row, j, 0, matrix_get(e,f,j));
+			accumulate_estimate(row);
+			compare_estimate(row, reference);
+			matrix_free(reference);
+			kalman_forget(filters[f],-1);
+		}
+		matrix_free(e);
+	}
+	reference_name = "independent ultimate filters";
+
+	matrix_free(row);
+	kalman_batch_free(batch);
+	for (f=0; f<batch_size; f++) {
+		kalman_free(filters[f]);
+		matrix_free(observed[f]);
+	}
+	free(filters);
+	free(observed);
+	matrix_free(so);
+}
+
+/*
+ * Filters a batch of identical filters for count steps; the estimates are read
+ * after every step, as in perftest_smooth. With accuracy=1, check_batch then
+ * compares a batch of distinct filters with independent ones.
+ */
+double perftest_batch(
+        int32_t batch_size,
+		kalman_matrix_t* H, kalman_matrix_t* F, kalman_matrix_t* c, kalman_matrix_t* K, char K_type,
+		kalman_matrix_t* G,                     kalman_matrix_t* o, kalman_matrix_t* C, char C_type,
+		int32_t count, int accuracy) {
+
+	struct timeval begin, end;
+	long seconds, microseconds;
+
+	int32_t i;
+
+	kalman_matrix_t* sH = stacked_shared(H);
+	kalman_matrix_t* sF = stacked_shared(F);
+	kalman_matrix_t* sc = stacked_shared(c);
+	kalman_matrix_t* sK = stacked_shared(K);
+	kalman_matrix_t* sG = stacked_shared(G);
+	kalman_matrix_t* so = stacked_shared(o);
+	kalman_matrix_t* sC = stacked_shared(C);
+
+	gettimeofday(&begin, 0);
+
+	kalman_batch_t* batch = kalman_batch_create(batch_size, matrix_cols(G));
+
+	for (i=0; i<count; i++) {
+		kalman_batch_evolve(batch,sH,sF,sc,sK,K_type);
+		kalman_batch_observe(batch,sG,so,sC,C_type);
+		kalman_matrix_t* e = kalman_batch_estimate(batch);
+		matrix_free(e);
+	}
+
+	gettimeofday(&end, 0);
+	seconds      = end.tv_sec  - begin.tv_sec;
+	microseconds = end.tv_usec - begin.tv_usec;
+	times[0]     = seconds + microseconds*1e-6;
+
+	kalman_batch_free(batch);
+
+	gettimeofday(&end, 0);
+	seconds      = end.tv_sec  - begin.tv_sec;
+	microseconds = end.tv_usec - begin.tv_usec;
+	times[1] = times[2] = times[3] = seconds + microseconds*1e-6; // no smoothing or reading
+
+	printf("performance testing batch: %.2e seconds per filter step\n",times[0]/((double) count*batch_size));
+
+	if (accuracy) check_batch(batch_size, sH, sF, sc, sK, K_type, sG, sC, C_type, H, F, c, K, G, o, C, count);
+
+	matrix_free(sH); matrix_free(sF); matrix_free(sc); matrix_free(sK);
+	matrix_free(sG); matrix_free(so); matrix_free(sC);
+
+	matrix_free(H);
+	matrix_free(F);
+	matrix_free(c);
+	matrix_free(K);
+	matrix_free(G);
+	matrix_free(o);
+	matrix_free(C);
+
+	return times[3];
+}
+
+#ifdef BUILD_MPI
+/*
+ * The steps of perftest_smooth on a trajectory of count steps that is
+ * partitioned over the ranks of comm and smoothed by kalman_smooth_oddeven_mpi,
+ * without covariances. times[0] is the time to set up the equations of the
+ * rank's block, times[1] includes the smoothing and times[3] the release of the
+ * estimates; the times are those of the slowest rank. There is nothing to read,
+ * except with accuracy=1, when rank 0 gathers the states of all the blocks
+ * and compares them with those of kalman_smooth_oddeven on the whole
+ * trajectory, which rank 0 computes before the timing starts.
+ */
+double perftest_mpi(
+        kalman_options_t options,
+		kalman_matrix_t* H, kalman_matrix_t* F, kalman_matrix_t* c, kalman_matrix_t* K, char K_type,
+		kalman_matrix_t* G,                     kalman_matrix_t* o, kalman_matrix_t* C, char C_type,
+		int32_t count, MPI_Comm comm, int accuracy) {
+
+	kalman_step_index_t i, first, length;
+	int32_t j;
+	int rank, size, r;
+	MPI_Comm_rank(comm, &rank);
+	MPI_Comm_size(comm, &size);
+	int32_t n = matrix_cols(G);
+
+	kalman_step_equations_t** reference = NULL; // not timed, on rank 0
+	if (accuracy && rank == 0) {
+		reference = trajectory_equations(H, F, c, K, K_type, G, o, C, C_type, 0, count);
+		kalman_smooth_oddeven(options | KALMAN_NO_COVARIANCE, reference, count);
+		reference_name = "kalman_smooth_oddeven";
+	}
+
+	MPI_Barrier(comm);
+	double begin = MPI_Wtime();
+
+	kalman_oddeven_mpi_partition(count, comm, &first, &length);
+
+	kalman_step_equations_t** equations = trajectory_equations(H, F, c, K, K_type, G, o, C, C_type, first, length);
+
+	times[0] = MPI_Wtime() - begin;
+
+	kalman_smooth_oddeven_mpi(options, equations, length, comm);
+
+	MPI_Barrier(comm);
+	times[1] = MPI_Wtime() - begin;
+
+	if (accuracy) {
+		// rank 0 gathers the states of all the blocks, in order
+		int     packed = (int) (length * n);
+		double* buffer = (double*) malloc((packed > 0 ? packed : 1) * sizeof(double));
+		for (i=0; i<length; i++) {
+			for (j=0; j<n; j++) buffer[i*n + j] = (double) matrix_get(equations[i]->state,j,0);
+		}
+
+		int*    counts  = NULL;
+		int*    offsets = NULL;
+		double* states  = NULL;
+		if (rank == 0) {
+			counts  = (int*) malloc(size * sizeof(int));
+			offsets = (int*) malloc(size * sizeof(int));
+		}
+		MPI_Gather(&packed, 1, MPI_INT, counts, 1, MPI_INT, 0, comm);
+		if (rank == 0) {
+			int total = 0;
+			for (r=0; r<size; r++) {
+				offsets[r] = total;
+				total += counts[r];
+			}
+			assert(total == count * n);
+			states = (double*) malloc(total * sizeof(double));
+		}
+		MPI_Gatherv(buffer, packed, MPI_DOUBLE, states, counts, offsets, MPI_DOUBLE, 0, comm);
+		free(buffer);
+
+		if (rank == 0) {
+			kalman_matrix_t* e = matrix_create(n,1);
+			for (i=0; i<count; i++) {
+				for (j=0; j<n; j++) matrix_set(e,j,0,(matrix_element_t) states[i*n + j]);
+				accumulate_estimate(e);
+				compare_estimate(e, reference[i]->state);
+			}
+			matrix_free(e);
+			trajectory_free(reference, count);
+		}
+		free(states);
+		free(offsets);
+		free(counts);
+	}
+
+	MPI_Barrier(comm);
+	times[2] = MPI_Wtime() - begin;
+
+	trajectory_free(equations, length);
+
+	MPI_Barrier(comm);
+	times[3] = MPI_Wtime() - begin;
+
+	double slowest;
+	MPI_Allreduce(times, &slowest, 1, MPI_DOUBLE, MPI_MAX, comm);
+	times[0] = slowest;
+
+	matrix_free(H);
+	matrix_free(F);
+	matrix_free(c);
+	matrix_free(K);
+	matrix_free(G);
+	matrix_free(o);
+	matrix_free(C);
+
+	return times[3];
+}
+#endif
+
+/*
+ * With MPI, only rank 0 of MPI_COMM_WORLD reports.
+ */
+static int reporting_rank() {
+#ifdef BUILD_MPI
+	int rank;
+	MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+	return rank == 0;
+#else
+	return 1;
+#endif
+}
+
+static int finish(int status) {
+#ifdef BUILD_MPI
+	MPI_Finalize();
+#endif
+	return status;
+}
+
+static int streq(char* constant, char* value) {
+  size_t l = strlen(constant);
+  if (strncmp(constant,value,l)==0 && strlen(value)==l) {
+    printf("streq %s == %s => %d\n",constant,value,1);
+    return 1;
+  }
+  printf("streq %s == %s => %d\n",constant,value,0);
+  return 0;
+}
+
+static kalman_options_t algorithm_options(char* algorithm) {
+  kalman_options_t options = KALMAN_ALGORITHM_ULTIMATE;
+  if (streq("ultimate",    algorithm)) options  = KALMAN_ALGORITHM_ULTIMATE;
+  if (streq("conventional",algorithm)) options  = KALMAN_ALGORITHM_CONVENTIONAL;
+  if (streq("oddeven",     algorithm)) options  = KALMAN_ALGORITHM_ODDEVEN;
+  if (streq("associative", algorithm)) options  = KALMAN_ALGORITHM_ASSOCIATIVE;
+  if (streq("oddeven-mpi", algorithm)) options  = KALMAN_ALGORITHM_ODDEVEN;
+  if (streq("associative-gpu", algorithm)) options = KALMAN_ALGORITHM_ASSOCIATIVE | KALMAN_GPU;
+  return options;
+}
+
+static void create_problem(int n, kalman_matrix_t** H, kalman_matrix_t** F, kalman_matrix_t** c, kalman_matrix_t** K,
+                                  kalman_matrix_t** G, kalman_matrix_t** o, kalman_matrix_t** C) {
+	srand(1); // the same random problem in every trial
+
+	switch (n) {
+	case 6:
+		*H = matrix_create_identity(6,6); *F = matrix_create_from_rowwise(F6, 6, 6); *c = matrix_create_constant(6,1,0.0);      *K = matrix_create_identity(6,6);
+		                                  *G = matrix_create_from_rowwise(G6, 6, 6); *o = matrix_create_from_rowwise(o6, 6, 1); *C = matrix_create_identity(6,6);
+		break;
+	case 48:
+		*H = matrix_create_identity(48,48); *F = matrix_create_from_rowwise(F48, 48, 48); *c = matrix_create_constant(48,1,0.0);      *K = matrix_create_identity(48,48);
+		                                    *G = matrix_create_from_rowwise(G48, 48, 48); *o = matrix_create_from_rowwise(o48, 48, 1); *C = matrix_create_identity(48,48);
+		break;
+	default:
+		*H = matrix_create_identity(n,n); *F = generateRandomOrthonormal(n, n); *c = matrix_create_constant(n,1,0.0); *K = matrix_create_identity(n,n);
+		                                  *G = generateRandomOrthonormal(n, n); *o = generateRandomOrthonormal(n, 1); *C = matrix_create_identity(n,n);
+		break;
+		//printf("dimension must be 6 or 48, exiting\n");
+		//return 1;
+	}
+}
+
+/******************************************************************************/
+/* BENCHMARKS                                                                 */
+/******************************************************************************/
+
+/*
+ * With format=csv or format=json, the program runs a benchmark instead of a
+ * single test. The parameters n, k, algorithm, nocov, nthreads and blocksize
+ * take comma-separated lists (e.g., n=6,48 nthreads=1,2,4), and every
+ * combination runs warmup times unmeasured and then trials times. Each
+ * combination produces one record, written to output (a file name, or - for
+ * standard output, in which case the progress messages of the test and of
+ * the library go to standard error, so that the output holds the records
+ * alone):
+ *
+ *   - the median and the 10th and 90th percentiles of the total time
+ *   - the median time of each phase: filter, smooth, read and free, and the
+ *     phases that the parallel smoothers report (see kalman_set_phase_callback)
+ *   - the strong-scaling efficiency T(k,p0)*p0/(T(k,p)*p) and the weak-scaling
+ *     efficiency T(k0,p0)/T(k,p) with k0/p0 = k/p, where p0 is the smallest
+ *     number of threads in the records with the same n, algorithm, nocov
+ *     and blocksize.
+ *
+ * An efficiency is missing if the sweep has no matching reference record.
+ *
+ * Each record also gives the peak resident memory of its trials, that memory
+ * per step, and the memory per step between the record and the one with the
+ * next smaller k and otherwise the same parameters, which leaves out the
+ * memory that does not depend on k. The peak of a process only grows, so
+ * every record runs in a child process of its own; in builds without fork
+ * (Windows and BUILD_MPI) the memory is missing. Memory is linear in k when
+ * the memory per step between consecutive values of k is about the same,
+ * which is checked and reported on standard error for every sweep of k; a
+ * failed check fails the run. Runs of
+ * a billion steps need the 64-bit index types (build.sh) and shared inputs,
+ * e.g., algorithm=oddeven n=6 k=1000000,10000000,100000000,1000000000
+ * bulk=1 borrow=1 nocov=1 warmup=0 trials=1.
+ *
+ * With algorithm=oddeven-mpi (in performance_mpi, built with BUILD_MPI and
+ * run under mpirun), the list ranks gives the numbers of MPI processes to use
+ * (-1 means all of them), the threads of a record are those of all its ranks,
+ * and the efficiencies therefore give the strong and weak scaling across
+ * nodes. Rank 0 writes the records.
+ */
+
+#define BENCHMARK_LIST_MAX   16
+#define BENCHMARK_PHASES_MAX 64
+#define BENCHMARK_FIXED      4   // filter, smooth, read and free
+
+typedef struct benchmark_record_st {
+	int    n, k, nocov, nthreads, blocksize;
+	char*  algorithm;
+	int    ranks;                   // MPI processes, 1 except for oddeven-mpi
+	int    threads;                 // in use in all the ranks, for the scaling efficiencies
+	double median, p10, p90;
+	double phases[BENCHMARK_PHASES_MAX]; // medians, NAN if not reported
+	double strong, weak;            // NAN if there is no reference
+	double memory;                  // peak resident bytes of the record's trials, NAN if unknown
+	double memory_slope;            // bytes per step from the record with the next smaller k, NAN if none
+} benchmark_record_t;
+
+#if !defined(_WIN32) && !defined(BUILD_MPI)
+#define BENCHMARK_FORK // every record runs in a child process
+#endif
+
+/*
+ * The memory per step between consecutive values of k may vary by this
+ * factor in a sweep whose memory is linear in k.
+ */
+#define BENCHMARK_LINEAR_SLACK 1.5
+
+static const char* phase_names [BENCHMARK_PHASES_MAX] = { "filter", "smooth", "read", "free" };
+static int32_t     phase_levels[BENCHMARK_PHASES_MAX] = { -1, -1, -1, -1 };
+static int         phase_count = BENCHMARK_FIXED;
+static double      phase_seconds[BENCHMARK_PHASES_MAX]; // of the current trial
+
+static void phase_callback(const char* phase, int32_t level, double seconds) {
+	int p;
+	for (p=BENCHMARK_FIXED; p<phase_count; p++) {
+		if (phase_levels[p] == level && strcmp(phase_names[p],phase) == 0) break;
+	}
+	if (p == phase_count) {
+		if (phase_count == BENCHMARK_PHASES_MAX) return;
+		phase_names [p] = phase; // the smoothers pass string literals
+		phase_levels[p] = level;
+		phase_seconds[p] = 0.0;
+		phase_count++;
+	}
+	phase_seconds[p] += seconds;
+}
+
+static int compare_doubles(const void* a, const void* b) {
+	double x = *((const double*) a);
+	double y = *((const double*) b);
+	return (x > y) - (x < y);
+}
+
+// of sorted values, NAN values last
+static double percentile(double* sorted, int count, double q) {
+	while (count > 0 && isnan(sorted[count-1])) count--;
+	if (count == 0) return NAN;
+	return sorted[ (int) floor(q*(count-1) + 0.5) ];
+}
+
+static int parse_list(const char* key, const char* list, int* values) {
+	int count = 0;
+	const char* p = list;
+	while (*p != 0) {
+		if (count == BENCHMARK_LIST_MAX) {
+			fprintf(stderr,"too many values for %s (at most %d)\n",key,BENCHMARK_LIST_MAX);
+			exit(1);
+		}
+		char* end;
+		values[count++] = (int) strtol(p, &end, 10);
+		if (end == p || (*end != ',' && *end != 0)) {
+			fprintf(stderr,"invalid list for %s: %s\n",key,list);
+			exit(1);
+		}
+		p = (*end == ',') ? end + 1 : end;
+	}
+	return count;
+}
+
+static int parse_string_list(char* list, char** values) {
+	int count = 0;
+	char* token = strtok(list, ",");
+	while (token != NULL && count < BENCHMARK_LIST_MAX) {
+		values[count++] = token;
+		token = strtok(NULL, ",");
+	}
+	return count;
+}
+
+static int same_series(benchmark_record_t* x, benchmark_record_t* y) {
+	return y->n == x->n && y->nocov == x->nocov && y->blocksize == x->blocksize && strcmp(y->algorithm,x->algorithm) == 0;
+}
+
+static int same_configuration(benchmark_record_t* x, benchmark_record_t* y) {
+	return same_series(x, y) && y->nthreads == x->nthreads && y->ranks == x->ranks;
+}
+
+static void benchmark_memory_slopes(benchmark_record_t* records, int count) {
+	for (int r=0; r<count; r++) {
+		benchmark_record_t* x = records + r;
+		benchmark_record_t* previous = NULL; // the next smaller k
+		for (int b=0; b<count; b++) {
+			benchmark_record_t* y = records + b;
+			if (!same_configuration(x, y) || y->k >= x->k) continue;
+			if (previous == NULL || y->k > previous->k) previous = y;
+		}
+		x->memory_slope = NAN;
+		if (previous != NULL) x->memory_slope = (x->memory - previous->memory) / ((double) x->k - (double) previous->k);
+	}
+}
+
+/*
+ * Reports, for every configuration with at least two memory slopes, whether
+ * its memory is linear in k; returns 0 if one is not.
+ */
+static int benchmark_linearity(benchmark_record_t* records, int count) {
+	int linear = 1;
+	for (int r=0; r<count; r++) {
+		benchmark_record_t* x = records + r;
+		if (isnan(x->memory_slope)) continue;
+
+		int    first  = 1; // the first record of its configuration with a slope
+		int    slopes = 0;
+		double low    = INFINITY;
+		double high   = -INFINITY;
+		for (int b=0; b<count; b++) {
+			benchmark_record_t* y = records + b;
+			if (!same_configuration(x, y) || isnan(y->memory_slope)) continue;
+			if (b < r) first = 0;
+			slopes++;
+			if (y->memory_slope < low ) low  = y->memory_slope;
+			if (y->memory_slope > high) high = y->memory_slope;
+		}
+		if (!first || slopes < 2) continue;
+
+		int passed = (low > 0.0 && high <= BENCHMARK_LINEAR_SLACK * low);
+		fprintf(stderr,"benchmark memory n=%d algorithm=%s nocov=%d nthreads=%d blocksize=%d ranks=%d: %.1f to %.1f bytes per step, linear in k: %s\n",
+		        x->n, x->algorithm, x->nocov, x->nthreads, x->blocksize, x->ranks, low, high, passed ? "passed" : "FAILED");
+		if (!passed) linear = 0;
+	}
+	return linear;
+}
+
+static void benchmark_efficiencies(benchmark_record_t* records, int count) {
+	for (int r=0; r<count; r++) {
+		benchmark_record_t* x = records + r;
+		int p0 = x->threads;
+		for (int b=0; b<count; b++) {
+			if (same_series(x, records + b) && records[b].threads < p0) p0 = records[b].threads;
+		}
+		x->strong = NAN;
+		x->weak   = NAN;
+		for (int b=0; b<count; b++) {
+			benchmark_record_t* y = records + b;
+			if (!same_series(x, y) || y->threads != p0) continue;
+			if (y->k == x->k)                                           x->strong = (y->median * p0) / (x->median * x->threads);
+			if ((int64_t) y->k * x->threads == (int64_t) x->k * p0)     x->weak   =  y->median / x->median;
+		}
+	}
+}
+
+static void print_number(FILE* f, double x, const char* missing) {
+	if (isnan(x)) fprintf(f,"%s",missing);
+	else          fprintf(f,"%.6e",x);
+}
+
+static void benchmark_write(FILE* f, int json, benchmark_record_t* records, int count) {
+	int r,p;
+	if (!json) {
+		fprintf(f,"n,k,algorithm,nocov,nthreads,blocksize,ranks,threads,median,p10,p90");
+		for (p=0; p<phase_count; p++) {
+			if (phase_levels[p] < 0) fprintf(f,",%s",phase_names[p]);
+			else                     fprintf(f,",%s/%d",phase_names[p],phase_levels[p]);
+		}
+		fprintf(f,",strong_efficiency,weak_efficiency,memory,memory_per_step,memory_slope\n");
+	} else {
+		fprintf(f,"[\n");
+	}
+
+	for (r=0; r<count; r++) {
+		benchmark_record_t* x = records + r;
+		const char* missing = json ? "null" : "";
+		if (json) {
+			fprintf(f,"  {\"n\": %d, \"k\": %d, \"algorithm\": \"%s\", \"nocov\": %d, \"nthreads\": %d, \"blocksize\": %d, \"ranks\": %d, \"threads\": %d,\n",
+			        x->n, x->k, x->algorithm, x->nocov, x->nthreads, x->blocksize, x->ranks, x->threads);
+			fprintf(f,"   \"median\": "); print_number(f,x->median,missing);
+			fprintf(f,", \"p10\": ");      print_number(f,x->p10,missing);
+			fprintf(f,", \"p90\": ");      print_number(f,x->p90,missing);
+			fprintf(f,",\n   \"phases\": {");
+			int first = 1;
+			for (p=0; p<phase_count; p++) {
+				if (isnan(x->phases[p])) continue;
+				if (phase_levels[p] < 0) fprintf(f,"%s\"%s\": ",   first ? "" : ", ",phase_names[p]);
+				else                     fprintf(f,"%s\"%s/%d\": ",first ? "" : ", ",phase_names[p],phase_levels[p]);
+				print_number(f,x->phases[p],missing);
+				first = 0;
+			}
+			fprintf(f,"},\n   \"strong_efficiency\": "); print_number(f,x->strong,missing);
+			fprintf(f,", \"weak_efficiency\": ");        print_number(f,x->weak,missing);
+			fprintf(f,",\n   \"memory\": ");             print_number(f,x->memory,missing);
+			fprintf(f,", \"memory_per_step\": ");        print_number(f,x->memory/x->k,missing);
+			fprintf(f,", \"memory_slope\": ");           print_number(f,x->memory_slope,missing);
+			fprintf(f,"}%s\n", r+1 < count ? "," : "");
+		} else {
+			fprintf(f,"%d,%d,%s,%d,%d,%d,%d,%d,",x->n,x->k,x->algorithm,x->nocov,x->nthreads,x->blocksize,x->ranks,x->threads);
+			print_number(f,x->median,missing); fprintf(f,",");
+			print_number(f,x->p10,   missing); fprintf(f,",");
+			print_number(f,x->p90,   missing);
+			for (p=0; p<phase_count; p++) { fprintf(f,","); print_number(f,x->phases[p],missing); }
+			fprintf(f,","); print_number(f,x->strong,missing);
+			fprintf(f,","); print_number(f,x->weak,  missing);
+			fprintf(f,","); print_number(f,x->memory,missing);
+			fprintf(f,","); print_number(f,x->memory/x->k,missing);
+			fprintf(f,","); print_number(f,x->memory_slope,missing);
+			fprintf(f,"\n");
+		}
+	}
+
+	if (json) fprintf(f,"]\n");
+}
+
+#ifdef BENCHMARK_FORK
+static int write_all(int fd, const void* buffer, size_t size) {
+	const char* p = (const char*) buffer;
+	while (size > 0) {
+		ssize_t written = write(fd, p, size);
+		if (written <= 0) return 0;
+		p += written; size -= (size_t) written;
+	}
+	return 1;
+}
+
+static int read_all(int fd, void* buffer, size_t size) {
+	char* p = (char*) buffer;
+	while (size > 0) {
+		ssize_t got = read(fd, p, size);
+		if (got <= 0) return 0;
+		p += got; size -= (size_t) got;
+	}
+	return 1;
+}
+
+/*
+ * The child that runs a record sends it back, with the phase table, which
+ * the record's phases may have extended. The table holds the string literals
+ * that the smoothers pass, whose addresses are the same in the parent, a
+ * fork of the same program.
+ */
+static void benchmark_send(int fd, benchmark_record_t* x) {
+	if (write_all(fd, x,             sizeof(*x))
+	 && write_all(fd, &phase_count,  sizeof(phase_count))
+	 && write_all(fd, phase_names,   sizeof(phase_names))
+	 && write_all(fd, phase_levels,  sizeof(phase_levels))) return;
+	fprintf(stderr,"benchmark could not send a record\n");
+}
+
+static int benchmark_receive(int fd, benchmark_record_t* x) {
+	benchmark_record_t received;
+	int                count;
+	const char*        names [BENCHMARK_PHASES_MAX];
+	int32_t            levels[BENCHMARK_PHASES_MAX];
+	if (!read_all(fd, &received, sizeof(received))
+	 || !read_all(fd, &count,    sizeof(count))
+	 || !read_all(fd, names,     sizeof(names))
+	 || !read_all(fd, levels,    sizeof(levels))) return 0;
+	*x = received;
+	phase_count = count; // the child's table extends ours
+	memcpy(phase_names,  names,  sizeof(names));
+	memcpy(phase_levels, levels, sizeof(levels));
+	return 1;
+}
+#endif
+
+static int benchmark(char* n_list, char* k_list, char* algorithm_list, char* nocov_list, char* nthreads_list, char* blocksize_list,
+                     char* ranks_list, kalman_options_t flags, int model, int lag, int bulk, int warmup, int trials, int json, char* output) {
+	int  ns[BENCHMARK_LIST_MAX], ks[BENCHMARK_LIST_MAX], nocovs[BENCHMARK_LIST_MAX], nthreadss[BENCHMARK_LIST_MAX], blocksizes[BENCHMARK_LIST_MAX];
+	int  rankss[BENCHMARK_LIST_MAX];
+	char* algorithms[BENCHMARK_LIST_MAX];
+
+	int n_count         = parse_list("n",         n_list,         ns);
+	int k_count         = parse_list("k",         k_list,         ks);
+	int nocov_count     = parse_list("nocov",     nocov_list,     nocovs);
+	int nthreads_count  = parse_list("nthreads",  nthreads_list,  nthreadss);
+	int blocksize_count = parse_list("blocksize", blocksize_list, blocksizes);
+	int ranks_count     = parse_list("ranks",     ranks_list,     rankss);
+	int algorithm_count = parse_string_list(algorithm_list, algorithms);
+
+	for (int ia=0; lag >= 0 && ia<algorithm_count; ia++) {
+		if (!(algorithm_options(algorithms[ia]) & KALMAN_ALGORITHM_ULTIMATE)) {
+			printf("lag requires algorithm ultimate\n");
+			return 1;
+		}
+	}
+
+	int capacity = n_count * k_count * algorithm_count * nocov_count * nthreads_count * blocksize_count * ranks_count;
+	benchmark_record_t* records = (benchmark_record_t*) malloc(capacity * sizeof(benchmark_record_t));
+	double* totals = (double*) calloc(trials, sizeof(double));
+	double* phases = (double*) calloc(((size_t) trials) * BENCHMARK_PHASES_MAX, sizeof(double)); // [phase][trial]
+	int count = 0;
+
+	FILE* records_output = NULL; // the original standard output
+	if (strcmp(output,"-") == 0) {
+		fflush(stdout);
+		int records_fd = dup(fileno(stdout));
+		if (records_fd < 0 || dup2(fileno(stderr), fileno(stdout)) < 0
+		    || (records_output = fdopen(records_fd, "w")) == NULL) {
+			fprintf(stderr,"cannot separate the records from the messages on standard output\n");
+			return 1;
+		}
+	}
+
+	kalman_set_phase_callback(phase_callback);
+
+	for (int in=0; in<n_count; in++)
+	for (int ik=0; ik<k_count; ik++)
+	for (int ia=0; ia<algorithm_count; ia++)
+	for (int ic=0; ic<nocov_count; ic++)
+	for (int it=0; it<nthreads_count; it++)
+	for (int ib=0; ib<blocksize_count; ib++)
+	for (int ir=0; ir<ranks_count; ir++) {
+		int mpi = strcmp(algorithms[ia],"oddeven-mpi") == 0;
+		if (!mpi && ir > 0) continue; // the ranks list only applies to oddeven-mpi
+
+		benchmark_record_t* x = records + (count++);
+		x->n = ns[in]; x->k = ks[ik]; x->algorithm = algorithms[ia]; x->nocov = nocovs[ic];
+		x->nthreads = nthreadss[it]; x->blocksize = blocksizes[ib];
+
+		kalman_options_t options = algorithm_options(x->algorithm) | flags;
+		if (x->nocov) options |= KALMAN_NO_COVARIANCE;
+		if (x->nthreads  != -1) parallel_set_thread_limit(x->nthreads);
+		if (x->blocksize != -1) parallel_set_blocksize(x->blocksize);
+		x->ranks   = 1;
+		x->threads = parallel_max_threads();
+
+#ifdef BUILD_MPI
+		// the first ranks of MPI_COMM_WORLD run the smoother, the other ones wait
+		MPI_Comm comm = MPI_COMM_NULL;
+		if (mpi) {
+			int rank, size;
+			MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+			MPI_Comm_size(MPI_COMM_WORLD, &size);
+			x->ranks = (rankss[ir] < 1 || rankss[ir] > size) ? size : rankss[ir];
+			MPI_Comm_split(MPI_COMM_WORLD, rank < x->ranks ? 0 : MPI_UNDEFINED, rank, &comm);
+			x->threads *= x->ranks;
+		}
+#endif
+
+#ifdef BENCHMARK_FORK
+		int channel[2];
+		fflush(NULL); // or the child would write the buffered output again
+		if (pipe(channel) != 0) { perror("benchmark pipe"); exit(1); }
+		pid_t child = fork();
+		if (child < 0) { perror("benchmark fork"); exit(1); }
+		if (child > 0) {
+			close(channel[1]);
+			int received = benchmark_receive(channel[0], x);
+			close(channel[0]);
+			int status;
+			waitpid(child, &status, 0);
+			if (!received || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+				fprintf(stderr,"benchmark record n=%d k=%d algorithm=%s failed\n",x->n,x->k,x->algorithm);
+				x->median = x->p10 = x->p90 = x->memory = NAN;
+				for (int p=0; p<BENCHMARK_PHASES_MAX; p++) x->phases[p] = NAN;
+			}
+			continue;
+		}
+		close(channel[0]);
+#endif
+
+		for (int t=0; t<warmup+trials; t++) {
+			kalman_matrix_t *H, *F, *c, *K, *G, *o, *C;
+#ifdef BUILD_MPI
+			if (mpi ? comm == MPI_COMM_NULL : !reporting_rank()) break; // the other algorithms run on rank 0
+#endif
+			create_problem(x->n, &H, &F, &c, &K, &G, &o, &C);
+
+			for (int p=0; p<BENCHMARK_PHASES_MAX; p++) phase_seconds[p] = 0.0;
+			double total;
+#ifdef BUILD_MPI
+			if (mpi) total = perftest_mpi(options, H, F, c, K, 'W', G, o, C, 'W', x->k, comm, 0);
+			else
+#endif
+			total = perftest_smooth(options, H, F, c, K, 'W', G, o, C, 'W', x->k, model, lag, bulk, 0);
+			if (t < warmup) continue;
+
+			int j = t - warmup;
+			phase_seconds[0] = times[0];
+			phase_seconds[1] = times[1]-times[0];
+			phase_seconds[2] = times[2]-times[1];
+			phase_seconds[3] = times[3]-times[2];
+			totals[j] = total;
+			for (int p=0; p<BENCHMARK_PHASES_MAX; p++) {
+				phases[p*trials + j] = (p < phase_count && (p < BENCHMARK_FIXED || phase_seconds[p] > 0.0)) ? phase_seconds[p] : NAN;
+				phase_seconds[p] = 0.0;
+			}
+		}
+
+		qsort(totals, trials, sizeof(double), compare_doubles);
+		x->median = percentile(totals, trials, 0.5);
+		x->p10    = percentile(totals, trials, 0.1);
+		x->p90    = percentile(totals, trials, 0.9);
+		for (int p=0; p<BENCHMARK_PHASES_MAX; p++) {
+			qsort(phases + p*trials, trials, sizeof(double), compare_doubles);
+			x->phases[p] = percentile(phases + p*trials, trials, 0.5);
+		}
+#ifdef BENCHMARK_FORK
+		x->memory = peak_memory();
+		benchmark_send(channel[1], x);
+		fflush(NULL);
+		_exit(0);
+#else
+		x->memory = NAN; // the peak of the process would include the earlier records
+#endif
+
+#ifdef BUILD_MPI
+		if (comm != MPI_COMM_NULL) MPI_Comm_free(&comm);
+		MPI_Barrier(MPI_COMM_WORLD);
+#endif
+	}
+
+	kalman_set_phase_callback(NULL);
+
+	benchmark_efficiencies(records, count);
+	benchmark_memory_slopes(records, count);
+	int linear = reporting_rank() ? benchmark_linearity(records, count) : 1;
+
+	if (reporting_rank()) {
+		FILE* f = (records_output != NULL) ? records_output : fopen(output,"w");
+		if (f == NULL) {
+			fprintf(stderr,"cannot open %s\n",output);
+			return 1;
+		}
+		benchmark_write(f, json, records, count);
+		if (f != records_output) fclose(f);
+	}
+	if (records_output != NULL) fclose(records_output);
+
+	free(phases);
+	free(totals);
+	free(records);
+	return linear ? 0 : 1;
+}
+
+/******************************************************************************/
+/* MAIN                                                                       */
+/******************************************************************************/
+
+int main(int argc, char* argv[]) {
+
+  int n, k;
+  int nocov;
+  int pool;
+  int small;
+  int borrow;
+  int model;
+  int lag;
+  int batch;
+  int bulk;
+  int segment;
+  int window, overlap;
+  int lazy;
+  int checkpoint;
+  int accuracy;
+  int instrument;
+  int nthreads, blocksize, budget;
+  int affinity;
+  int warmup, trials;
+  char *algorithm;
+  char *n_list, *k_list, *nocov_list, *nthreads_list, *blocksize_list, *ranks_list;
+  char *format, *output;
+  char *trace;
+  char *trajectory;
+  int present;
+
+#ifdef BUILD_MPI
+  MPI_Init(&argc, &argv);
+#endif
+
+  parse_args(argc, argv);
+  present = get_string_param ("n",         &n_list,        "6");
+  present = get_string_param ("k",         &k_list,        "100000");
+  present = get_string_param ("algorithm", &algorithm,     "ultimate");
+  present = get_string_param ("nthreads",  &nthreads_list, "-1");
+  present = get_string_param ("blocksize", &blocksize_list,"-1");
+  present = get_string_param ("ranks",     &ranks_list,    "-1");
+  present = get_int_param    ("budget",    &budget,    -1);
+  present = get_boolean_param("affinity",  &affinity,   0);
+  present = get_string_param ("nocov",     &nocov_list,    "0");
+  present = get_boolean_param("pool",      &pool,       0);
+  present = get_boolean_param("small",     &small,      0);
+  present = get_boolean_param("borrow",    &borrow,     0);
+  present = get_boolean_param("model",     &model,      0);
+  present = get_int_param    ("lag",       &lag,       -1);
+  present = get_int_param    ("batch",     &batch,      0);
+  present = get_boolean_param("bulk",      &bulk,       0);
+  present = get_int_param    ("segment",   &segment,    0);
+  present = get_int_param    ("window",    &window,     0);
+  present = get_int_param    ("overlap",   &overlap,    KALMAN_WINDOWED_MIN_OVERLAP);
+  present = get_boolean_param("lazy",      &lazy,       0);
+  present = get_boolean_param("checkpoint",&checkpoint, 0);
+  present = get_boolean_param("accuracy",  &accuracy,   0);
+  present = get_boolean_param("instrument",&instrument, 0);
+  present = get_string_param ("trace",     &trace,      "");
+  present = get_string_param ("trajectory",&trajectory, "");
+  present = get_string_param ("format",    &format,     "text");
+  present = get_string_param ("output",    &output,     "-");
+  present = get_int_param    ("warmup",    &warmup,     1);
+  present = get_int_param    ("trials",    &trials,     5);
+  check_unused_args();
+
+  kalman_options_t flags = 0;
+  if (pool)                            flags |= KALMAN_MATRIX_POOL;
+  if (small)                           flags |= KALMAN_SMALL_KERNELS;
+  if (borrow)                          flags |= KALMAN_BORROW_MATRICES;
+  if (lazy)                            flags |= KALMAN_LAZY_COVARIANCE;
+
+  if (budget != -1)    parallel_set_thread_budget(budget);
+  if (affinity)        parallel_set_affinity(1);
+
+#ifndef BUILD_MPI
+  if (strstr(algorithm,"oddeven-mpi") != NULL) {
+    printf("algorithm oddeven-mpi requires performance_mpi (BUILD_MPI)\n");
+    return 1;
+  }
+#endif
+
+  if (strcmp(format,"text") != 0) {
+    if ((strcmp(format,"csv") != 0 && strcmp(format,"json") != 0) || trials < 1 || warmup < 0) {
+      printf("format must be text, csv or json, trials at least 1\n");
+      return finish(1);
+    }
+    return finish(benchmark(n_list, k_list, algorithm, nocov_list, nthreads_list, blocksize_list, ranks_list,
+                            flags, model, lag, bulk, warmup, trials, strcmp(format,"json") == 0, output));
+  }
+
+  n         = atoi(n_list);
+  k         = atoi(k_list);
+  nocov     = atoi(nocov_list);
+  nthreads  = atoi(nthreads_list);
+  blocksize = atoi(blocksize_list);
+
+  if (reporting_rank()) printf("performance n=%d k=%d nocov=%d pool=%d small=%d borrow=%d model=%d lag=%d batch=%d bulk=%d segment=%d window=%d overlap=%d trajectory=%s lazy=%d checkpoint=%d accuracy=%d algorithm=%s nthreads=%d blocksize=%d budget=%d affinity=%d (-1 means do not set)\n",n,k,nocov,pool,small,borrow,model,lag,batch,bulk,segment,window,overlap,trajectory,lazy,checkpoint,accuracy,algorithm,nthreads,blocksize,budget,affinity);
+
+  kalman_options_t options = algorithm_options(algorithm) | flags;
+  if (nocov)                           options |= KALMAN_NO_COVARIANCE;
+
+  if (lag >= 0 && !(options & KALMAN_ALGORITHM_ULTIMATE)) {
+    printf("lag requires algorithm ultimate\n");
+    return finish(1);
+  }
+
+  if (nthreads != -1)  parallel_set_thread_limit(nthreads);
+  if (blocksize != -1) parallel_set_blocksize(blocksize);
+
+	if (reporting_rank()) printf("performance testing smoothing\n");
+
+	double t = 0.0;
+
+	kalman_matrix_t *H, *F, *c, *K, *G, *o, *C;
+
+	create_problem(n, &H, &F, &c, &K, &G, &o, &C);
+
+	instrument_reset();
+
+	if (batch > 0) {
+		t = perftest_batch(batch, H, F, c, K, 'W', G, o, C, 'W', k, accuracy);
+#ifdef BUILD_MPI
+	} else if (strcmp(algorithm,"oddeven-mpi") == 0) {
+		t = perftest_mpi(options, H, F, c, K, 'W', G, o, C, 'W', k, MPI_COMM_WORLD, accuracy);
+#endif
+	} else if (segment > 0) {
+		t = perftest_async(options, H, F, c, K, 'W', G, o, C, 'W', k, segment, accuracy);
+	} else if (checkpoint) {
+		t = perftest_checkpoint(options, H, F, c, K, 'W', G, o, C, 'W', k, accuracy);
+		if (t < 0.0) return finish(1);
+	} else if (strlen(trajectory) > 0) {
+		t = perftest_trajectory(options, H, F, c, K, 'W', G, o, C, 'W', k, window, overlap, trajectory, accuracy);
+		if (t < 0.0) return finish(1);
+	} else if (window > 0) {
+		t = perftest_windowed(options, H, F, c, K, 'W', G, o, C, 'W', k, window, overlap, accuracy);
+		if (t < 0.0) return finish(1);
+	} else {
+		t = perftest_smooth(options, H, F, c, K, 'W', G, o, C, 'W', k, model, lag, bulk, accuracy);
+	}
+
+	if (!reporting_rank()) return finish(0);
+
+	printf("performance testing took %.2e seconds\n",t);
+	printf("performance testing breakdown %.2e %.2e %.2e %.2e (filter, smooth, read estimates, free)\n",
+			times[0],
+			times[1]-times[0],
+			times[2]-times[1],
+			times[3]-times[2]);
+	printf("performance testing peak memory %.3e bytes (%.1f per step)\n",peak_memory(),peak_memory()/k);
+
+	if (accuracy) {
+		printf("performance accuracy %s elements (epsilon %.1e): sum of estimates %.17e largest %.17e\n",
+				sizeof(matrix_element_t) == sizeof(float) ? "single" : "double",
+				sizeof(matrix_element_t) == sizeof(float) ? (double) FLT_EPSILON : DBL_EPSILON,
+				estimates_sum, estimates_max);
+	}
+	if (accuracy && reference_name != NULL) {
+		printf("performance accuracy largest difference from %s %.3e (largest element %.3e): %s\n",
+				reference_name, reference_difference, reference_max, reference_passed() ? "passed" : "FAILED");
+	}
+
+	if (instrument) instrument_report(stdout);
+	if (strlen(trace) > 0 && instrument_write_trace(trace) != 0) {
+		printf("performance could not write the trace to %s\n", trace);
+	}
+
+	printf("performance testing done\n");
+	return finish(reference_name != NULL && !reference_passed() ? 1 : 0);
+}
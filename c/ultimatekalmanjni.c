@@ -0,0 +1,347 @@
+/*
+ * ultimatekalmanjni.c
+ *
+ * A JNI interface to the C implementation of the UltimateKalman collection
+ * of Kalman filters and smoothers, for the Java class
+ * sivantoledo.kalman.UltimateKalmanNative.
+ *
+ * Matrices arrive in direct buffers (java.nio.DoubleBuffer) in column-major
+ * order and are wrapped in matrix views, so no element is copied on the way
+ * in; the filter copies what it keeps, as it does for any caller, so
+ * filters created with KALMAN_BORROW_MATRICES are rejected. A filter
+ * handle is the kalman_t pointer.
+ *
+ * Copyright (C) Sivan Toledo 2022-2025.
+ */
+#include <jni.h>
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#include "kalman.h"
+
+#ifdef BUILD_SINGLE_PRECISION
+#error "The JNI interface reads Java doubles in place and requires double-precision matrix elements"
+#endif
+
+/*******************************************************************/
+/* HELPER FUNCTIONS                                                */
+/*******************************************************************/
+
+static void throwIllegalArgument(JNIEnv* env, const char* msg) {
+	jclass exception = (*env)->FindClass(env, "java/lang/IllegalArgumentException");
+	if (exception != NULL) (*env)->ThrowNew(env, exception, msg);
+}
+
+/*
+ * The elements of a direct buffer with at least length elements, or NULL
+ * (with a pending exception if the buffer is not direct or too short).
+ */
+static double* bufferElements(JNIEnv* env, jobject buffer, int64_t length) {
+	if (buffer == NULL) return NULL;
+	double* elements = (double*) (*env)->GetDirectBufferAddress(env, buffer);
+	if (elements == NULL) {
+		throwIllegalArgument(env, "UltimateKalmanNative: buffers must be direct");
+		return NULL;
+	}
+	if ((int64_t) (*env)->GetDirectBufferCapacity(env, buffer) < length) {
+		throwIllegalArgument(env, "UltimateKalmanNative: buffer too short");
+		return NULL;
+	}
+	return elements;
+}
+
+static kalman_matrix_t* bufferView(JNIEnv* env, jobject buffer, int32_t rows, int32_t cols, kalman_matrix_t* header) {
+	if (buffer == NULL || rows == 0 || cols == 0) return NULL;
+	double* elements = bufferElements(env, buffer, (int64_t) rows * cols);
+	if (elements == NULL) return NULL;
+	return matrix_view(header, elements, rows, cols);
+}
+
+static void copyToBuffer(kalman_matrix_t* A, double* out, int32_t length) {
+	int32_t rows = matrix_rows(A);
+	int32_t cols = matrix_cols(A);
+	for (int32_t j=0; j<cols; j++)
+		for (int32_t i=0; i<rows; i++)
+			out[i + j*length] = matrix_get(A,i,j);
+}
+
+/*
+ * A buffer holding one rows-by-cols matrix, shared by all the steps, or
+ * count of them, one per step.
+ */
+typedef struct stacked_st {
+	kalman_matrix_t** matrices; // one per step, NULL if the buffer is NULL
+	kalman_matrix_t*  headers;  // one per page
+} stacked_t;
+
+static int stackedCreate(JNIEnv* env, jobject buffer, int32_t rows, int32_t cols, kalman_step_index_t count, stacked_t* s) {
+	s->matrices = NULL;
+	s->headers  = NULL;
+
+	if (buffer == NULL || rows == 0 || cols == 0) return 1;
+
+	double* elements = bufferElements(env, buffer, (int64_t) rows * cols);
+	if (elements == NULL) return 0;
+
+	int64_t size  = (int64_t) rows * cols;
+	int64_t pages = ((int64_t) (*env)->GetDirectBufferCapacity(env, buffer) >= size * count) ? count : 1;
+
+	s->matrices = (kalman_matrix_t**) malloc(count * sizeof(kalman_matrix_t*));
+	s->headers  = (kalman_matrix_t*)  malloc(pages * sizeof(kalman_matrix_t));
+	if (s->matrices == NULL || s->headers == NULL) {
+		free(s->matrices);
+		free(s->headers);
+		s->matrices = NULL;
+		s->headers  = NULL;
+		throwIllegalArgument(env, "UltimateKalmanNative: out of memory");
+		return 0;
+	}
+
+	for (int64_t p=0; p<pages; p++) matrix_view(s->headers + p, elements + p*size, rows, cols);
+	for (kalman_step_index_t j=0; j<count; j++) (s->matrices)[j] = s->headers + (pages == 1 ? 0 : j);
+
+	return 1;
+}
+
+static void stackedFree(stacked_t* s) {
+	free(s->matrices);
+	free(s->headers);
+}
+
+#define KALMAN(handle) ((kalman_t*) (intptr_t) (handle))
+
+/*
+ * The views of the buffers are only valid during the call, so a filter that
+ * keeps the caller's matrices cannot use them. Returns 1 (with a pending
+ * exception) if the filter borrows matrices.
+ */
+static int borrowsMatrices(JNIEnv* env, kalman_t* kalman) {
+	if (!(kalman->options & KALMAN_BORROW_MATRICES)) return 0;
+	throwIllegalArgument(env, "UltimateKalmanNative: filters that borrow matrices cannot use views of buffers");
+	return 1;
+}
+
+/*
+ * Resolves -1 to the latest step; returns 0 if there is no such step.
+ */
+static int stepIndex(kalman_t* kalman, jlong si, kalman_step_index_t* index) {
+	if (kalman_latest(kalman) < 0) return 0;
+	if (si < 0) si = kalman_latest(kalman);
+	if (si < kalman_earliest(kalman) || si > kalman_latest(kalman)) return 0;
+	*index = (kalman_step_index_t) si;
+	return 1;
+}
+
+/*******************************************************************/
+/* NATIVE METHODS                                                  */
+/*******************************************************************/
+
+JNIEXPORT jlong JNICALL Java_sivantoledo_kalman_UltimateKalmanNative_create(JNIEnv* env, jclass cls, jint options) {
+	return (jlong) (intptr_t) kalman_create_options((kalman_options_t) options);
+}
+
+JNIEXPORT void JNICALL Java_sivantoledo_kalman_UltimateKalmanNative_free(JNIEnv* env, jclass cls, jlong handle) {
+	kalman_free(KALMAN(handle));
+}
+
+JNIEXPORT jlong JNICALL Java_sivantoledo_kalman_UltimateKalmanNative_earliest(JNIEnv* env, jclass cls, jlong handle) {
+	return (jlong) kalman_earliest(KALMAN(handle));
+}
+
+JNIEXPORT jlong JNICALL Java_sivantoledo_kalman_UltimateKalmanNative_latest(JNIEnv* env, jclass cls, jlong handle) {
+	return (jlong) kalman_latest(KALMAN(handle));
+}
+
+/*
+ * K is l-by-l, or l-by-1 if its type is 'w' or 'I'.
+ */
+JNIEXPORT void JNICALL Java_sivantoledo_kalman_UltimateKalmanNative_evolve(JNIEnv* env, jclass cls, jlong handle,
+		jint n, jint l, jint n_previous, jobject H, jobject F, jobject c, jobject K, jchar K_type) {
+	kalman_matrix_t headers[4];
+
+	if (borrowsMatrices(env, KALMAN(handle))) return;
+
+	kalman_matrix_t* H_i = bufferView(env, H, l, n,                       headers + 0);
+	kalman_matrix_t* F_i = bufferView(env, F, l, n_previous,              headers + 1);
+	kalman_matrix_t* c_i = bufferView(env, c, l, 1,                       headers + 2);
+	kalman_matrix_t* K_i = bufferView(env, K, l, (K_type == 'w' || K_type == 'I') ? 1 : l,   headers + 3);
+	if ((*env)->ExceptionCheck(env)) return;
+
+	kalman_evolve(KALMAN(handle), n, H_i, F_i, c_i, K_i, (char) K_type);
+}
+
+JNIEXPORT void JNICALL Java_sivantoledo_kalman_UltimateKalmanNative_observe(JNIEnv* env, jclass cls, jlong handle,
+		jint m, jint n, jobject G, jobject o, jobject C, jchar C_type) {
+	kalman_matrix_t headers[3];
+
+	if (borrowsMatrices(env, KALMAN(handle))) return;
+
+	kalman_matrix_t* G_i = bufferView(env, G, m, n,                       headers + 0);
+	kalman_matrix_t* o_i = bufferView(env, o, m, 1,                       headers + 1);
+	kalman_matrix_t* C_i = bufferView(env, C, m, (C_type == 'w' || C_type == 'I') ? 1 : m,   headers + 2);
+	if ((*env)->ExceptionCheck(env)) return;
+
+	kalman_observe(KALMAN(handle), G_i, o_i, C_i, (char) C_type);
+}
+
+JNIEXPORT void JNICALL Java_sivantoledo_kalman_UltimateKalmanNative_smooth(JNIEnv* env, jclass cls, jlong handle) {
+	kalman_smooth(KALMAN(handle));
+}
+
+/*
+ * Returns the dimension of the step (-1 if there is no such step), and
+ * stores the estimate in e if e is large enough.
+ */
+JNIEXPORT jint JNICALL Java_sivantoledo_kalman_UltimateKalmanNative_estimate(JNIEnv* env, jclass cls, jlong handle,
+		jlong si, jobject e) {
+	kalman_t* kalman = KALMAN(handle);
+	kalman_step_index_t index;
+	if (!stepIndex(kalman, si, &index)) return -1;
+
+	kalman_matrix_t* estimate = kalman_estimate(kalman, index);
+	if (estimate == NULL) return -1;
+
+	int32_t n = matrix_rows(estimate);
+	if (e != NULL && (int64_t) (*env)->GetDirectBufferCapacity(env, e) >= n) {
+		double* out = bufferElements(env, e, n);
+		if (out != NULL) copyToBuffer(estimate, out, n);
+	}
+	matrix_free(estimate);
+	return n;
+}
+
+/*
+ * Stores the covariance in the form that kalman_covariance returns (n-by-n
+ * or n-by-1) in W, and returns its type.
+ */
+JNIEXPORT jchar JNICALL Java_sivantoledo_kalman_UltimateKalmanNative_covariance(JNIEnv* env, jclass cls, jlong handle,
+		jlong si, jobject W) {
+	kalman_t* kalman = KALMAN(handle);
+	kalman_step_index_t index;
+	if (!stepIndex(kalman, si, &index)) return (jchar) 0;
+
+	kalman_matrix_t* cov = kalman_covariance(kalman, index);
+	if (cov == NULL) return (jchar) 0;
+
+	double* out = bufferElements(env, W, (int64_t) matrix_rows(cov) * matrix_cols(cov));
+	if (out != NULL) copyToBuffer(cov, out, matrix_rows(cov));
+	matrix_free(cov);
+
+	return (jchar) kalman_covariance_type(kalman, index);
+}
+
+JNIEXPORT void JNICALL Java_sivantoledo_kalman_UltimateKalmanNative_forget(JNIEnv* env, jclass cls, jlong handle, jlong si) {
+	kalman_forget(KALMAN(handle), (kalman_step_index_t) si);
+}
+
+JNIEXPORT void JNICALL Java_sivantoledo_kalman_UltimateKalmanNative_rollback(JNIEnv* env, jclass cls, jlong handle, jlong si) {
+	kalman_rollback(KALMAN(handle), (kalman_step_index_t) si);
+}
+
+/*******************************************************************/
+/* BULK METHODS                                                    */
+/*******************************************************************/
+
+/*
+ * Appends count steps with kalman_append_steps. Steps whose observation
+ * vector starts with a NaN, or all the steps if o is NULL, are not observed.
+ */
+JNIEXPORT void JNICALL Java_sivantoledo_kalman_UltimateKalmanNative_append(JNIEnv* env, jclass cls, jlong handle,
+		jlong count_j, jint n,
+		jint l, jobject H, jobject F, jobject c, jobject K, jchar K_type,
+		jint m, jobject G, jobject o, jobject C, jchar C_type) {
+	kalman_t* kalman = KALMAN(handle);
+	kalman_step_index_t count = (kalman_step_index_t) count_j;
+
+	if (borrowsMatrices(env, kalman)) return;
+	if (count <= 0) return;
+
+	stacked_t s[7] = { { NULL, NULL } };
+	int ok = stackedCreate(env, H, l, n,                     count, s + 0)
+	      && stackedCreate(env, F, l, n,                     count, s + 1)
+	      && stackedCreate(env, c, l, 1,                     count, s + 2)
+	      && stackedCreate(env, K, l, (K_type == 'w' || K_type == 'I') ? 1 : l, count, s + 3)
+	      && stackedCreate(env, G, m, n,                     count, s + 4)
+	      && stackedCreate(env, o, m, 1,                     count, s + 5)
+	      && stackedCreate(env, C, m, (C_type == 'w' || C_type == 'I') ? 1 : m, count, s + 6);
+
+	if (ok) {
+		if (s[5].matrices != NULL) {
+			for (kalman_step_index_t j=0; j<count; j++) {
+				if (isnan(matrix_get((s[5].matrices)[j],0,0))) (s[5].matrices)[j] = NULL;
+			}
+		}
+
+		kalman_append_steps(kalman, count, n,
+		                    s[0].matrices, s[1].matrices, s[2].matrices, s[3].matrices, (char) K_type,
+		                    s[4].matrices, s[5].matrices, s[6].matrices, (char) C_type);
+	}
+
+	for (int i=0; i<7; i++) stackedFree(s + i);
+}
+
+/*
+ * Stores the estimates of steps first to last (the earliest and latest if
+ * negative) in E, n elements per step padded with NaNs, and if W is not
+ * NULL, their covariances in the form that kalman_covariance returns,
+ * n-by-n per step, with their types in types (if not NULL). Returns the
+ * number of steps; steps outside the earliest to latest range throw.
+ */
+JNIEXPORT jlong JNICALL Java_sivantoledo_kalman_UltimateKalmanNative_estimates(JNIEnv* env, jclass cls, jlong handle,
+		jlong first, jlong last, jint n, jobject E, jobject W, jobject types) {
+	kalman_t* kalman = KALMAN(handle);
+	if (kalman_latest(kalman) < 0 && first < 0 && last < 0) return 0;
+
+	if (first < 0) first = kalman_earliest(kalman);
+	if (last  < 0) last  = kalman_latest(kalman);
+	if (kalman_latest(kalman) < 0 || first < kalman_earliest(kalman) || last > kalman_latest(kalman)) {
+		throwIllegalArgument(env, "UltimateKalmanNative: steps out of range");
+		return 0;
+	}
+	if (last < first) return 0;
+	int64_t count = last - first + 1;
+
+	double* e = bufferElements(env, E, n * count);
+	if (e == NULL) return 0;
+	double* w = NULL;
+	if (W != NULL && (w = bufferElements(env, W, (int64_t) n * n * count)) == NULL) return 0;
+	char* t = NULL;
+	if (types != NULL) {
+		t = (char*) (*env)->GetDirectBufferAddress(env, types);
+		if (t == NULL || (*env)->GetDirectBufferCapacity(env, types) < count) {
+			throwIllegalArgument(env, "UltimateKalmanNative: types must be a direct buffer of one byte per step");
+			return 0;
+		}
+	}
+
+	for (int64_t i=0; i<n*count; i++) e[i] = kalman_nan;
+	for (int64_t i=0; w != NULL && i<(int64_t) n*n*count; i++) w[i] = kalman_nan;
+
+	for (int64_t j=0; j<count; j++) {
+		kalman_step_index_t si = (kalman_step_index_t) (first + j);
+
+		kalman_matrix_t* estimate = kalman_estimate(kalman, si);
+		if (estimate != NULL) {
+			if (matrix_rows(estimate) <= n) copyToBuffer(estimate, e + j*n, n);
+			matrix_free(estimate);
+		}
+
+		if (w == NULL) continue;
+
+		kalman_matrix_t* cov = kalman_covariance(kalman, si);
+		if (t != NULL) t[j] = kalman_covariance_type(kalman, si);
+		if (cov != NULL) {
+			if (matrix_rows(cov) <= n) copyToBuffer(cov, w + j*n*n, n);
+			matrix_free(cov);
+		}
+	}
+
+	return (jlong) count;
+}
+
+/******************************************************************************/
+/* END OF FILE                                                                */
+/******************************************************************************/
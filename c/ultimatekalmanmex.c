@@ -376,6 +376,191 @@ static void mexPerfTest(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs
 	//printf("free all\n");
 }
 
+/*******************************************************************/
+/* BULK INTERFACES                                                 */
+/*******************************************************************/
+
+/*
+ * These commands move an entire trajectory across the mex boundary in one
+ * call. The inputs are stacked: page j of a rows-by-cols-by-count array is
+ * the matrix of step j, and a 2-D array is shared by all the steps. The
+ * matrices are views of the mxArray data (in double-precision builds), so
+ * the only copy is the one that the filter or smoother keeps.
+ */
+typedef struct stacked_st {
+	kalman_matrix_t** matrices; // one per step, NULL if the argument is empty
+	kalman_matrix_t*  headers;  // one per page
+	matrix_element_t* elements; // converted copy in single-precision builds, NULL otherwise
+} stacked_t;
+
+static stacked_t stackedCreate(char* name, const mxArray* mx, kalman_step_index_t count) {
+	stacked_t s = { NULL, NULL, NULL };
+	char msg[81];
+
+	if (mxIsEmpty(mx)) return s;
+
+	const mwSize* dims  = mxGetDimensions(mx);
+	int32_t       rows  = (int32_t) dims[0];
+	int32_t       cols  = (int32_t) dims[1];
+	int64_t       pages = (mxGetNumberOfDimensions(mx) > 2) ? (int64_t) (mxGetNumberOfElements(mx) / ((size_t) rows * cols)) : 1;
+
+	if (pages != 1 && pages != count) {
+		sprintf(msg,"append: %s must have 1 or %lld pages.",name,(long long) count);
+		mexErrMsgIdAndTxt("sivantoledo:UltimateKalman:append",msg);
+	}
+
+	s.matrices = (kalman_matrix_t**) mxMalloc(count * sizeof(kalman_matrix_t*));
+	s.headers  = (kalman_matrix_t*)  mxMalloc(pages * sizeof(kalman_matrix_t));
+
+	double* data = mxGetPr(mx);
+#ifdef BUILD_SINGLE_PRECISION
+	size_t elements = mxGetNumberOfElements(mx);
+	s.elements = (matrix_element_t*) mxMalloc(elements * sizeof(matrix_element_t));
+	for (size_t i=0; i<elements; i++) (s.elements)[i] = (matrix_element_t) data[i];
+	matrix_element_t* base = s.elements;
+#else
+	matrix_element_t* base = data;
+#endif
+
+	for (int64_t p=0; p<pages; p++) matrix_view(s.headers + p, base + p*rows*cols, rows, cols);
+	for (kalman_step_index_t j=0; j<count; j++) (s.matrices)[j] = s.headers + (pages == 1 ? 0 : j);
+
+	return s;
+}
+
+static void stackedFree(stacked_t s) {
+	if (s.matrices != NULL) mxFree(s.matrices);
+	if (s.headers  != NULL) mxFree(s.headers);
+	if (s.elements != NULL) mxFree(s.elements);
+}
+
+/*
+ * append(handle, count, n, H, F, c, K, K_type, G, o, C, C_type) appends count
+ * steps of dimension n with kalman_append_steps. Steps whose observation
+ * vector starts with a NaN, or all the steps if o is empty, are not observed.
+ */
+static void mexAppend(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
+	argCheck("append",12,12,0,0,nlhs,plhs,nrhs,prhs);
+
+	int handle = (int) floor(mxGetScalar(prhs[1]));
+	kalman_t* kalman = (kalman_t*) handleGet(kalman_handles,handle);
+	if (kalman==NULL) mexErrMsgIdAndTxt("sivantoledo:UltimateKalman:append","append: invalid handle.");
+
+	// the views are only valid during this call
+	if (kalman->options & KALMAN_BORROW_MATRICES)
+		mexErrMsgIdAndTxt("sivantoledo:UltimateKalman:append","append: filters that borrow matrices cannot use views of mxArrays.");
+
+	kalman_step_index_t count = (kalman_step_index_t) mxGetScalar(prhs[2]);
+	int32_t             n_i   = (int32_t) mxGetScalar(prhs[3]);
+	if (count <= 0) return;
+
+	stacked_t H = stackedCreate("H", prhs[4],  count);
+	stacked_t F = stackedCreate("F", prhs[5],  count);
+	stacked_t c = stackedCreate("c", prhs[6],  count);
+	stacked_t K = stackedCreate("K", prhs[7],  count);
+	char K_type = (char) round(mxGetScalar(prhs[8]));
+
+	stacked_t G = stackedCreate("G", prhs[9],  count);
+	stacked_t o = stackedCreate("o", prhs[10], count);
+	stacked_t C = stackedCreate("C", prhs[11], count);
+	char C_type = (char) round(mxGetScalar(prhs[12]));
+
+	if (o.matrices != NULL) {
+		for (kalman_step_index_t j=0; j<count; j++) {
+			kalman_matrix_t* o_j = (o.matrices)[j];
+			if (isnan(matrix_get(o_j,0,0))) (o.matrices)[j] = NULL;
+		}
+	}
+
+	kalman_append_steps(kalman, count, n_i,
+	                    H.matrices, F.matrices, c.matrices, K.matrices, K_type,
+	                    G.matrices, o.matrices, C.matrices, C_type);
+
+	stackedFree(C);
+	stackedFree(o);
+	stackedFree(G);
+	stackedFree(K);
+	stackedFree(c);
+	stackedFree(F);
+	stackedFree(H);
+}
+
+static void copyToColumn(kalman_matrix_t* A, double* out, int32_t length) {
+	int32_t rows = matrix_rows(A);
+	int32_t cols = matrix_cols(A);
+	for (int32_t j=0; j<cols; j++)
+		for (int32_t i=0; i<rows; i++)
+			out[i + j*length] = (double) matrix_get(A,i,j);
+}
+
+/*
+ * [E, W, types] = estimates(handle, first, last) returns the estimates of
+ * steps first to last (the earliest and latest steps if negative) as the
+ * columns of E, and their covariances as the pages of W, in the form that
+ * covariance returns, with the type of each in types. Steps of a smaller
+ * dimension than the largest are padded with NaNs. Steps outside the
+ * earliest to latest range are an error.
+ */
+static void mexEstimates(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
+	argCheck("estimates",3,3,1,3,nlhs,plhs,nrhs,prhs);
+
+	int handle = (int) floor(mxGetScalar(prhs[1]));
+	kalman_t* kalman = (kalman_t*) handleGet(kalman_handles,handle);
+	if (kalman==NULL) mexErrMsgIdAndTxt("sivantoledo:UltimateKalman:estimates","estimates: invalid handle.");
+
+	kalman_step_index_t first = (kalman_step_index_t) mxGetScalar(prhs[2]);
+	kalman_step_index_t last  = (kalman_step_index_t) mxGetScalar(prhs[3]);
+	kalman_step_index_t count = 0;
+
+	if (kalman_latest(kalman) >= 0) {
+		if (first < 0) first = kalman_earliest(kalman);
+		if (last  < 0) last  = kalman_latest(kalman);
+		if (first < kalman_earliest(kalman) || last > kalman_latest(kalman))
+			mexErrMsgIdAndTxt("sivantoledo:UltimateKalman:estimates","estimates: steps out of range.");
+		count = (last >= first) ? last - first + 1 : 0;
+	} else if (first >= 0 || last >= 0) {
+		mexErrMsgIdAndTxt("sivantoledo:UltimateKalman:estimates","estimates: steps out of range.");
+	}
+
+	kalman_matrix_t** e = (kalman_matrix_t**) mxMalloc((count > 0 ? count : 1) * sizeof(kalman_matrix_t*));
+	int32_t n = 0;
+	for (kalman_step_index_t j=0; j<count; j++) {
+		e[j] = kalman_estimate(kalman, first + j);
+		if (e[j] != NULL && matrix_rows(e[j]) > n) n = matrix_rows(e[j]);
+	}
+
+	plhs[0] = mxCreateDoubleMatrix(n,(mwSize) count,mxREAL);
+	double* E = mxGetPr(plhs[0]);
+	for (int64_t i=0; i<(int64_t) n*count; i++) E[i] = kalman_nan;
+	for (kalman_step_index_t j=0; j<count; j++) {
+		if (e[j] == NULL) continue;
+		copyToColumn(e[j], E + j*n, n);
+		matrix_free(e[j]);
+	}
+	mxFree(e);
+
+	if (nlhs < 2) return;
+
+	mwSize dims[3] = { (mwSize) n, (mwSize) n, (mwSize) count };
+	plhs[1] = mxCreateNumericArray(3,dims,mxDOUBLE_CLASS,mxREAL);
+	double* W = mxGetPr(plhs[1]);
+	for (int64_t i=0; i<(int64_t) n*n*count; i++) W[i] = kalman_nan;
+
+	double* types = NULL;
+	if (nlhs == 3) {
+		plhs[2] = mxCreateDoubleMatrix(1,(mwSize) count,mxREAL);
+		types = mxGetPr(plhs[2]);
+	}
+
+	for (kalman_step_index_t j=0; j<count; j++) {
+		kalman_matrix_t* W_j = kalman_covariance(kalman, first + j);
+		if (types != NULL) types[j] = (double) kalman_covariance_type(kalman, first + j);
+		if (W_j == NULL) continue;
+		copyToColumn(W_j, W + j*n*n, n);
+		matrix_free(W_j);
+	}
+}
+
 /*******************************************************************/
 /* MEX FUNCTION                                                    */
 /*******************************************************************/
@@ -401,11 +586,13 @@ void mexFunction( int nlhs, mxArray *plhs[],
     else if (selector("evolve"     ,nrhs,prhs)) { mexEvolve    (nlhs,plhs,nrhs,prhs); return; }
     else if (selector("observe"    ,nrhs,prhs)) { mexObserve   (nlhs,plhs,nrhs,prhs); return; }
     else if (selector("smooth"     ,nrhs,prhs)) { mexSmooth    (nlhs,plhs,nrhs,prhs); return; }
+    else if (selector("estimates"  ,nrhs,prhs)) { mexEstimates (nlhs,plhs,nrhs,prhs); return; } // before estimate, a prefix
     else if (selector("estimate"   ,nrhs,prhs)) { mexEstimate  (nlhs,plhs,nrhs,prhs); return; }
     else if (selector("covariance" ,nrhs,prhs)) { mexCovariance(nlhs,plhs,nrhs,prhs); return; }
     else if (selector("forget"     ,nrhs,prhs)) { mexForget    (nlhs,plhs,nrhs,prhs); return; }
     else if (selector("rollback"   ,nrhs,prhs)) { mexRollback  (nlhs,plhs,nrhs,prhs); return; }
     else if (selector("perftest"   ,nrhs,prhs)) { mexPerfTest  (nlhs,plhs,nrhs,prhs); return; }
+    else if (selector("append"     ,nrhs,prhs)) { mexAppend    (nlhs,plhs,nrhs,prhs); return; }
     else mexErrMsgIdAndTxt("sivantoledo:UltimateKalman:invalidSelector","invalid selector");
 }
 
@@ -12,7 +12,8 @@ javac ^
   -sourcepath src ^
   --release 8 ^
   src\sivantoledo\kalman\*.java ^
-  src\sivantoledo\kalman\examples\Rotation.java 
+  src\sivantoledo\kalman\examples\Rotation.java ^
+  src\sivantoledo\kalman\examples\NativeBenchmark.java 
 
 echo CREATING JAR
 
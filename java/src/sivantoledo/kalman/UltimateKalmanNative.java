@@ -0,0 +1,269 @@
+package sivantoledo.kalman;
+
+import java.nio.ByteBuffer;
+import java.nio.ByteOrder;
+import java.nio.DoubleBuffer;
+
+import org.apache.commons.math3.linear.MatrixUtils;
+import org.apache.commons.math3.linear.RealMatrix;
+import org.apache.commons.math3.linear.RealVector;
+
+/**
+ *
+ * An UltimateKalman filter/smoother that runs on the native C library
+ * through JNI (libultimatekalmanjni, built by c/build.sh when JAVA_HOME is set).
+ *
+ * The API is the API of UltimateKalman, plus a bulk API that passes many steps
+ * in one call and can use the parallel smoothers. Matrices are passed through
+ * direct buffers in column-major order; the native code uses them in place.
+ *
+ * The native filter must be released with close().
+ *
+ * @author Sivan Toledo
+ *
+ */
+public class UltimateKalmanNative implements AutoCloseable {
+
+  static {
+    System.loadLibrary("ultimatekalmanjni");
+  }
+
+  /*
+   * The options of kalman_create_options in kalman.h.
+   */
+  public static final int ALGORITHM_ULTIMATE     = 1 << 0;
+  public static final int ALGORITHM_CONVENTIONAL = 1 << 1;
+  public static final int ALGORITHM_ODDEVEN      = 1 << 2;
+  public static final int ALGORITHM_ASSOCIATIVE  = 1 << 3;
+  public static final int NO_COVARIANCE          = 1 << 16;
+  public static final int BORROW_MATRICES        = 1 << 19; // the single-step and bulk APIs reject such filters
+
+  private long handle; // a kalman_t*, 0 after close()
+
+  /*
+   * Scratch buffers for the single-step API, one per argument, grown as needed.
+   */
+  private DoubleBuffer[] scratch = new DoubleBuffer[ 7 ];
+
+  private static final int SLOT_H = 0, SLOT_F = 1, SLOT_c = 2, SLOT_K = 3, SLOT_G = 4, SLOT_o = 5, SLOT_C = 6;
+
+  public UltimateKalmanNative() {
+    this(ALGORITHM_ULTIMATE);
+  }
+
+  public UltimateKalmanNative(int options) {
+    handle = create(options);
+    if (handle == 0) throw new IllegalStateException("could not create a native filter");
+  }
+
+  /**
+   * Releases the native filter and its steps.
+   */
+  @Override
+  public void close() {
+    if (handle != 0) free(handle);
+    handle = 0;
+  }
+
+  /**
+   * Allocates a direct buffer in the native byte order, suitable for the bulk API.
+   *
+   * @param length number of elements
+   * @return a direct buffer of the given length
+   */
+  public static DoubleBuffer allocate(long length) {
+    return ByteBuffer.allocateDirect((int) (8*length)).order(ByteOrder.nativeOrder()).asDoubleBuffer();
+  }
+
+  public long earliest() { return earliest(handle); }
+  public long latest()   { return latest(handle);   }
+
+  /**
+   * Creates a new step with the given state dimension and provides
+   * the evolution equations H_i*u_i = F_i*u_{i-1} + c_i + eps_i,
+   * as in UltimateKalman.
+   */
+  public void evolve(int n_i, RealMatrix H_i, RealMatrix F_i, RealVector c_i, CovarianceMatrix K_i) {
+    if (F_i == null) {
+      evolve(handle, n_i, 0, 0, null, null, null, null, 'X');
+      return;
+    }
+    int l_i = F_i.getRowDimension();
+    char K_type = put(SLOT_K, K_i, l_i);
+    evolve(handle, n_i, l_i, F_i.getColumnDimension(),
+           put(SLOT_H, H_i), put(SLOT_F, F_i), put(SLOT_c, c_i), scratch[SLOT_K], K_type);
+  }
+
+  public void evolve(int n_i) {
+    evolve(n_i,null,null,null,null);
+  }
+
+  /**
+   * A simplified version with H=I.
+   */
+  public void evolve(int n_i, RealMatrix F_i, RealVector c_i, CovarianceMatrix K_i) {
+    int l_i = F_i.getRowDimension();
+    RealMatrix H_i = MatrixUtils.createRealMatrix(l_i, n_i);
+    for (int i=0; i<Integer.min(l_i,n_i); i++) H_i.setEntry(i, i, 1.0);
+    evolve(n_i,H_i,F_i,c_i,K_i);
+  }
+
+  /**
+   * Adds observation equations o_i = G_i*u_i + delta_i to the current step.
+   */
+  public void observe(RealMatrix G_i, RealVector o_i, CovarianceMatrix C_i) {
+    if (o_i == null) {
+      observe(handle, 0, 0, null, null, null, 'X');
+      return;
+    }
+    int m_i = G_i.getRowDimension();
+    char C_type = put(SLOT_C, C_i, m_i);
+    observe(handle, m_i, G_i.getColumnDimension(), put(SLOT_G, G_i), put(SLOT_o, o_i), scratch[SLOT_C], C_type);
+  }
+
+  public void observe() {
+    observe(null,null,null);
+  }
+
+  public RealVector estimate(long si) {
+    DoubleBuffer e = buffer(SLOT_o, 0);
+    int n = estimate(handle, si, e);
+    if (n < 0) return null;
+    if (n > e.capacity()) estimate(handle, si, e = buffer(SLOT_o, n));
+    double[] v = new double[ n ];
+    e.get(v);
+    return MatrixUtils.createRealVector(v);
+  }
+
+  public RealVector estimate() {
+    return estimate(-1);
+  }
+
+  /**
+   * The covariance matrix of the most up to date estimate of step si.
+   */
+  public CovarianceMatrix covariance(long si) {
+    int n = estimate(handle, si, null);
+    if (n < 0) return null;
+    DoubleBuffer W = buffer(SLOT_C, n*n);
+    char type = covariance(handle, si, W);
+    double[][] A = get(W, n, (type == 'w' || type == 'I') ? 1 : n);
+    switch (type) {
+    case 'W': return new RealCovarianceMatrix(MatrixUtils.createRealMatrix(A), RealCovarianceMatrix.Representation.INVERSE_FACTOR);
+    case 'U': // an upper triangular factor, like 'F' (lower)
+    case 'F': return new RealCovarianceMatrix(MatrixUtils.createRealMatrix(A), RealCovarianceMatrix.Representation.FACTOR);
+    case 'C': return new RealCovarianceMatrix(MatrixUtils.createRealMatrix(A), RealCovarianceMatrix.Representation.COVARIANCE_MATRIX);
+    case 'w': return new DiagonalCovarianceMatrix(MatrixUtils.createRealMatrix(A).getColumnVector(0),
+                                                  DiagonalCovarianceMatrix.Representation.DIAGONAL_INVERSE_STANDARD_DEVIATIONS);
+    case 'I': return new DiagonalCovarianceMatrix(n, 1.0, DiagonalCovarianceMatrix.Representation.DIAGONAL_STANDARD_DEVIATIONS);
+    }
+    return null;
+  }
+
+  public CovarianceMatrix covariance() {
+    return covariance(-1);
+  }
+
+  public void smooth()           { smooth(handle);       }
+  public void forget()           { forget(handle, -1);   }
+  public void forget(long si)    { forget(handle, si);   }
+  public void rollback()         { rollback(handle, -1); }
+  public void rollback(long si)  { rollback(handle, si); }
+
+  /**
+   * Appends count steps of dimension n in one call. Each buffer holds either
+   * one matrix, shared by all the steps, or count matrices one after the
+   * other, each in column-major order: H, F (l-by-n), c (l-by-1) and K of the
+   * evolution equations, and G (m-by-n), o (m-by-1) and C of the observations.
+   * K and C are l-by-l (m-by-m) of type 'W' (inverse factors) or l-by-1 (m-by-1)
+   * of type 'w' (diagonal inverse factors). The evolution arguments of the
+   * first step of the filter are ignored. A step whose observation vector
+   * starts with NaN is not observed, and if o is null, none is.
+   *
+   * The buffers must be direct; they are read in place.
+   */
+  public void appendSteps(long count, int n,
+                          int l, DoubleBuffer H, DoubleBuffer F, DoubleBuffer c, DoubleBuffer K, char K_type,
+                          int m, DoubleBuffer G, DoubleBuffer o, DoubleBuffer C, char C_type) {
+    append(handle, count, n, l, H, F, c, K, K_type, m, G, o, C, C_type);
+  }
+
+  /**
+   * Stores the estimates of steps first to last (the earliest and latest if
+   * negative) in E, n elements per step, padded with NaNs for steps of a
+   * smaller dimension, and if W is not null, stores their covariances there,
+   * n-by-n per step, in the form given by the byte of the step in types (which
+   * may be null; see covariance). Steps outside the earliest to latest range
+   * throw an IllegalArgumentException.
+   *
+   * @return the number of steps
+   */
+  public long estimates(long first, long last, int n, DoubleBuffer E, DoubleBuffer W, ByteBuffer types) {
+    return estimates(handle, first, last, n, E, W, types);
+  }
+
+  /*
+   * Packing into the scratch buffers
+   */
+
+  private DoubleBuffer buffer(int slot, int length) {
+    if (scratch[slot] == null || scratch[slot].capacity() < length) scratch[slot] = allocate(Integer.max(length, 64));
+    scratch[slot].clear();
+    return scratch[slot];
+  }
+
+  private DoubleBuffer put(int slot, RealMatrix A) {
+    int rows = A.getRowDimension();
+    int cols = A.getColumnDimension();
+    DoubleBuffer b = buffer(slot, rows*cols);
+    for (int j=0; j<cols; j++) for (int i=0; i<rows; i++) b.put(A.getEntry(i, j));
+    return b;
+  }
+
+  private DoubleBuffer put(int slot, RealVector v) {
+    DoubleBuffer b = buffer(slot, v.getDimension());
+    for (int i=0; i<v.getDimension(); i++) b.put(v.getEntry(i));
+    return b;
+  }
+
+  /*
+   * Weighs by the covariance, which only exposes its factor W through weigh.
+   */
+  private char put(int slot, CovarianceMatrix cov, int dimension) {
+    if (cov instanceof DiagonalCovarianceMatrix) {
+      put(slot, cov.weigh(MatrixUtils.createRealVector(new double[ dimension ]).mapAdd(1.0)));
+      return 'w';
+    }
+    put(slot, cov.weigh(MatrixUtils.createRealIdentityMatrix(dimension)));
+    return 'W';
+  }
+
+  private static double[][] get(DoubleBuffer b, int rows, int cols) {
+    double[][] A = new double[ rows ][ cols ];
+    for (int j=0; j<cols; j++) for (int i=0; i<rows; i++) A[i][j] = b.get(i + j*rows);
+    return A;
+  }
+
+  /*
+   * Native methods, in c/ultimatekalmanjni.c
+   */
+
+  private static native long create  (int options);
+  private static native void free    (long handle);
+  private static native long earliest(long handle);
+  private static native long latest  (long handle);
+  private static native void evolve  (long handle, int n, int l, int n_previous,
+                                      DoubleBuffer H, DoubleBuffer F, DoubleBuffer c, DoubleBuffer K, char K_type);
+  private static native void observe (long handle, int m, int n,
+                                      DoubleBuffer G, DoubleBuffer o, DoubleBuffer C, char C_type);
+  private static native void smooth  (long handle);
+  private static native int  estimate(long handle, long si, DoubleBuffer e); // returns the dimension, -1 if no such step
+  private static native char covariance(long handle, long si, DoubleBuffer W);
+  private static native void forget  (long handle, long si);
+  private static native void rollback(long handle, long si);
+  private static native void append  (long handle, long count, int n,
+                                      int l, DoubleBuffer H, DoubleBuffer F, DoubleBuffer c, DoubleBuffer K, char K_type,
+                                      int m, DoubleBuffer G, DoubleBuffer o, DoubleBuffer C, char C_type);
+  private static native long estimates(long handle, long first, long last, int n,
+                                       DoubleBuffer E, DoubleBuffer W, ByteBuffer types);
+}
@@ -0,0 +1,182 @@
+package sivantoledo.kalman.examples;
+
+import java.nio.DoubleBuffer;
+
+import org.apache.commons.math3.linear.MatrixUtils;
+import org.apache.commons.math3.linear.RealMatrix;
+import org.apache.commons.math3.linear.RealVector;
+
+import sivantoledo.kalman.CovarianceMatrix;
+import sivantoledo.kalman.DiagonalCovarianceMatrix;
+import sivantoledo.kalman.UltimateKalman;
+import sivantoledo.kalman.UltimateKalmanNative;
+
+/**
+ * Compares the pure-Java UltimateKalman with the native one, step by step and
+ * in bulk, on the rotation problem of performance.c (filter, smooth and read
+ * every estimate). The arguments are the state dimension, the number of steps,
+ * and the number of warmup and timed trials; the median of the timed trials is
+ * reported, after checks that misuse of the native filter throws.
+ *
+ * Requires libultimatekalmanjni on java.library.path, e.g.
+ *   java -Djava.library.path=../c -cp ultimatekalman.jar:commons-math3-3.6.1.jar sivantoledo.kalman.examples.NativeBenchmark 6 100000 2 5
+ */
+public class NativeBenchmark {
+
+  private static interface Run {
+    void run();
+  }
+
+  private static int n, k;
+  private static RealMatrix F, G;
+  private static RealVector c, o;
+  private static CovarianceMatrix K, C;
+
+  private static void java() {
+    UltimateKalman kalman = new UltimateKalman();
+    kalman.evolve(n);
+    kalman.observe(G, o, C);
+    for (int i=1; i<k; i++) {
+      kalman.evolve(n, F, c, K);
+      kalman.observe(G, o, C);
+    }
+    kalman.smooth();
+    for (int i=0; i<k; i++) kalman.estimate(i);
+  }
+
+  private static void nativeSteps(int algorithm) {
+    try (UltimateKalmanNative kalman = new UltimateKalmanNative(algorithm)) {
+      kalman.evolve(n);
+      kalman.observe(G, o, C);
+      for (int i=1; i<k; i++) {
+        kalman.evolve(n, F, c, K);
+        kalman.observe(G, o, C);
+      }
+      kalman.smooth();
+      for (int i=0; i<k; i++) kalman.estimate(i);
+    }
+  }
+
+  private static DoubleBuffer column(RealMatrix A) {
+    DoubleBuffer b = UltimateKalmanNative.allocate(A.getRowDimension()*A.getColumnDimension());
+    for (int j=0; j<A.getColumnDimension(); j++) for (int i=0; i<A.getRowDimension(); i++) b.put(A.getEntry(i, j));
+    return b;
+  }
+
+  private static void nativeBulk(int algorithm) {
+    RealMatrix I = MatrixUtils.createRealIdentityMatrix(n);
+    DoubleBuffer H_b = column(I);
+    DoubleBuffer F_b = column(F);
+    DoubleBuffer c_b = column(MatrixUtils.createColumnRealMatrix(c.toArray()));
+    DoubleBuffer K_b = column(MatrixUtils.createColumnRealMatrix(K.weigh(MatrixUtils.createRealVector(new double[n]).mapAdd(1.0)).toArray()));
+    DoubleBuffer G_b = column(G);
+    DoubleBuffer o_b = column(MatrixUtils.createColumnRealMatrix(o.toArray()));
+    DoubleBuffer C_b = column(MatrixUtils.createColumnRealMatrix(C.weigh(MatrixUtils.createRealVector(new double[n]).mapAdd(1.0)).toArray()));
+    DoubleBuffer E   = UltimateKalmanNative.allocate((long) n*k);
+
+    try (UltimateKalmanNative kalman = new UltimateKalmanNative(algorithm)) {
+      kalman.appendSteps(k, n, n, H_b, F_b, c_b, K_b, 'w', n, G_b, o_b, C_b, 'w');
+      kalman.smooth();
+      kalman.estimates(-1, -1, n, E, null, null);
+    }
+  }
+
+  /*
+   * Misuse of the native filter must throw rather than corrupt memory, and
+   * every covariance must convert to a CovarianceMatrix.
+   */
+  private static boolean checks() {
+    boolean passed = true;
+
+    int borrowed = UltimateKalmanNative.ALGORITHM_ULTIMATE | UltimateKalmanNative.BORROW_MATRICES;
+    try (UltimateKalmanNative kalman = new UltimateKalmanNative(borrowed)) {
+      try {
+        kalman.evolve(n);
+        System.out.printf("evolve accepted a filter that borrows matrices\n");
+        passed = false;
+      } catch (IllegalArgumentException expected) { }
+      try {
+        kalman.observe(G, o, C);
+        System.out.printf("observe accepted a filter that borrows matrices\n");
+        passed = false;
+      } catch (IllegalArgumentException expected) { }
+    }
+
+    int[] algorithms = { UltimateKalmanNative.ALGORITHM_ULTIMATE,   UltimateKalmanNative.ALGORITHM_CONVENTIONAL,
+                         UltimateKalmanNative.ALGORITHM_ODDEVEN,    UltimateKalmanNative.ALGORITHM_ASSOCIATIVE };
+    for (int algorithm: algorithms) {
+      try (UltimateKalmanNative kalman = new UltimateKalmanNative(algorithm)) {
+        kalman.evolve(n);
+        kalman.observe(G, o, C);
+        for (int i=1; i<4; i++) {
+          kalman.evolve(n, F, c, K);
+          kalman.observe(G, o, C);
+        }
+        kalman.smooth();
+
+        for (long si=kalman.earliest(); si<=kalman.latest(); si++) {
+          if (kalman.covariance(si) == null) {
+            System.out.printf("algorithm %d: no covariance for step %d\n", algorithm, si);
+            passed = false;
+          }
+        }
+
+        DoubleBuffer E = UltimateKalmanNative.allocate((long) n*(kalman.latest()+2));
+        try {
+          kalman.estimates(kalman.earliest(), kalman.latest()+1, n, E, null, null);
+          System.out.printf("algorithm %d: estimates accepted a step beyond the latest\n", algorithm);
+          passed = false;
+        } catch (IllegalArgumentException expected) { }
+      }
+    }
+
+    System.out.printf("native checks %s\n", passed ? "passed" : "FAILED");
+    return passed;
+  }
+
+  private static double time(String name, int warmup, int trials, Run r) {
+    double[] t = new double[ trials ];
+    for (int i=0; i<warmup; i++) r.run();
+    for (int i=0; i<trials; i++) {
+      long start = System.nanoTime();
+      r.run();
+      t[i] = 1e-9 * (double) (System.nanoTime() - start);
+    }
+    java.util.Arrays.sort(t);
+    double median = t[ trials/2 ];
+    System.out.printf("%-24s n=%d k=%d median %.3e seconds (%.3e per step)\n", name, n, k, median, median/k);
+    return median;
+  }
+
+  public static void main(String[] args) {
+    n = args.length > 0 ? Integer.parseInt(args[0]) : 6;
+    k = args.length > 1 ? Integer.parseInt(args[1]) : 10000;
+    int warmup = args.length > 2 ? Integer.parseInt(args[2]) : 2;
+    int trials = args.length > 3 ? Integer.parseInt(args[3]) : 5;
+
+    // a rotation in each consecutive pair of coordinates, as in performance.c
+    double alpha = 2 * Math.PI / 16;
+    F = MatrixUtils.createRealMatrix(n, n);
+    for (int i=0; i+1<n; i+=2) {
+      F.setEntry(i,   i,    Math.cos(alpha)); F.setEntry(i,   i+1, -Math.sin(alpha));
+      F.setEntry(i+1, i,    Math.sin(alpha)); F.setEntry(i+1, i+1,  Math.cos(alpha));
+    }
+    if (n % 2 == 1) F.setEntry(n-1, n-1, 1.0);
+    G = MatrixUtils.createRealIdentityMatrix(n);
+    c = MatrixUtils.createRealVector(new double[ n ]);
+    o = MatrixUtils.createRealVector(new double[ n ]).mapAdd(1.0);
+    K = new DiagonalCovarianceMatrix(n, 1e-3, DiagonalCovarianceMatrix.Representation.DIAGONAL_STANDARD_DEVIATIONS);
+    C = new DiagonalCovarianceMatrix(n, 1e-1, DiagonalCovarianceMatrix.Representation.DIAGONAL_STANDARD_DEVIATIONS);
+
+    if (!checks()) System.exit(1);
+
+    double pure = time("java",                   warmup, trials, () -> java());
+    double step = time("native steps",           warmup, trials, () -> nativeSteps(UltimateKalmanNative.ALGORITHM_ULTIMATE));
+    double bulk = time("native bulk ultimate",   warmup, trials, () -> nativeBulk (UltimateKalmanNative.ALGORITHM_ULTIMATE));
+    double odd  = time("native bulk oddeven",    warmup, trials, () -> nativeBulk (UltimateKalmanNative.ALGORITHM_ODDEVEN));
+    double asc  = time("native bulk associative",warmup, trials, () -> nativeBulk (UltimateKalmanNative.ALGORITHM_ASSOCIATIVE));
+
+    System.out.printf("speedups over java: steps %.2f bulk %.2f oddeven %.2f associative %.2f\n",
+                      pure/step, pure/bulk, pure/odd, pure/asc);
+  }
+}
@@ -236,6 +236,57 @@ classdef KalmanNative < handle
             ultimatekalmanmex('smooth',kalman.handle);
         end
 
+        function appendSteps(kalman,n,H,F,c,K,G,o,C)
+            %APPENDSTEPS   Evolve and observe many steps in one call.
+            %   kalman.APPENDSTEPS(n,H,F,c,K,G,o,C) is equivalent to calling
+            %   evolve(n,H(:,:,j),F(:,:,j),c(:,:,j),K) and
+            %   observe(G(:,:,j),o(:,:,j),C) for j=1:count, where count is
+            %   the largest number of pages of the arguments. An argument
+            %   with a single page is used in all the steps. K and C are
+            %   either CovarianceMatrix objects that all the steps share or
+            %   cell arrays {Z,type} with one page of Z per step.
+            %
+            %   H can be empty, as in evolve. A step whose observation
+            %   o(:,:,j) starts with NaN is not observed, and if o is empty,
+            %   none is.
+            %
+            %   The matrices are passed to the native code without copying,
+            %   and the parallel smoothers store the steps in parallel.
+            count = max([size(H,3) size(F,3) size(c,3) size(G,3) size(o,3)]);
+            if size(H,1) ~= size(F,1)
+                l = size(F,1);
+                H = [ eye(l) zeros(l,n - l) ];
+            end
+            [K_rep,K_type] = KalmanNative.stackedRep(K);
+            [C_rep,C_type] = KalmanNative.stackedRep(C);
+            count = max([count size(K_rep,3) size(C_rep,3)]);
+            ultimatekalmanmex('append',kalman.handle,count,n,H,F,c,K_rep,double(K_type), ...
+                              G,o,C_rep,double(C_type));
+        end
+
+        function [E,W,types] = estimates(kalman,first,last)
+            %ESTIMATES   The estimates of many steps in one call.
+            %   [E,W,types] = kalman.ESTIMATES(first,last) returns the
+            %   estimates of steps first to last as the columns of E, and
+            %   the representations of their covariances as the pages of W,
+            %   with the type of page j in char(types(j)) (as in
+            %   CovarianceMatrix(W(:,:,j),char(types(j)))). Estimates of
+            %   steps with a smaller dimension are padded with NaNs.
+            %
+            %   kalman.ESTIMATES() returns all the steps in memory.
+            if nargin<2
+                first = -1;
+            end
+            if nargin<3
+                last = -1;
+            end
+            if nargout<2
+                E = ultimatekalmanmex('estimates',kalman.handle,first,last);
+            else
+                [E,W,types] = ultimatekalmanmex('estimates',kalman.handle,first,last);
+            end
+        end
+
         function u = gather(kalman)
             e = kalman.earliest();
             l = kalman.latest();
@@ -290,5 +341,14 @@ classdef KalmanNative < handle
             addpath(cdir)
             isInitialized = true;
         end
+
+        function [Z,type] = stackedRep(cov)
+            if iscell(cov)
+                Z    = cov{1};
+                type = cov{2};
+            else
+                [Z,type] = rep(cov);
+            end
+        end
     end    
 end
\ No newline at end of file
@@ -8,8 +8,8 @@ if ispc
             -DKALMAN_STEP_INDEX_TYPE_INT64 -DFARRAY_INDEX_TYPE_INT64 -DPARALLEL_INDEX_TYPE_INT64 ...
             ultimatekalmanmex.c ...
             kalman_ultimate.c kalman_conventional.c kalman_oddeven_smoother.c kalman_associative_smoother.c ...
-            kalman_base.c kalman_explicit_representation.c ...
-            matrix_ops.c flexible_arrays.c concurrent_set.c parallel_sequential.c ...
+            kalman_base.c kalman_explicit_representation.c kalman_batch.c kalman_windowed_smoother.c kalman_async_smoother.c kalman_trajectory.c ...
+            matrix_ops.c matrix_small.c flexible_arrays.c concurrent_set.c concurrent_bag.c instrument.c parallel_budget.c parallel_sequential.c ...
             gettimeofday.c ...
             -lmwlapack -lmwblas
     end
@@ -37,8 +37,8 @@ if isunix
             -DKALMAN_STEP_INDEX_TYPE_INT64 -DFARRAY_INDEX_TYPE_INT64 -DPARALLEL_INDEX_TYPE_INT64 ...
             ultimatekalmanmex.c ...
             kalman_ultimate.c kalman_conventional.c kalman_oddeven_smoother.c kalman_associative_smoother.c ...
-            kalman_base.c kalman_explicit_representation.c ...
-            matrix_ops.c flexible_arrays.c concurrent_set.c parallel_sequential.c ...
+            kalman_base.c kalman_explicit_representation.c kalman_batch.c kalman_windowed_smoother.c kalman_async_smoother.c kalman_trajectory.c ...
+            matrix_ops.c matrix_small.c flexible_arrays.c concurrent_set.c concurrent_bag.c instrument.c parallel_budget.c parallel_sequential.c ...
             -lmwlapack -lmwblas
     end
     if (~isempty(ver('Octave')))
@@ -52,8 +52,8 @@ if isunix
             -DKALMAN_STEP_INDEX_TYPE_INT64 -DFARRAY_INDEX_TYPE_INT64 -DPARALLEL_INDEX_TYPE_INT64 ...
             ultimatekalmanmex.c ...
             kalman_ultimate.c kalman_conventional.c kalman_oddeven_smoother.c kalman_associative_smoother.c ...
-            kalman_base.c kalman_explicit_representation.c ...
-            matrix_ops.c flexible_arrays.c concurrent_set.c parallel_sequential.c ...
+            kalman_base.c kalman_explicit_representation.c kalman_batch.c kalman_windowed_smoother.c kalman_async_smoother.c kalman_trajectory.c ...
+            matrix_ops.c matrix_small.c flexible_arrays.c concurrent_set.c concurrent_bag.c instrument.c parallel_budget.c parallel_sequential.c ...
             -L/usr/lib/x86_64-linux-gnu/ -lblas -llapack
     end
     disp('compiling and linking done');